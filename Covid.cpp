@@ -10,10 +10,65 @@
 #include <iomanip>
 #include <limits>
 #include <algorithm>
+#include <climits>
+#include <cstring>
+#include <string_view>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <memory>
+#include <cstdint>
+#include <filesystem>
+#include <atomic>
+#include <cstddef>
+#include <cerrno>
+#include <unordered_set>
+#include <shared_mutex>
+#include <coroutine>
+#include <utility>
+#include <array>
+#include <map>
+#include <span>
+#include <bit>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#else
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL    // Built with an AVX2 categoriseBatch, used when the CPU has it
+#endif
+#ifndef NO_METRICS
+#define HAVE_METRICS        // Built with latency histograms and counters; -DNO_METRICS leaves them out
+#endif
 using namespace std;
 
 // Enum to represent different categories related to COVID-19 for tracking and reporting purposes.
-enum Category
+enum Category : uint8_t
 {
     LOW_RISK,           // Low-risk category, typically used for individuals with no known exposure to COVID-19.
     TRAVEL_HISTORY,     // Has recently traveled to a high-risk area with active COVID-19 cases.
@@ -33,930 +88,12622 @@ struct User
     string phone;
     string IC;
     Category category;
-    string testdate;
+    int32_t testDay;            // Days since 01/01/1970, NO_TEST_DAY if never tested
 };
 
 // Global constants
 const string DATA_FILE = "userdata.txt";
+const string SNAPSHOT_FILE = "userdata.snap";
+const string JOURNAL_FILE = "userdata.journal";
+const string POLICY_FILE = "policy.txt";
+const string HISTORY_FILE = "userdata.history";
+const string PARTITION_FILE = "userdata.partition";
 const string DEFAULT_DATE = "00/00/0000";
-const int TEST_REMINDER_DAYS = 3;
+const int TEST_REMINDER_DAYS = 3;                  // Built-in policy durations; policy.txt can change them
 const int QUARANTINE_DAYS = 7;
+const int CONTACT_WINDOW_DAYS = 14;                 // Built-in contact tracing: contacts this recent,
+const int TRACE_HOPS = 2;                           // this many contacts away from a POSITIVE user
+const int MAX_TRACE_HOPS = 8;
+const int USER_FIELD_COUNT = 9;
+const size_t PARALLEL_LOAD_MIN_BYTES = 1 << 20;    // Smaller files are parsed on the calling thread
+const unsigned LOAD_CHUNKS_PER_THREAD = 4;         // Extra chunks even out uneven line lengths
+const uint32_t USER_CHUNK_SIZE = 4096;             // Users per UserStore chunk
+const size_t MAX_POOLED_STRING = (1 << 24) - 1;    // Longest field a StringPool can hold
+const size_t STRING_POOL_MIN_DEAD = 1 << 20;       // Dead bytes a UserStore tolerates before compacting its pool
+const unsigned USER_SHARD_BITS = 4;                 // UserDirectory splits users into 2^bits shards
+const size_t MAX_SESSION_INPUT = 64 << 10;          // Longest line a server session will buffer
+const int AGE_BAND_STARTS[] = {0, 18, 30, 45, 60};  // Age bands counted by CategoryStats
+const int AGE_BANDS = 5;
+const int DASHBOARD_DAYS = 14;                      // Days of positive tests the dashboard lists
+const size_t INGEST_BATCH_ROWS = 10000;             // Results --ingest applies and commits together
+const size_t INGEST_READ_BYTES = 1 << 20;           // Input --ingest reads at a time; also its longest line
+const int HISTORY_PERIOD_BITS = 4;                  // Test history is indexed by date in periods of 2^bits days
+const uint64_t HISTORY_COMPACT_MIN_BYTES = 1 << 20; // Smaller history files are never compacted
+const size_t CONTACT_MERGE_MIN = 1 << 16;           // New contacts kept aside before merging into the graph
+const size_t TRACE_PARALLEL_FRONTIER = 1024;        // Smaller BFS levels are expanded on the calling thread
+const int MAX_REPORTED_CONTACTS = 20;               // Contacts one assessment can name
+const size_t ROARING_ARRAY_MAX = 4096;              // Bitmap containers above this many values become bitsets
+const int QUERY_AGE_BUCKET_YEARS = 5;               // Roster queries bucket ages by this many years
+const int QUERY_DATE_BUCKET_BITS = 3;               // and test days by 2^bits days
+const int LATENCY_SUB_BUCKET_BITS = 5;              // Latency histograms split each power of two into 2^bits buckets
+const int LATENCY_MAX_BITS = 40;                    // and go up to 2^bits ns (about 18 minutes)
+const uint64_t LATENCY_SAMPLE_INTERVAL = 128;       // Fast operations are timed once in this many calls
+const int STATS_INTERVAL_SECONDS = 10;              // --stats-file is rewritten this often
+const uint32_t MAX_PARTITIONS = 1024;               // Most partitions the users can be split into
+const char CONTROL_MARK = '\x1e';                   // Starts control requests and redirects on a session socket
+const size_t ROUTER_QUEUE_BYTES = 64 << 10;         // Output --route queues for a slow reader before pausing
+const int ROUTER_RETRY_MS = 100;                    // A redirect the partition map cannot follow yet is retried
+const int ROUTER_RETRIES = 50;                      // this often, this many times
+const int REPLICA_POLL_MS = 100;                    // A replica reads what the primary has appended this often,
+const int REPLICA_MAX_STALENESS_MS = 2000;          // and refuses reads once it has not caught up for this long
 
-// Function prototypes
-void loadUsersFromFile(const string& filename, vector<User>& users);
-void saveUsersToFile(const string& filename, const vector<User>& users);
-void clearScreen();
-void waitForUser();
+// Binary snapshot layout: header, fixed-width records, then a string heap.
+// Each record's six strings are stored back to back in the heap starting at
+// heapOffset, so only their lengths need to be kept in the record.
+const char SNAPSHOT_MAGIC[8] = {'C', 'V', 'D', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t SNAPSHOT_VERSION = 3;              // Version 2 added journalSequence, 3 textStamp
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+const int32_t NO_TEST_DAY = INT32_MIN;          // Day number stored for DEFAULT_DATE
+const int SNAPSHOT_STRING_COUNT = 6;
 
-// User management
-void registration(vector<User>& users);
-bool login(vector<User>& users, User*& currentUser);
-void logout(User*& currentUser);
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;         // Written as SNAPSHOT_BYTE_ORDER by the host that saved it
+    uint32_t recordSize;
+    uint32_t reserved;
+    uint64_t userCount;
+    uint64_t heapSize;
+    uint64_t journalSequence;   // Last journal record folded into this snapshot
+    uint64_t textStamp;         // textFileStamp() of the DATA_FILE this snapshot covers, or 0
+};
 
-// User operations
-void viewProfile(const User* user);
-void updateProfile(User* user, vector<User>& users);
-void takeTest(vector<User>& users, User* user);
-void viewCategory(const User* user);
-void showReminder(const User* user);
+// Hash of a text data file built up from its bytes in order, however they are
+// split, so saveUsersToFile() can stamp what it writes without reading it back
+class TextStamp
+{
+public:
+    void add(string_view bytes);
+    uint64_t value() const;     // Never 0
 
-// Helper functions
-int categoryToInt(Category category);
-Category intToCategory(int value);
-bool isValidDate(const string& dateStr);
-bool needsTesting(const User* user);
-void updateCategoryBasedOnTime(User* user);
-void displayQuote();
-int getValidatedInt(const string& prompt, int minVal = INT_MIN, int maxVal = INT_MAX);
-string getValidatedString(const string& prompt, bool allowSpaces = true);
-string getCurrentDate();
-string normalizeDate(const string& dateStr);
+private:
+    static uint64_t mix(uint64_t hash, uint64_t word);
+
+    uint64_t hash = 0x9E3779B97F4A7C15ull;
+    uint64_t size = 0;
+    uint64_t partial = 0;       // The last size % 8 bytes, not yet mixed in
+};
 
-int main()
+struct SnapshotRecord
 {
-    vector<User> users;
-    User* currentUser = nullptr;
-    bool dataModified = false;
+    uint64_t heapOffset;
+    uint32_t lengths[SNAPSHOT_STRING_COUNT];   // username, password, name, address, phone, IC
+    int32_t testDay;                            // Days since 01/01/1970
+    uint8_t age;
+    uint8_t category;
+    uint8_t padding[2];
+};
 
-    // Load users from file
-    loadUsersFromFile(DATA_FILE, users);
+// Journal records are [length][checksum][sequence][type][payload], where the
+// checksum covers the sequence, type and payload. Replay stops at the first
+// record that is torn or fails its checksum.
+enum JournalRecordType : uint8_t
+{
+    JOURNAL_PUT_USER = 1,       // Full user record, replacing any user with the same username
+    JOURNAL_RENAME_USER = 2,    // Old and new username
+    JOURNAL_TEST_HISTORY = 3,   // Username and delta-encoded tests; HISTORY_FILE only
+    JOURNAL_CONTACT = 4,        // Two usernames and the day they met; HISTORY_FILE only
+    JOURNAL_REMOVE_USER = 5     // Username of a user moved to another partition
+};
 
-    // Main program loop
-    while (true)
+struct JournalRecordHeader
+{
+    uint32_t length;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint8_t type;
+};
+
+const size_t JOURNAL_RECORD_HEADER_SIZE = 17;       // Packed size of JournalRecordHeader
+const uint64_t JOURNAL_COMPACT_BYTES = 8 << 20;     // Fold the journal into a snapshot past this size
+const int WRITE_ATTEMPTS = 5;                       // Tries at writing a batch before the writer gives up
+const int WRITE_RETRY_MS = 500;                     // Pause between them
+
+// How changes made in the menus reach disk
+enum PersistenceMode
+{
+    PERSIST_REWRITE,    // Rewrite the text file and snapshot after every change
+    PERSIST_JOURNAL     // Append each change to the journal and compact in the background
+};
+
+// When committed changes are forced to stable storage with fsync
+enum FsyncPolicy
+{
+    FSYNC_NONE,         // Leave it to the operating system
+    FSYNC_INTERVAL,     // At most fsyncIntervalMs after a commit
+    FSYNC_COMMIT        // Before a commit is considered done
+};
+
+// 64-bit FNV-1a of the username with a final mix, so the partition of a
+// username is the same in every process and on every platform
+constexpr uint64_t partitionHash(string_view username)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : username)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    return hash ^ (hash >> 33);
+}
+
+// One slice of the users: those whose partitionHash() is `index` modulo
+// `count`. Counts are powers of two, so partition i/n splits into i/2n and
+// (i + n)/2n and only half of its users move.
+struct Partition
+{
+    uint32_t index = 0;
+    uint32_t count = 1;
+
+    bool owns(string_view username) const { return (partitionHash(username) & (count - 1)) == index; }
+    bool operator==(const Partition& other) const = default;
+};
+
+// Settings and tool selection taken from the command line
+struct ProgramOptions
+{
+    unsigned loadThreads = 0;       // 0 = one per hardware thread
+    PersistenceMode persistence = PERSIST_REWRITE;
+    FsyncPolicy fsyncPolicy = FSYNC_NONE;
+    int fsyncIntervalMs = 0;
+    unsigned serverThreads = 0;     // Event loops for --serve; 0 = one per hardware thread
+    bool uniqueIC = false;          // Refuse a second user with the same IC/passport number
+    string statsFile;               // Where latency and counter statistics are written, if anywhere
+    bool headless = false;          // No screen clearing or pauses, and output is not flushed for prompts
+    string recordFile;              // Console input is also copied here, to replay later
+    Partition partition;            // Users this process serves; from --partition or PARTITION_FILE
+    bool partitionGiven = false;
+    bool replica = false;           // Follow the primary writing the data files here; the menus only read
+    int maxStalenessMs = REPLICA_MAX_STALENESS_MS;
+    string command;                 // Tool to run instead of the interactive menu
+    vector<string> commandArgs;
+};
+
+// Which address serves each partition, from a map file of
+// "<index>/<count> <socket|port>" lines. Every username falls in exactly one
+// listed partition.
+struct PartitionMap
+{
+    vector<pair<Partition, string>> entries;
+
+    const string* addressOf(string_view username) const;
+};
+
+// Read-only view of a whole file. Uses mmap where available so the loader can
+// parse records straight out of the page cache without copying lines.
+class MappedFile
+{
+public:
+    explicit MappedFile(const string& filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    string_view contents() const { return string_view(data, size); }
+
+private:
+    bool opened = false;
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    string buffer;      // Fallback storage when the file cannot be mapped
+};
+
+// Fixed-size pool of worker threads fed from a shared task queue
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threadCount);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+    template <typename Task>
+    auto submit(Task task) -> future<decltype(task())>
     {
-        clearScreen();
-        
-        // Display header
-        cout << "========================================\n";
-        cout << "    COVID-19 HEALTH MANAGEMENT SYSTEM   \n";
-        cout << "========================================\n\n";
-        
-        if (currentUser == nullptr)
+        auto packaged = make_shared<packaged_task<decltype(task())()>>(move(task));
+        auto result = packaged->get_future();
         {
-            // Not logged in - show main menu
-            cout << "MAIN MENU:\n";
-            cout << "1. Register New Account\n";
-            cout << "2. Login\n";
-            cout << "3. Exit\n\n";
-            
-            int choice = getValidatedInt("Enter your choice (1-3): ", 1, 3);
-            clearScreen();
-            
-            switch (choice)
-            {
-                case 1:
-                    registration(users);
-                    saveUsersToFile(DATA_FILE, users);
-                    dataModified = true;
-                    waitForUser();
-                    break;
-                    
-                case 2:
-                    if (login(users, currentUser))
-                    {
-                        if (currentUser->testdate == DEFAULT_DATE)
-                        {
-                            cout << "\nNOTICE: Please update your test result after login.\n";
-                        }
-                        showReminder(currentUser);
-                        waitForUser();
-                    }
-                    break;
-                    
-                case 3:
-                    if (dataModified)
-                    {
-                        saveUsersToFile(DATA_FILE, users);
-                        cout << "User data has been saved.\n";
-                    }
-                    cout << "Thank you for using the COVID-19 Health Management System!\n";
-                    return 0;
-            }
+            lock_guard<mutex> lock(queueMutex);
+            tasks.push([packaged]() { (*packaged)(); });
         }
-        else
+        queueReady.notify_one();
+        return result;
+    }
+
+private:
+    void workerLoop();
+
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex queueMutex;
+    condition_variable queueReady;
+    bool stopping = false;
+};
+
+// Open-addressing hash index from a string key to a record number, using
+// linear probing with backward-shift deletion. Keys are not copied: lookups
+// take a function that returns the key of a stored record number. Duplicate
+// keys are allowed; callers that need uniqueness check with find() first.
+class HashIndex
+{
+public:
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+    size_t size() const { return count; }
+    void clear();
+    void reserve(size_t records);
+
+    template <typename KeyOf>
+    uint32_t find(string_view key, KeyOf keyOf) const
+    {
+        if (count == 0)
+            return NOT_FOUND;
+        uint64_t hash = hashKey(key);
+        for (size_t pos = hash & mask; slots[pos].record != NOT_FOUND; pos = (pos + 1) & mask)
         {
-            // Logged in - show user menu
-            displayQuote();
-            cout << "\nUSER MENU - Welcome, " << currentUser->name << "\n";
-            cout << "========================================\n";
-            cout << "1. View Profile\n";
-            cout << "2. Update Profile\n";
-            cout << "3. Take COVID-19 Test\n";
-            cout << "4. View Health Category\n";
-            cout << "5. Logout\n\n";
-            
-            int choice = getValidatedInt("Enter your choice (1-5): ", 1, 5);
-            clearScreen();
-            
-            switch (choice)
+            if (slots[pos].hash == hash && keyOf(slots[pos].record) == key)
+                return slots[pos].record;
+        }
+        return NOT_FOUND;
+    }
+
+    void insert(string_view key, uint32_t record);
+    bool erase(string_view key, uint32_t record);
+
+    // Returns the record already stored under the key, or stores `record`
+    // and returns NOT_FOUND, in one probe
+    template <typename KeyOf>
+    uint32_t findOrInsert(string_view key, uint32_t record, KeyOf keyOf)
+    {
+        if ((count + 1) * 4 > slots.size() * 3)
+            grow(max<size_t>(16, slots.size() * 2));
+        uint64_t hash = hashKey(key);
+        size_t pos = hash & mask;
+        for (; slots[pos].record != NOT_FOUND; pos = (pos + 1) & mask)
+        {
+            if (slots[pos].hash == hash && keyOf(slots[pos].record) == key)
+                return slots[pos].record;
+        }
+        slots[pos] = {hash, record};
+        count++;
+        return NOT_FOUND;
+    }
+    size_t memoryBytes() const { return slots.capacity() * sizeof(Slot); }
+
+    static uint64_t hashKey(string_view key) { return hash<string_view>()(key); }
+
+private:
+    struct Slot
+    {
+        uint64_t hash;
+        uint32_t record;    // NOT_FOUND marks an empty slot
+    };
+
+    void grow(size_t capacity);
+
+    vector<Slot> slots;
+    size_t mask = 0;
+    size_t count = 0;
+};
+
+// Handle to a user in a UserStore. The generation is bumped whenever a slot
+// is freed, so a handle to a removed user no longer resolves even after its
+// slot has been reused.
+struct UserId
+{
+    uint32_t slot = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool operator==(const UserId& other) const { return slot == other.slot && generation == other.generation; }
+    bool operator!=(const UserId& other) const { return !(*this == other); }
+};
+
+// Location of a string in a StringPool, packed into 8 bytes
+struct PooledString
+{
+    uint64_t offset : 40;
+    uint64_t length : 24;
+};
+
+// Append-only character arena holding the store's strings without a
+// std::string header or heap block per field. Strings added with intern()
+// are deduplicated, which suits fields like names and addresses that repeat
+// across many users, and counted per use. Strings given back with release()
+// or releaseInterned() stay in the arena as dead bytes until the owner copies
+// the live ones into a fresh pool.
+class StringPool
+{
+public:
+    PooledString append(string_view text);
+    PooledString intern(string_view text);
+    string_view view(PooledString ref) const { return string_view(chars.data() + ref.offset, ref.length); }
+    void release(PooledString ref) { dead += ref.length; }
+    void releaseInterned(PooledString ref);
+
+    void clear();
+    void reserve(size_t bytes) { chars.reserve(bytes); }
+    size_t size() const { return chars.size(); }
+    size_t deadBytes() const { return dead; }
+    size_t memoryBytes() const;
+
+private:
+    string chars;
+    vector<PooledString> interned;
+    vector<uint32_t> internedUses;  // Users of each interned string; dead at 0
+    HashIndex internIndex;          // Interned string to position in `interned`
+    size_t dead = 0;                // Bytes of chars no one refers to any more
+};
+
+// Array split into USER_CHUNK_SIZE-element chunks, so growing it never moves
+// or copies the elements already in it
+template <typename T>
+class ChunkedArray
+{
+public:
+    ChunkedArray() = default;
+    ChunkedArray(const ChunkedArray& other) { *this = other; }
+    ChunkedArray& operator=(const ChunkedArray& other)
+    {
+        if (this == &other)
+            return *this;
+        chunks.clear();
+        for (const auto& chunk : other.chunks)
+        {
+            chunks.push_back(make_unique<T[]>(USER_CHUNK_SIZE));
+            copy(chunk.get(), chunk.get() + USER_CHUNK_SIZE, chunks.back().get());
+        }
+        return *this;
+    }
+    ChunkedArray(ChunkedArray&&) = default;
+    ChunkedArray& operator=(ChunkedArray&&) = default;
+
+    T& operator[](size_t i) { return chunks[i / USER_CHUNK_SIZE][i % USER_CHUNK_SIZE]; }
+    const T& operator[](size_t i) const { return chunks[i / USER_CHUNK_SIZE][i % USER_CHUNK_SIZE]; }
+    size_t capacity() const { return chunks.size() * USER_CHUNK_SIZE; }
+    void grow() { chunks.push_back(make_unique<T[]>(USER_CHUNK_SIZE)); }
+    void clear() { chunks.clear(); }
+    size_t memoryBytes() const { return capacity() * sizeof(T) + chunks.capacity() * sizeof(chunks[0]); }
+
+private:
+    vector<unique_ptr<T[]>> chunks;
+};
+
+// Read-only view of a stored user. The strings point into the store and stay
+// valid only until the store is next modified.
+struct UserView
+{
+    string_view username;
+    string_view password;
+    string_view name;
+    string_view address;
+    string_view phone;
+    string_view IC;
+    int age;
+    Category category;
+    int32_t testDay;            // Days since 01/01/1970, NO_TEST_DAY if never tested
+};
+
+// Counters kept up to date as users change: users per category, per age
+// band and category, and POSITIVE users per test day
+struct CategoryStats
+{
+    array<int64_t, 5> byCategory{};
+    array<array<int64_t, 5>, AGE_BANDS> byAgeBand{};
+    unordered_map<int32_t, int64_t> positivesByDay;     // Days with none are left out
+
+    void count(Category category, int age, int32_t testDay, int64_t delta);
+    void merge(const CategoryStats& other);
+    bool operator==(const CategoryStats& other) const = default;
+};
+
+// Bytes held by each part of a UserStore
+struct StoreMemoryUsage
+{
+    size_t hotRecords;
+    size_t coldRecords;
+    size_t strings;
+    size_t deadStrings;         // Part of `strings` no user refers to any more
+    size_t usernameIndex;
+    size_t identityIndexes;     // IC and phone
+    size_t rosterIndex;
+
+    size_t total() const { return hotRecords + coldRecords + strings + usernameIndex + identityIndexes + rosterIndex; }
+};
+
+// Set of 32-bit values, split by their high 16 bits into containers of up to
+// 65536 values each, Roaring-style: a container is a sorted array of the low
+// halves while it holds up to ROARING_ARRAY_MAX values and a bitset above
+// that, so sparse and dense sets both stay small
+class RoaringBitmap
+{
+public:
+    static constexpr size_t CHUNK_WORDS = 1024;    // 64-bit words in one container's worth of bits
+
+    void add(uint32_t value);
+    void remove(uint32_t value);
+    bool contains(uint32_t value) const;
+    bool empty() const { return containers.empty(); }
+    size_t cardinality() const;
+    size_t memoryBytes() const;
+    // ORs the values whose high half is `key` into a CHUNK_WORDS-word bitset.
+    // Returns false if there are none.
+    bool orChunk(uint32_t key, uint64_t* words) const;
+
+private:
+    struct Container
+    {
+        uint16_t key;
+        uint32_t count = 0;
+        vector<uint16_t> values;    // Sorted low halves, while the container is an array
+        vector<uint64_t> bits;      // CHUNK_WORDS words, once it is a bitset
+    };
+
+    const Container* findContainer(uint32_t key) const;
+
+    vector<Container> containers;   // By key
+};
+
+// Conjunctive filter over the roster: users in any of the categories, aged
+// minAge..maxAge and tested fromDay..toDay. Users never tested only match
+// while both ends of the date range are open.
+struct RosterFilter
+{
+    unsigned categories = (1u << 5) - 1;    // One bit per Category
+    int minAge = 0;
+    int maxAge = INT_MAX;
+    int32_t fromDay = INT32_MIN;
+    int32_t toDay = INT32_MAX;
+
+    bool datesOpen() const { return fromDay == INT32_MIN && toDay == INT32_MAX; }
+    bool matches(Category category, int age, int32_t testDay) const;
+};
+
+// Bitmaps of a store's slots by category, by QUERY_AGE_BUCKET_YEARS age
+// bucket and by test-day bucket, kept up to date by the store. A filter is
+// answered one 65536-slot chunk at a time as the OR of the buckets it covers
+// in each dimension, ANDed across dimensions; the buckets at the ends of a
+// range may hold slots outside it, so the store checks each candidate.
+class RosterIndex
+{
+public:
+    static constexpr int AGE_BUCKETS = 256 / QUERY_AGE_BUCKET_YEARS + 1;
+
+    void add(uint32_t slot, Category category, int age, int32_t testDay);
+    void remove(uint32_t slot, Category category, int age, int32_t testDay);
+    // Moves the slot between only the bitmaps whose bucket changed
+    void change(uint32_t slot, Category oldCategory, int oldAge, int32_t oldTestDay, Category category, int age,
+                int32_t testDay);
+    void clear();
+    size_t memoryBytes() const;
+    // Sets in `words` the slots of chunk `key` that may match. Returns false
+    // if none can.
+    bool candidates(const RosterFilter& filter, uint32_t key, uint64_t* words) const;
+
+private:
+    static int ageBucket(int age) { return min(age / QUERY_AGE_BUCKET_YEARS, AGE_BUCKETS - 1); }
+    static int32_t dateBucket(int32_t testDay) { return testDay >> QUERY_DATE_BUCKET_BITS; }
+    void removeTestDay(uint32_t slot, int32_t testDay);
+
+    array<RoaringBitmap, 5> byCategory;
+    array<RoaringBitmap, AGE_BUCKETS> byAge;
+    map<int32_t, RoaringBitmap> byTestDay;     // Users never tested are in none
+};
+
+// Every user in memory plus the username index used by login, registration
+// and renames. The fields read on every session and scan (category, age, test
+// day) are kept in a 12-byte hot record per slot, apart from the profile
+// strings, which live in a StringPool and are referenced from a cold record.
+// Both arrays are chunked, so the store grows without copying existing users
+// and sessions hold a UserId rather than a pointer. User remains the owned,
+// editable form used by the menus, loaders and journal.
+class UserStore
+{
+public:
+    void assign(vector<User> loaded, bool warnDuplicates = true);
+    size_t size() const { return liveCount; }
+
+    UserId find(string_view username) const;
+    bool contains(string_view username) const { return valid(find(username)); }
+    bool valid(UserId id) const;
+    UserId idAt(uint32_t slot) const;
+    UserView view(UserId id) const;
+    bool get(UserId id, User& user) const;
+
+    UserId add(const User& user);
+    UserId put(const User& user);
+    bool update(UserId id, const User& user);
+    bool rename(UserId id, const string& newUsername);
+    bool setCategory(UserId id, Category category);
+    bool remove(UserId id);
+
+    StoreMemoryUsage memoryUsage() const;
+    const CategoryStats& statistics() const { return stats; }
+    CategoryStats recountStatistics() const;
+
+    // Calls visit(id, view) for every user with the IC/passport number, in
+    // the order they were given it
+    template <typename Visit>
+    void forEachWithIC(string_view IC, Visit visit) const
+    {
+        forEachSharing(icIndex, icLinks, &ColdRecord::IC, IC, visit);
+    }
+
+    // Likewise for the phone number
+    template <typename Visit>
+    void forEachWithPhone(string_view phone, Visit visit) const
+    {
+        forEachSharing(phoneIndex, phoneLinks, &ColdRecord::phone, phone, visit);
+    }
+
+    // Calls visit(id, view) for every user matching the filter, in slot order,
+    // until visit returns false. Candidates are found a chunk at a time, so
+    // the first users arrive before the rest of the roster is looked at.
+    // Returns false if visit stopped the query.
+    template <typename Visit>
+    bool query(const RosterFilter& filter, Visit visit) const
+    {
+        vector<uint64_t> words(RoaringBitmap::CHUNK_WORDS);
+        for (uint32_t key = 0; key < (slotCount + 65535) >> 16; key++)
+        {
+            if (!roster.candidates(filter, key, words.data()))
+                continue;
+            for (uint32_t word = 0; word < RoaringBitmap::CHUNK_WORDS; word++)
             {
-                case 1:
-                    viewProfile(currentUser);
-                    waitForUser();
-                    break;
-                    
-                case 2:
-                    updateProfile(currentUser, users);
-                    saveUsersToFile(DATA_FILE, users);
-                    dataModified = true;
-                    break;
-                    
-                case 3:
-                    takeTest(users, currentUser);
-                    saveUsersToFile(DATA_FILE, users);
-                    dataModified = true;
-                    waitForUser();
-                    break;
-                    
-                case 4:
-                    viewCategory(currentUser);
-                    waitForUser();
-                    break;
-                    
-                case 5:
-                    logout(currentUser);
-                    break;
+                for (uint64_t bits = words[word]; bits != 0; bits &= bits - 1)
+                {
+                    uint32_t slot = key << 16 | word << 6 | static_cast<uint32_t>(countr_zero(bits));
+                    const HotRecord& record = hot[slot];
+                    if (filter.matches(record.category, record.age, record.testDay) &&
+                        !visit(UserId{slot, record.generation}, viewSlot(slot)))
+                        return false;
+                }
             }
         }
+        return true;
     }
-    
-    return 0;
-}
 
-void loadUsersFromFile(const string& filename, vector<User>& users)
+    // Calls visit(id, view) for every user in slot order, which is load and
+    // registration order until a removed user's slot is reused
+    template <typename Visit>
+    void forEach(Visit visit) const
+    {
+        for (uint32_t slot = 0; slot < slotCount; slot++)
+        {
+            if (hot[slot].live)
+                visit(UserId{slot, hot[slot].generation}, viewSlot(slot));
+        }
+    }
+
+private:
+    // The username hash is not repeated here: usernameIndex keeps it in the
+    // slot beside the record number, so a lookup rejects other users without
+    // reading either array, and no scan over hot records needs it.
+    struct HotRecord
+    {
+        int32_t testDay;
+        uint32_t generation;
+        Category category;
+        uint8_t age;
+        bool live;
+    };
+
+    struct ColdRecord
+    {
+        PooledString username;
+        PooledString password;
+        PooledString name;
+        PooledString address;
+        PooledString phone;
+        PooledString IC;
+    };
+
+    // Users sharing an IC or phone number form a circular list through these,
+    // so a number held by thousands of test accounts costs one index entry
+    struct IdentityLinks
+    {
+        uint32_t next;
+        uint32_t previous;
+    };
+
+    template <typename Visit>
+    void forEachSharing(const HashIndex& index, const ChunkedArray<IdentityLinks>& links,
+                        PooledString ColdRecord::*field, string_view key, Visit visit) const
+    {
+        if (key.empty())
+            return;
+        uint32_t first = index.find(key, [this, field](uint32_t s) { return strings.view(cold[s].*field); });
+        if (first == HashIndex::NOT_FOUND)
+            return;
+        uint32_t slot = first;
+        do
+        {
+            uint32_t next = links[slot].next;
+            visit(UserId{slot, hot[slot].generation}, viewSlot(slot));
+            slot = next;
+        } while (slot != first);
+    }
+
+    UserView viewSlot(uint32_t slot) const;
+    void storeSlot(uint32_t slot, const User& user);
+    void indexIdentity(uint32_t slot, bool add);
+    void linkIdentity(HashIndex& index, ChunkedArray<IdentityLinks>& links, PooledString ColdRecord::*field,
+                      uint32_t slot, bool add);
+    void compactStringsIfNeeded();
+    string_view usernameOf(uint32_t slot) const { return strings.view(cold[slot].username); }
+    uint32_t allocateSlot();
+
+    ChunkedArray<HotRecord> hot;
+    ChunkedArray<ColdRecord> cold;
+    uint32_t slotCount = 0;         // Slots handed out so far, live or freed
+    vector<uint32_t> freeSlots;
+    size_t liveCount = 0;
+    StringPool strings;
+    HashIndex usernameIndex;        // Username to slot
+    HashIndex icIndex;              // IC/passport number to the first slot holding it
+    HashIndex phoneIndex;           // Phone number to the first slot holding it
+    ChunkedArray<IdentityLinks> icLinks;        // The other slots with the same IC
+    ChunkedArray<IdentityLinks> phoneLinks;     // Likewise for the phone number
+    CategoryStats stats;            // Of every live slot, updated wherever a record changes
+    RosterIndex roster;             // Likewise
+};
+
+static_assert(sizeof(PooledString) == 8, "PooledString must pack into one word");
+
+// One assessment in a user's test history
+struct TestRecord
 {
-    ifstream infile(filename);
-    if (!infile.is_open())
+    int32_t day;            // Days since 01/01/1970
+    uint8_t answers;        // riskIndex() of the five answers and the result
+    Category category;      // Category the policy of the time gave
+
+    bool operator==(const TestRecord& other) const = default;
+};
+
+// Test history entries: a varint of the zigzag-encoded days since
+// `previousDay`, shifted past the category (3 bits) and the answers (6 bits)
+const size_t MAX_TEST_ENTRY_BYTES = 10;
+size_t encodeTestEntry(const TestRecord& test, int32_t previousDay, uint8_t* out);
+bool decodeTestEntry(const uint8_t* data, size_t size, size_t& pos, int32_t previousDay, TestRecord& test);
+
+// Every assessment of the users in one UserStore, by slot, append-only. Each
+// test is a varint entry of the days since the previous test, the category
+// and the answers, so a daily test takes two bytes. A user's entries fill a
+// chain of 32-byte blocks from a shared pool; the first entry in a block
+// counts from day 0, so decoding can start at any block. A coarse index lists,
+// for each period of 2^HISTORY_PERIOD_BITS days, the slots tested in it and
+// the block their tests in it start in, so a query by date only decodes the
+// users tested then.
+class TestHistory
+{
+public:
+    void append(uint32_t slot, const TestRecord& test);
+    void remove(uint32_t slot) { remove(span<const uint32_t>(&slot, 1)); }
+    void remove(span<const uint32_t> slots);
+
+    size_t count(uint32_t slot) const { return slot < chains.size() ? chains[slot].count : 0; }
+    size_t tests() const { return testCount; }
+    size_t encodedBytes() const { return entryBytes; }
+    size_t memoryBytes() const;
+
+    // Calls visit(test) for each of the slot's tests dated fromDay..toDay,
+    // in the order they were recorded
+    template <typename Visit>
+    void forEach(uint32_t slot, int32_t fromDay, int32_t toDay, Visit visit) const
     {
-        // This is not an error - it's normal if the file doesn't exist yet
-        cout << "No data file found. Starting with empty user database.\n";
-        return;
+        if (slot < chains.size())
+            decode(chains[slot], chains[slot].head, fromDay, toDay, visit);
     }
-    
-    string line;
-    int lineNumber = 0;
-    int loadedCount = 0;
-    
-    while (getline(infile, line))
+
+    // Calls visit(slot, test) for every test dated fromDay..toDay, one slot at
+    // a time in slot order
+    template <typename Visit>
+    void forEachBetween(int32_t fromDay, int32_t toDay, Visit visit) const
     {
-        lineNumber++;
-        
-        // Skip empty lines
-        if (line.empty() || line.find_first_not_of(' ') == string::npos)
-            continue;
+        vector<PeriodStart> starts;
+        auto last = periods.upper_bound(periodOf(toDay));
+        for (auto period = periods.lower_bound(periodOf(fromDay)); period != last; ++period)
+            starts.insert(starts.end(), period->second.begin(), period->second.end());
         
-        // Count the number of delimiters
-        int delimiterCount = 0;
-        for (char c : line) {
-            if (c == '|') delimiterCount++;
+        // Periods were taken in date order, so a slot's first start is its earliest
+        stable_sort(starts.begin(), starts.end(),
+                    [](const PeriodStart& a, const PeriodStart& b) { return a.slot < b.slot; });
+        for (size_t i = 0; i < starts.size(); i++)
+        {
+            if (i > 0 && starts[i].slot == starts[i - 1].slot)
+                continue;
+            const Chain& chain = chains[starts[i].slot];
+            uint32_t slot = starts[i].slot;
+            decode(chain, chain.inOrder ? starts[i].block : chain.head, fromDay, toDay,
+                   [&](const TestRecord& test) { visit(slot, test); });
         }
-        
-        // We need exactly 8 delimiters for 9 fields
-        if (delimiterCount != 8) {
-            cerr << "Warning: Line " << lineNumber << " has " << delimiterCount 
-                 << " delimiters (expected 8). Skipping.\n";
-            cerr << "Line: " << line << endl;
-            continue;
+    }
+
+private:
+    static constexpr uint32_t NO_BLOCK = UINT32_MAX;
+    static constexpr size_t BLOCK_BYTES = 27;
+
+    struct Block
+    {
+        uint32_t next;
+        uint8_t used;
+        uint8_t bytes[BLOCK_BYTES];
+    };
+    static_assert(sizeof(Block) == 32, "A history block should fill half a cache line");
+
+    struct Chain
+    {
+        uint32_t head = NO_BLOCK;
+        uint32_t tail = NO_BLOCK;
+        int32_t lastDay = 0;
+        uint32_t count = 0;
+        bool inOrder = true;        // No test is dated before the one recorded ahead of it
+    };
+
+    struct PeriodStart
+    {
+        uint32_t slot;
+        uint32_t block;             // Holds the slot's first test in the period
+    };
+
+    static int32_t periodOf(int32_t day) { return day >> HISTORY_PERIOD_BITS; }
+    uint32_t allocateBlock();
+
+    // Decodes from `block` to the end of the chain; an ordered chain stops
+    // at the first test after toDay
+    template <typename Visit>
+    void decode(const Chain& chain, uint32_t block, int32_t fromDay, int32_t toDay, Visit visit) const
+    {
+        for (; block != NO_BLOCK; block = blocks[block].next)
+        {
+            const Block& data = blocks[block];
+            size_t pos = 0;
+            int32_t day = 0;
+            TestRecord test;
+            while (pos < data.used && decodeTestEntry(data.bytes, data.used, pos, day, test))
+            {
+                day = test.day;
+                if (test.day > toDay && chain.inOrder)
+                    return;
+                if (test.day >= fromDay && test.day <= toDay)
+                    visit(test);
+            }
         }
-        
-        stringstream ss(line);
-        vector<string> fields;
-        string field;
-        
-        // Split by '|'
-        while (getline(ss, field, '|')) {
-            fields.push_back(field);
+    }
+
+    ChunkedArray<Block> blocks;
+    uint32_t blockCount = 0;        // Blocks handed out so far, in use or freed
+    uint32_t freeBlock = NO_BLOCK;  // Freed blocks, linked through next
+    vector<Chain> chains;           // By slot
+    map<int32_t, vector<PeriodStart>> periods;
+    size_t testCount = 0;
+    size_t entryBytes = 0;
+};
+
+// Who has met whom, for contact tracing. Users are vertices, numbered as they
+// first appear and looked up by username. Every contact is kept in both
+// directions with the day it happened, in compressed sparse row form: one
+// offsets array and one array of every user's contacts back to back. New
+// contacts go to a log chained per user, so inserting is O(1), and the log is
+// merged into the arrays once it reaches half their size.
+class ContactGraph
+{
+public:
+    static constexpr uint32_t NO_VERTEX = UINT32_MAX;
+
+    struct Contact
+    {
+        uint32_t user;
+        int32_t day;
+    };
+
+    uint32_t find(string_view username) const;
+    uint32_t vertex(const string& username);
+    const string& name(uint32_t user) const { return names[user]; }
+    void rename(const string& from, const string& to);
+    void addContact(uint32_t a, uint32_t b, int32_t day);
+    void merge();
+
+    size_t vertexCount() const { return names.size(); }
+    size_t contactCount() const { return (edges.size() + log.size()) / 2; }
+    size_t memoryBytes() const;
+
+    // Calls visit(contact) for each of the user's contacts, merged ones first
+    template <typename Visit>
+    void forEachContact(uint32_t user, Visit visit) const
+    {
+        if (size_t(user) + 1 < offsets.size())
+        {
+            for (uint64_t i = offsets[user]; i < offsets[user + 1]; i++)
+                visit(edges[i]);
+        }
+        for (uint32_t entry = user < logHeads.size() ? logHeads[user] : NO_VERTEX; entry != NO_VERTEX;
+             entry = log[entry].next)
+            visit(log[entry].contact);
+    }
+
+    // Breadth-first search from `source` along contacts made on or after
+    // sinceDay, at most `hops` deep. Returns the users reached, nearest first.
+    // Levels with a large frontier are split across `pool` if one is given.
+    vector<uint32_t> trace(uint32_t source, int hops, int32_t sinceDay, ThreadPool* pool) const;
+
+private:
+    struct LogEntry
+    {
+        Contact contact;
+        uint32_t next;
+    };
+
+    vector<string> names;
+    HashIndex index;                // Username to vertex
+    vector<uint64_t> offsets;       // Merged contacts of v are edges[offsets[v]..offsets[v + 1])
+    vector<Contact> edges;
+    vector<LogEntry> log;           // Contacts added since the last merge
+    vector<uint32_t> logHeads;      // Newest log entry of each vertex
+};
+
+// Append-only journal file. Records are staged in memory and written with a
+// single write() per group commit; the owner decides when to fsync.
+class Journal
+{
+public:
+    ~Journal();
+
+    bool open(const string& journalFile, uint64_t lastSequence);
+    void close();
+    bool isOpen() const { return fd >= 0; }
+
+    void stagePut(const User& user);
+    void stageRename(const string& oldUsername, const string& newUsername);
+    void stageTests(string_view username, span<const TestRecord> tests);
+    void stageContact(string_view username, string_view contact, int32_t day);
+    void stageRemove(string_view username);
+    // Appends the staged records. If that fails the file is cut back to where
+    // it was and the records stay staged, so a later call can write them whole.
+    bool writeStaged();
+    // A failed write could not be cut back, so nothing more can be appended
+    bool broken() const { return cutFailed; }
+    // Hands the staged records over instead of writing them, for sending to
+    // another process
+    string takeStaged() { return exchange(pending, string()); }
+    bool sync();
+    bool rotate();
+    // Takes an exclusive lock on the file until close(), so that a second
+    // writer in the same directory is refused. Fails if another holds it.
+    bool lock();
+    // Gives the records staged from now on all the same sequence number
+    // rather than the next ones. The history file takes the journal sequence
+    // of the change its records belong to, so a replica can interleave them.
+    void pinSequence(uint64_t sequence)
+    {
+        pinned = true;
+        pinnedSequence = sequence;
+    }
+
+    uint64_t size() const { return activeBytes; }
+    uint64_t lastSequence() const { return nextSequence - 1; }
+
+private:
+    void stage(JournalRecordType type, const string& payload);
+
+    string filename;
+    int fd = -1;
+    string pending;
+    uint64_t nextSequence = 1;
+    bool pinned = false;
+    uint64_t pinnedSequence = 0;
+    uint64_t activeBytes = 0;
+    bool cutFailed = false;
+};
+
+// A change made through the menus, as handed to the writer thread
+struct UserChange
+{
+    User user;
+    string previousUsername;    // Differs from user.username after a rename
+    bool tested = false;        // The change records `test`
+    TestRecord test{};
+    vector<string> contacts;    // Named in the test, met on its day
+    bool removed = false;       // The user has moved to another partition
+};
+
+// Commits user changes on a dedicated thread so the menus never wait for the
+// disk. Changes that arrive while a commit is running are grouped into the
+// next one. In journal mode a commit appends the batch to the journal; in
+// rewrite mode it rewrites both data files from the writer's own copy of the
+// users, through a temporary file and rename. In both modes tests and renames
+// are appended to HISTORY_FILE.
+class PersistenceWriter
+{
+public:
+    PersistenceWriter(const ProgramOptions& options, const UserStore& store, uint64_t lastSequence);
+    ~PersistenceWriter();
+
+    bool start();
+    void userChanged(const User& user, const string& previousUsername, const TestRecord* test = nullptr,
+                     span<const string> contacts = {});
+    void contactsAdded(const User& user, int32_t day, span<const string> contacts);
+    void userRemoved(const string& username);
+    bool flush();
+    bool close();
+
+private:
+    void writerLoop();
+    void stage(vector<UserChange>& batch);
+    bool writeStaged();
+    void applyToShadow(const UserChange& change);
+    void syncJournal();
+    void compactIfNeeded();
+
+    PersistenceMode mode;
+    FsyncPolicy fsyncPolicy;
+    chrono::milliseconds fsyncInterval;
+    uint64_t startSequence;
+
+    // Writer-thread state
+    UserStore shadow;
+    Journal journal;
+    Journal history;
+    bool unsynced = false;
+    chrono::steady_clock::time_point lastSync;
+    uint64_t dataFileStamp = 0;     // textFileStamp() of DATA_FILE as last written or read, 0 until known
+    thread compactor;
+    atomic<bool> compacting{false};
+
+    thread writer;
+    mutex queueMutex;
+    condition_variable queueReady;
+    vector<UserChange> queued;
+    bool stopping = false;
+    bool failed = false;            // Writes kept failing; later changes are not saved
+    uint64_t queuedCount = 0;       // Changes handed over, and changes committed,
+    uint64_t committedCount = 0;    // since start; flush() waits for these to meet
+    condition_variable batchCommitted;
+};
+
+// Kinds of timer a HealthScheduler sets for each user
+enum TimerKind : uint8_t
+{
+    TIMER_QUARANTINE_END,   // POSITIVE user has served the policy's quarantine
+    TIMER_TEST_REMINDER     // The policy's reminder interval has passed since the last test
+};
+
+struct Timer
+{
+    UserId id;
+    int32_t testDay;        // Test the timer was set for; a newer test makes it stale
+    TimerKind kind;
+};
+
+// Day-granularity timer wheel. Timers due within the next WHEEL_DAYS days sit
+// in one bucket per day; later ones wait in a heap and move into the wheel as
+// it turns. Advancing by a day only touches that day's bucket.
+class TimerWheel
+{
+public:
+    static constexpr int32_t WHEEL_DAYS = 64;
+
+    explicit TimerWheel(int32_t startDay) : nextDay(startDay), buckets(WHEEL_DAYS) {}
+
+    void schedule(int32_t dueDay, const Timer& timer);
+    size_t pending() const { return count; }
+
+    // Calls fire(timer) for every timer due on or before `day`
+    template <typename Fire>
+    void advanceTo(int32_t day, Fire fire)
+    {
+        vector<Timer> due;
+        due.swap(overdue);
+        for (const Timer& timer : due)
+            fire(timer);
+        count -= due.size();
+        
+        for (; nextDay <= day; nextDay++)
+        {
+            due.clear();
+            due.swap(buckets[bucketOf(nextDay)]);
+            count -= due.size();
+            for (const Timer& timer : due)
+                fire(timer);
+            
+            // The bucket just emptied now stands for nextDay + WHEEL_DAYS
+            while (!later.empty() && later.top().first <= nextDay + WHEEL_DAYS)
+            {
+                buckets[bucketOf(later.top().first)].push_back(later.top().second);
+                later.pop();
+            }
+        }
+    }
+
+private:
+    static size_t bucketOf(int32_t day) { return static_cast<size_t>(((day % WHEEL_DAYS) + WHEEL_DAYS) % WHEEL_DAYS); }
+
+    struct LaterFirst
+    {
+        bool operator()(const pair<int32_t, Timer>& a, const pair<int32_t, Timer>& b) const { return a.first > b.first; }
+    };
+
+    int32_t nextDay;                // First day not yet advanced past
+    vector<vector<Timer>> buckets;  // buckets[bucketOf(d)] for d in [nextDay, nextDay + WHEEL_DAYS)
+    vector<Timer> overdue;          // Scheduled for a day already advanced past
+    priority_queue<pair<int32_t, Timer>, vector<pair<int32_t, Timer>>, LaterFirst> later;
+    size_t count = 0;
+};
+
+// Ends quarantines and raises test reminders on time, with work proportional
+// to the users that are due rather than the size of the store. Timers are
+// never cancelled: one whose user has been removed, retested or is no longer
+// POSITIVE is dropped when it fires. Each user has at most one live reminder.
+class HealthScheduler
+{
+public:
+    explicit HealthScheduler(int32_t today) : wheel(today) {}
+
+    void rebuild(const UserStore& store);
+    void userChanged(UserId id, const UserView& user);
+    size_t pending() const { return wheel.pending(); }
+
+    // Fires everything due up to `today`. Users whose quarantine has ended are
+    // moved to LOW_RISK in `store` and passed to onRelease; users now due for
+    // another test are passed to onReminder.
+    void advanceTo(int32_t today, UserStore& store, const function<void(UserId)>& onRelease,
+                   const function<void(UserId)>& onReminder);
+    void userRemoved(UserId id);
+
+private:
+    void scheduleReminder(UserId id, int32_t testDay);
+    void scheduleQuarantineEnd(UserId id, int32_t testDay);
+
+    TimerWheel wheel;
+    vector<int32_t> reminderDays;   // Test day of each slot's live reminder, or NO_TEST_DAY
+};
+
+// Thrown by the input helpers when a session's input ends, so the menus can
+// unwind from any prompt without checking every read
+struct SessionClosed
+{
+};
+
+template <typename T>
+class Task;
+
+// Promise parts shared by every Task. A task starts suspended and runs when
+// first awaited; when it finishes it resumes whoever awaited it, unless it
+// finished without ever suspending, in which case the awaiter just carries on.
+struct TaskPromiseBase
+{
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        coroutine_handle<> await_suspend(coroutine_handle<Promise> finished) noexcept
+        {
+            TaskPromiseBase& promise = finished.promise();
+            if (promise.runningInline || !promise.continuation)
+                return noop_coroutine();
+            return promise.continuation;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = current_exception(); }
+
+    coroutine_handle<> continuation;
+    exception_ptr error;
+    bool runningInline = false;     // Running inside the awaiter's await_suspend
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase
+{
+    Task<T> get_return_object();
+    void return_value(T result) { value = move(result); }
+
+    T value{};
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+// Coroutine for the menu flows. Awaiting a task runs it until it finishes or
+// suspends waiting for input; exceptions thrown inside reach the awaiter.
+// A task that never suspends (every console session) runs like a plain call,
+// so the stack does not grow with the number of prompts answered.
+template <typename T = void>
+class Task
+{
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Runs a top-level task until it first suspends or finishes
+    void start() { handle.resume(); }
+    bool done() const { return handle.done(); }
+
+    T result()
+    {
+        if (handle.promise().error)
+            rethrow_exception(handle.promise().error);
+        if constexpr (!is_void_v<T>)
+            return move(handle.promise().value);
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(coroutine_handle<> awaiting)
+    {
+        promise_type& promise = handle.promise();
+        promise.continuation = awaiting;
+        promise.runningInline = true;
+        handle.resume();
+        promise.runningInline = false;
+        return !handle.done();
+    }
+
+    T await_resume() { return result(); }
+
+private:
+    coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Reads the menus make, named after the istream calls they replace
+enum InputRequest : uint8_t
+{
+    READ_WORD,      // in >> word
+    READ_LINE,      // getline(in, line)
+    READ_CHAR,      // in.get()
+    SKIP_CHAR,      // in.ignore()
+    SKIP_LINE       // in.ignore(max, '\n')
+};
+
+// Where a session reads and writes. The console session reads lines from cin
+// as the menus ask for them; a server session is fed by its event loop and
+// suspends until enough input has arrived. Input is parsed the way the
+// istream calls did, including the newlines they used to leave behind.
+class Terminal
+{
+public:
+    Terminal(istream* source, ostream& out) : out(out), source(source) {}
+
+    ostream& out;
+    bool console() const { return source != nullptr; }
+    // A headless session never clears the screen or pauses for Enter, so a
+    // script can drive it as fast as it is read
+    bool headless() const { return quiet; }
+    void setHeadless(bool headless) { quiet = headless; }
+    // The console copies every line it reads to `script`, if set
+    void recordTo(ostream* script) { recording = script; }
+    // True if everything taken so far ends with a whole line
+    bool atLineStart() const { return consumed > 0 ? buffer[consumed - 1] == '\n' : takenWholeLines; }
+    // Bytes of input taken since the session started. The main menu marks
+    // where its choice starts, so a redirected session can be replayed from
+    // there on another partition.
+    size_t position() const { return dropped + consumed; }
+    void markMenuChoice() { menuChoice = position(); }
+    size_t menuChoiceStart() const { return menuChoice; }
+
+    // True once `request` can complete, which includes input having ended.
+    // The console blocks on cin here until then.
+    bool hasInput(InputRequest request);
+    void waitFor(InputRequest request, coroutine_handle<> session);
+    bool take(InputRequest request, string* text);
+
+    // Event loop side: add input or end it, then resume the waiting session
+    // if it can continue. Returns true if the session ran.
+    void receive(const char* data, size_t length);
+    void closeInput() { inputClosed = true; }
+    bool resumeIfReady();
+    size_t buffered() const { return buffer.size() - consumed; }
+
+private:
+    bool satisfied(InputRequest request) const;
+
+    istream* source;                // cin for the console, null for server sessions
+    ostream* recording = nullptr;
+    bool quiet = false;
+    bool takenWholeLines = true;    // atLineStart() for input already dropped from `buffer`
+    size_t dropped = 0;             // Input taken and dropped from `buffer`
+    size_t menuChoice = 0;
+    string buffer;
+    size_t consumed = 0;            // Bytes of `buffer` already taken
+    bool inputClosed = false;
+    InputRequest waitingFor = READ_CHAR;
+    coroutine_handle<> waiting;
+};
+
+// co_await-able read on a Terminal. Reads throw SessionClosed when input ends
+// first; skips just stop at the end of input, as ignore() did.
+struct InputAwaiter
+{
+    Terminal& term;
+    InputRequest request;
+    string* text;
+
+    bool await_ready() { return term.hasInput(request); }
+    void await_suspend(coroutine_handle<> session) { term.waitFor(request, session); }
+    void await_resume()
+    {
+        if (!term.take(request, text))
+            throw SessionClosed();
+    }
+};
+
+// The state every session shares. Users are split across shards by a hash of
+// the username; each shard has its own store, scheduler and reader-writer
+// lock, so lookups run in parallel and a write only blocks its own shard.
+// Menus work on copies of users and hand changes back through these calls,
+// so each check-then-act step happens under the shard's lock.
+//
+// A UserId from the directory carries its shard in the low bits of the slot.
+// Renaming a user to a name in another shard moves the user and gives it a
+// new id, which is why rename() takes the id by reference.
+class UserDirectory
+{
+public:
+    // Splits `loaded` into 2^shardBits shards. A null writer leaves changes
+    // unpersisted, which the benchmarks use.
+    UserDirectory(const UserStore& loaded, PersistenceWriter* writer, unsigned shardBits = USER_SHARD_BITS);
+
+    size_t size() const;
+    bool contains(const string& username) const;
+    bool valid(UserId id) const;
+    bool get(UserId id, User& user) const;
+
+    UserId registerUser(const User& user);
+    UserId login(const string& username, const string& password, User& user, bool& quarantineEnded);
+    bool update(UserId id, const User& user);
+    bool rename(UserId& id, const string& newUsername);
+    bool recordTest(UserId id, const TestRecord& test, span<const string> contacts = {});
+    bool recordTest(const string& username, const TestRecord& test);
+    string findContact(const string& usernameOrIC) const;
+
+    // Front-desk lookups, one index probe per shard rather than a scan
+    bool findByIC(const string& IC, User& user) const;
+    vector<User> findByPhone(const string& phone) const;
+    // With uniqueness required, registerUser and update refuse an IC/passport
+    // number another user already has
+    void requireUniqueIC(bool required);
+    bool uniqueIC() const { return icMustBeUnique; }
+    bool icTaken(const string& IC, const string& exceptUsername) const;
+    // Calls visit(user) for every user matching the filter, a shard at a time
+    // under its read lock, until visit returns false
+    void query(const RosterFilter& filter, const function<bool(const UserView&)>& visit) const;
+    vector<string> contactsWithin(const string& username, int hops, int32_t sinceDay) const;
+    size_t traceContacts(const string& username, int32_t positiveDay);
+    size_t contactCount() const;
+
+    // Test history, in the order the tests were recorded. Returns false if
+    // there is no such user.
+    bool testHistory(const string& username, int32_t fromDay, int32_t toDay, vector<TestRecord>& tests) const;
+    // Calls visit(username, test) for every test dated fromDay..toDay, one
+    // shard at a time
+    void testsBetween(int32_t fromDay, int32_t toDay,
+                      const function<void(string_view, const TestRecord&)>& visit) const;
+    size_t historyBytes() const;
+    // Loads the tests in a history file before sessions start, up to the
+    // last record numbered lastSequence or below, and returns the offset just
+    // past it. With a writer it also cuts off a torn last record and
+    // compacts an overgrown file.
+    size_t loadHistory(const string& filename, bool durable, uint64_t lastSequence = UINT64_MAX);
+    bool saveHistory(const string& filename, bool durable) const;
+
+    // Sums the shards' counters with every shard read-locked, so the totals
+    // are exact at one instant. Costs one lock per shard, not per user.
+    CategoryStats statistics() const;
+    // Recounts each shard from scratch and compares with its counters
+    bool checkStatistics() const;
+
+    // Releases users whose quarantine has ended and persists the change, and
+    // picks up a changed policy file. Only does work once the day or the
+    // policy has changed.
+    void tick();
+    bool modified() const { return dataModified; }
+    // Has tick() also rewrite `filename` with the metrics every
+    // STATS_INTERVAL_SECONDS; empty turns it off
+    void writeStatsTo(const string& filename) { statsFile = filename; }
+
+    // The users this process serves. Registration, login and renames refuse
+    // usernames of other partitions, and the menus redirect them.
+    Partition partition() const;
+    void setPartition(const Partition& partition);
+    bool owns(string_view username) const { return partition().owns(username); }
+    // Halves the partition, keeping index/2count, and moves the users of
+    // (index + count)/2count out as journal records appended to `records`:
+    // their users, their tests and the contacts between them. Returns false
+    // if the partition cannot be split further.
+    bool splitPartition(string& records, size_t& movedUsers);
+    // Adds the users in records from another partition's splitPartition().
+    // Users of other partitions, and usernames or ICs already taken here, are
+    // skipped. Returns false if the records are damaged.
+    bool importRecords(string_view records, size_t& users, size_t& tests, size_t& contacts);
+
+    // A replica takes its changes from the primary's files rather than from
+    // the menus, which only read. Reads are refused once it has gone longer
+    // than maxStaleness without catching up with the primary.
+    void setReplica(chrono::milliseconds maxStaleness);
+    bool replica() const { return replicaMode; }
+    void caughtUp();
+    bool stale() const;
+    // Applies a record from the primary's journal or history file. Tests and
+    // contacts go in beside the user, whose record comes from the journal.
+    bool applyRecord(uint8_t type, string_view payload);
+    // Drops every test and contact, before a rewritten history file is loaded
+    void clearHistory();
+    // A copy of every user, for the writer of a promoted replica
+    UserStore copyUsers() const;
+    // Ends replica mode; changes are persisted through `newWriter` from now on
+    void promote(PersistenceWriter* newWriter);
+
+private:
+    struct alignas(64) Shard
+    {
+        explicit Shard(int32_t today) : scheduler(today) {}
+
+        mutable shared_mutex lock;
+        UserStore store;
+        HealthScheduler scheduler;
+        TestHistory history;        // By the store's slots
+    };
+
+    size_t shardOf(string_view username) const;
+    size_t shardOf(UserId id) const { return id.slot & shardMask; }
+    UserId localId(UserId id) const { return UserId{id.slot >> shardBits, id.generation}; }
+    UserId globalId(size_t shard, UserId local) const;
+    void releaseDue(Shard& shard, int32_t today);
+    void reschedule();
+    bool applyTest(Shard& shard, UserId local, const TestRecord& test, span<const string> contacts);
+    ThreadPool& tracePool() const;
+    void persist(const User& user, const string& previousUsername, const TestRecord* test = nullptr,
+                 span<const string> contacts = {});
+
+    unsigned shardBits;
+    uint32_t shardMask;
+    vector<unique_ptr<Shard>> shards;
+    // Taken after any shard locks, never before them
+    mutable shared_mutex contactsLock;
+    ContactGraph contactGraph;
+    mutable once_flag tracePoolCreated;
+    mutable unique_ptr<ThreadPool> tracePoolThreads;
+    // Held across the check and the write of an IC while uniqueness is
+    // required; taken before any shard lock
+    mutable mutex identityMutex;
+    bool icMustBeUnique = false;
+    string statsFile;
+    atomic<uint64_t> ownedPartition{1};     // Index in the high half, count in the low
+    atomic<bool> replicaMode{false};
+    chrono::milliseconds maxStaleness{0};
+    atomic<int64_t> caughtUpAt{0};          // steady_clock ticks at the replica's last catch-up
+    PersistenceWriter* writer;
+    atomic<int32_t> tickedDay;
+    atomic<bool> dataModified{false};
+};
+
+// Keeps a replica's directory up to date with the primary writing the data
+// files in the same directory. Every REPLICA_POLL_MS it reads what the
+// primary has appended to the journal and the history file; a journal the
+// primary rotates away is read to its end through the descriptor still open
+// on it. The primary writes a change's history records before its journal
+// records, and numbers them with the journal sequence of the change, so
+// reading the journal first and then the history covers whole changes and
+// lets the two be applied in the order the primary made them. A history file
+// the primary has rewritten is loaded again.
+class ReplicaFollower
+{
+public:
+    ReplicaFollower(UserDirectory& directory, const ProgramOptions& options)
+        : directory(directory), options(options) {}
+    ~ReplicaFollower();
+    ReplicaFollower(const ReplicaFollower&) = delete;
+    ReplicaFollower& operator=(const ReplicaFollower&) = delete;
+
+    // Applies the journal on top of the base files loaded at baseSequence and
+    // loads the test history, then follows on a thread of its own
+    bool start(uint64_t baseSequence);
+    // Stops following, and commits and closes a promoted replica's writer.
+    // Returns false if that writer could not save every change.
+    bool close();
+    // Takes over from a primary that has stopped: applies the rest of its
+    // files, cuts off a torn last record and starts writing the journal. On
+    // failure says why in `error` and goes on following.
+    bool promote(string& error);
+    uint64_t sequence() const { return appliedSequence; }
+    uint64_t records() const { return appliedRecords; }
+
+private:
+    struct FollowedFile
+    {
+        string name;
+        int fd = -1;
+        uint64_t offset = 0;        // Just past the last record taken
+    };
+    struct FollowedRecord
+    {
+        uint64_t sequence;
+        uint8_t type;
+        string payload;
+        uint64_t end;               // Offset just past the record
+    };
+
+    void run();
+    bool poll(bool final);
+    bool readRecords(FollowedFile& file, vector<FollowedRecord>& records);
+    bool replaced(const FollowedFile& file) const;
+    void applyJournal(const FollowedRecord& record);
+    void stopFollowing();
+    void closeFiles();
+
+    UserDirectory& directory;
+    ProgramOptions options;
+    FollowedFile journal{JOURNAL_FILE};
+    FollowedFile history{HISTORY_FILE};
+    atomic<uint64_t> appliedSequence{0};
+    atomic<uint64_t> appliedRecords{0};     // Journal records applied since start()
+    unique_ptr<PersistenceWriter> writer;   // Once promoted
+    thread follower;
+    mutex stopMutex;
+    condition_variable stopRequested;
+    bool stopping = false;
+};
+
+#ifdef __linux__
+// Stream buffer that collects a session's output until its loop sends it
+class OutputBuffer : public streambuf
+{
+public:
+    string& pending() { return text; }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+            text.push_back(traits_type::to_char_type(ch));
+        return traits_type::not_eof(ch);
+    }
+
+    streamsize xsputn(const char* data, streamsize length) override
+    {
+        text.append(data, static_cast<size_t>(length));
+        return length;
+    }
+
+private:
+    string text;
+};
+
+// One connected client: its input and output and the suspended menu coroutine
+struct ServerSession
+{
+    ServerSession(int fd, UserDirectory& directory);
+
+    int fd;
+    OutputBuffer output;
+    ostream out;
+    Terminal term;
+    Task<> task;
+    bool writing = false;       // Waiting for room to send rather than for input
+    bool inputSeen = false;
+    bool control = false;       // The first input was a control request rather than menu input
+    string request;             // The control request so far
+    bool answered = false;      // The reply is queued; the session ends once it is sent
+};
+
+// An epoll loop running many sessions on one thread. New connections arrive
+// through adopt() from the accepting thread; everything else happens on the
+// loop's own thread.
+class SessionLoop
+{
+public:
+    SessionLoop(UserDirectory& directory, bool headless, ReplicaFollower* follower)
+        : directory(directory), headless(headless), follower(follower) {}
+    ~SessionLoop();
+    SessionLoop(const SessionLoop&) = delete;
+    SessionLoop& operator=(const SessionLoop&) = delete;
+
+    bool open();
+    void adopt(int fd);
+    void run();
+    size_t openSessions() const { return openCount; }
+
+private:
+    void startSession(int fd);
+    void service(int fd, uint32_t events);
+    void settle(ServerSession& session);
+    bool flush(ServerSession& session);
+    void endSession(int fd);
+
+    UserDirectory& directory;
+    bool headless;
+    ReplicaFollower* follower;      // Promotes the server if it is a replica
+    int epollFd = -1;
+    int wakeFd = -1;
+    mutex inboxMutex;
+    vector<int> inbox;
+    unordered_map<int, unique_ptr<ServerSession>> sessions;
+    atomic<size_t> openCount{0};
+};
+
+// One client of --route and the partition its session is on. Everything the
+// client has sent that partition is kept, so that if the partition redirects
+// the session it can be replayed on the owner from its main menu choice.
+struct RoutedSession
+{
+    int client = -1;
+    int partition = -1;
+    string address;                 // Of `partition`
+    string sent;                    // Client input since the partition's session started
+    size_t forwarded = 0;           // Bytes of `sent` the partition has been sent
+    string toClient;                // Output the client has not read yet
+    bool clientDone = false;        // The client has closed its side
+    bool partitionShut = false;     // Nothing more is sent to the partition
+    bool skipping = false;          // Dropping a replay's output up to its username prompt
+    string skipped;
+    bool redirected = false;        // Reading a redirect line; the rest of it is in `redirect`
+    string redirect;
+    string redirectUser;            // Waiting for the map to name another owner
+    size_t replayFrom = 0;
+    int retries = 0;
+    chrono::steady_clock::time_point retryAt;
+};
+
+// Forwards client sessions to the partitions in a map file, on one epoll
+// thread. New sessions go to the partitions in turn, since any of them can
+// show the main menu. When one redirects a session, the session is replayed
+// on the owner of the username and the owner's repeat of what the client has
+// already seen is dropped, so the client sees one continuous session. The
+// map is read again whenever its file changes.
+class PartitionRouter
+{
+public:
+    explicit PartitionRouter(const string& mapFile) : mapFile(mapFile) {}
+    ~PartitionRouter();
+    PartitionRouter(const PartitionRouter&) = delete;
+    PartitionRouter& operator=(const PartitionRouter&) = delete;
+
+    bool run(const string& address);
+
+private:
+    bool reloadMap();
+    void acceptClients();
+    void track(int fd, const shared_ptr<RoutedSession>& session);
+    void service(const shared_ptr<RoutedSession>& session, int fd, uint32_t events);
+    bool fromPartition(RoutedSession& session, string_view data);
+    void follow(const shared_ptr<RoutedSession>& session);
+    bool forward(RoutedSession& session);
+    void settle(RoutedSession& session);
+    void watch(RoutedSession& session);
+    void closePartition(RoutedSession& session);
+    void end(RoutedSession& session);
+
+    string mapFile;
+    PartitionMap map;
+    filesystem::file_time_type mapTime;
+    int epollFd = -1;
+    int listener = -1;
+    size_t nextPartition = 0;
+    unordered_map<int, shared_ptr<RoutedSession>> byFd;     // Both ends of every session
+    vector<shared_ptr<RoutedSession>> retrying;
+    long long routedCount = 0;
+    long long redirectCount = 0;
+    long long failedCount = 0;
+};
+#endif
+
+// One row of a lab results feed for --ingest: the five screening answers,
+// the test result and the test date, as the assessment menu asks for them
+struct TestResultRow
+{
+    string username;
+    bool hasFever;
+    bool hasCough;
+    bool hasBreathingDifficulty;
+    bool hasTravelHistory;
+    bool hasCloseContact;
+    bool testPositive;
+    int32_t testDay;
+};
+
+// Screening answers for categoriseBatch as one array per question, one byte
+// per row; any nonzero byte means yes
+struct ScreeningColumns
+{
+    const uint8_t* fever;
+    const uint8_t* cough;
+    const uint8_t* breathingDifficulty;
+    const uint8_t* travelHistory;
+    const uint8_t* closeContact;
+    const uint8_t* testPositive;
+};
+
+// Bit of each answer in a risk table index: fever is bit 0, a positive test bit 5
+constexpr unsigned riskIndex(bool hasFever, bool hasCough, bool hasBreathingDifficulty, bool hasTravelHistory,
+                             bool hasCloseContact, bool testPositive)
+{
+    return unsigned(hasFever) | unsigned(hasCough) << 1 | unsigned(hasBreathingDifficulty) << 2 |
+           unsigned(hasTravelHistory) << 3 | unsigned(hasCloseContact) << 4 | unsigned(testPositive) << 5;
+}
+
+// Categorisation rules and durations from a policy file, compiled into a
+// category for each of the 64 possible sets of answers
+struct Policy
+{
+    array<Category, 64> table;
+    int quarantineDays;
+    int testReminderDays;
+    int contactWindowDays;
+    int traceHops;
+
+    Category assess(bool hasFever, bool hasCough, bool hasBreathingDifficulty, bool hasTravelHistory,
+                    bool hasCloseContact, bool testPositive) const
+    {
+        return table[riskIndex(hasFever, hasCough, hasBreathingDifficulty, hasTravelHistory, hasCloseContact,
+                               testPositive)];
+    }
+};
+
+// Operations whose latency is measured
+enum MetricOperation : uint8_t
+{
+    METRIC_LOAD,            // Loading the data files at startup
+    METRIC_SAVE,            // Rewriting the data files
+    METRIC_LOGIN,
+    METRIC_REGISTRATION,
+    METRIC_ASSESSMENT,      // Recording a test, including any contact tracing it starts
+    METRIC_PROFILE_UPDATE,  // Profile changes and renames
+    METRIC_OPERATION_COUNT
+};
+
+// Events that are only counted
+enum MetricCounter : uint8_t
+{
+    COUNTER_LOAD_WARNINGS,  // Data file lines loaded with a default in place of a bad field
+    COUNTER_SKIPPED_LINES,  // Data file lines that could not be loaded at all
+    COUNTER_FAILED_LOGINS,
+    METRIC_COUNTER_COUNT
+};
+
+#ifdef HAVE_METRICS
+// Latency histogram in the style of HdrHistogram. Values below 2^sub-bucket
+// bits ns get a bucket each; above that every power of two is split into
+// 2^sub-bucket bits buckets, so a percentile is within about 3% at any
+// scale. Only the owning thread records, with plain loads and stores of
+// the atomics, and any thread may read.
+class LatencyHistogram
+{
+public:
+    static constexpr int SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+    static constexpr int BUCKETS = (LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    static int bucketOf(uint64_t ns);
+    // Largest value that falls in `bucket`
+    static uint64_t bucketLimit(int bucket);
+
+    void record(uint64_t ns);
+    // Adds these counts to `total`, which no other thread may be writing
+    void addTo(LatencyHistogram& total) const;
+    uint64_t count() const { return total.load(memory_order_relaxed); }
+    // Upper end of the bucket holding the sample at `fraction` (0-1) of the
+    // way through, or the largest sample if that is lower
+    uint64_t percentile(double fraction) const;
+    uint64_t maximum() const { return maxNs.load(memory_order_relaxed); }
+    double mean() const;
+
+private:
+    static void bump(atomic<uint64_t>& counter, uint64_t amount)
+    {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+    atomic<uint64_t> counts[BUCKETS] = {};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> totalNs{0};
+    atomic<uint64_t> maxNs{0};
+};
+
+// One thread's measurements. `operations` counts every call; the histograms
+// hold every load and save but one in LATENCY_SAMPLE_INTERVAL of the other
+// operations, which keeps reading the clock off the fast paths.
+struct ThreadMetrics
+{
+    void addTo(ThreadMetrics& total) const;
+
+    LatencyHistogram latency[METRIC_OPERATION_COUNT];
+    atomic<uint64_t> operations[METRIC_OPERATION_COUNT] = {};
+    atomic<uint64_t> counters[METRIC_COUNTER_COUNT] = {};
+};
+
+// The calling thread's metrics. Only a thread's first call registers them,
+// so the rest cost one thread-local load.
+constinit thread_local ThreadMetrics* localMetrics = nullptr;
+ThreadMetrics& registerThreadMetrics();
+inline ThreadMetrics& threadMetrics()
+{
+    return localMetrics ? *localMetrics : registerThreadMetrics();
+}
+#endif
+
+// Times the scope it lives in as one `operation`. Built with NO_METRICS it is
+// empty and costs nothing.
+class LatencyTimer
+{
+public:
+#ifdef HAVE_METRICS
+    // Defined here so the unsampled path, a count and a test, is inlined
+    explicit LatencyTimer(MetricOperation operation) : metrics(threadMetrics()), operation(operation)
+    {
+        uint64_t calls = metrics.operations[operation].load(memory_order_relaxed);
+        metrics.operations[operation].store(calls + 1, memory_order_relaxed);
+        sampled = operation <= METRIC_SAVE || calls % LATENCY_SAMPLE_INTERVAL == 0;
+        if (sampled)
+            start = chrono::steady_clock::now();
+    }
+    ~LatencyTimer()
+    {
+        if (sampled)
+            recordSample();
+    }
+    LatencyTimer(const LatencyTimer&) = delete;
+    LatencyTimer& operator=(const LatencyTimer&) = delete;
+
+private:
+    void recordSample();
+
+    ThreadMetrics& metrics;
+    MetricOperation operation;
+    bool sampled;
+    chrono::steady_clock::time_point start;
+#else
+    explicit LatencyTimer(MetricOperation) {}
+#endif
+};
+
+inline void countEvent([[maybe_unused]] MetricCounter counter, [[maybe_unused]] uint64_t amount = 1)
+{
+#ifdef HAVE_METRICS
+    atomic<uint64_t>& value = threadMetrics().counters[counter];
+    value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+#endif
+}
+
+// Function prototypes
+void loadUsersFromFile(const string& filename, vector<User>& users, unsigned threadCount = 0);
+int parseUserChunk(string_view chunk, int firstLineNumber, vector<User>& users, ostream& warnings);
+void loadUsersFromFileGetline(const string& filename, vector<User>& users);
+bool parseUserRecord(string_view line, int lineNumber, User& user, ostream& warnings);
+bool saveUsersToFile(const string& filename, const UserStore& store, bool durable = false,
+                     uint64_t* textStamp = nullptr);
+bool loadSnapshot(const string& filename, vector<User>& users, unsigned threadCount = 0,
+                  uint64_t* journalSequence = nullptr);
+bool saveSnapshot(const string& filename, const UserStore& store, uint64_t journalSequence = 0,
+                  bool durable = false, uint64_t textStamp = 0);
+uint64_t textFileStamp(const string& filename);
+bool snapshotCoversText(const string& snapshotFile, const string& textFile);
+bool replaceFile(const string& tempName, const string& filename, bool durable);
+uint64_t replayJournal(const string& filename, UserStore& store, uint64_t afterSequence);
+bool parseJournalUser(string_view payload, User& user);
+bool parsePartition(string_view text, Partition& partition);
+string partitionName(const Partition& partition);
+bool resolvePartition(ProgramOptions& options);
+bool savePartition(const Partition& partition);
+bool loadPartitionMap(const string& filename, PartitionMap& map, string& error);
+bool savePartitionMap(const string& filename, const PartitionMap& map);
+uint64_t loadUserData(UserStore& store, const ProgramOptions& options);
+bool saveUserData(const UserStore& store, bool durable = false, uint64_t* textStamp = nullptr);
+void clearScreen(Terminal& term);
+Task<> waitForUser(Terminal& term);
+InputAwaiter readWord(Terminal& term, string& word);
+InputAwaiter readLine(Terminal& term, string& line);
+InputAwaiter skipChar(Terminal& term);
+InputAwaiter skipLine(Terminal& term);
+Task<bool> runSession(Terminal& term, UserDirectory& directory);
+
+// Command line tools
+bool parseCommandLine(int argc, char* argv[], ProgramOptions& options);
+int runCommand(const ProgramOptions& options);
+void printUsage(const char* program);
+bool generateUserFile(const string& filename, long long count, int malformedPercent = 0,
+                      long long* skippedLines = nullptr);
+void benchmarkLoad(const string& filename, int iterations);
+bool runBenchmarkSuite(long long userCount, const string& output);
+void benchmarkLogin(long long maxUsers);
+bool benchmarkMemory(long long maxUsers);
+bool benchmarkScheduler(long long userCount);
+bool benchmarkContention(long long userCount, unsigned maxThreads);
+void printDueReport(const ProgramOptions& options);
+void printDashboard(ostream& out, const CategoryStats& stats, int32_t today);
+bool showDashboard(const ProgramOptions& options);
+bool ingestResults(const ProgramOptions& options, const string& filename, size_t batchRows);
+bool parseResultRow(string_view line, int32_t today, TestResultRow& row, string& error);
+bool benchmarkDates();
+bool benchmarkCategorise(long long rows);
+bool benchmarkPolicy(long long rows);
+bool showHistory(const ProgramOptions& options, const string& username, int32_t fromDay, int32_t toDay);
+bool showTestsBetween(const ProgramOptions& options, int32_t fromDay, int32_t toDay);
+bool benchmarkHistory(long long userCount, int days);
+bool showContacts(const ProgramOptions& options, const string& username, int hops);
+bool showLookup(const ProgramOptions& options, const string& key);
+bool showQuery(const ProgramOptions& options, const vector<string>& args);
+bool benchmarkQuery(long long userCount);
+bool benchmarkContacts(long long userCount, int contactsPerUser);
+bool benchmarkMetrics(long long userCount);
+bool benchmarkPartitions(long long userCount);
+bool benchmarkWriter(long long changeCount);
+size_t residentBytes();
+User makeSyntheticUser(long long id, mt19937& rng);
+
+// Server mode
+int runServer(const ProgramOptions& options, const string& address);
+bool runLoadTest(const string& address, long long sessions, unsigned concurrency, long long idleSessions,
+                 const vector<string>& scripts = {});
+Task<> serveSession(Terminal& term, UserDirectory& directory);
+size_t controlRequestSize(string_view request);
+string answerControl(UserDirectory& directory, ReplicaFollower* follower, string_view request);
+int runRouter(const string& address, const string& mapFile);
+bool splitMappedPartition(const string& mapFile, const string& name, const string& newAddress);
+bool promoteReplica(const string& address);
+#ifndef _WIN32
+void raiseFileLimit();
+bool makeSocketAddress(const string& address, sockaddr_storage& storage, socklen_t& length);
+int openListener(const string& address);
+int connectTo(const string& address);
+bool runScriptedSession(const string& address, const string& script, string& output);
+bool sendControl(const string& address, const string& request, string& reply);
+#endif
+
+// User management
+Task<UserId> registration(Terminal& term, UserDirectory& directory);
+Task<bool> login(Terminal& term, UserDirectory& directory, UserId& currentUser);
+Task<> logout(Terminal& term, UserId& currentUser);
+void redirectSession(Terminal& term, const string& username);
+
+// User operations
+void viewProfile(Terminal& term, const UserDirectory& directory, UserId id);
+Task<> updateProfile(Terminal& term, UserDirectory& directory, UserId& id);
+Task<> takeTest(Terminal& term, UserDirectory& directory, UserId id);
+void viewCategory(Terminal& term, const UserDirectory& directory, UserId id);
+void showReminder(Terminal& term, const UserDirectory& directory, UserId id);
+constexpr Category assessRisk(bool hasFever, bool hasCough, bool hasBreathingDifficulty, bool hasTravelHistory,
+                              bool hasCloseContact, bool testPositive);
+void categoriseBatch(const ScreeningColumns& answers, size_t count, Category* categories);
+void categoriseBatchScalar(const ScreeningColumns& answers, size_t count, Category* categories, const Category* table);
+#ifdef HAVE_AVX2_KERNEL
+void categoriseBatchAvx2(const ScreeningColumns& answers, size_t count, Category* categories, const Category* table);
+#endif
+
+// Policy
+shared_ptr<const Policy> currentPolicy();
+bool compilePolicy(string_view text, Policy& policy, string& error);
+void installPolicy(shared_ptr<const Policy> policy);
+bool reloadPolicyIfChanged(bool& durationsChanged);
+// Metrics
+void printMetrics(ostream& out);
+bool writeStats(const string& filename);
+void writeStatsIfDue(const string& filename);
+
+// Helper functions
+int categoryToInt(Category category);
+Category intToCategory(int value);
+constexpr bool parseDate(string_view text, int32_t& dayNumber);
+bool isValidDateRegex(const string& dateStr);
+string normalizeDateStream(const string& dateStr);
+bool needsTesting(const User* user);
+bool updateCategoryBasedOnTime(User* user);
+bool sameUser(const User& a, const User& b);
+void displayQuote(Terminal& term);
+Task<int> getValidatedInt(Terminal& term, string prompt, int minVal = INT_MIN, int maxVal = INT_MAX);
+Task<string> getValidatedString(Terminal& term, string prompt, bool allowSpaces = true);
+int32_t currentDayNumber();
+constexpr int32_t daysFromCivil(int year, int month, int day);
+void civilFromDays(int32_t dayNumber, int& year, int& month, int& day);
+void formatDate(int32_t dayNumber, char* out);
+string dayNumberToDate(int32_t dayNumber);
+bool parseLeadingInt(string_view text, int& value);
+
+int main(int argc, char* argv[])
+{
+    ProgramOptions options;
+    if (!parseCommandLine(argc, argv, options))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (!resolvePartition(options))
+    {
+        return 1;
+    }
+    if (!options.command.empty())
+    {
+        return runCommand(options);
+    }
+    if (options.headless)
+    {
+        // Prompts are no longer flushed before each read
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+    }
+
+    UserStore store;
+
+    // Load users from the snapshot (or the text file if it is newer) plus the journal
+    uint64_t journalSequence = loadUserData(store, options);
+    PersistenceWriter writer(options, store, journalSequence);
+    
+    // Quarantines end on schedule even for users who never log in again
+    UserDirectory directory(store, options.replica ? nullptr : &writer);
+    store = UserStore();
+    directory.setPartition(options.partition);
+    directory.requireUniqueIC(options.uniqueIC && !options.replica);
+    directory.writeStatsTo(options.statsFile);
+    ReplicaFollower follower(directory, options);
+    if (options.replica)
+    {
+        directory.setReplica(chrono::milliseconds(options.maxStalenessMs));
+        if (!follower.start(journalSequence))
+            return 1;
+    }
+    else
+    {
+        directory.loadHistory(HISTORY_FILE, options.fsyncPolicy != FSYNC_NONE);
+        if (!writer.start())
+            return 1;
+    }
+    
+    // Console input never suspends a session, so this runs to the end
+    Terminal console(&cin, cout);
+    console.setHeadless(options.headless);
+    ofstream script;
+    if (!options.recordFile.empty())
+    {
+        script.open(options.recordFile, ios::binary | ios::trunc);
+        if (!script.is_open())
+        {
+            cerr << "Error: Could not create " << options.recordFile << ".\n";
+            writer.close();
+            follower.close();
+            return 1;
+        }
+        console.recordTo(&script);
+    }
+    Task<bool> session = runSession(console, directory);
+    session.start();
+    
+    bool saved = writer.close();
+    saved = follower.close() && saved;
+    if (!options.statsFile.empty())
+        writeStats(options.statsFile);
+    if (!saved)
+    {
+        cerr << "Error: Some changes could not be saved.\n";
+        return 1;
+    }
+    if (directory.modified() && !directory.replica())
+    {
+        cout << "User data has been saved.\n";
+    }
+    cout << "Thank you for using the COVID-19 Health Management System!\n";
+    return 0;
+}
+
+// Runs the menus for one session until the user chooses Exit (true) or the
+// input ends (false). Each pass first lets the scheduler release due users.
+Task<bool> runSession(Terminal& term, UserDirectory& directory)
+{
+    UserId currentUser;
+    
+    try {
+        while (true)
+        {
+            directory.tick();
+            clearScreen(term);
+            
+            // Display header
+            term.out << "========================================\n";
+            term.out << "    COVID-19 HEALTH MANAGEMENT SYSTEM   \n";
+            term.out << "========================================\n\n";
+            
+            if (!directory.valid(currentUser))
+            {
+                // Not logged in - show main menu
+                term.out << "MAIN MENU:\n";
+                term.out << "1. Register New Account\n";
+                term.out << "2. Login\n";
+                term.out << "3. Exit\n\n";
+                
+                term.markMenuChoice();
+                int choice = co_await getValidatedInt(term, "Enter your choice (1-3): ", 1, 3);
+                clearScreen(term);
+                
+                switch (choice)
+                {
+                    case 1:
+                        if (directory.replica())
+                            term.out << "This copy of the system is read-only. Please register at the main counter.\n";
+                        else
+                            co_await registration(term, directory);
+                        co_await waitForUser(term);
+                        break;
+                        
+                    case 2:
+                    {
+                        if (directory.stale())
+                        {
+                            term.out << "This copy of the system is behind the main one. Please try again later.\n";
+                            co_await waitForUser(term);
+                            break;
+                        }
+                        // Awaited into a local: GCC 12 drops coroutine bodies
+                        // that await inside an if condition
+                        bool loggedIn = co_await login(term, directory, currentUser);
+                        if (loggedIn)
+                        {
+                            User user;
+                            if (directory.get(currentUser, user) && user.testDay == NO_TEST_DAY)
+                            {
+                                term.out << "\nNOTICE: Please update your test result after login.\n";
+                            }
+                            showReminder(term, directory, currentUser);
+                            co_await waitForUser(term);
+                        }
+                        break;
+                    }
+                        
+                    case 3:
+                        co_return true;
+                }
+            }
+            else
+            {
+                // Logged in - show user menu
+                User user;
+                directory.get(currentUser, user);
+                displayQuote(term);
+                term.out << "\nUSER MENU - Welcome, " << user.name << "\n";
+                term.out << "========================================\n";
+                term.out << "1. View Profile\n";
+                term.out << "2. Update Profile\n";
+                term.out << "3. Take COVID-19 Test\n";
+                term.out << "4. View Health Category\n";
+                term.out << "5. Logout\n\n";
+                
+                int choice = co_await getValidatedInt(term, "Enter your choice (1-5): ", 1, 5);
+                clearScreen(term);
+                
+                // A replica only shows what the primary has recorded, and only
+                // while it is not too far behind
+                if (choice != 5 && (choice == 2 || choice == 3 ? directory.replica() : directory.stale()))
+                {
+                    if (directory.replica() && (choice == 2 || choice == 3))
+                        term.out << "This copy of the system is read-only. Please use the main counter.\n";
+                    else
+                        term.out << "This copy of the system is behind the main one. Please try again later.\n";
+                    co_await waitForUser(term);
+                    continue;
+                }
+                
+                switch (choice)
+                {
+                    case 1:
+                        viewProfile(term, directory, currentUser);
+                        co_await waitForUser(term);
+                        break;
+                        
+                    case 2:
+                        co_await updateProfile(term, directory, currentUser);
+                        break;
+                        
+                    case 3:
+                        co_await takeTest(term, directory, currentUser);
+                        co_await waitForUser(term);
+                        break;
+                        
+                    case 4:
+                        viewCategory(term, directory, currentUser);
+                        co_await waitForUser(term);
+                        break;
+                        
+                    case 5:
+                        co_await logout(term, currentUser);
+                        break;
+                }
+            }
+        }
+    } catch (const SessionClosed&) {
+        co_return false;
+    }
+}
+
+// Loads every user in `filename`. Large files are split at line boundaries
+// and parsed on `threadCount` threads (0 = one per hardware thread); the
+// results and warnings are merged back in file order either way.
+void loadUsersFromFile(const string& filename, vector<User>& users, unsigned threadCount)
+{
+    MappedFile file(filename);
+    if (!file.isOpen())
+    {
+        // This is not an error - it's normal if the file doesn't exist yet
+        cout << "No data file found. Starting with empty user database.\n";
+        return;
+    }
+    
+    string_view contents = file.contents();
+    size_t initialCount = users.size();
+    int lineCount = 0;
+    
+    if (threadCount == 0)
+        threadCount = max(1u, thread::hardware_concurrency());
+    
+    if (threadCount == 1 || contents.size() < PARALLEL_LOAD_MIN_BYTES)
+    {
+        lineCount = parseUserChunk(contents, 1, users, cerr);
+    }
+    else
+    {
+        // Cut the buffer into chunks that each end just after a newline
+        size_t chunkCount = static_cast<size_t>(threadCount) * LOAD_CHUNKS_PER_THREAD;
+        vector<string_view> chunks;
+        size_t chunkStart = 0;
+        for (size_t i = 1; i <= chunkCount && chunkStart < contents.size(); i++)
+        {
+            size_t chunkEnd = contents.size() * i / chunkCount;
+            if (chunkEnd < chunkStart)
+                chunkEnd = chunkStart;
+            chunkEnd = contents.find('\n', chunkEnd);
+            chunkEnd = (chunkEnd == string_view::npos) ? contents.size() : chunkEnd + 1;
+            chunks.push_back(contents.substr(chunkStart, chunkEnd - chunkStart));
+            chunkStart = chunkEnd;
+        }
+        
+        ThreadPool pool(threadCount);
+        
+        // First pass counts newlines so every chunk knows its starting line number
+        vector<future<int>> newlineCounts;
+        for (string_view chunk : chunks)
+        {
+            newlineCounts.push_back(pool.submit([chunk]() {
+                return static_cast<int>(count(chunk.begin(), chunk.end(), '\n'));
+            }));
+        }
+        vector<int> firstLines(chunks.size());
+        int nextLine = 1;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            firstLines[i] = nextLine;
+            nextLine += newlineCounts[i].get();
+        }
+        
+        // Second pass parses the chunks, buffering warnings per chunk
+        vector<vector<User>> chunkUsers(chunks.size());
+        vector<ostringstream> chunkWarnings(chunks.size());
+        vector<future<int>> chunkLines;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            chunkLines.push_back(pool.submit([&, i]() {
+                return parseUserChunk(chunks[i], firstLines[i], chunkUsers[i], chunkWarnings[i]);
+            }));
+        }
+        
+        size_t parsedCount = 0;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            lineCount += chunkLines[i].get();
+            parsedCount += chunkUsers[i].size();
+        }
+        
+        users.reserve(users.size() + parsedCount);
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            cerr << chunkWarnings[i].str();
+            move(chunkUsers[i].begin(), chunkUsers[i].end(), back_inserter(users));
+        }
+    }
+    
+    size_t loadedCount = users.size() - initialCount;
+    if (loadedCount > 0) {
+        cout << "Successfully loaded " << loadedCount << " user(s) from file." << endl;
+    } else if (lineCount > 0) {
+        cout << "No valid user data found in file." << endl;
+    }
+}
+
+// Parses every line in `chunk`, numbering them from `firstLineNumber`.
+// Returns the number of lines seen so callers can report empty files.
+int parseUserChunk(string_view chunk, int firstLineNumber, vector<User>& users, ostream& warnings)
+{
+    size_t pos = 0;
+    int lineNumber = firstLineNumber;
+    
+    while (pos < chunk.size())
+    {
+        size_t end = chunk.find('\n', pos);
+        if (end == string_view::npos)
+            end = chunk.size();
+        
+        string_view line = chunk.substr(pos, end - pos);
+        pos = end + 1;
+        
+        User user;
+        if (parseUserRecord(line, lineNumber, user, warnings))
+        {
+            users.push_back(move(user));
+        }
+        lineNumber++;
+    }
+    
+    return lineNumber - firstLineNumber;
+}
+
+// Parses one line of the data file into a User. Blank lines are skipped
+// silently; malformed lines are reported to `warnings` and skipped.
+bool parseUserRecord(string_view line, int lineNumber, User& user, ostream& warnings)
+{
+    // Skip empty lines
+    if (line.empty() || line.find_first_not_of(' ') == string_view::npos)
+        return false;
+    
+    // Count the delimiters and remember the field boundaries in one pass
+    string_view fields[USER_FIELD_COUNT];
+    int delimiterCount = 0;
+    size_t fieldStart = 0;
+    for (size_t i = 0; i < line.size(); i++)
+    {
+        if (line[i] == '|')
+        {
+            if (delimiterCount < USER_FIELD_COUNT - 1)
+                fields[delimiterCount] = line.substr(fieldStart, i - fieldStart);
+            delimiterCount++;
+            fieldStart = i + 1;
+        }
+    }
+    
+    // We need exactly 8 delimiters for 9 fields
+    if (delimiterCount != USER_FIELD_COUNT - 1) {
+        warnings << "Warning: Line " << lineNumber << " has " << delimiterCount 
+                 << " delimiters (expected 8). Skipping.\n";
+        warnings << "Line: " << line << "\n";
+        countEvent(COUNTER_SKIPPED_LINES);
+        return false;
+    }
+    fields[USER_FIELD_COUNT - 1] = line.substr(fieldStart);
+    
+    // Splitting with getline never produced a trailing empty field, so a
+    // record that ends in '|' has always been rejected as one field short
+    if (fields[USER_FIELD_COUNT - 1].empty()) {
+        warnings << "Warning: Line " << lineNumber << " has " << USER_FIELD_COUNT - 1 
+                 << " fields (expected 9). Skipping.\n";
+        countEvent(COUNTER_SKIPPED_LINES);
+        return false;
+    }
+    
+    for (const auto& field : fields) {
+        if (field.size() > MAX_POOLED_STRING) {
+            warnings << "Warning: Line " << lineNumber << " has a field longer than "
+                     << MAX_POOLED_STRING << " characters. Skipping.\n";
+            countEvent(COUNTER_SKIPPED_LINES);
+            return false;
+        }
+    }
+    
+    try {
+        user.username.assign(fields[0]);
+        user.password.assign(fields[1]);
+        user.name.assign(fields[2]);
+        
+        // Parse age
+        if (!parseLeadingInt(fields[3], user.age) || user.age < 1 || user.age > 120) {
+            warnings << "Warning: Invalid age on line " << lineNumber 
+                     << ": '" << fields[3] << "'. Using default age 25.\n";
+            countEvent(COUNTER_LOAD_WARNINGS);
+            user.age = 25;
+        }
+        
+        user.address.assign(fields[4]);
+        user.phone.assign(fields[5]);
+        user.IC.assign(fields[6]);
+        
+        // Parse category
+        int catVal;
+        if (!parseLeadingInt(fields[7], catVal) || catVal < 0 || catVal > 4) {
+            warnings << "Warning: Invalid category on line " << lineNumber 
+                     << ": '" << fields[7] << "'. Using default LOW_RISK.\n";
+            countEvent(COUNTER_LOAD_WARNINGS);
+            user.category = LOW_RISK;
+        } else {
+            user.category = intToCategory(catVal);
+        }
+        
+        // Parse and validate date
+        if (!parseDate(fields[8], user.testDay)) {
+            warnings << "Warning: Invalid date format on line " << lineNumber 
+                     << ": '" << fields[8] << "'. Using default date.\n";
+            countEvent(COUNTER_LOAD_WARNINGS);
+            user.testDay = NO_TEST_DAY;
+        }
+    } catch (const exception& e) {
+        warnings << "Error processing line " << lineNumber << ": " << e.what() << "\n";
+        warnings << "Line: " << line << "\n";
+        countEvent(COUNTER_SKIPPED_LINES);
+        return false;
+    }
+    
+    return true;
+}
+
+// Original line-by-line loader, kept as the reference for --bench-load
+void loadUsersFromFileGetline(const string& filename, vector<User>& users)
+{
+    ifstream infile(filename);
+    if (!infile.is_open())
+    {
+        // This is not an error - it's normal if the file doesn't exist yet
+        cout << "No data file found. Starting with empty user database.\n";
+        return;
+    }
+    
+    string line;
+    int lineNumber = 0;
+    int loadedCount = 0;
+    
+    while (getline(infile, line))
+    {
+        lineNumber++;
+        
+        // Skip empty lines
+        if (line.empty() || line.find_first_not_of(' ') == string::npos)
+            continue;
+        
+        // Count the number of delimiters
+        int delimiterCount = 0;
+        for (char c : line) {
+            if (c == '|') delimiterCount++;
+        }
+        
+        // We need exactly 8 delimiters for 9 fields
+        if (delimiterCount != 8) {
+            cerr << "Warning: Line " << lineNumber << " has " << delimiterCount 
+                 << " delimiters (expected 8). Skipping.\n";
+            cerr << "Line: " << line << endl;
+            continue;
+        }
+        
+        stringstream ss(line);
+        vector<string> fields;
+        string field;
+        
+        // Split by '|'
+        while (getline(ss, field, '|')) {
+            fields.push_back(field);
+        }
+        
+        // Check if we got exactly 9 fields
+        if (fields.size() != 9) {
+            cerr << "Warning: Line " << lineNumber << " has " << fields.size() 
+                 << " fields (expected 9). Skipping.\n";
+            continue;
+        }
+        
+        try {
+            User user;
+            user.username = fields[0];
+            user.password = fields[1];
+            user.name = fields[2];
+            
+            // Parse age
+            try {
+                user.age = stoi(fields[3]);
+                if (user.age < 1 || user.age > 120) {
+                    throw out_of_range("Age out of range");
+                }
+            } catch (const exception& e) {
+                cerr << "Warning: Invalid age on line " << lineNumber 
+                     << ": '" << fields[3] << "'. Using default age 25.\n";
+                user.age = 25;
+            }
+            
+            user.address = fields[4];
+            user.phone = fields[5];
+            user.IC = fields[6];
+            
+            // Parse category
+            try {
+                int catVal = stoi(fields[7]);
+                if (catVal < 0 || catVal > 4) {
+                    throw out_of_range("Category out of range");
+                }
+                user.category = intToCategory(catVal);
+            } catch (const exception& e) {
+                cerr << "Warning: Invalid category on line " << lineNumber 
+                     << ": '" << fields[7] << "'. Using default LOW_RISK.\n";
+                user.category = LOW_RISK;
+            }
+            
+            string testdate = normalizeDateStream(fields[8]);
+            
+            // Validate date
+            if (testdate != DEFAULT_DATE && !isValidDateRegex(testdate)) {
+                cerr << "Warning: Invalid date format on line " << lineNumber 
+                     << ": '" << fields[8] << "'. Using default date.\n";
+                testdate = DEFAULT_DATE;
+            }
+            parseDate(testdate, user.testDay);
+            
+            users.push_back(user);
+            loadedCount++;
+            
+        } catch (const exception& e) {
+            cerr << "Error processing line " << lineNumber << ": " << e.what() << endl;
+            cerr << "Line: " << line << endl;
+            continue;
+        }
+    }
+    
+    infile.close();
+    
+    if (loadedCount > 0) {
+        cout << "Successfully loaded " << loadedCount << " user(s) from file." << endl;
+    } else if (lineNumber > 0) {
+        cout << "No valid user data found in file." << endl;
+    }
+}
+
+// Writes the text data file through a temporary file and rename, so a crash
+// never leaves a half-written userdata.txt behind. Sets `textStamp`, if given,
+// to the textFileStamp() of what was written.
+bool saveUsersToFile(const string& filename, const UserStore& store, bool durable, uint64_t* textStamp)
+{
+    string tempName = filename + ".tmp";
+    ofstream outfile(tempName, ios::trunc);
+    if (!outfile.is_open())
+    {
+        cerr << "Error: Could not save user data to file.\n";
+        return false;
+    }
+    
+    // Lines are gathered a block at a time, then stamped and written
+    const size_t blockBytes = 1 << 20;
+    string block;
+    block.reserve(blockBytes + 4096);
+    TextStamp stamp;
+    auto writeBlock = [&]() {
+        stamp.add(block);
+        outfile.write(block.data(), static_cast<streamsize>(block.size()));
+        block.clear();
+    };
+    store.forEach([&](UserId, const UserView& user) {
+        for (string_view field : {user.username, user.password, user.name})
+            block.append(field).push_back('|');
+        block.append(to_string(user.age)).push_back('|');
+        for (string_view field : {user.address, user.phone, user.IC})
+            block.append(field).push_back('|');
+        block.append(to_string(categoryToInt(user.category))).push_back('|');
+        char date[10];
+        formatDate(user.testDay, date);
+        block.append(date, sizeof(date)).push_back('\n');
+        if (block.size() >= blockBytes)
+            writeBlock();
+    });
+    writeBlock();
+    
+    outfile.close();
+    if (!outfile)
+    {
+        cerr << "Error: Could not save user data to file.\n";
+        return false;
+    }
+    if (textStamp)
+        *textStamp = stamp.value();
+    return replaceFile(tempName, filename, durable);
+}
+
+// Renames a fully written temporary file over `filename`. When `durable` is
+// set the data is fsynced before the rename and the directory entry after it.
+bool replaceFile(const string& tempName, const string& filename, bool durable)
+{
+#ifndef _WIN32
+    if (durable)
+    {
+        int fd = open(tempName.c_str(), O_RDONLY);
+        if (fd < 0 || fsync(fd) != 0)
+        {
+            cerr << "Error: Could not flush " << tempName << " to disk.\n";
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        close(fd);
+    }
+#endif
+    
+    error_code ec;
+    filesystem::rename(tempName, filename, ec);
+    if (ec)
+    {
+        cerr << "Error: Could not replace " << filename << ": " << ec.message() << "\n";
+        return false;
+    }
+    
+#ifndef _WIN32
+    if (durable)
+    {
+        string directory = filesystem::path(filename).parent_path().string();
+        int dirFd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+        if (dirFd >= 0)
+        {
+            fsync(dirFd);
+            close(dirFd);
+        }
+    }
+#endif
+    return true;
+}
+
+MappedFile::MappedFile(const string& filename)
+{
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void* addr = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            madvise(addr, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+            data = static_cast<const char*>(addr);
+            size = static_cast<size_t>(info.st_size);
+            mapped = true;
+            opened = true;
+        }
+    }
+    close(fd);
+    if (mapped)
+        return;
+#endif
+    
+    // Empty files, pipes and platforms without mmap are read into memory instead
+    ifstream infile(filename, ios::binary);
+    if (!infile.is_open())
+        return;
+    buffer.assign(istreambuf_iterator<char>(infile), istreambuf_iterator<char>());
+    data = buffer.data();
+    size = buffer.size();
+    opened = true;
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+    if (mapped)
+        munmap(const_cast<char*>(data), size);
+#endif
+}
+
+ThreadPool::ThreadPool(unsigned threadCount)
+{
+    for (unsigned i = 0; i < max(threadCount, 1u); i++)
+    {
+        workers.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueReady.notify_all();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    while (true)
+    {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueReady.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            task = move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
+
+// Picks the snapshot when it is newer than the text file, or as new and
+// written over that same text, so hand edits to userdata.txt are still
+// honoured, then replays any journal records
+// the base file does not already contain. Returns the last journal sequence,
+// or for a replica the sequence the base file was written at.
+uint64_t loadUserData(UserStore& store, const ProgramOptions& options)
+{
+    LatencyTimer timer(METRIC_LOAD);
+    vector<User> users;
+    error_code ec;
+    bool haveSnapshot = filesystem::exists(SNAPSHOT_FILE, ec);
+    bool haveText = filesystem::exists(DATA_FILE, ec);
+    uint64_t baseSequence = 0;
+    bool loaded = false;
+    
+    bool useSnapshot = haveSnapshot;
+    if (haveSnapshot && haveText)
+    {
+        // Timestamps can be coarse, and a copy or restore can make them equal,
+        // so a tie goes to the snapshot only if it was written over this text
+        auto snapshotTime = filesystem::last_write_time(SNAPSHOT_FILE, ec);
+        auto textTime = filesystem::last_write_time(DATA_FILE, ec);
+        useSnapshot = snapshotTime > textTime ||
+                      (snapshotTime == textTime && snapshotCoversText(SNAPSHOT_FILE, DATA_FILE));
+    }
+    if (useSnapshot)
+    {
+        loaded = loadSnapshot(SNAPSHOT_FILE, users, options.loadThreads, &baseSequence);
+        if (!loaded)
+        {
+            cerr << "Warning: Falling back to " << DATA_FILE << ".\n";
+            users.clear();
+        }
+    }
+    
+    if (!loaded)
+        loadUsersFromFile(DATA_FILE, users, options.loadThreads);
+    
+    store.assign(move(users));
+    // A replica reads the journal itself, without cutting off a record the
+    // primary is still writing
+    uint64_t lastSequence = options.replica ? baseSequence : replayJournal(JOURNAL_FILE, store, baseSequence);
+    
+    // Users of other partitions, say in data copied from before a split, are left out
+    if (options.partition.count > 1)
+    {
+        vector<UserId> others;
+        store.forEach([&](UserId id, const UserView& user) {
+            if (!options.partition.owns(user.username))
+                others.push_back(id);
+        });
+        for (UserId id : others)
+            store.remove(id);
+        if (!others.empty())
+            cout << "Left out " << others.size() << " user(s) of other partitions." << endl;
+    }
+    return lastSequence;
+}
+
+// Reads "<index>/<count>", where the count is a power of two no larger than
+// MAX_PARTITIONS
+bool parsePartition(string_view text, Partition& partition)
+{
+    auto number = [](string_view digits, uint32_t& value) {
+        if (digits.empty() || digits.size() > 9 || digits.find_first_not_of("0123456789") != string_view::npos)
+            return false;
+        value = static_cast<uint32_t>(stoul(string(digits)));
+        return true;
+    };
+    size_t slash = text.find('/');
+    Partition parsed;
+    if (slash == string_view::npos || !number(text.substr(0, slash), parsed.index) ||
+        !number(text.substr(slash + 1), parsed.count) || !has_single_bit(parsed.count) ||
+        parsed.count > MAX_PARTITIONS || parsed.index >= parsed.count)
+        return false;
+    partition = parsed;
+    return true;
+}
+
+string partitionName(const Partition& partition)
+{
+    return to_string(partition.index) + "/" + to_string(partition.count);
+}
+
+// Settles which partition the data in this directory is. PARTITION_FILE
+// records it the first time --partition is given and follows every split;
+// after that --partition must agree with it, so a restart cannot bring back
+// users that have moved away. With neither, the process holds every user.
+bool resolvePartition(ProgramOptions& options)
+{
+    ifstream file(PARTITION_FILE);
+    string text;
+    if (!file.is_open() || !(file >> text))
+        return !options.partitionGiven || savePartition(options.partition);
+    
+    Partition recorded;
+    if (!parsePartition(text, recorded))
+    {
+        cerr << "Error: " << PARTITION_FILE << " does not name a partition.\n";
+        return false;
+    }
+    if (options.partitionGiven && !(options.partition == recorded))
+    {
+        cerr << "Error: This directory holds partition " << partitionName(recorded) << ", not "
+             << partitionName(options.partition) << ".\n";
+        return false;
+    }
+    options.partition = recorded;
+    return true;
+}
+
+bool savePartition(const Partition& partition)
+{
+    string tempName = PARTITION_FILE + ".tmp";
+    {
+        ofstream out(tempName, ios::trunc);
+        out << partitionName(partition) << '\n';
+        if (!out)
+        {
+            cerr << "Error: Could not write " << tempName << ".\n";
+            return false;
+        }
+    }
+    return replaceFile(tempName, PARTITION_FILE, true);
+}
+
+const string* PartitionMap::addressOf(string_view username) const
+{
+    for (const auto& [partition, address] : entries)
+    {
+        if (partition.owns(username))
+            return &address;
+    }
+    return nullptr;
+}
+
+// Blank lines and lines starting with # are ignored. The partitions must
+// cover every hash exactly once, which is checked residue by residue modulo
+// the largest count.
+bool loadPartitionMap(const string& filename, PartitionMap& map, string& error)
+{
+    ifstream file(filename);
+    if (!file.is_open())
+    {
+        error = "could not open " + filename;
+        return false;
+    }
+    
+    PartitionMap loaded;
+    string line;
+    int lineNumber = 0;
+    uint32_t largest = 1;
+    while (getline(file, line))
+    {
+        lineNumber++;
+        istringstream fields(line);
+        string name, address, extra;
+        if (!(fields >> name) || name[0] == '#')
+            continue;
+        Partition partition;
+        if (!parsePartition(name, partition) || !(fields >> address) || (fields >> extra))
+        {
+            error = filename + " line " + to_string(lineNumber) + " is not \"<index>/<count> <socket|port>\"";
+            return false;
+        }
+        loaded.entries.emplace_back(partition, address);
+        largest = max(largest, partition.count);
+    }
+    
+    for (uint32_t residue = 0; residue < largest; residue++)
+    {
+        int covering = 0;
+        for (const auto& entry : loaded.entries)
+            covering += (residue & (entry.first.count - 1)) == entry.first.index;
+        if (covering != 1)
+        {
+            error = filename + (covering == 0 ? " leaves out" : " overlaps on") + " hashes equal to " +
+                    to_string(residue) + " modulo " + to_string(largest);
+            return false;
+        }
+    }
+    map = move(loaded);
+    return true;
+}
+
+// Through a temporary file and rename, so a router never reads half a map
+bool savePartitionMap(const string& filename, const PartitionMap& map)
+{
+    string tempName = filename + ".tmp";
+    {
+        ofstream out(tempName, ios::trunc);
+        for (const auto& [partition, address] : map.entries)
+            out << partitionName(partition) << ' ' << address << '\n';
+        if (!out)
+        {
+            cerr << "Error: Could not write " << tempName << ".\n";
+            return false;
+        }
+    }
+    return replaceFile(tempName, filename, true);
+}
+
+// Rewrites both data files. They then hold every change, so any journal left
+// behind by journal mode is no longer needed.
+bool saveUserData(const UserStore& store, bool durable, uint64_t* textStamp)
+{
+    LatencyTimer timer(METRIC_SAVE);
+    uint64_t written = 0;
+    if (!saveUsersToFile(DATA_FILE, store, durable, &written) ||
+        !saveSnapshot(SNAPSHOT_FILE, store, 0, durable, written))
+        return false;
+    if (textStamp)
+        *textStamp = written;
+    
+    error_code ec;
+    filesystem::remove(JOURNAL_FILE + ".old", ec);
+    filesystem::remove(JOURNAL_FILE, ec);
+    return true;
+}
+
+// Loads a snapshot written by saveSnapshot. Records were validated when they
+// were saved, so only the file structure is checked here.
+bool loadSnapshot(const string& filename, vector<User>& users, unsigned threadCount, uint64_t* journalSequence)
+{
+    MappedFile file(filename);
+    if (!file.isOpen())
+        return false;
+    
+    string_view contents = file.contents();
+    SnapshotHeader header = {};
+    size_t headerSize = offsetof(SnapshotHeader, journalSequence);
+    if (contents.size() < headerSize)
+    {
+        cerr << "Error: Snapshot " << filename << " is truncated.\n";
+        return false;
+    }
+    memcpy(&header, contents.data(), headerSize);
+    
+    // Version 1 snapshots stop before journalSequence, version 2 before textStamp
+    if (header.version >= 2)
+    {
+        headerSize = header.version >= 3 ? sizeof(SnapshotHeader) : offsetof(SnapshotHeader, textStamp);
+        if (contents.size() < headerSize)
+        {
+            cerr << "Error: Snapshot " << filename << " is truncated.\n";
+            return false;
+        }
+        memcpy(&header, contents.data(), headerSize);
+    }
+    
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.byteOrder != SNAPSHOT_BYTE_ORDER || header.recordSize != sizeof(SnapshotRecord))
+    {
+        cerr << "Error: " << filename << " is not a snapshot written by this program.\n";
+        return false;
+    }
+    if (header.version < 1 || header.version > SNAPSHOT_VERSION)
+    {
+        cerr << "Error: Snapshot " << filename << " has unsupported version " << header.version << ".\n";
+        return false;
+    }
+    
+    uint64_t recordBytes = header.userCount * sizeof(SnapshotRecord);
+    if (header.userCount > contents.size() / sizeof(SnapshotRecord) ||
+        contents.size() - headerSize < recordBytes ||
+        contents.size() - headerSize - recordBytes != header.heapSize)
+    {
+        cerr << "Error: Snapshot " << filename << " is truncated.\n";
+        return false;
+    }
+    
+    const char* records = contents.data() + headerSize;
+    const char* heap = records + recordBytes;
+    size_t firstUser = users.size();
+    users.resize(firstUser + header.userCount);
+    
+    // Materialises users [begin, end); returns false if a record points outside the heap
+    auto buildRange = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            SnapshotRecord record;
+            memcpy(&record, records + i * sizeof(SnapshotRecord), sizeof(record));
+            
+            uint64_t total = 0;
+            for (uint32_t length : record.lengths)
+                total += length;
+            if (record.heapOffset > header.heapSize || total > header.heapSize - record.heapOffset)
+                return false;
+            
+            User& user = users[firstUser + i];
+            string* fields[SNAPSHOT_STRING_COUNT] = {&user.username, &user.password, &user.name,
+                                                     &user.address, &user.phone, &user.IC};
+            const char* text = heap + record.heapOffset;
+            for (int f = 0; f < SNAPSHOT_STRING_COUNT; f++)
+            {
+                fields[f]->assign(text, record.lengths[f]);
+                text += record.lengths[f];
+            }
+            user.age = record.age;
+            user.category = intToCategory(record.category);
+            user.testDay = record.testDay;
+        }
+        return true;
+    };
+    
+    if (threadCount == 0)
+        threadCount = max(1u, thread::hardware_concurrency());
+    
+    bool intact = true;
+    if (threadCount == 1 || contents.size() < PARALLEL_LOAD_MIN_BYTES)
+    {
+        intact = buildRange(0, header.userCount);
+    }
+    else
+    {
+        ThreadPool pool(threadCount);
+        vector<future<bool>> parts;
+        for (unsigned t = 0; t < threadCount; t++)
+        {
+            size_t begin = header.userCount * t / threadCount;
+            size_t end = header.userCount * (t + 1) / threadCount;
+            parts.push_back(pool.submit([&buildRange, begin, end]() { return buildRange(begin, end); }));
+        }
+        for (auto& part : parts)
+            intact = part.get() && intact;
+    }
+    
+    if (!intact)
+    {
+        cerr << "Error: Snapshot " << filename << " is corrupt.\n";
+        users.resize(firstUser);
+        return false;
+    }
+    
+    if (journalSequence != nullptr)
+        *journalSequence = header.journalSequence;
+    cout << "Successfully loaded " << header.userCount << " user(s) from snapshot." << endl;
+    return true;
+}
+
+// Writes the snapshot to a temporary file and renames it into place, so a
+// crash mid-write leaves the previous snapshot intact.
+bool saveSnapshot(const string& filename, const UserStore& store, uint64_t journalSequence, bool durable,
+                  uint64_t textStamp)
+{
+    string tempName = filename + ".tmp";
+    ofstream outfile(tempName, ios::binary | ios::trunc);
+    if (!outfile.is_open())
+    {
+        cerr << "Error: Could not save snapshot to " << filename << ".\n";
+        return false;
+    }
+    
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.recordSize = sizeof(SnapshotRecord);
+    header.userCount = store.size();
+    header.journalSequence = journalSequence;
+    header.textStamp = textStamp;
+    
+    store.forEach([&header](UserId, const UserView& user) {
+        header.heapSize += user.username.size() + user.password.size() + user.name.size() +
+                           user.address.size() + user.phone.size() + user.IC.size();
+    });
+    outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    
+    // Fixed-width records first, then the strings in the same order
+    uint64_t heapOffset = 0;
+    store.forEach([&outfile, &heapOffset](UserId, const UserView& user) {
+        SnapshotRecord record = {};
+        const string_view fields[SNAPSHOT_STRING_COUNT] = {user.username, user.password, user.name,
+                                                           user.address, user.phone, user.IC};
+        record.heapOffset = heapOffset;
+        for (int f = 0; f < SNAPSHOT_STRING_COUNT; f++)
+        {
+            record.lengths[f] = static_cast<uint32_t>(fields[f].size());
+            heapOffset += fields[f].size();
+        }
+        record.testDay = user.testDay;
+        record.age = static_cast<uint8_t>(user.age);
+        record.category = static_cast<uint8_t>(categoryToInt(user.category));
+        outfile.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    });
+    
+    store.forEach([&outfile](UserId, const UserView& user) {
+        outfile << user.username << user.password << user.name
+                << user.address << user.phone << user.IC;
+    });
+    
+    outfile.close();
+    if (!outfile)
+    {
+        cerr << "Error: Could not save snapshot to " << filename << ".\n";
+        return false;
+    }
+    return replaceFile(tempName, filename, durable);
+}
+
+uint64_t TextStamp::mix(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+    return hash ^ (hash >> 29);
+}
+
+// Whole 8-byte words are mixed in as they complete, in little-endian order
+// whatever the host, so stamps match across machines
+void TextStamp::add(string_view bytes)
+{
+    size_t pos = 0;
+    while (pos < bytes.size() && size % 8 != 0)
+    {
+        partial |= uint64_t(uint8_t(bytes[pos++])) << (size % 8 * 8);
+        if (++size % 8 == 0)
+        {
+            hash = mix(hash, partial);
+            partial = 0;
+        }
+    }
+    for (; pos + 8 <= bytes.size(); pos += 8)
+    {
+        uint64_t word = 0;
+        for (int i = 0; i < 8; i++)
+            word |= uint64_t(uint8_t(bytes[pos + i])) << (i * 8);
+        hash = mix(hash, word);
+        size += 8;
+    }
+    for (; pos < bytes.size(); pos++, size++)
+        partial |= uint64_t(uint8_t(bytes[pos])) << (size % 8 * 8);
+}
+
+uint64_t TextStamp::value() const
+{
+    uint64_t stamp = mix(mix(hash, partial), size);
+    stamp = mix(stamp, stamp >> 32);
+    return stamp == 0 ? 1 : stamp;
+}
+
+// Identifies the contents of a text data file, so a snapshot can record which
+// text it holds the same users as. 0 if the file cannot be read.
+uint64_t textFileStamp(const string& filename)
+{
+    MappedFile file(filename);
+    if (!file.isOpen())
+        return 0;
+    TextStamp stamp;
+    stamp.add(file.contents());
+    return stamp.value();
+}
+
+// True if the snapshot was written together with the text file as it is now,
+// or folds in a journal begun after it
+bool snapshotCoversText(const string& snapshotFile, const string& textFile)
+{
+    ifstream infile(snapshotFile, ios::binary);
+    SnapshotHeader header = {};
+    if (!infile.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version < 3 ||
+        header.textStamp == 0)
+        return false;
+    return header.textStamp == textFileStamp(textFile);
+}
+
+// FNV-1a, used to detect torn or corrupted journal records
+uint32_t journalChecksum(uint64_t sequence, uint8_t type, string_view payload)
+{
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const void* bytes, size_t length) {
+        const unsigned char* p = static_cast<const unsigned char*>(bytes);
+        for (size_t i = 0; i < length; i++)
+        {
+            hash ^= p[i];
+            hash *= 16777619u;
+        }
+    };
+    mix(&sequence, sizeof(sequence));
+    mix(&type, sizeof(type));
+    mix(payload.data(), payload.size());
+    return hash;
+}
+
+void appendJournalField(string& payload, string_view value)
+{
+    uint32_t length = static_cast<uint32_t>(value.size());
+    payload.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    payload.append(value.data(), value.size());
+}
+
+bool readJournalField(string_view& payload, string& value)
+{
+    uint32_t length;
+    if (payload.size() < sizeof(length))
+        return false;
+    memcpy(&length, payload.data(), sizeof(length));
+    if (payload.size() - sizeof(length) < length)
+        return false;
+    value.assign(payload.data() + sizeof(length), length);
+    payload.remove_prefix(sizeof(length) + length);
+    return true;
+}
+
+// Reads the record at `pos` and moves past it. Returns false at the end of
+// the file or at a record that is torn or fails its checksum.
+bool readJournalRecord(string_view contents, size_t& pos, JournalRecordHeader& header, string_view& payload)
+{
+    if (contents.size() - pos < JOURNAL_RECORD_HEADER_SIZE)
+        return false;
+    memcpy(&header.length, contents.data() + pos, 4);
+    memcpy(&header.checksum, contents.data() + pos + 4, 4);
+    memcpy(&header.sequence, contents.data() + pos + 8, 8);
+    header.type = static_cast<uint8_t>(contents[pos + 16]);
+    
+    if (contents.size() - pos - JOURNAL_RECORD_HEADER_SIZE < header.length)
+        return false;
+    payload = contents.substr(pos + JOURNAL_RECORD_HEADER_SIZE, header.length);
+    if (journalChecksum(header.sequence, header.type, payload) != header.checksum)
+        return false;
+    pos += JOURNAL_RECORD_HEADER_SIZE + header.length;
+    return true;
+}
+
+// Little-endian base-128: seven bits per byte, high bit set on all but the last
+size_t encodeVarint(uint64_t value, uint8_t* out)
+{
+    size_t length = 0;
+    while (value >= 0x80)
+    {
+        out[length++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = static_cast<uint8_t>(value);
+    return length;
+}
+
+bool decodeVarint(const uint8_t* data, size_t size, size_t& pos, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < size; shift += 7)
+    {
+        uint8_t byte = data[pos++];
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
+size_t encodeTestEntry(const TestRecord& test, int32_t previousDay, uint8_t* out)
+{
+    int64_t delta = int64_t(test.day) - previousDay;
+    uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+    return encodeVarint(zigzag << 9 | uint64_t(test.category) << 6 | (test.answers & 63), out);
+}
+
+// Decodes the entry at `pos` and moves past it. Returns false if the entry is
+// cut short or does not hold a valid category and day.
+bool decodeTestEntry(const uint8_t* data, size_t size, size_t& pos, int32_t previousDay, TestRecord& test)
+{
+    uint64_t value;
+    if (!decodeVarint(data, size, pos, value))
+        return false;
+    
+    uint64_t zigzag = value >> 9;
+    int64_t day = previousDay + static_cast<int64_t>((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+    unsigned category = (value >> 6) & 7;
+    if (category > POSITIVE || day < INT32_MIN || day > INT32_MAX)
+        return false;
+    test.day = static_cast<int32_t>(day);
+    test.category = static_cast<Category>(category);
+    test.answers = static_cast<uint8_t>(value & 63);
+    return true;
+}
+
+// Payload of a JOURNAL_TEST_HISTORY record: the username, a varint test count
+// and the tests as chained entries, the first counting from day 0
+bool parseTestHistory(string_view payload, string& username, vector<TestRecord>& tests)
+{
+    if (!readJournalField(payload, username))
+        return false;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(payload.data());
+    size_t pos = 0;
+    uint64_t count;
+    // Every entry takes at least a byte, which bounds the count
+    if (!decodeVarint(data, payload.size(), pos, count) || count > payload.size())
+        return false;
+    
+    tests.clear();
+    int32_t day = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        TestRecord test;
+        if (!decodeTestEntry(data, payload.size(), pos, day, test))
+            return false;
+        tests.push_back(test);
+        day = test.day;
+    }
+    return pos == payload.size();
+}
+
+// Applies the records in one journal file with a sequence above
+// `afterSequence`. Returns the highest sequence seen and the byte offset just
+// past the last intact record in `validBytes`.
+uint64_t replayJournalFile(const string& filename, UserStore& store,
+                           uint64_t afterSequence, size_t& validBytes, int& applied)
+{
+    uint64_t lastSequence = afterSequence;
+    validBytes = 0;
+    
+    MappedFile file(filename);
+    if (!file.isOpen())
+        return lastSequence;
+    
+    string_view contents = file.contents();
+    size_t pos = 0;
+    JournalRecordHeader header;
+    string_view payload;
+    while (readJournalRecord(contents, pos, header, payload))
+    {
+        validBytes = pos;
+        
+        if (header.sequence <= afterSequence)
+            continue;
+        lastSequence = max(lastSequence, header.sequence);
+        
+        if (header.type == JOURNAL_PUT_USER)
+        {
+            User user;
+            if (!parseJournalUser(payload, user))
+                continue;
+            store.put(user);
+            applied++;
+        }
+        else if (header.type == JOURNAL_REMOVE_USER)
+        {
+            string username;
+            if (!readJournalField(payload, username) || !store.remove(store.find(username)))
+                continue;
+            applied++;
+        }
+        else if (header.type == JOURNAL_RENAME_USER)
+        {
+            string oldUsername, newUsername;
+            if (!readJournalField(payload, oldUsername) || !readJournalField(payload, newUsername))
+                continue;
+            
+            // Skips renames the base file already reflects
+            if (!store.rename(store.find(oldUsername), newUsername))
+                continue;
+            applied++;
+        }
+    }
+    
+    return lastSequence;
+}
+
+// Reads the payload of a JOURNAL_PUT_USER record, as Journal::stagePut wrote it
+bool parseJournalUser(string_view payload, User& user)
+{
+    uint8_t age, category;
+    int32_t testDay;
+    if (!readJournalField(payload, user.username) || !readJournalField(payload, user.password) ||
+        !readJournalField(payload, user.name) || !readJournalField(payload, user.address) ||
+        !readJournalField(payload, user.phone) || !readJournalField(payload, user.IC) ||
+        payload.size() != sizeof(age) + sizeof(category) + sizeof(testDay))
+        return false;
+    memcpy(&age, payload.data(), sizeof(age));
+    memcpy(&category, payload.data() + 1, sizeof(category));
+    memcpy(&testDay, payload.data() + 2, sizeof(testDay));
+    user.age = age;
+    user.category = intToCategory(category);
+    user.testDay = testDay;
+    return true;
+}
+
+// Replays JOURNAL_FILE.old (left by an unfinished compaction) and then the
+// active journal on top of `users`. A torn record at the end of the active
+// journal is cut off so new records are appended after the last good one.
+uint64_t replayJournal(const string& filename, UserStore& store, uint64_t afterSequence)
+{
+    error_code ec;
+    string oldName = filename + ".old";
+    if (!filesystem::exists(filename, ec) && !filesystem::exists(oldName, ec))
+        return afterSequence;
+    
+    int applied = 0;
+    size_t validBytes = 0;
+    uint64_t lastSequence = replayJournalFile(oldName, store, afterSequence, validBytes, applied);
+    lastSequence = replayJournalFile(filename, store, lastSequence, validBytes, applied);
+    
+    if (filesystem::exists(filename, ec) && filesystem::file_size(filename, ec) > validBytes)
+    {
+        cerr << "Warning: Discarding incomplete record at the end of " << filename << ".\n";
+        filesystem::resize_file(filename, validBytes, ec);
+    }
+    if (applied > 0)
+        cout << "Replayed " << applied << " change(s) from the journal." << endl;
+    
+    return lastSequence;
+}
+
+void HashIndex::clear()
+{
+    slots.clear();
+    mask = 0;
+    count = 0;
+}
+
+// Sizes the table so `records` entries fit without growing
+void HashIndex::reserve(size_t records)
+{
+    size_t capacity = 16;
+    while (capacity * 3 / 4 < records)
+        capacity *= 2;
+    if (capacity > slots.size())
+        grow(capacity);
+}
+
+void HashIndex::insert(string_view key, uint32_t record)
+{
+    if ((count + 1) * 4 > slots.size() * 3)
+        grow(max<size_t>(16, slots.size() * 2));
+    
+    uint64_t hash = hashKey(key);
+    size_t pos = hash & mask;
+    while (slots[pos].record != NOT_FOUND)
+        pos = (pos + 1) & mask;
+    slots[pos] = {hash, record};
+    count++;
+}
+
+// Removes the entry for `record`, then shifts later entries of the probe run
+// back so lookups never stop early at the hole
+bool HashIndex::erase(string_view key, uint32_t record)
+{
+    if (count == 0)
+        return false;
+    
+    uint64_t hash = hashKey(key);
+    size_t pos = hash & mask;
+    while (slots[pos].record != record)
+    {
+        if (slots[pos].record == NOT_FOUND)
+            return false;
+        pos = (pos + 1) & mask;
+    }
+    
+    size_t hole = pos;
+    for (size_t next = (hole + 1) & mask; slots[next].record != NOT_FOUND; next = (next + 1) & mask)
+    {
+        size_t home = slots[next].hash & mask;
+        // Move the entry back unless its home lies cyclically in (hole, next]
+        bool homeBetween = (hole <= next) ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!homeBetween)
+        {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+    }
+    slots[hole].record = NOT_FOUND;
+    count--;
+    return true;
+}
+
+void HashIndex::grow(size_t capacity)
+{
+    vector<Slot> old;
+    old.swap(slots);
+    slots.assign(capacity, Slot{0, NOT_FOUND});
+    mask = capacity - 1;
+    
+    for (const Slot& slot : old)
+    {
+        if (slot.record == NOT_FOUND)
+            continue;
+        size_t pos = slot.hash & mask;
+        while (slots[pos].record != NOT_FOUND)
+            pos = (pos + 1) & mask;
+        slots[pos] = slot;
+    }
+}
+
+// Copies `text` to the end of the arena. Fields longer than
+// MAX_POOLED_STRING are rejected by the loader before they get here.
+PooledString StringPool::append(string_view text)
+{
+    PooledString ref;
+    ref.offset = chars.size();
+    ref.length = min(text.size(), MAX_POOLED_STRING);
+    chars.append(text.data(), ref.length);
+    return ref;
+}
+
+PooledString StringPool::intern(string_view text)
+{
+    auto keyOf = [this](uint32_t i) { return view(interned[i]); };
+    uint32_t existing = internIndex.find(text, keyOf);
+    if (existing != HashIndex::NOT_FOUND)
+    {
+        if (internedUses[existing]++ == 0)
+            dead -= interned[existing].length;
+        return interned[existing];
+    }
+    
+    interned.push_back(append(text));
+    internedUses.push_back(1);
+    internIndex.insert(text, static_cast<uint32_t>(interned.size() - 1));
+    return interned.back();
+}
+
+// An interned string nobody uses is kept for reuse, but counts as dead
+void StringPool::releaseInterned(PooledString ref)
+{
+    uint32_t existing = internIndex.find(view(ref), [this](uint32_t i) { return view(interned[i]); });
+    if (existing != HashIndex::NOT_FOUND && internedUses[existing] > 0 && --internedUses[existing] == 0)
+        dead += ref.length;
+}
+
+void StringPool::clear()
+{
+    chars.clear();
+    interned.clear();
+    internedUses.clear();
+    internIndex.clear();
+    dead = 0;
+}
+
+size_t StringPool::memoryBytes() const
+{
+    return chars.capacity() + interned.capacity() * sizeof(PooledString) +
+           internedUses.capacity() * sizeof(uint32_t) + internIndex.memoryBytes();
+}
+
+const RoaringBitmap::Container* RoaringBitmap::findContainer(uint32_t key) const
+{
+    auto found = lower_bound(containers.begin(), containers.end(), key,
+                             [](const Container& container, uint32_t k) { return container.key < k; });
+    return (found != containers.end() && found->key == key) ? &*found : nullptr;
+}
+
+void RoaringBitmap::add(uint32_t value)
+{
+    uint16_t key = static_cast<uint16_t>(value >> 16), low = static_cast<uint16_t>(value);
+    auto container = lower_bound(containers.begin(), containers.end(), key,
+                                 [](const Container& c, uint16_t k) { return c.key < k; });
+    if (container == containers.end() || container->key != key)
+        container = containers.insert(container, Container{key, 0, {}, {}});
+    
+    if (container->bits.empty())
+    {
+        auto position = lower_bound(container->values.begin(), container->values.end(), low);
+        if (position != container->values.end() && *position == low)
+            return;
+        if (container->count < ROARING_ARRAY_MAX)
+        {
+            container->values.insert(position, low);
+            container->count++;
+            return;
+        }
+        // A full array becomes a bitset
+        container->bits.assign(CHUNK_WORDS, 0);
+        for (uint16_t existing : container->values)
+            container->bits[existing >> 6] |= uint64_t(1) << (existing & 63);
+        container->values = vector<uint16_t>();
+    }
+    uint64_t& word = container->bits[low >> 6];
+    uint64_t bit = uint64_t(1) << (low & 63);
+    if (!(word & bit))
+    {
+        word |= bit;
+        container->count++;
+    }
+}
+
+void RoaringBitmap::remove(uint32_t value)
+{
+    uint16_t key = static_cast<uint16_t>(value >> 16), low = static_cast<uint16_t>(value);
+    auto container = lower_bound(containers.begin(), containers.end(), key,
+                                 [](const Container& c, uint16_t k) { return c.key < k; });
+    if (container == containers.end() || container->key != key)
+        return;
+    
+    if (container->bits.empty())
+    {
+        auto position = lower_bound(container->values.begin(), container->values.end(), low);
+        if (position == container->values.end() || *position != low)
+            return;
+        container->values.erase(position);
+        container->count--;
+    }
+    else
+    {
+        uint64_t& word = container->bits[low >> 6];
+        uint64_t bit = uint64_t(1) << (low & 63);
+        if (!(word & bit))
+            return;
+        word &= ~bit;
+        // Back to an array only well below the limit, so a container near it
+        // does not convert on every change
+        if (--container->count <= ROARING_ARRAY_MAX / 2)
+        {
+            for (uint32_t w = 0; w < CHUNK_WORDS; w++)
+            {
+                for (uint64_t bits = container->bits[w]; bits != 0; bits &= bits - 1)
+                    container->values.push_back(static_cast<uint16_t>(w << 6 | countr_zero(bits)));
+            }
+            container->bits = vector<uint64_t>();
+        }
+    }
+    if (container->count == 0)
+        containers.erase(container);
+}
+
+bool RoaringBitmap::contains(uint32_t value) const
+{
+    const Container* container = findContainer(value >> 16);
+    if (!container)
+        return false;
+    uint16_t low = static_cast<uint16_t>(value);
+    if (!container->bits.empty())
+        return container->bits[low >> 6] >> (low & 63) & 1;
+    return binary_search(container->values.begin(), container->values.end(), low);
+}
+
+size_t RoaringBitmap::cardinality() const
+{
+    size_t total = 0;
+    for (const Container& container : containers)
+        total += container.count;
+    return total;
+}
+
+size_t RoaringBitmap::memoryBytes() const
+{
+    size_t total = containers.capacity() * sizeof(Container);
+    for (const Container& container : containers)
+        total += container.values.capacity() * sizeof(uint16_t) + container.bits.capacity() * sizeof(uint64_t);
+    return total;
+}
+
+bool RoaringBitmap::orChunk(uint32_t key, uint64_t* words) const
+{
+    const Container* container = findContainer(key);
+    if (!container)
+        return false;
+    if (!container->bits.empty())
+    {
+        for (size_t w = 0; w < CHUNK_WORDS; w++)
+            words[w] |= container->bits[w];
+    }
+    else
+    {
+        for (uint16_t low : container->values)
+            words[low >> 6] |= uint64_t(1) << (low & 63);
+    }
+    return true;
+}
+
+bool RosterFilter::matches(Category category, int age, int32_t testDay) const
+{
+    if (!(categories >> category & 1) || age < minAge || age > maxAge)
+        return false;
+    return datesOpen() || (testDay != NO_TEST_DAY && testDay >= fromDay && testDay <= toDay);
+}
+
+void RosterIndex::add(uint32_t slot, Category category, int age, int32_t testDay)
+{
+    byCategory[category].add(slot);
+    byAge[ageBucket(age)].add(slot);
+    if (testDay != NO_TEST_DAY)
+        byTestDay[dateBucket(testDay)].add(slot);
+}
+
+void RosterIndex::remove(uint32_t slot, Category category, int age, int32_t testDay)
+{
+    byCategory[category].remove(slot);
+    byAge[ageBucket(age)].remove(slot);
+    removeTestDay(slot, testDay);
+}
+
+void RosterIndex::change(uint32_t slot, Category oldCategory, int oldAge, int32_t oldTestDay, Category category,
+                         int age, int32_t testDay)
+{
+    if (oldCategory != category)
+    {
+        byCategory[oldCategory].remove(slot);
+        byCategory[category].add(slot);
+    }
+    if (ageBucket(oldAge) != ageBucket(age))
+    {
+        byAge[ageBucket(oldAge)].remove(slot);
+        byAge[ageBucket(age)].add(slot);
+    }
+    bool sameBucket = (oldTestDay == NO_TEST_DAY) == (testDay == NO_TEST_DAY) &&
+                      (testDay == NO_TEST_DAY || dateBucket(oldTestDay) == dateBucket(testDay));
+    if (!sameBucket)
+    {
+        removeTestDay(slot, oldTestDay);
+        if (testDay != NO_TEST_DAY)
+            byTestDay[dateBucket(testDay)].add(slot);
+    }
+}
+
+// Empty buckets are dropped so a date range only visits days someone tested on
+void RosterIndex::removeTestDay(uint32_t slot, int32_t testDay)
+{
+    if (testDay == NO_TEST_DAY)
+        return;
+    auto bucket = byTestDay.find(dateBucket(testDay));
+    if (bucket == byTestDay.end())
+        return;
+    bucket->second.remove(slot);
+    if (bucket->second.empty())
+        byTestDay.erase(bucket);
+}
+
+void RosterIndex::clear()
+{
+    byCategory = {};
+    byAge = {};
+    byTestDay.clear();
+}
+
+size_t RosterIndex::memoryBytes() const
+{
+    size_t total = 0;
+    for (const RoaringBitmap& bitmap : byCategory)
+        total += bitmap.memoryBytes();
+    for (const RoaringBitmap& bitmap : byAge)
+        total += bitmap.memoryBytes();
+    for (const auto& [bucket, bitmap] : byTestDay)
+        total += bitmap.memoryBytes() + sizeof(bucket) + 4 * sizeof(void*);
+    return total;
+}
+
+bool RosterIndex::candidates(const RosterFilter& filter, uint32_t key, uint64_t* words) const
+{
+    fill(words, words + RoaringBitmap::CHUNK_WORDS, 0);
+    bool any = false;
+    for (int category = 0; category < 5; category++)
+    {
+        if (filter.categories >> category & 1)
+            any = byCategory[category].orChunk(key, words) || any;
+    }
+    if (!any)
+        return false;
+    
+    // ANDs `words` with the buckets orBuckets ORs together, and reports
+    // whether anything is left
+    array<uint64_t, RoaringBitmap::CHUNK_WORDS> range;
+    auto intersect = [&](auto orBuckets) {
+        range.fill(0);
+        if (!orBuckets(range.data()))
+            return false;
+        uint64_t left = 0;
+        for (size_t w = 0; w < range.size(); w++)
+            left |= (words[w] &= range[w]);
+        return left != 0;
+    };
+    
+    if (filter.minAge > 0 || filter.maxAge < INT_MAX)
+    {
+        if (filter.minAge > filter.maxAge || filter.maxAge < 0)
+            return false;
+        int first = ageBucket(max(filter.minAge, 0)), last = ageBucket(min(filter.maxAge, 255));
+        bool left = intersect([&](uint64_t* out) {
+            bool found = false;
+            for (int bucket = first; bucket <= last; bucket++)
+                found = byAge[bucket].orChunk(key, out) || found;
+            return found;
+        });
+        if (!left)
+            return false;
+    }
+    if (!filter.datesOpen())
+    {
+        if (filter.fromDay > filter.toDay)
+            return false;
+        auto first = byTestDay.lower_bound(dateBucket(filter.fromDay));
+        auto last = byTestDay.upper_bound(dateBucket(filter.toDay));
+        bool left = intersect([&](uint64_t* out) {
+            bool found = false;
+            for (auto bucket = first; bucket != last; ++bucket)
+                found = bucket->second.orChunk(key, out) || found;
+            return found;
+        });
+        if (!left)
+            return false;
+    }
+    return true;
+}
+
+// Replaces the store with freshly loaded users and rebuilds the index. Only
+// the first of several users with the same username can log in, as before;
+// the others are kept so they are saved again.
+void UserStore::assign(vector<User> loaded, bool warnDuplicates)
+{
+    hot.clear();
+    cold.clear();
+    icLinks.clear();
+    phoneLinks.clear();
+    slotCount = 0;
+    freeSlots.clear();
+    liveCount = 0;
+    strings.clear();
+    usernameIndex.clear();
+    usernameIndex.reserve(loaded.size());
+    icIndex.clear();
+    icIndex.reserve(loaded.size());
+    phoneIndex.clear();
+    phoneIndex.reserve(loaded.size());
+    stats = CategoryStats();
+    roster.clear();
+    
+    size_t uniqueBytes = 0;
+    for (const auto& user : loaded)
+        uniqueBytes += user.username.size() + user.password.size() + user.phone.size() + user.IC.size();
+    strings.reserve(uniqueBytes);
+    
+    for (const auto& user : loaded)
+    {
+        if (contains(user.username))
+        {
+            if (warnDuplicates)
+                cerr << "Warning: Duplicate username '" << user.username << "'. Only the first can log in.\n";
+            uint32_t slot = allocateSlot();
+            storeSlot(slot, user);
+            liveCount++;
+            continue;
+        }
+        add(user);
+    }
+}
+
+UserId UserStore::find(string_view username) const
+{
+    uint32_t slot = usernameIndex.find(username, [this](uint32_t s) { return usernameOf(s); });
+    if (slot == HashIndex::NOT_FOUND)
+        return UserId();
+    return UserId{slot, hot[slot].generation};
+}
+
+// False for a default UserId or one whose user has been removed
+bool UserStore::valid(UserId id) const
+{
+    return id.slot < slotCount && hot[id.slot].live && hot[id.slot].generation == id.generation;
+}
+
+// Handle of the user in `slot`, or an invalid id if the slot is free
+UserId UserStore::idAt(uint32_t slot) const
+{
+    if (slot >= slotCount || !hot[slot].live)
+        return UserId();
+    return UserId{slot, hot[slot].generation};
+}
+
+// The caller must have checked that `id` is valid
+UserView UserStore::view(UserId id) const
+{
+    return viewSlot(id.slot);
+}
+
+// Copies the user out into `user` for editing; write it back with update()
+bool UserStore::get(UserId id, User& user) const
+{
+    if (!valid(id))
+        return false;
+    
+    UserView stored = viewSlot(id.slot);
+    user.username.assign(stored.username);
+    user.password.assign(stored.password);
+    user.name.assign(stored.name);
+    user.age = stored.age;
+    user.address.assign(stored.address);
+    user.phone.assign(stored.phone);
+    user.IC.assign(stored.IC);
+    user.category = stored.category;
+    user.testDay = stored.testDay;
+    return true;
+}
+
+// Adds a user whose username the caller has checked is free
+UserId UserStore::add(const User& user)
+{
+    uint32_t slot = allocateSlot();
+    storeSlot(slot, user);
+    liveCount++;
+    usernameIndex.insert(user.username, slot);
+    return UserId{slot, hot[slot].generation};
+}
+
+// Adds the user, or replaces the existing user with the same username
+UserId UserStore::put(const User& user)
+{
+    UserId id = find(user.username);
+    if (!valid(id))
+        return add(user);
+    storeSlot(id.slot, user);
+    return id;
+}
+
+// Overwrites every field. Returns false for a stale id or when the user's
+// username has changed to one another user already has.
+bool UserStore::update(UserId id, const User& user)
+{
+    if (!valid(id) || !rename(id, user.username))
+        return false;
+    storeSlot(id.slot, user);
+    return true;
+}
+
+// Returns false for a stale id or when another user already has `newUsername`
+bool UserStore::rename(UserId id, const string& newUsername)
+{
+    if (!valid(id))
+        return false;
+    
+    uint32_t holder = usernameIndex.find(newUsername, [this](uint32_t s) { return usernameOf(s); });
+    if (holder == id.slot)
+        return true;
+    if (holder != HashIndex::NOT_FOUND)
+        return false;
+    
+    usernameIndex.erase(usernameOf(id.slot), id.slot);
+    strings.release(cold[id.slot].username);
+    cold[id.slot].username = strings.append(newUsername);
+    usernameIndex.insert(newUsername, id.slot);
+    compactStringsIfNeeded();
+    return true;
+}
+
+bool UserStore::setCategory(UserId id, Category category)
+{
+    if (!valid(id))
+        return false;
+    HotRecord& record = hot[id.slot];
+    stats.count(record.category, record.age, record.testDay, -1);
+    roster.change(id.slot, record.category, record.age, record.testDay, category, record.age, record.testDay);
+    record.category = category;
+    stats.count(record.category, record.age, record.testDay, 1);
+    return true;
+}
+
+// Frees the user's slot for reuse. Every existing id for it stops resolving.
+bool UserStore::remove(UserId id)
+{
+    if (!valid(id))
+        return false;
+    
+    usernameIndex.erase(usernameOf(id.slot), id.slot);
+    indexIdentity(id.slot, false);
+    HotRecord& record = hot[id.slot];
+    stats.count(record.category, record.age, record.testDay, -1);
+    roster.remove(id.slot, record.category, record.age, record.testDay);
+    record.live = false;
+    hot[id.slot].generation++;
+    freeSlots.push_back(id.slot);
+    liveCount--;
+    
+    ColdRecord& profile = cold[id.slot];
+    for (PooledString field : {profile.username, profile.password, profile.phone, profile.IC})
+        strings.release(field);
+    strings.releaseInterned(profile.name);
+    strings.releaseInterned(profile.address);
+    profile = ColdRecord{};
+    compactStringsIfNeeded();
+    return true;
+}
+
+// Copies the strings live users refer to into a fresh pool once more than
+// half the pool is dead, so stores that live as long as the server stay
+// bounded however often users rename or change their details
+void UserStore::compactStringsIfNeeded()
+{
+    if (strings.deadBytes() < STRING_POOL_MIN_DEAD || strings.deadBytes() * 2 < strings.size())
+        return;
+    
+    StringPool fresh;
+    fresh.reserve(strings.size() - strings.deadBytes());
+    for (uint32_t slot = 0; slot < slotCount; slot++)
+    {
+        ColdRecord& profile = cold[slot];
+        if (!hot[slot].live)
+            continue;
+        for (PooledString* field : {&profile.username, &profile.password, &profile.phone, &profile.IC})
+            *field = fresh.append(strings.view(*field));
+        profile.name = fresh.intern(strings.view(profile.name));
+        profile.address = fresh.intern(strings.view(profile.address));
+    }
+    strings = move(fresh);
+}
+
+// Counts every live user from scratch, to check the maintained counters
+CategoryStats UserStore::recountStatistics() const
+{
+    CategoryStats counted;
+    forEach([&](UserId, const UserView& user) {
+        counted.count(user.category, user.age, user.testDay, 1);
+    });
+    return counted;
+}
+
+void CategoryStats::count(Category category, int age, int32_t testDay, int64_t delta)
+{
+    int band = AGE_BANDS - 1;
+    while (band > 0 && age < AGE_BAND_STARTS[band])
+        band--;
+    byCategory[category] += delta;
+    byAgeBand[band][category] += delta;
+    if (category == POSITIVE)
+    {
+        auto day = positivesByDay.try_emplace(testDay, 0).first;
+        day->second += delta;
+        if (day->second == 0)
+            positivesByDay.erase(day);
+    }
+}
+
+void CategoryStats::merge(const CategoryStats& other)
+{
+    for (int category = 0; category < 5; category++)
+    {
+        byCategory[category] += other.byCategory[category];
+        for (int band = 0; band < AGE_BANDS; band++)
+            byAgeBand[band][category] += other.byAgeBand[band][category];
+    }
+    for (const auto& [day, positives] : other.positivesByDay)
+        positivesByDay[day] += positives;
+}
+
+StoreMemoryUsage UserStore::memoryUsage() const
+{
+    StoreMemoryUsage usage;
+    usage.hotRecords = hot.memoryBytes() + freeSlots.capacity() * sizeof(uint32_t);
+    usage.coldRecords = cold.memoryBytes();
+    usage.strings = strings.memoryBytes();
+    usage.deadStrings = strings.deadBytes();
+    usage.usernameIndex = usernameIndex.memoryBytes();
+    usage.identityIndexes = icIndex.memoryBytes() + phoneIndex.memoryBytes() + icLinks.memoryBytes() +
+                            phoneLinks.memoryBytes();
+    usage.rosterIndex = roster.memoryBytes();
+    return usage;
+}
+
+UserView UserStore::viewSlot(uint32_t slot) const
+{
+    const HotRecord& record = hot[slot];
+    const ColdRecord& profile = cold[slot];
+    return UserView{strings.view(profile.username), strings.view(profile.password),
+                    strings.view(profile.name), strings.view(profile.address),
+                    strings.view(profile.phone), strings.view(profile.IC),
+                    record.age, record.category, record.testDay};
+}
+
+// Writes every field of `user` into the slot and marks it live. Names and
+// addresses are interned; the other strings are mostly unique per user.
+void UserStore::storeSlot(uint32_t slot, const User& user)
+{
+    HotRecord& record = hot[slot];
+    ColdRecord& profile = cold[slot];
+    
+    // Rewriting a live user keeps the strings that did not change, and the
+    // IC and phone index entries unless either number changed
+    bool rewriting = record.live;
+    bool identityChanged = !rewriting || strings.view(profile.IC) != user.IC || strings.view(profile.phone) != user.phone;
+    if (rewriting)
+        stats.count(record.category, record.age, record.testDay, -1);
+    if (rewriting && identityChanged)
+        indexIdentity(slot, false);
+    auto appendChanged = [&](PooledString current, const string& text) {
+        if (rewriting && strings.view(current) == text)
+            return current;
+        if (rewriting)
+            strings.release(current);
+        return strings.append(text);
+    };
+    
+    uint8_t age = static_cast<uint8_t>(user.age);
+    if (rewriting)
+        roster.change(slot, record.category, record.age, record.testDay, user.category, age, user.testDay);
+    else
+        roster.add(slot, user.category, age, user.testDay);
+    record.testDay = user.testDay;
+    record.category = user.category;
+    record.age = age;
+    record.live = true;
+    stats.count(record.category, record.age, record.testDay, 1);
+    
+    profile.username = appendChanged(profile.username, user.username);
+    profile.password = appendChanged(profile.password, user.password);
+    PooledString name = strings.intern(user.name);
+    PooledString address = strings.intern(user.address);
+    if (rewriting)
+    {
+        strings.releaseInterned(profile.name);
+        strings.releaseInterned(profile.address);
+    }
+    profile.name = name;
+    profile.address = address;
+    profile.phone = appendChanged(profile.phone, user.phone);
+    profile.IC = appendChanged(profile.IC, user.IC);
+    if (identityChanged)
+        indexIdentity(slot, true);
+    compactStringsIfNeeded();
+}
+
+// Adds the slot's IC and phone number to their indexes, or takes them out.
+// Empty numbers are not indexed.
+void UserStore::indexIdentity(uint32_t slot, bool add)
+{
+    linkIdentity(icIndex, icLinks, &ColdRecord::IC, slot, add);
+    linkIdentity(phoneIndex, phoneLinks, &ColdRecord::phone, slot, add);
+}
+
+// The index holds the first slot with each number and the others follow it
+// round the circle, so adding or removing a user is one probe whatever the
+// number of users sharing it
+void UserStore::linkIdentity(HashIndex& index, ChunkedArray<IdentityLinks>& links, PooledString ColdRecord::*field,
+                             uint32_t slot, bool add)
+{
+    string_view key = strings.view(cold[slot].*field);
+    if (key.empty())
+        return;
+    auto keyOf = [this, field](uint32_t s) { return strings.view(cold[s].*field); };
+    
+    if (add)
+    {
+        uint32_t first = index.findOrInsert(key, slot, keyOf);
+        if (first == HashIndex::NOT_FOUND)
+        {
+            links[slot] = {slot, slot};
+            return;
+        }
+        uint32_t last = links[first].previous;
+        links[slot] = {first, last};
+        links[last].next = slot;
+        links[first].previous = slot;
+        return;
+    }
+    
+    uint32_t first = index.find(key, keyOf);
+    IdentityLinks removed = links[slot];
+    if (removed.next != slot)
+    {
+        links[removed.previous].next = removed.next;
+        links[removed.next].previous = removed.previous;
+    }
+    if (first == slot)
+    {
+        index.erase(key, slot);
+        if (removed.next != slot)
+            index.insert(key, removed.next);
+    }
+}
+
+// Reuses a freed slot, or takes the next one, adding a chunk to both arrays
+// when the last is full. Existing chunks never move.
+uint32_t UserStore::allocateSlot()
+{
+    if (!freeSlots.empty())
+    {
+        uint32_t slot = freeSlots.back();
+        freeSlots.pop_back();
+        return slot;
+    }
+    if (slotCount == hot.capacity())
+    {
+        hot.grow();
+        cold.grow();
+        icLinks.grow();
+        phoneLinks.grow();
+    }
+    return slotCount++;
+}
+
+Journal::~Journal()
+{
+    close();
+}
+
+bool Journal::open(const string& journalFile, uint64_t lastSequence)
+{
+    filename = journalFile;
+    nextSequence = lastSequence + 1;
+#ifdef _WIN32
+    fd = _open(filename.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    fd = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+#endif
+    if (fd < 0)
+    {
+        cerr << "Error: Could not open journal " << filename << ".\n";
+        return false;
+    }
+    
+    error_code ec;
+    activeBytes = filesystem::file_size(filename, ec);
+    return true;
+}
+
+void Journal::close()
+{
+    if (fd < 0)
+        return;
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+    fd = -1;
+}
+
+void Journal::stagePut(const User& user)
+{
+    string payload;
+    appendJournalField(payload, user.username);
+    appendJournalField(payload, user.password);
+    appendJournalField(payload, user.name);
+    appendJournalField(payload, user.address);
+    appendJournalField(payload, user.phone);
+    appendJournalField(payload, user.IC);
+    
+    uint8_t age = static_cast<uint8_t>(user.age);
+    uint8_t category = static_cast<uint8_t>(categoryToInt(user.category));
+    int32_t testDay = user.testDay;
+    payload.append(reinterpret_cast<const char*>(&age), sizeof(age));
+    payload.append(reinterpret_cast<const char*>(&category), sizeof(category));
+    payload.append(reinterpret_cast<const char*>(&testDay), sizeof(testDay));
+    
+    stage(JOURNAL_PUT_USER, payload);
+}
+
+void Journal::stageRename(const string& oldUsername, const string& newUsername)
+{
+    string payload;
+    appendJournalField(payload, oldUsername);
+    appendJournalField(payload, newUsername);
+    stage(JOURNAL_RENAME_USER, payload);
+}
+
+void Journal::stageTests(string_view username, span<const TestRecord> tests)
+{
+    string payload;
+    appendJournalField(payload, username);
+    uint8_t entry[MAX_TEST_ENTRY_BYTES];
+    payload.append(reinterpret_cast<const char*>(entry), encodeVarint(tests.size(), entry));
+    int32_t day = 0;
+    for (const TestRecord& test : tests)
+    {
+        payload.append(reinterpret_cast<const char*>(entry), encodeTestEntry(test, day, entry));
+        day = test.day;
+    }
+    stage(JOURNAL_TEST_HISTORY, payload);
+}
+
+void Journal::stageContact(string_view username, string_view contact, int32_t day)
+{
+    string payload;
+    appendJournalField(payload, username);
+    appendJournalField(payload, contact);
+    payload.append(reinterpret_cast<const char*>(&day), sizeof(day));
+    stage(JOURNAL_CONTACT, payload);
+}
+
+void Journal::stageRemove(string_view username)
+{
+    string payload;
+    appendJournalField(payload, username);
+    stage(JOURNAL_REMOVE_USER, payload);
+}
+
+void Journal::stage(JournalRecordType type, const string& payload)
+{
+    uint64_t sequence = pinned ? pinnedSequence : nextSequence++;
+    uint8_t typeByte = type;
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    uint32_t checksum = journalChecksum(sequence, typeByte, payload);
+    
+    pending.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    pending.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+    pending.append(reinterpret_cast<const char*>(&sequence), sizeof(sequence));
+    pending.append(reinterpret_cast<const char*>(&typeByte), sizeof(typeByte));
+    pending += payload;
+}
+
+// Writes every staged record. A short write leaves a torn record that the
+// next replay discards, so the batch is all-or-nothing from replay's view
+// except for records already complete on disk.
+bool Journal::writeStaged()
+{
+    if (cutFailed)
+        return false;
+    size_t written = 0;
+    while (written < pending.size())
+    {
+#ifdef _WIN32
+        int result = _write(fd, pending.data() + written, static_cast<unsigned>(pending.size() - written));
+#else
+        ssize_t result = ::write(fd, pending.data() + written, pending.size() - written);
+#endif
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+        {
+            cerr << "Error: Could not write to journal " << filename << ".\n";
+            break;
+        }
+        written += static_cast<size_t>(result);
+    }
+    
+    if (written == pending.size())
+    {
+        activeBytes += written;
+        pending.clear();
+        return true;
+    }
+    
+    // Records after a torn one would never be replayed
+    if (written > 0)
+    {
+#ifdef _WIN32
+        cutFailed = _chsize_s(fd, static_cast<__int64>(activeBytes)) != 0;
+#else
+        cutFailed = ftruncate(fd, static_cast<off_t>(activeBytes)) != 0;
+#endif
+        if (cutFailed)
+            cerr << "Error: Could not remove a partly written record from " << filename << ".\n";
+    }
+    return false;
+}
+
+bool Journal::sync()
+{
+#ifdef _WIN32
+    return _commit(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+bool Journal::lock()
+{
+#ifdef _WIN32
+    return true;
+#else
+    return flock(fd, LOCK_EX | LOCK_NB) == 0;
+#endif
+}
+
+// Moves the active journal to JOURNAL_FILE.old and starts a new one. If an
+// earlier compaction never removed the old file the active journal is kept;
+// the next snapshot covers both.
+bool Journal::rotate()
+{
+    error_code ec;
+    string oldName = filename + ".old";
+    if (filesystem::exists(oldName, ec))
+        return true;
+    
+    close();
+    filesystem::rename(filename, oldName, ec);
+    activeBytes = 0;
+    return open(filename, nextSequence - 1);
+}
+
+PersistenceWriter::PersistenceWriter(const ProgramOptions& options, const UserStore& store, uint64_t lastSequence)
+    : mode(options.persistence),
+      fsyncPolicy(options.fsyncPolicy),
+      fsyncInterval(options.fsyncIntervalMs),
+      startSequence(lastSequence),
+      shadow(store)
+{
+}
+
+PersistenceWriter::~PersistenceWriter()
+{
+    close();
+}
+
+// Opens the files the writer appends to and starts its thread. The history
+// file must already have been loaded, since loading may replace it.
+bool PersistenceWriter::start()
+{
+    if (mode == PERSIST_JOURNAL && !journal.open(JOURNAL_FILE, startSequence))
+        return false;
+    // History records are applied in file order; in journal mode each takes
+    // the sequence of its change's journal record, for replicas
+    if (!history.open(HISTORY_FILE, 0))
+        return false;
+    if (!history.lock())
+    {
+        cerr << "Error: Another process is already writing " << HISTORY_FILE << " in this directory.\n";
+        return false;
+    }
+    
+    lastSync = chrono::steady_clock::now();
+    writer = thread([this]() { writerLoop(); });
+    return true;
+}
+
+// Queues a copy of the changed user, and the test that changed it and the
+// contacts it named if there are any; returns without touching the disk
+void PersistenceWriter::userChanged(const User& user, const string& previousUsername, const TestRecord* test,
+                                    span<const string> contacts)
+{
+    {
+        lock_guard<mutex> lock(queueMutex);
+        queued.push_back({user, previousUsername, test != nullptr, test ? *test : TestRecord{},
+                          vector<string>(contacts.begin(), contacts.end())});
+        queuedCount++;
+    }
+    queueReady.notify_one();
+}
+
+// Queues contacts the user met on `day` that came without a test of this
+// run, such as those moved in from another partition
+void PersistenceWriter::contactsAdded(const User& user, int32_t day, span<const string> contacts)
+{
+    {
+        lock_guard<mutex> lock(queueMutex);
+        queued.push_back({user, user.username, false, TestRecord{day, 0, user.category},
+                          vector<string>(contacts.begin(), contacts.end())});
+        queuedCount++;
+    }
+    queueReady.notify_one();
+}
+
+// Queues the removal of a user who has moved to another partition
+void PersistenceWriter::userRemoved(const string& username)
+{
+    {
+        lock_guard<mutex> lock(queueMutex);
+        UserChange change;
+        change.user.username = username;
+        change.previousUsername = username;
+        change.removed = true;
+        queued.push_back(move(change));
+        queuedCount++;
+    }
+    queueReady.notify_one();
+}
+
+// Waits until every change queued so far has been committed. Returns false
+// if the writer has given up on them.
+bool PersistenceWriter::flush()
+{
+    unique_lock<mutex> lock(queueMutex);
+    uint64_t target = queuedCount;
+    queueReady.notify_one();
+    batchCommitted.wait(lock, [&]() { return committedCount >= target || failed || !writer.joinable(); });
+    return committedCount >= target;
+}
+
+// Commits everything queued so far, then stops the writer and any compaction.
+// Returns false if the writer gave up on some of the changes.
+bool PersistenceWriter::close()
+{
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (stopping)
+            return committedCount >= queuedCount;
+        stopping = true;
+    }
+    queueReady.notify_one();
+    if (writer.joinable())
+        writer.join();
+    if (compactor.joinable())
+        compactor.join();
+    journal.close();
+    history.close();
+    lock_guard<mutex> lock(queueMutex);
+    return committedCount >= queuedCount;
+}
+
+void PersistenceWriter::writerLoop()
+{
+    unique_lock<mutex> lock(queueMutex);
+    uint64_t unwritten = 0;     // Changes staged but not yet on disk
+    int attempts = 0;           // Failed writes of them in a row
+    while (true)
+    {
+        // Changes that failed to write are retried without waiting for more
+        if (queued.empty() && !stopping && unwritten == 0)
+        {
+            if (unsynced && fsyncPolicy == FSYNC_INTERVAL)
+                queueReady.wait_until(lock, lastSync + fsyncInterval);
+            else
+                queueReady.wait(lock, [this]() { return stopping || !queued.empty(); });
+        }
+        
+        // In rewrite mode the interval spaces out full rewrites, so more
+        // changes can join the batch
+        if (mode == PERSIST_REWRITE && fsyncPolicy == FSYNC_INTERVAL && !stopping && !queued.empty())
+            queueReady.wait_until(lock, lastSync + fsyncInterval, [this]() { return stopping; });
+        
+        vector<UserChange> batch;
+        batch.swap(queued);
+        bool finished = stopping;
+        bool givenUp = failed;
+        lock.unlock();
+        
+        // A batch only counts as committed once all of its records are on
+        // disk. Until then it stays staged and is written again a little later.
+        uint64_t written = 0;
+        if (!givenUp)
+        {
+            if (!batch.empty())
+                stage(batch);
+            unwritten += batch.size();
+            if (unwritten > 0 && writeStaged())
+            {
+                written = exchange(unwritten, 0);
+                attempts = 0;
+            }
+            else if (unwritten > 0 && (++attempts >= WRITE_ATTEMPTS || journal.broken() || history.broken()))
+            {
+                cerr << "Error: " << unwritten << " change(s) could not be saved. No further changes will be "
+                     << "saved until the program is restarted.\n";
+                givenUp = true;
+            }
+            else if (unwritten > 0)
+            {
+                this_thread::sleep_for(chrono::milliseconds(WRITE_RETRY_MS));
+            }
+        }
+        if (unsynced && (finished || chrono::steady_clock::now() - lastSync >= fsyncInterval))
+            syncJournal();
+        
+        lock.lock();
+        committedCount += written;
+        failed = givenUp;
+        batchCommitted.notify_all();
+        if (finished && queued.empty() && (unwritten == 0 || failed))
+            return;
+    }
+}
+
+// Applies the batch to the shadow copy and stages its records
+void PersistenceWriter::stage(vector<UserChange>& batch)
+{
+    for (const auto& change : batch)
+    {
+        applyToShadow(change);
+        if (change.removed)
+        {
+            if (mode == PERSIST_JOURNAL)
+                journal.stageRemove(change.user.username);
+            continue;
+        }
+        bool renamed = (change.previousUsername != change.user.username);
+        if (mode == PERSIST_JOURNAL)
+            history.pinSequence(journal.lastSequence() + (renamed ? 2 : 1));
+        if (renamed)
+            history.stageRename(change.previousUsername, change.user.username);
+        if (change.tested)
+            history.stageTests(change.user.username, span<const TestRecord>(&change.test, 1));
+        for (const string& contact : change.contacts)
+            history.stageContact(change.user.username, contact, change.test.day);
+        if (mode == PERSIST_JOURNAL)
+        {
+            if (renamed)
+                journal.stageRename(change.previousUsername, change.user.username);
+            journal.stagePut(change.user);
+        }
+    }
+}
+
+// Writes whatever is staged, the history first since its records come before
+// their change's journal records. Each file keeps what it could not write.
+bool PersistenceWriter::writeStaged()
+{
+    if (!history.writeStaged())
+        return false;
+    
+    if (mode == PERSIST_REWRITE)
+    {
+        if (!saveUserData(shadow, fsyncPolicy != FSYNC_NONE, &dataFileStamp))
+            return false;
+        if (fsyncPolicy != FSYNC_NONE && !history.sync())
+            cerr << "Error: Could not flush " << HISTORY_FILE << " to disk.\n";
+        lastSync = chrono::steady_clock::now();
+        return true;
+    }
+    
+    if (!journal.writeStaged())
+        return false;
+    if (fsyncPolicy == FSYNC_COMMIT)
+        syncJournal();
+    else if (fsyncPolicy == FSYNC_INTERVAL)
+        unsynced = true;
+    
+    compactIfNeeded();
+    return true;
+}
+
+void PersistenceWriter::applyToShadow(const UserChange& change)
+{
+    if (change.removed)
+    {
+        shadow.remove(shadow.find(change.user.username));
+        return;
+    }
+    if (change.previousUsername != change.user.username)
+        shadow.rename(shadow.find(change.previousUsername), change.user.username);
+    shadow.put(change.user);
+}
+
+void PersistenceWriter::syncJournal()
+{
+    if (!journal.sync() || !history.sync())
+        cerr << "Error: Could not flush the journal to disk.\n";
+    unsynced = false;
+    lastSync = chrono::steady_clock::now();
+}
+
+// Rotates the journal and writes a snapshot of the shadow copy on a separate
+// thread. The snapshot records the last rotated sequence, so a crash before
+// JOURNAL_FILE.old is removed only causes already-applied records to be skipped.
+void PersistenceWriter::compactIfNeeded()
+{
+    if (journal.size() < JOURNAL_COMPACT_BYTES || compacting)
+        return;
+    if (compactor.joinable())
+        compactor.join();
+    
+    if (unsynced)
+        syncJournal();
+    if (!journal.rotate())
+        return;
+    
+    uint64_t sequence = journal.lastSequence();
+    bool durable = (fsyncPolicy != FSYNC_NONE);
+    // The text file is left as it was, so it is read only for the first stamp
+    if (dataFileStamp == 0)
+        dataFileStamp = textFileStamp(DATA_FILE);
+    compacting = true;
+    compactor = thread([this, snapshotUsers = shadow, sequence, durable, textStamp = dataFileStamp]() {
+        // The snapshot and journal supersede the text file
+        if (saveSnapshot(SNAPSHOT_FILE, snapshotUsers, sequence, durable, textStamp))
+        {
+            error_code ec;
+            filesystem::remove(JOURNAL_FILE + ".old", ec);
+        }
+        compacting = false;
+    });
+}
+
+void TimerWheel::schedule(int32_t dueDay, const Timer& timer)
+{
+    if (dueDay < nextDay)
+        overdue.push_back(timer);
+    else if (dueDay < nextDay + WHEEL_DAYS)
+        buckets[bucketOf(dueDay)].push_back(timer);
+    else
+        later.push({dueDay, timer});
+    count++;
+}
+
+// Sets timers for every loaded user. Tests old enough to be due already fire
+// on the first advanceTo().
+void HealthScheduler::rebuild(const UserStore& store)
+{
+    store.forEach([this](UserId id, const UserView& user) {
+        userChanged(id, user);
+    });
+}
+
+// Sets timers for a user who has just been added or changed. A reminder is
+// not set again while one for the same test is still live.
+void HealthScheduler::userChanged(UserId id, const UserView& user)
+{
+    if (user.testDay == NO_TEST_DAY)
+        return;
+    if (id.slot >= reminderDays.size())
+        reminderDays.resize(max<size_t>(id.slot + 1, reminderDays.size() * 2), NO_TEST_DAY);
+    if (reminderDays[id.slot] != user.testDay)
+        scheduleReminder(id, user.testDay);
+    if (user.category == POSITIVE)
+        scheduleQuarantineEnd(id, user.testDay);
+}
+
+void HealthScheduler::advanceTo(int32_t today, UserStore& store, const function<void(UserId)>& onRelease,
+                                const function<void(UserId)>& onReminder)
+{
+    wheel.advanceTo(today, [&](const Timer& timer) {
+        if (!store.valid(timer.id))
+            return;
+        UserView user = store.view(timer.id);
+        if (user.testDay != timer.testDay)
+            return;
+        
+        if (timer.kind == TIMER_QUARANTINE_END)
+        {
+            if (user.category != POSITIVE)
+                return;
+            store.setCategory(timer.id, LOW_RISK);
+            if (onRelease)
+                onRelease(timer.id);
+        }
+        else if (reminderDays[timer.id.slot] == timer.testDay)
+        {
+            reminderDays[timer.id.slot] = NO_TEST_DAY;
+            if (onReminder)
+                onReminder(timer.id);
+        }
+    });
+}
+
+void HealthScheduler::scheduleReminder(UserId id, int32_t testDay)
+{
+    reminderDays[id.slot] = testDay;
+    wheel.schedule(testDay + currentPolicy()->testReminderDays, Timer{id, testDay, TIMER_TEST_REMINDER});
+}
+
+void HealthScheduler::scheduleQuarantineEnd(UserId id, int32_t testDay)
+{
+    wheel.schedule(testDay + currentPolicy()->quarantineDays, Timer{id, testDay, TIMER_QUARANTINE_END});
+}
+
+// Forgets the slot's reminder so a user who later reuses the slot gets one
+void HealthScheduler::userRemoved(UserId id)
+{
+    if (id.slot < reminderDays.size())
+        reminderDays[id.slot] = NO_TEST_DAY;
+}
+
+void TestHistory::append(uint32_t slot, const TestRecord& test)
+{
+    if (slot >= chains.size())
+        chains.resize(max<size_t>(slot + 1, chains.size() * 2));
+    Chain& chain = chains[slot];
+    
+    // A new block starts counting from day 0 again
+    uint8_t entry[MAX_TEST_ENTRY_BYTES];
+    size_t length = 0;
+    if (chain.tail != NO_BLOCK)
+        length = encodeTestEntry(test, chain.lastDay, entry);
+    if (chain.tail == NO_BLOCK || blocks[chain.tail].used + length > BLOCK_BYTES)
+    {
+        uint32_t block = allocateBlock();
+        if (chain.tail == NO_BLOCK)
+            chain.head = block;
+        else
+            blocks[chain.tail].next = block;
+        chain.tail = block;
+        length = encodeTestEntry(test, 0, entry);
+    }
+    
+    if (chain.count == 0 || periodOf(test.day) != periodOf(chain.lastDay))
+        periods[periodOf(test.day)].push_back({slot, chain.tail});
+    if (chain.count > 0 && test.day < chain.lastDay)
+        chain.inOrder = false;
+    
+    Block& tail = blocks[chain.tail];
+    memcpy(tail.bytes + tail.used, entry, length);
+    tail.used = static_cast<uint8_t>(tail.used + length);
+    chain.lastDay = test.day;
+    chain.count++;
+    testCount++;
+    entryBytes += length;
+}
+
+// Forgets the slots' tests, for users who have left the store. Drops the
+// slots from the index periods they were tested in, which costs a pass over
+// each, so users leaving together are best removed in one call.
+void TestHistory::remove(span<const uint32_t> slots)
+{
+    vector<uint32_t> removed;
+    vector<int32_t> tested;
+    for (uint32_t slot : slots)
+    {
+        if (slot >= chains.size() || chains[slot].count == 0)
+            continue;
+        removed.push_back(slot);
+        forEach(slot, INT32_MIN, INT32_MAX, [&](const TestRecord& test) { tested.push_back(periodOf(test.day)); });
+    }
+    sort(removed.begin(), removed.end());
+    sort(tested.begin(), tested.end());
+    tested.erase(unique(tested.begin(), tested.end()), tested.end());
+    for (int32_t period : tested)
+    {
+        auto found = periods.find(period);
+        if (found == periods.end())
+            continue;
+        erase_if(found->second, [&](const PeriodStart& start) {
+            return binary_search(removed.begin(), removed.end(), start.slot);
+        });
+        if (found->second.empty())
+            periods.erase(found);
+    }
+    
+    for (uint32_t slot : removed)
+    {
+        Chain& chain = chains[slot];
+        for (uint32_t block = chain.head; block != NO_BLOCK;)
+        {
+            Block& freed = blocks[block];
+            uint32_t next = freed.next;
+            entryBytes -= freed.used;
+            freed.next = freeBlock;
+            freeBlock = block;
+            block = next;
+        }
+        testCount -= chain.count;
+        chain = Chain();
+    }
+}
+
+uint32_t TestHistory::allocateBlock()
+{
+    uint32_t block = freeBlock;
+    if (block != NO_BLOCK)
+        freeBlock = blocks[block].next;
+    else
+    {
+        if (blockCount == blocks.capacity())
+            blocks.grow();
+        block = blockCount++;
+    }
+    blocks[block].next = NO_BLOCK;
+    blocks[block].used = 0;
+    return block;
+}
+
+size_t TestHistory::memoryBytes() const
+{
+    // A map node costs about as much as four pointers besides its value
+    size_t total = blocks.memoryBytes() + chains.capacity() * sizeof(Chain);
+    for (const auto& period : periods)
+        total += sizeof(period) + 4 * sizeof(void*) + period.second.capacity() * sizeof(PeriodStart);
+    return total;
+}
+
+uint32_t ContactGraph::find(string_view username) const
+{
+    uint32_t user = index.find(username, [this](uint32_t v) { return string_view(names[v]); });
+    return user == HashIndex::NOT_FOUND ? NO_VERTEX : user;
+}
+
+// Vertex of the username, added if it is new
+uint32_t ContactGraph::vertex(const string& username)
+{
+    uint32_t user = find(username);
+    if (user != NO_VERTEX)
+        return user;
+    user = static_cast<uint32_t>(names.size());
+    names.push_back(username);
+    index.insert(username, user);
+    return user;
+}
+
+// Follows a user to a new username. A vertex left over under the new name
+// (whose user has gone) can no longer be found.
+void ContactGraph::rename(const string& from, const string& to)
+{
+    uint32_t user = find(from);
+    if (user == NO_VERTEX)
+        return;
+    uint32_t stale = find(to);
+    if (stale != NO_VERTEX)
+        index.erase(to, stale);
+    index.erase(from, user);
+    names[user] = to;
+    index.insert(to, user);
+}
+
+void ContactGraph::addContact(uint32_t a, uint32_t b, int32_t day)
+{
+    if (a == b)
+        return;
+    if (logHeads.size() < names.size())
+        logHeads.resize(names.size(), NO_VERTEX);
+    log.push_back({{b, day}, logHeads[a]});
+    logHeads[a] = static_cast<uint32_t>(log.size() - 1);
+    log.push_back({{a, day}, logHeads[b]});
+    logHeads[b] = static_cast<uint32_t>(log.size() - 1);
+    
+    if (log.size() >= max(CONTACT_MERGE_MIN, edges.size() / 2))
+        merge();
+}
+
+// Rebuilds the arrays with the log folded in. Repeat contacts between two
+// users collapse into one with the latest day.
+void ContactGraph::merge()
+{
+    // Buckets every contact under its user in two passes over the arrays
+    // rather than following each user's log chain. Log entries come in
+    // pairs, so the user an entry belongs to is the contact of its partner.
+    vector<uint64_t> starts(names.size() + 1, 0);
+    for (uint32_t user = 0; user + 1 < offsets.size(); user++)
+        starts[user + 1] = offsets[user + 1] - offsets[user];
+    for (size_t entry = 0; entry < log.size(); entry++)
+        starts[log[entry ^ 1].contact.user + 1]++;
+    for (size_t user = 0; user < names.size(); user++)
+        starts[user + 1] += starts[user];
+    
+    vector<Contact> merged(starts.back());
+    vector<uint64_t> filled(starts.begin(), starts.end() - 1);
+    for (uint32_t user = 0; user + 1 < offsets.size(); user++)
+    {
+        copy(edges.begin() + offsets[user], edges.begin() + offsets[user + 1], merged.begin() + filled[user]);
+        filled[user] += offsets[user + 1] - offsets[user];
+    }
+    for (size_t entry = 0; entry < log.size(); entry++)
+        merged[filled[log[entry ^ 1].contact.user]++] = log[entry].contact;
+    
+    // Sorts each user's contacts and keeps the latest of any repeats,
+    // compacting the array as it goes
+    uint64_t kept = 0;
+    for (size_t user = 0; user < names.size(); user++)
+    {
+        auto begin = merged.begin() + starts[user], end = merged.begin() + starts[user + 1];
+        sort(begin, end, [](const Contact& a, const Contact& b) {
+            return a.user != b.user ? a.user < b.user : a.day > b.day;
+        });
+        starts[user] = kept;
+        for (auto contact = begin; contact != end; ++contact)
+        {
+            if (kept == starts[user] || merged[kept - 1].user != contact->user)
+                merged[kept++] = *contact;
+        }
+    }
+    starts.back() = kept;
+    merged.resize(kept);
+    merged.shrink_to_fit();
+    
+    offsets.swap(starts);
+    edges.swap(merged);
+    log.clear();
+    logHeads.clear();
+}
+
+size_t ContactGraph::memoryBytes() const
+{
+    size_t total = names.capacity() * sizeof(string) + index.memoryBytes() + offsets.capacity() * sizeof(uint64_t) +
+                   edges.capacity() * sizeof(Contact) + log.capacity() * sizeof(LogEntry) +
+                   logHeads.capacity() * sizeof(uint32_t);
+    for (const string& name : names)
+    {
+        if (name.capacity() > string().capacity())
+            total += name.capacity() + 1;
+    }
+    return total;
+}
+
+// Level by level: each level's frontier is expanded into the next, and a
+// user is claimed for the level that first sets its bit in `visited`, so
+// threads expanding one level never add the same user twice. The bitset is
+// kept per calling thread and only the words of reached users are cleared
+// afterwards, so a trace costs what it reaches rather than a pass over every
+// user.
+vector<uint32_t> ContactGraph::trace(uint32_t source, int hops, int32_t sinceDay, ThreadPool* pool) const
+{
+    vector<uint32_t> reached;
+    if (source >= names.size() || hops <= 0)
+        return reached;
+    
+    // Pool threads reach the caller's bitset through this reference, not
+    // their own thread_local one
+    thread_local vector<atomic<uint64_t>> visitedWords;
+    size_t words = (names.size() + 63) / 64;
+    if (visitedWords.size() < words)
+        visitedWords = vector<atomic<uint64_t>>(words + words / 2);
+    vector<atomic<uint64_t>>& visited = visitedWords;
+    auto claim = [&visited](uint32_t user) {
+        uint64_t bit = uint64_t(1) << (user & 63);
+        return !(visited[user >> 6].fetch_or(bit, memory_order_relaxed) & bit);
+    };
+    claim(source);
+    
+    try {
+        vector<uint32_t> frontier = {source};
+        for (int hop = 0; hop < hops && !frontier.empty(); hop++)
+        {
+            auto expand = [&](size_t begin, size_t end) {
+                vector<uint32_t> next;
+                for (size_t i = begin; i < end; i++)
+                {
+                    forEachContact(frontier[i], [&](const Contact& contact) {
+                        if (contact.day >= sinceDay && claim(contact.user))
+                            next.push_back(contact.user);
+                    });
+                }
+                return next;
+            };
+            
+            vector<uint32_t> next;
+            if (!pool || frontier.size() < TRACE_PARALLEL_FRONTIER)
+                next = expand(0, frontier.size());
+            else
+            {
+                size_t parts = min<size_t>(pool->size() * 4, frontier.size());
+                vector<future<vector<uint32_t>>> results;
+                for (size_t part = 0; part < parts; part++)
+                {
+                    size_t begin = frontier.size() * part / parts;
+                    size_t end = frontier.size() * (part + 1) / parts;
+                    results.push_back(pool->submit([&expand, begin, end]() { return expand(begin, end); }));
+                }
+                for (auto& result : results)
+                {
+                    vector<uint32_t> found = result.get();
+                    next.insert(next.end(), found.begin(), found.end());
+                }
+            }
+            reached.insert(reached.end(), next.begin(), next.end());
+            frontier.swap(next);
+        }
+    } catch (...) {
+        // Users claimed by the level that failed are not in `reached`
+        for (auto& word : visited)
+            word.store(0, memory_order_relaxed);
+        throw;
+    }
+    visited[source >> 6].store(0, memory_order_relaxed);
+    for (uint32_t user : reached)
+        visited[user >> 6].store(0, memory_order_relaxed);
+    return reached;
+}
+
+UserDirectory::UserDirectory(const UserStore& loaded, PersistenceWriter* writer, unsigned shardBits)
+    : shardBits(shardBits), shardMask((1u << shardBits) - 1), writer(writer)
+{
+    // Timers are set with the policy's durations, so load it first
+    bool durationsChanged;
+    reloadPolicyIfChanged(durationsChanged);
+    
+    // A duplicate username the loaded store could not index is kept, after
+    // the users that can log in so the same one still can
+    vector<vector<User>> shardUsers(size_t(1) << shardBits);
+    vector<User> duplicates;
+    loaded.forEach([&](UserId id, const UserView& view) {
+        User user;
+        loaded.get(id, user);
+        if (loaded.find(view.username) != id)
+            duplicates.push_back(move(user));
+        else
+            shardUsers[shardOf(user.username)].push_back(move(user));
+    });
+    for (User& user : duplicates)
+        shardUsers[shardOf(user.username)].push_back(move(user));
+    
+    int32_t today = currentDayNumber();
+    for (vector<User>& users : shardUsers)
+    {
+        shards.push_back(make_unique<Shard>(today));
+        Shard& shard = *shards.back();
+        // The loaded store has already warned about them
+        shard.store.assign(move(users), false);
+        shard.scheduler.rebuild(shard.store);
+        releaseDue(shard, today);
+    }
+    tickedDay = today;
+}
+
+// Takes the shard from the top bits of a multiplicative hash, since the
+// shard's own HashIndex uses the low bits of the plain hash
+size_t UserDirectory::shardOf(string_view username) const
+{
+    if (shardBits == 0)
+        return 0;
+    uint64_t hash = static_cast<uint64_t>(std::hash<string_view>()(username));
+    return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> (64 - shardBits));
+}
+
+UserId UserDirectory::globalId(size_t shard, UserId local) const
+{
+    if (local.slot == UserId().slot)
+        return UserId();
+    return UserId{local.slot << shardBits | static_cast<uint32_t>(shard), local.generation};
+}
+
+size_t UserDirectory::size() const
+{
+    size_t total = 0;
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        total += shard->store.size();
+    }
+    return total;
+}
+
+bool UserDirectory::contains(const string& username) const
+{
+    const Shard& shard = *shards[shardOf(username)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    return shard.store.contains(username);
+}
+
+bool UserDirectory::valid(UserId id) const
+{
+    const Shard& shard = *shards[shardOf(id)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    return shard.store.valid(localId(id));
+}
+
+bool UserDirectory::get(UserId id, User& user) const
+{
+    const Shard& shard = *shards[shardOf(id)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    return shard.store.get(localId(id), user);
+}
+
+// Adds the user unless the username is taken. Returns an invalid id if it is,
+// since another session may have registered it after the menu checked.
+UserId UserDirectory::registerUser(const User& user)
+{
+    LatencyTimer timer(METRIC_REGISTRATION);
+    unique_lock<mutex> identityLock(identityMutex, defer_lock);
+    if (icMustBeUnique)
+    {
+        identityLock.lock();
+        if (icTaken(user.IC, user.username))
+            return UserId();
+    }
+    
+    size_t index = shardOf(user.username);
+    Shard& shard = *shards[index];
+    unique_lock<shared_mutex> lock(shard.lock);
+    if (shard.store.contains(user.username) || !owns(user.username))
+        return UserId();
+    UserId local = shard.store.add(user);
+    shard.scheduler.userChanged(local, shard.store.view(local));
+    persist(user, user.username);
+    return globalId(index, local);
+}
+
+// Checks the password under a read lock. Only a login that ends an expired
+// quarantine takes the write lock. Returns an invalid id if the username or
+// password is wrong.
+UserId UserDirectory::login(const string& username, const string& password, User& user, bool& quarantineEnded)
+{
+    LatencyTimer timer(METRIC_LOGIN);
+    size_t index = shardOf(username);
+    Shard& shard = *shards[index];
+    UserId local;
+    {
+        shared_lock<shared_mutex> lock(shard.lock);
+        // A user moved out by splitPartition() is already gone from the store
+        local = shard.store.find(username);
+        if (!shard.store.valid(local) || shard.store.view(local).password != password)
+        {
+            countEvent(COUNTER_FAILED_LOGINS);
+            return UserId();
+        }
+        shard.store.get(local, user);
+    }
+    
+    quarantineEnded = updateCategoryBasedOnTime(&user);
+    if (quarantineEnded)
+    {
+        // Another session may have changed the user between the two locks
+        unique_lock<shared_mutex> lock(shard.lock);
+        User current;
+        if (shard.store.get(local, current) && current.category == POSITIVE && current.testDay == user.testDay)
+        {
+            shard.store.setCategory(local, LOW_RISK);
+            current.category = LOW_RISK;
+            persist(current, current.username);
+        }
+    }
+    return globalId(index, local);
+}
+
+// Writes an edited copy back. Unchanged copies are not persisted; a changed
+// test date or category reschedules the user's timers. Usernames only change
+// through rename(), so a copy with a different username is refused, as is a
+// stale handle.
+bool UserDirectory::update(UserId id, const User& user)
+{
+    LatencyTimer timer(METRIC_PROFILE_UPDATE);
+    // A user who already shared an IC before uniqueness was required keeps it
+    unique_lock<mutex> identityLock(identityMutex, defer_lock);
+    bool taken = false;
+    if (icMustBeUnique)
+    {
+        identityLock.lock();
+        taken = icTaken(user.IC, user.username);
+    }
+    
+    Shard& shard = *shards[shardOf(id)];
+    UserId local = localId(id);
+    unique_lock<shared_mutex> lock(shard.lock);
+    User previous;
+    if (!shard.store.get(local, previous) || previous.username != user.username)
+        return false;
+    if (sameUser(previous, user))
+        return true;
+    if (taken && user.IC != previous.IC)
+        return false;
+    
+    shard.store.update(local, user);
+    persist(user, previous.username);
+    if (user.testDay != previous.testDay || user.category != previous.category)
+    {
+        shard.scheduler.userChanged(local, shard.store.view(local));
+        releaseDue(shard, currentDayNumber());
+    }
+    return true;
+}
+
+CategoryStats UserDirectory::statistics() const
+{
+    // Shards lock in index order, like a cross-shard rename
+    vector<shared_lock<shared_mutex>> locks;
+    for (const auto& shard : shards)
+        locks.emplace_back(shard->lock);
+    
+    CategoryStats total;
+    for (const auto& shard : shards)
+        total.merge(shard->store.statistics());
+    return total;
+}
+
+bool UserDirectory::checkStatistics() const
+{
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        if (!(shard->store.statistics() == shard->store.recountStatistics()))
+            return false;
+    }
+    return true;
+}
+
+// Stores an assessment: the user takes its category and date, it is added to
+// the user's test history, and the users named as close contacts are linked
+// to them on the test day. A POSITIVE result then marks the user's recent
+// contacts CLOSE_CONTACT. Returns false for a stale handle.
+bool UserDirectory::recordTest(UserId id, const TestRecord& test, span<const string> contacts)
+{
+    LatencyTimer timer(METRIC_ASSESSMENT);
+    Shard& shard = *shards[shardOf(id)];
+    string username;
+    {
+        unique_lock<shared_mutex> lock(shard.lock);
+        if (!applyTest(shard, localId(id), test, contacts))
+            return false;
+        username = shard.store.view(localId(id)).username;
+    }
+    if (test.category == POSITIVE)
+        traceContacts(username, test.day);
+    return true;
+}
+
+// As above for the named user, for --ingest. Returns false if there is no
+// such user.
+bool UserDirectory::recordTest(const string& username, const TestRecord& test)
+{
+    LatencyTimer timer(METRIC_ASSESSMENT);
+    Shard& shard = *shards[shardOf(username)];
+    {
+        unique_lock<shared_mutex> lock(shard.lock);
+        if (!applyTest(shard, shard.store.find(username), test, {}))
+            return false;
+    }
+    if (test.category == POSITIVE)
+        traceContacts(username, test.day);
+    return true;
+}
+
+// The caller holds the shard's write lock
+bool UserDirectory::applyTest(Shard& shard, UserId local, const TestRecord& test, span<const string> contacts)
+{
+    User user;
+    if (!shard.store.get(local, user))
+        return false;
+    
+    user.category = test.category;
+    user.testDay = test.day;
+    shard.store.update(local, user);
+    shard.history.append(local.slot, test);
+    if (!contacts.empty())
+    {
+        unique_lock<shared_mutex> graphLock(contactsLock);
+        uint32_t self = contactGraph.vertex(user.username);
+        for (const string& contact : contacts)
+            contactGraph.addContact(self, contactGraph.vertex(contact), test.day);
+    }
+    persist(user, user.username, &test, contacts);
+    shard.scheduler.userChanged(local, shard.store.view(local));
+    releaseDue(shard, currentDayNumber());
+    return true;
+}
+
+// Username of the user with that username or, failing that, IC number; empty
+// if there is none
+string UserDirectory::findContact(const string& usernameOrIC) const
+{
+    if (contains(usernameOrIC))
+        return usernameOrIC;
+    User user;
+    return findByIC(usernameOrIC, user) ? user.username : string();
+}
+
+// The first user found with the IC/passport number
+bool UserDirectory::findByIC(const string& IC, User& user) const
+{
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        bool found = false;
+        shard->store.forEachWithIC(IC, [&](UserId local, const UserView&) {
+            found = found || shard->store.get(local, user);
+        });
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+// Every user with the phone number, which households may share
+vector<User> UserDirectory::findByPhone(const string& phone) const
+{
+    vector<User> users;
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        shard->store.forEachWithPhone(phone, [&](UserId local, const UserView&) {
+            users.emplace_back();
+            shard->store.get(local, users.back());
+        });
+    }
+    return users;
+}
+
+// Whether a user other than exceptUsername has the IC/passport number. An
+// empty number is never taken.
+bool UserDirectory::icTaken(const string& IC, const string& exceptUsername) const
+{
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        bool taken = false;
+        shard->store.forEachWithIC(IC, [&](UserId, const UserView& user) {
+            taken = taken || user.username != exceptUsername;
+        });
+        if (taken)
+            return true;
+    }
+    return false;
+}
+
+// Warns about users who already share an IC/passport number. They keep it,
+// but no one else can take it.
+void UserDirectory::requireUniqueIC(bool required)
+{
+    icMustBeUnique = required;
+    if (!required)
+        return;
+    
+    unordered_map<string, size_t> holders;
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        shard->store.forEach([&](UserId, const UserView& user) {
+            if (!user.IC.empty())
+                holders[string(user.IC)]++;
+        });
+    }
+    size_t sharing = 0;
+    for (const auto& [IC, count] : holders)
+        sharing += count > 1 ? count : 0;
+    if (sharing > 0)
+        cerr << "Warning: " << sharing << " user(s) share an IC/passport number with another user.\n";
+}
+
+void UserDirectory::query(const RosterFilter& filter, const function<bool(const UserView&)>& visit) const
+{
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        if (!shard->store.query(filter, [&](UserId, const UserView& user) { return visit(user); }))
+            return;
+    }
+}
+
+// Usernames up to `hops` contacts away from the user, along contacts made on
+// or after sinceDay, nearest first
+vector<string> UserDirectory::contactsWithin(const string& username, int hops, int32_t sinceDay) const
+{
+    vector<string> names;
+    shared_lock<shared_mutex> lock(contactsLock);
+    uint32_t source = contactGraph.find(username);
+    if (source == ContactGraph::NO_VERTEX)
+        return names;
+    for (uint32_t user : contactGraph.trace(source, hops, sinceDay, &tracePool()))
+        names.push_back(contactGraph.name(user));
+    return names;
+}
+
+// Marks CLOSE_CONTACT everyone within the policy's hops of a user who tested
+// POSITIVE on positiveDay, along contacts made in the policy's window before
+// it. Users already CLOSE_CONTACT or POSITIVE are left alone. Takes each
+// shard's lock once, after the search, and returns the number of users marked.
+size_t UserDirectory::traceContacts(const string& username, int32_t positiveDay)
+{
+    shared_ptr<const Policy> policy = currentPolicy();
+    vector<vector<string>> byShard(shards.size());
+    for (string& name : contactsWithin(username, policy->traceHops, positiveDay - policy->contactWindowDays))
+        byShard[shardOf(name)].push_back(move(name));
+    
+    size_t marked = 0;
+    for (size_t index = 0; index < shards.size(); index++)
+    {
+        if (byShard[index].empty())
+            continue;
+        Shard& shard = *shards[index];
+        unique_lock<shared_mutex> lock(shard.lock);
+        for (const string& name : byShard[index])
+        {
+            UserId local = shard.store.find(name);
+            if (!shard.store.valid(local) || shard.store.view(local).category >= CLOSE_CONTACT)
+                continue;
+            shard.store.setCategory(local, CLOSE_CONTACT);
+            User user;
+            shard.store.get(local, user);
+            persist(user, user.username);
+            marked++;
+        }
+    }
+    return marked;
+}
+
+size_t UserDirectory::contactCount() const
+{
+    shared_lock<shared_mutex> lock(contactsLock);
+    return contactGraph.contactCount();
+}
+
+// Created on first use, so sessions that never trace start no threads
+ThreadPool& UserDirectory::tracePool() const
+{
+    call_once(tracePoolCreated, [this]() {
+        tracePoolThreads = make_unique<ThreadPool>(max(1u, thread::hardware_concurrency()));
+    });
+    return *tracePoolThreads;
+}
+
+bool UserDirectory::testHistory(const string& username, int32_t fromDay, int32_t toDay,
+                                vector<TestRecord>& tests) const
+{
+    const Shard& shard = *shards[shardOf(username)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    UserId local = shard.store.find(username);
+    if (!shard.store.valid(local))
+        return false;
+    tests.clear();
+    shard.history.forEach(local.slot, fromDay, toDay, [&](const TestRecord& test) { tests.push_back(test); });
+    return true;
+}
+
+void UserDirectory::testsBetween(int32_t fromDay, int32_t toDay,
+                                 const function<void(string_view, const TestRecord&)>& visit) const
+{
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        shard->history.forEachBetween(fromDay, toDay, [&](uint32_t slot, const TestRecord& test) {
+            UserId local = shard->store.idAt(slot);
+            if (shard->store.valid(local))
+                visit(shard->store.view(local).username, test);
+        });
+    }
+}
+
+size_t UserDirectory::historyBytes() const
+{
+    size_t total = 0;
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        total += shard->history.memoryBytes();
+    }
+    return total;
+}
+
+// Tests are filed under the name the user had when they were recorded. A
+// first pass over the renames, last to first, works out the name each of
+// those names ends up as; the second pass applies the tests in file order,
+// moving names on as their renames go by. Tests and contacts of users who no
+// longer exist are dropped, and the file is then compacted to leave them out.
+// A replica stops at the last record of a change its journal has reached.
+size_t UserDirectory::loadHistory(const string& filename, bool durable, uint64_t lastSequence)
+{
+    struct Rename
+    {
+        string from;
+        string to;
+        string fromAfter;       // Final name of whoever takes `from` after the rename
+        size_t end;             // Offset just past the record
+    };
+    
+    size_t fileBytes = 0, validBytes = 0, loadedBytes = 0, dropped = 0, droppedContacts = 0;
+    {
+        MappedFile file(filename);
+        if (!file.isOpen())
+            return 0;
+        string_view contents = file.contents();
+        fileBytes = contents.size();
+        
+        vector<Rename> renames;
+        size_t pos = 0;
+        JournalRecordHeader header;
+        string_view payload;
+        while (readJournalRecord(contents, pos, header, payload))
+        {
+            validBytes = pos;
+            if (header.sequence <= lastSequence)
+                loadedBytes = pos;
+            Rename rename;
+            rename.end = pos;
+            if (header.type == JOURNAL_RENAME_USER && readJournalField(payload, rename.from) &&
+                readJournalField(payload, rename.to))
+                renames.push_back(move(rename));
+        }
+        while (!renames.empty() && renames.back().end > loadedBytes)
+            renames.pop_back();
+        
+        // Names missing from finalName keep their name; an empty final name
+        // means no current user ever held the name at that point
+        unordered_map<string, string> finalName;
+        auto resolve = [&finalName](const string& name) {
+            auto found = finalName.find(name);
+            return found == finalName.end() ? name : found->second;
+        };
+        for (auto rename = renames.rbegin(); rename != renames.rend(); ++rename)
+        {
+            rename->fromAfter = resolve(rename->from);
+            finalName[rename->from] = resolve(rename->to);
+            finalName[rename->to] = string();
+        }
+        
+        size_t renameIndex = 0;
+        string username, contact, ignored;
+        vector<TestRecord> tests;
+        pos = 0;
+        while (pos < loadedBytes && readJournalRecord(contents, pos, header, payload))
+        {
+            if (header.type == JOURNAL_RENAME_USER && readJournalField(payload, ignored) &&
+                readJournalField(payload, ignored))
+            {
+                const Rename& rename = renames[renameIndex++];
+                finalName[rename.to] = resolve(rename.from);
+                finalName[rename.from] = rename.fromAfter;
+                continue;
+            }
+            int32_t day;
+            if (header.type == JOURNAL_CONTACT && readJournalField(payload, username) &&
+                readJournalField(payload, contact) && payload.size() == sizeof(day))
+            {
+                memcpy(&day, payload.data(), sizeof(day));
+                string first = resolve(username), second = resolve(contact);
+                if (first.empty() || second.empty() || !contains(first) || !contains(second))
+                {
+                    droppedContacts++;
+                    continue;
+                }
+                unique_lock<shared_mutex> lock(contactsLock);
+                contactGraph.addContact(contactGraph.vertex(first), contactGraph.vertex(second), day);
+                continue;
+            }
+            if (header.type != JOURNAL_TEST_HISTORY || !parseTestHistory(payload, username, tests))
+                continue;
+            
+            string current = resolve(username);
+            Shard& shard = *shards[shardOf(current)];
+            unique_lock<shared_mutex> lock(shard.lock);
+            UserId local = shard.store.find(current);
+            if (!shard.store.valid(local))
+            {
+                dropped += tests.size();
+                continue;
+            }
+            for (const TestRecord& test : tests)
+                shard.history.append(local.slot, test);
+        }
+    }
+    {
+        unique_lock<shared_mutex> lock(contactsLock);
+        contactGraph.merge();
+    }
+    if (!writer)
+        return loadedBytes;
+    
+    error_code ec;
+    if (validBytes < fileBytes)
+    {
+        cerr << "Warning: Discarding incomplete record at the end of " << filename << ".\n";
+        filesystem::resize_file(filename, validBytes, ec);
+    }
+    if (dropped > 0 || droppedContacts > 0)
+        cerr << "Warning: Dropping " << dropped << " test(s) and " << droppedContacts
+             << " contact(s) of users who no longer exist from " << filename << ".\n";
+    
+    // One record per user, as saveHistory writes it
+    size_t compactBytes = 0;
+    for (const auto& shard : shards)
+    {
+        compactBytes += shard->history.encodedBytes();
+        shard->store.forEach([&](UserId local, const UserView& user) {
+            if (shard->history.count(local.slot) > 0)
+                compactBytes += JOURNAL_RECORD_HEADER_SIZE + sizeof(uint32_t) + user.username.size() + 4;
+        });
+    }
+    compactBytes += contactGraph.contactCount() * (JOURNAL_RECORD_HEADER_SIZE + 2 * sizeof(uint32_t) + 2 * 8 + 4);
+    if (dropped > 0 || droppedContacts > 0 || (validBytes > HISTORY_COMPACT_MIN_BYTES && validBytes > 2 * compactBytes))
+        saveHistory(filename, durable);
+    return loadedBytes;
+}
+
+// Writes every user's tests as one record per user, through a temporary file
+// and rename
+bool UserDirectory::saveHistory(const string& filename, bool durable) const
+{
+    const size_t usersPerWrite = 4096;
+    string tempName = filename + ".tmp";
+    error_code ec;
+    filesystem::remove(tempName, ec);
+    Journal out;
+    if (!out.open(tempName, 0))
+        return false;
+    // Older than any journal record a replica could be waiting for
+    out.pinSequence(0);
+    
+    bool written = true;
+    vector<TestRecord> tests;
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        size_t staged = 0;
+        shard->store.forEach([&](UserId local, const UserView& user) {
+            if (shard->history.count(local.slot) == 0)
+                return;
+            tests.clear();
+            shard->history.forEach(local.slot, INT32_MIN, INT32_MAX,
+                                   [&](const TestRecord& test) { tests.push_back(test); });
+            out.stageTests(user.username, tests);
+            if (++staged % usersPerWrite == 0)
+                written = out.writeStaged() && written;
+        });
+        written = out.writeStaged() && written;
+    }
+    
+    // Each contact once, from its lower-numbered end, leaving out vertices
+    // whose user has gone. Shard locks come before contactsLock, so which
+    // users exist is looked up first.
+    vector<string> names;
+    {
+        shared_lock<shared_mutex> lock(contactsLock);
+        for (uint32_t user = 0; user < contactGraph.vertexCount(); user++)
+            names.push_back(contactGraph.name(user));
+    }
+    vector<bool> current(names.size());
+    for (uint32_t user = 0; user < names.size(); user++)
+        current[user] = contains(names[user]);
+    shared_lock<shared_mutex> lock(contactsLock);
+    for (uint32_t user = 0; user < current.size(); user++)
+    {
+        const string& name = contactGraph.name(user);
+        if (!current[user] || contactGraph.find(name) != user)
+            continue;
+        contactGraph.forEachContact(user, [&](const ContactGraph::Contact& contact) {
+            if (contact.user > user && contact.user < current.size() && current[contact.user] &&
+                contactGraph.find(contactGraph.name(contact.user)) == contact.user)
+                out.stageContact(name, contactGraph.name(contact.user), contact.day);
+        });
+        if ((user + 1) % usersPerWrite == 0)
+            written = out.writeStaged() && written;
+    }
+    written = out.writeStaged() && written;
+    
+    if (durable && !out.sync())
+        written = false;
+    out.close();
+    if (!written)
+    {
+        cerr << "Error: Could not write " << tempName << ".\n";
+        return false;
+    }
+    return replaceFile(tempName, filename, durable);
+}
+
+// Renames in place when both names hash to the same shard. Otherwise the
+// user moves to the new name's shard with both shards locked, and `id` is
+// updated to the user's new handle.
+bool UserDirectory::rename(UserId& id, const string& newUsername)
+{
+    LatencyTimer timer(METRIC_PROFILE_UPDATE);
+    size_t from = shardOf(id);
+    size_t to = shardOf(newUsername);
+    UserId local = localId(id);
+    if (!owns(newUsername))
+        return false;
+    
+    if (from == to)
+    {
+        Shard& shard = *shards[from];
+        unique_lock<shared_mutex> lock(shard.lock);
+        User user;
+        if (!shard.store.get(local, user) || !shard.store.rename(local, newUsername))
+            return false;
+        string previousUsername = move(user.username);
+        user.username = newUsername;
+        {
+            unique_lock<shared_mutex> graphLock(contactsLock);
+            contactGraph.rename(previousUsername, newUsername);
+        }
+        persist(user, previousUsername);
+        return true;
+    }
+    
+    // Lock in shard order so two renames in opposite directions cannot deadlock
+    unique_lock<shared_mutex> firstLock(shards[min(from, to)]->lock);
+    unique_lock<shared_mutex> secondLock(shards[max(from, to)]->lock);
+    Shard& source = *shards[from];
+    Shard& target = *shards[to];
+    
+    User user;
+    if (!source.store.get(local, user) || target.store.contains(newUsername))
+        return false;
+    
+    vector<TestRecord> tests;
+    source.history.forEach(local.slot, INT32_MIN, INT32_MAX, [&](const TestRecord& test) { tests.push_back(test); });
+    source.history.remove(local.slot);
+    source.store.remove(local);
+    source.scheduler.userRemoved(local);
+    string previousUsername = move(user.username);
+    user.username = newUsername;
+    UserId moved = target.store.add(user);
+    for (const TestRecord& test : tests)
+        target.history.append(moved.slot, test);
+    target.scheduler.userChanged(moved, target.store.view(moved));
+    {
+        unique_lock<shared_mutex> graphLock(contactsLock);
+        contactGraph.rename(previousUsername, newUsername);
+    }
+    persist(user, previousUsername);
+    
+    id = globalId(to, moved);
+    return true;
+}
+
+Partition UserDirectory::partition() const
+{
+    uint64_t packed = ownedPartition.load();
+    return Partition{static_cast<uint32_t>(packed >> 32), static_cast<uint32_t>(packed)};
+}
+
+void UserDirectory::setPartition(const Partition& partition)
+{
+    ownedPartition = uint64_t(partition.index) << 32 | partition.count;
+}
+
+// The partition changes before any shard is locked, so a registration that
+// reaches its shard afterwards is refused and one that got there first is
+// moved with the rest. Shards are emptied one at a time, so sessions on the
+// others carry on; sessions of moved users find their handles stale.
+bool UserDirectory::splitPartition(string& records, size_t& movedUsers)
+{
+    Partition kept = partition();
+    if (kept.count >= MAX_PARTITIONS)
+        return false;
+    Partition leaving{kept.index + kept.count, kept.count * 2};
+    kept.count *= 2;
+    setPartition(kept);
+    
+    Journal out;
+    unordered_set<string> moved;
+    vector<UserId> leavingIds;
+    vector<uint32_t> leavingSlots;
+    vector<string> leavingNames;
+    vector<TestRecord> tests;
+    for (auto& shard : shards)
+    {
+        unique_lock<shared_mutex> lock(shard->lock);
+        leavingIds.clear();
+        shard->store.forEach([&](UserId local, const UserView& user) {
+            if (leaving.owns(user.username))
+                leavingIds.push_back(local);
+        });
+        leavingSlots.clear();
+        leavingNames.clear();
+        for (UserId local : leavingIds)
+        {
+            User user;
+            shard->store.get(local, user);
+            tests.clear();
+            shard->history.forEach(local.slot, INT32_MIN, INT32_MAX,
+                                   [&](const TestRecord& test) { tests.push_back(test); });
+            out.stagePut(user);
+            if (!tests.empty())
+                out.stageTests(user.username, tests);
+            leavingSlots.push_back(local.slot);
+            leavingNames.push_back(move(user.username));
+        }
+        shard->history.remove(leavingSlots);
+        for (size_t i = 0; i < leavingIds.size(); i++)
+        {
+            UserId local = leavingIds[i];
+            string& username = leavingNames[i];
+            shard->store.remove(local);
+            shard->scheduler.userRemoved(local);
+            if (writer)
+                writer->userRemoved(username);
+            moved.insert(move(username));
+        }
+    }
+    if (!moved.empty())
+        dataModified = true;
+    
+    // Each contact between two moved users once, from its lower-numbered end.
+    // Contacts with users who stay are left behind, as neither side can
+    // trace across partitions.
+    shared_lock<shared_mutex> graphLock(contactsLock);
+    for (const string& name : moved)
+    {
+        uint32_t user = contactGraph.find(name);
+        if (user == ContactGraph::NO_VERTEX)
+            continue;
+        contactGraph.forEachContact(user, [&](const ContactGraph::Contact& contact) {
+            const string& other = contactGraph.name(contact.user);
+            if (contact.user > user && moved.count(other) && contactGraph.find(other) == contact.user)
+                out.stageContact(name, other, contact.day);
+        });
+    }
+    records += out.takeStaged();
+    movedUsers = moved.size();
+    graphLock.unlock();
+    // Should the removals fail to save, the leaving users are still left out
+    // at the next startup as another partition's, so the records go out anyway
+    if (writer)
+        writer->flush();
+    return true;
+}
+
+// Users go in through registerUser(), then their tests and contacts are
+// added and persisted as if they had been recorded here
+bool UserDirectory::importRecords(string_view records, size_t& users, size_t& tests, size_t& contacts)
+{
+    users = tests = contacts = 0;
+    size_t pos = 0;
+    JournalRecordHeader header;
+    string_view payload;
+    string username, contact;
+    vector<TestRecord> userTests;
+    while (readJournalRecord(records, pos, header, payload))
+    {
+        if (header.type == JOURNAL_PUT_USER)
+        {
+            User user;
+            if (parseJournalUser(payload, user) && valid(registerUser(user)))
+                users++;
+            continue;
+        }
+        
+        int32_t day = 0;
+        bool isContact = header.type == JOURNAL_CONTACT && readJournalField(payload, username) &&
+                         readJournalField(payload, contact) && payload.size() == sizeof(day);
+        if (!isContact && (header.type != JOURNAL_TEST_HISTORY || !parseTestHistory(payload, username, userTests)))
+            continue;
+        if (isContact && !contains(contact))
+            continue;
+        
+        Shard& shard = *shards[shardOf(username)];
+        unique_lock<shared_mutex> lock(shard.lock);
+        UserId local = shard.store.find(username);
+        User user;
+        if (!shard.store.get(local, user))
+            continue;
+        if (isContact)
+        {
+            memcpy(&day, payload.data(), sizeof(day));
+            {
+                unique_lock<shared_mutex> graphLock(contactsLock);
+                contactGraph.addContact(contactGraph.vertex(username), contactGraph.vertex(contact), day);
+            }
+            if (writer)
+                writer->contactsAdded(user, day, span<const string>(&contact, 1));
+            contacts++;
+            continue;
+        }
+        for (const TestRecord& test : userTests)
+        {
+            shard.history.append(local.slot, test);
+            persist(user, user.username, &test);
+        }
+        tests += userTests.size();
+    }
+    return pos == records.size();
+}
+
+void UserDirectory::setReplica(chrono::milliseconds bound)
+{
+    maxStaleness = bound;
+    replicaMode = true;
+}
+
+void UserDirectory::caughtUp()
+{
+    caughtUpAt = chrono::steady_clock::now().time_since_epoch().count();
+}
+
+bool UserDirectory::stale() const
+{
+    if (!replicaMode)
+        return false;
+    chrono::steady_clock::duration since(chrono::steady_clock::now().time_since_epoch().count() - caughtUpAt.load());
+    return since > maxStaleness;
+}
+
+// Renames go through rename(), since a new name can belong to another shard;
+// the rest work on the shard directly and are not persisted
+bool UserDirectory::applyRecord(uint8_t type, string_view payload)
+{
+    string username, other;
+    if (type == JOURNAL_PUT_USER)
+    {
+        User user;
+        if (!parseJournalUser(payload, user))
+            return false;
+        Shard& shard = *shards[shardOf(user.username)];
+        unique_lock<shared_mutex> lock(shard.lock);
+        UserId local = shard.store.find(user.username);
+        if (shard.store.valid(local))
+            shard.store.update(local, user);
+        else
+            local = shard.store.add(user);
+        shard.scheduler.userChanged(local, shard.store.view(local));
+        return true;
+    }
+    if (type == JOURNAL_RENAME_USER)
+    {
+        if (!readJournalField(payload, username) || !readJournalField(payload, other))
+            return false;
+        size_t index = shardOf(username);
+        UserId id;
+        {
+            shared_lock<shared_mutex> lock(shards[index]->lock);
+            id = globalId(index, shards[index]->store.find(username));
+        }
+        return rename(id, other);
+    }
+    if (type == JOURNAL_REMOVE_USER)
+    {
+        if (!readJournalField(payload, username))
+            return false;
+        Shard& shard = *shards[shardOf(username)];
+        unique_lock<shared_mutex> lock(shard.lock);
+        UserId local = shard.store.find(username);
+        if (!shard.store.valid(local))
+            return false;
+        shard.history.remove(local.slot);
+        shard.store.remove(local);
+        shard.scheduler.userRemoved(local);
+        return true;
+    }
+    if (type == JOURNAL_TEST_HISTORY)
+    {
+        vector<TestRecord> tests;
+        if (!parseTestHistory(payload, username, tests))
+            return false;
+        Shard& shard = *shards[shardOf(username)];
+        unique_lock<shared_mutex> lock(shard.lock);
+        UserId local = shard.store.find(username);
+        if (!shard.store.valid(local))
+            return false;
+        for (const TestRecord& test : tests)
+            shard.history.append(local.slot, test);
+        return true;
+    }
+    int32_t day;
+    if (type != JOURNAL_CONTACT || !readJournalField(payload, username) || !readJournalField(payload, other) ||
+        payload.size() != sizeof(day))
+        return false;
+    memcpy(&day, payload.data(), sizeof(day));
+    unique_lock<shared_mutex> graphLock(contactsLock);
+    contactGraph.addContact(contactGraph.vertex(username), contactGraph.vertex(other), day);
+    return true;
+}
+
+void UserDirectory::clearHistory()
+{
+    for (auto& shard : shards)
+    {
+        unique_lock<shared_mutex> lock(shard->lock);
+        shard->history = TestHistory();
+    }
+    unique_lock<shared_mutex> graphLock(contactsLock);
+    contactGraph = ContactGraph();
+}
+
+// Duplicate usernames kept from the data file are copied too, after the
+// users that can log in
+UserStore UserDirectory::copyUsers() const
+{
+    vector<User> users, duplicates;
+    for (const auto& shard : shards)
+    {
+        shared_lock<shared_mutex> lock(shard->lock);
+        shard->store.forEach([&](UserId local, const UserView& view) {
+            vector<User>& into = shard->store.find(view.username) == local ? users : duplicates;
+            into.emplace_back();
+            shard->store.get(local, into.back());
+        });
+    }
+    users.insert(users.end(), make_move_iterator(duplicates.begin()), make_move_iterator(duplicates.end()));
+    UserStore copy;
+    copy.assign(move(users), false);
+    return copy;
+}
+
+// Every shard is write-locked, so no change is persisted halfway through
+void UserDirectory::promote(PersistenceWriter* newWriter)
+{
+    vector<unique_lock<shared_mutex>> locks;
+    for (const auto& shard : shards)
+        locks.emplace_back(shard->lock);
+    writer = newWriter;
+    replicaMode = false;
+}
+
+void UserDirectory::tick()
+{
+    bool durationsChanged;
+    if (reloadPolicyIfChanged(durationsChanged) && durationsChanged)
+        reschedule();
+    writeStatsIfDue(statsFile);
+    
+    int32_t today = currentDayNumber();
+    if (tickedDay.load() == today)
+        return;
+    
+    for (auto& shard : shards)
+    {
+        unique_lock<shared_mutex> lock(shard->lock);
+        releaseDue(*shard, today);
+    }
+    tickedDay = today;
+}
+
+// Fires the shard's due timers. The caller holds the shard's write lock.
+void UserDirectory::releaseDue(Shard& shard, int32_t today)
+{
+    shard.scheduler.advanceTo(today, shard.store, [&](UserId local) {
+        User released;
+        shard.store.get(local, released);
+        persist(released, released.username);
+    }, nullptr);
+}
+
+// Sets every timer again after the policy's durations have changed, one
+// shard at a time so sessions on the other shards carry on
+void UserDirectory::reschedule()
+{
+    int32_t today = currentDayNumber();
+    for (auto& shard : shards)
+    {
+        unique_lock<shared_mutex> lock(shard->lock);
+        shard->scheduler = HealthScheduler(today);
+        shard->scheduler.rebuild(shard->store);
+        releaseDue(*shard, today);
+    }
+}
+
+// Hands a change to the writer. Callers hold the lock of every shard the
+// change touches, so changes to one username reach the writer in order.
+void UserDirectory::persist(const User& user, const string& previousUsername, const TestRecord* test,
+                            span<const string> contacts)
+{
+    if (writer)
+        writer->userChanged(user, previousUsername, test, contacts);
+    dataModified = true;
+}
+
+#ifndef _WIN32
+ReplicaFollower::~ReplicaFollower()
+{
+    close();
+}
+
+bool ReplicaFollower::start(uint64_t baseSequence)
+{
+    appliedSequence = baseSequence;
+    error_code ec;
+    if (!filesystem::exists(JOURNAL_FILE, ec))
+        cerr << "Warning: There is no " << JOURNAL_FILE << " here yet. The primary must run with --journal "
+             << "for its changes to reach this replica.\n";
+    
+    // A compaction the primary did not finish leaves records in the old journal
+    vector<FollowedRecord> records;
+    FollowedFile old{JOURNAL_FILE + ".old"};
+    old.fd = ::open(old.name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (old.fd >= 0)
+    {
+        readRecords(old, records);
+        ::close(old.fd);
+    }
+    journal.fd = ::open(journal.name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (journal.fd >= 0)
+        readRecords(journal, records);
+    for (const FollowedRecord& record : records)
+        applyJournal(record);
+    
+    history.fd = ::open(history.name.c_str(), O_RDONLY | O_CLOEXEC);
+    history.offset = directory.loadHistory(HISTORY_FILE, false, appliedSequence);
+    directory.caughtUp();
+    cout << "Following the primary from journal sequence " << appliedSequence << "." << endl;
+    follower = thread([this]() { run(); });
+    return true;
+}
+
+bool ReplicaFollower::close()
+{
+    stopFollowing();
+    bool saved = !writer || writer->close();
+    closeFiles();
+    return saved;
+}
+
+// Changes from the journal that the replica has already applied are skipped
+void ReplicaFollower::applyJournal(const FollowedRecord& record)
+{
+    if (record.sequence <= appliedSequence)
+        return;
+    directory.applyRecord(record.type, record.payload);
+    appliedSequence = record.sequence;
+    appliedRecords++;
+}
+
+void ReplicaFollower::run()
+{
+    unique_lock<mutex> lock(stopMutex);
+    while (!stopRequested.wait_for(lock, chrono::milliseconds(REPLICA_POLL_MS), [this]() { return stopping; }))
+    {
+        lock.unlock();
+        if (poll(false))
+            directory.caughtUp();
+        lock.lock();
+    }
+}
+
+void ReplicaFollower::stopFollowing()
+{
+    {
+        lock_guard<mutex> lock(stopMutex);
+        stopping = true;
+    }
+    stopRequested.notify_all();
+    if (follower.joinable())
+        follower.join();
+    stopping = false;
+}
+
+void ReplicaFollower::closeFiles()
+{
+    for (FollowedFile* file : {&journal, &history})
+    {
+        if (file->fd >= 0)
+            ::close(file->fd);
+        file->fd = -1;
+    }
+}
+
+// Takes what the primary has appended since the last poll. History records
+// of changes the journal has not reached yet wait for the next poll, unless
+// this is the final poll before a promotion. Returns false if a file could
+// not be read, so that the replica does not count as caught up.
+bool ReplicaFollower::poll(bool final)
+{
+    vector<FollowedRecord> changes, tests;
+    bool readable = true;
+    if (journal.fd < 0)
+        journal.fd = ::open(journal.name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (journal.fd >= 0)
+        readable = readRecords(journal, changes);
+    if (journal.fd >= 0 && replaced(journal))
+    {
+        // The primary closes the old journal before renaming it, so this read
+        // finds whatever it wrote after the last one
+        readable = readRecords(journal, changes) && readable;
+        ::close(journal.fd);
+        journal = FollowedFile{JOURNAL_FILE, ::open(JOURNAL_FILE.c_str(), O_RDONLY | O_CLOEXEC), 0};
+        if (journal.fd >= 0)
+            readable = readRecords(journal, changes) && readable;
+    }
+    uint64_t reached = appliedSequence;
+    if (!changes.empty())
+        reached = max(reached, changes.back().sequence);
+    
+    if (history.fd < 0)
+        history.fd = ::open(history.name.c_str(), O_RDONLY | O_CLOEXEC);
+    bool rewritten = history.fd >= 0 && replaced(history);
+    if (history.fd >= 0 && !rewritten)
+    {
+        uint64_t start = history.offset;
+        readable = readRecords(history, tests) && readable;
+        size_t ready = tests.size();
+        while (!final && ready > 0 && tests[ready - 1].sequence > reached)
+            ready--;
+        tests.resize(ready);
+        history.offset = tests.empty() ? start : tests.back().end;
+    }
+    
+    // A change's tests and contacts follow its rename and come before its
+    // user record, which carries the sequence they are numbered with
+    size_t next = 0;
+    for (const FollowedRecord& test : tests)
+    {
+        while (next < changes.size() && changes[next].sequence < test.sequence)
+            applyJournal(changes[next++]);
+        directory.applyRecord(test.type, test.payload);
+    }
+    while (next < changes.size())
+        applyJournal(changes[next++]);
+    
+    if (rewritten)
+    {
+        // The primary compacts the file when it starts, under the names the
+        // users have now
+        ::close(history.fd);
+        history.fd = ::open(history.name.c_str(), O_RDONLY | O_CLOEXEC);
+        directory.clearHistory();
+        history.offset = directory.loadHistory(HISTORY_FILE, false, final ? UINT64_MAX : appliedSequence.load());
+    }
+    return readable;
+}
+
+// Reads the whole records after file.offset and moves the offset past them.
+// A torn record at the end is left for the next read.
+bool ReplicaFollower::readRecords(FollowedFile& file, vector<FollowedRecord>& records)
+{
+    struct stat info;
+    if (fstat(file.fd, &info) != 0)
+        return false;
+    if (static_cast<uint64_t>(info.st_size) <= file.offset)
+        return true;
+    
+    string bytes(static_cast<size_t>(info.st_size - file.offset), '\0');
+    size_t got = 0;
+    while (got < bytes.size())
+    {
+        ssize_t result = pread(file.fd, bytes.data() + got, bytes.size() - got, static_cast<off_t>(file.offset + got));
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+            return false;
+        if (result == 0)
+            break;
+        got += static_cast<size_t>(result);
+    }
+    bytes.resize(got);
+    
+    size_t pos = 0;
+    JournalRecordHeader header;
+    string_view payload;
+    while (readJournalRecord(bytes, pos, header, payload))
+        records.push_back({header.sequence, header.type, string(payload), file.offset + pos});
+    file.offset += pos;
+    return true;
+}
+
+// The name now belongs to another file than the one open, after the primary
+// rotated or rewrote it
+bool ReplicaFollower::replaced(const FollowedFile& file) const
+{
+    struct stat opened, named;
+    return fstat(file.fd, &opened) == 0 && stat(file.name.c_str(), &named) == 0 &&
+           (opened.st_ino != named.st_ino || opened.st_dev != named.st_dev);
+}
+
+// The primary holds a lock on its history file for as long as it runs, so
+// the replica only takes over once it can take that lock itself
+bool ReplicaFollower::promote(string& error)
+{
+    if (!directory.replica())
+    {
+        error = "this server is not a replica";
+        return false;
+    }
+    stopFollowing();
+    auto resume = [this]() { follower = thread([this]() { run(); }); };
+    
+    int lockFd = ::open(HISTORY_FILE.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    bool primaryStopped = lockFd >= 0 && flock(lockFd, LOCK_EX | LOCK_NB) == 0;
+    if (lockFd >= 0)
+        ::close(lockFd);
+    if (!primaryStopped)
+    {
+        error = "the primary is still running";
+        resume();
+        return false;
+    }
+    if (!poll(true))
+    {
+        error = "the primary's files could not be read";
+        resume();
+        return false;
+    }
+    
+    // New records go after the last whole one, as after a restart
+    for (const FollowedFile* file : {&journal, &history})
+    {
+        error_code ec;
+        uintmax_t size = filesystem::file_size(file->name, ec);
+        if (!ec && file->fd >= 0 && !replaced(*file) && size > file->offset)
+        {
+            cerr << "Warning: Discarding incomplete record at the end of " << file->name << ".\n";
+            filesystem::resize_file(file->name, file->offset, ec);
+        }
+    }
+    
+    ProgramOptions writerOptions = options;
+    writerOptions.persistence = PERSIST_JOURNAL;
+    writer = make_unique<PersistenceWriter>(writerOptions, directory.copyUsers(), appliedSequence);
+    if (!writer->start())
+    {
+        writer.reset();
+        error = "the data files could not be opened for writing";
+        resume();
+        return false;
+    }
+    directory.promote(writer.get());
+    closeFiles();
+    cout << "Promoted to primary at journal sequence " << appliedSequence << "." << endl;
+    return true;
+}
+#else
+ReplicaFollower::~ReplicaFollower()
+{
+}
+
+bool ReplicaFollower::start(uint64_t)
+{
+    cerr << "Error: Replicas follow the primary's files with POSIX calls and are not available on Windows.\n";
+    return false;
+}
+
+bool ReplicaFollower::close()
+{
+    return true;
+}
+
+bool ReplicaFollower::promote(string& error)
+{
+    error = "replicas are not available on Windows";
+    return false;
+}
+#endif
+
+void clearScreen(Terminal& term)
+{
+    if (term.headless())
+        return;
+    if (!term.console())
+    {
+        term.out << "\033[2J\033[H";
+        return;
+    }
+#ifdef _WIN32
+    system("cls");
+#else
+    system("clear");
+#endif
+}
+
+Task<> waitForUser(Terminal& term)
+{
+    // Only what is left of the current line is skipped
+    if (term.headless())
+    {
+        if (!term.atLineStart())
+            co_await skipLine(term);
+        co_return;
+    }
+    term.out << "\nPress Enter to continue...";
+    co_await skipLine(term);
+    co_await InputAwaiter{term, READ_CHAR, nullptr};
+}
+
+// Reads one whitespace-delimited word, ending the session if input has closed
+InputAwaiter readWord(Terminal& term, string& word)
+{
+    return InputAwaiter{term, READ_WORD, &word};
+}
+
+// Reads the rest of the current line, ending the session if input has closed
+InputAwaiter readLine(Terminal& term, string& line)
+{
+    return InputAwaiter{term, READ_LINE, &line};
+}
+
+InputAwaiter skipChar(Terminal& term)
+{
+    return InputAwaiter{term, SKIP_CHAR, nullptr};
+}
+
+InputAwaiter skipLine(Terminal& term)
+{
+    return InputAwaiter{term, SKIP_LINE, nullptr};
+}
+
+bool Terminal::hasInput(InputRequest request)
+{
+    while (!satisfied(request) && !inputClosed)
+    {
+        if (!source)
+            return false;
+        
+        // The console reads a line at a time, as the menus did through cin
+        string line;
+        if (!getline(*source, line))
+        {
+            inputClosed = true;
+            break;
+        }
+        receive(line.data(), line.size());
+        if (!source->eof())
+            receive("\n", 1);
+        if (recording)
+            *recording << line << (source->eof() ? "" : "\n");
+    }
+    return true;
+}
+
+bool Terminal::satisfied(InputRequest request) const
+{
+    size_t pos = consumed;
+    switch (request)
+    {
+        case READ_CHAR:
+        case SKIP_CHAR:
+            return pos < buffer.size();
+            
+        case READ_LINE:
+        case SKIP_LINE:
+            return buffer.find('\n', pos) != string::npos;
+            
+        case READ_WORD:
+            // A word is complete once whitespace follows it
+            while (pos < buffer.size() && isspace(static_cast<unsigned char>(buffer[pos])))
+                pos++;
+            while (pos < buffer.size() && !isspace(static_cast<unsigned char>(buffer[pos])))
+                pos++;
+            return pos < buffer.size() && pos > consumed && !isspace(static_cast<unsigned char>(buffer[pos - 1]));
+    }
+    return false;
+}
+
+void Terminal::waitFor(InputRequest request, coroutine_handle<> session)
+{
+    waitingFor = request;
+    waiting = session;
+}
+
+// Takes the requested input from the buffer. Returns false if a read finds
+// input has ended; skips always succeed.
+bool Terminal::take(InputRequest request, string* text)
+{
+    size_t end;
+    switch (request)
+    {
+        case READ_CHAR:
+            if (consumed == buffer.size())
+                return false;
+            consumed++;
+            return true;
+            
+        case SKIP_CHAR:
+            if (consumed < buffer.size())
+                consumed++;
+            return true;
+            
+        case SKIP_LINE:
+            end = buffer.find('\n', consumed);
+            consumed = (end == string::npos) ? buffer.size() : end + 1;
+            return true;
+            
+        case READ_LINE:
+            if (consumed == buffer.size())
+                return false;
+            end = buffer.find('\n', consumed);
+            if (end == string::npos)
+                end = buffer.size();
+            text->assign(buffer, consumed, end - consumed);
+            consumed = min(end + 1, buffer.size());
+            return true;
+            
+        case READ_WORD:
+            while (consumed < buffer.size() && isspace(static_cast<unsigned char>(buffer[consumed])))
+                consumed++;
+            if (consumed == buffer.size())
+                return false;
+            end = consumed;
+            while (end < buffer.size() && !isspace(static_cast<unsigned char>(buffer[end])))
+                end++;
+            text->assign(buffer, consumed, end - consumed);
+            consumed = end;
+            return true;
+    }
+    return false;
+}
+
+void Terminal::receive(const char* data, size_t length)
+{
+    // Drop what has been taken so the buffer only holds the unread tail
+    if (consumed > 0)
+    {
+        takenWholeLines = buffer[consumed - 1] == '\n';
+        dropped += consumed;
+        buffer.erase(0, consumed);
+        consumed = 0;
+    }
+    buffer.append(data, length);
+}
+
+bool Terminal::resumeIfReady()
+{
+    if (!waiting || !hasInput(waitingFor))
+        return false;
+    coroutine_handle<> session = exchange(waiting, nullptr);
+    session.resume();
+    return true;
+}
+
+Task<UserId> registration(Terminal& term, UserDirectory& directory)
+{
+    term.out << "REGISTRATION\n";
+    term.out << "============\n\n";
+    
+    User newUser;
+    
+    // Username
+    while (true)
+    {
+        term.out << "Username: ";
+        co_await readWord(term, newUser.username);
+        
+        if (!directory.owns(newUser.username))
+            redirectSession(term, newUser.username);
+        if (!directory.contains(newUser.username)) break;
+        term.out << "Username already exists. Please choose another.\n";
+    }
+    
+    // Password
+    term.out << "Password: ";
+    co_await readWord(term, newUser.password);
+    
+    // Name
+    co_await skipChar(term);
+    term.out << "Full Name: ";
+    co_await readLine(term, newUser.name);
+    
+    // Age
+    newUser.age = co_await getValidatedInt(term, "Age: ", 1, 120);
+    
+    // Address
+    term.out << "Address: ";
+    co_await readLine(term, newUser.address);
+    
+    // Phone
+    term.out << "Phone Number: ";
+    co_await readLine(term, newUser.phone);
+    
+    // IC/Passport
+    while (true)
+    {
+        term.out << "IC/Passport Number: ";
+        co_await readLine(term, newUser.IC);
+        
+        if (!directory.uniqueIC() || !directory.icTaken(newUser.IC, newUser.username)) break;
+        term.out << "IC/Passport number already registered. Please enter another.\n";
+    }
+    
+    // Default values
+    newUser.category = LOW_RISK;
+    newUser.testDay = NO_TEST_DAY;
+    
+    // Another session may have taken the username or IC while this one was typing
+    UserId id = directory.registerUser(newUser);
+    if (!directory.valid(id))
+    {
+        if (directory.contains(newUser.username) || !directory.owns(newUser.username))
+            term.out << "\nUsername already exists. Please register again.\n";
+        else
+            term.out << "\nIC/Passport number already registered. Please register again.\n";
+        co_return id;
+    }
+    term.out << "\nRegistration successful!\n";
+    co_return id;
+}
+
+Task<bool> login(Terminal& term, UserDirectory& directory, UserId& currentUser)
+{
+    term.out << "LOGIN\n";
+    term.out << "=====\n\n";
+    
+    string username, password;
+    
+    term.out << "Username: ";
+    co_await readWord(term, username);
+    if (!directory.owns(username))
+        redirectSession(term, username);
+    
+    term.out << "Password: ";
+    co_await readWord(term, password);
+    
+    User user;
+    bool quarantineEnded = false;
+    UserId id = directory.login(username, password, user, quarantineEnded);
+    if (directory.valid(id))
+    {
+        currentUser = id;
+        if (quarantineEnded)
+        {
+            term.out << "\nNOTE: Your quarantine period has ended. Category updated to Low Risk.\n";
+        }
+        term.out << "\nLogin successful! Welcome, " << user.name << "!\n";
+        co_return true;
+    }
+    
+    term.out << "\nInvalid username or password.\n";
+    co_await waitForUser(term);
+    co_return false;
+}
+
+Task<> logout(Terminal& term, UserId& currentUser)
+{
+    currentUser = UserId();
+    term.out << "You have been logged out.\n";
+    co_await waitForUser(term);
+}
+
+// Ends a session that named a user of another partition. The line tells
+// --route where the session's main menu choice started, so it can replay the
+// session from there on the partition that owns the user.
+void redirectSession(Terminal& term, const string& username)
+{
+    term.out << CONTROL_MARK << "redirect " << term.menuChoiceStart() << ' ' << username
+             << ": this account is served by another partition\n";
+    throw SessionClosed();
+}
+
+void viewProfile(Terminal& term, const UserDirectory& directory, UserId id)
+{
+    User user;
+    if (!directory.get(id, user))
+        return;
+    
+    term.out << "PROFILE INFORMATION\n";
+    term.out << "===================\n\n";
+    
+    term.out << "Name: " << user.name << endl;
+    term.out << "Age: " << user.age << endl;
+    term.out << "Address: " << user.address << endl;
+    term.out << "Phone: " << user.phone << endl;
+    term.out << "IC/Passport: " << user.IC << endl;
+    term.out << "Last Test Date: " << (user.testDay == NO_TEST_DAY ? "Not recorded" : dayNumberToDate(user.testDay)) << endl;
+    
+    string categoryNames[] = {"Low Risk", "Travel History", "Suspected Case", "Close Contact", "Positive Case"};
+    term.out << "Health Category: " << categoryNames[user.category] << endl;
+}
+
+// Copies the user out of the directory on every pass and writes the edited
+// copy back, so a handle that has gone stale ends the loop
+Task<> updateProfile(Terminal& term, UserDirectory& directory, UserId& id)
+{
+    while (true)
+    {
+        User user;
+        if (!directory.get(id, user))
+            co_return;
+        
+        clearScreen(term);
+        term.out << "UPDATE PROFILE\n";
+        term.out << "==============\n\n";
+        
+        term.out << "Current Information:\n";
+        term.out << "1. Name: " << user.name << endl;
+        term.out << "2. Age: " << user.age << endl;
+        term.out << "3. Address: " << user.address << endl;
+        term.out << "4. Phone: " << user.phone << endl;
+        term.out << "5. IC/Passport: " << user.IC << endl;
+        term.out << "6. Password: " << string(user.password.length(), '*') << endl;
+        term.out << "7. Username: " << user.username << endl;
+        term.out << "8. Return to Menu\n\n";
+        
+        int choice = co_await getValidatedInt(term, "Select field to update (1-8): ", 1, 8);
+        
+        if (choice == 8) co_return;
+        
+        co_await skipChar(term);
+        switch (choice)
+        {
+            case 1:
+                term.out << "Enter new name: ";
+                co_await readLine(term, user.name);
+                term.out << "Name updated.\n";
+                break;
+                
+            case 2:
+                user.age = co_await getValidatedInt(term, "Enter new age: ", 1, 120);
+                term.out << "Age updated.\n";
+                break;
+                
+            case 3:
+                term.out << "Enter new address: ";
+                co_await readLine(term, user.address);
+                term.out << "Address updated.\n";
+                break;
+                
+            case 4:
+                term.out << "Enter new phone number: ";
+                co_await readLine(term, user.phone);
+                term.out << "Phone number updated.\n";
+                break;
+                
+            case 5:
+            {
+                term.out << "Enter new IC/Passport number: ";
+                string newIC;
+                co_await readLine(term, newIC);
+                
+                if (directory.uniqueIC() && directory.icTaken(newIC, user.username))
+                {
+                    term.out << "IC/Passport number already registered.\n";
+                    break;
+                }
+                user.IC = newIC;
+                term.out << "IC/Passport updated.\n";
+                break;
+            }
+                
+            case 6:
+            {
+                term.out << "Enter old password: ";
+                string oldPass;
+                co_await readLine(term, oldPass);
+                
+                if (oldPass == user.password)
+                {
+                    term.out << "Enter new password: ";
+                    co_await readLine(term, user.password);
+                    term.out << "Password updated.\n";
+                }
+                else
+                {
+                    term.out << "Incorrect password.\n";
+                }
+                break;
+            }
+                
+            case 7:
+            {
+                term.out << "Enter new username: ";
+                string newUsername;
+                co_await readLine(term, newUsername);
+                
+                if (!directory.owns(newUsername))
+                {
+                    term.out << "That username is kept on another server. Please choose another.\n";
+                }
+                else if (directory.rename(id, newUsername))
+                {
+                    user.username = newUsername;
+                    term.out << "Username updated.\n";
+                }
+                else
+                {
+                    term.out << "Username already exists.\n";
+                }
+                break;
+            }
+        }
+        
+        directory.update(id, user);
+        co_await waitForUser(term);
+    }
+}
+
+// Collects every answer before touching the directory, then writes the
+// result back through the user's id
+Task<> takeTest(Terminal& term, UserDirectory& directory, UserId id)
+{
+    term.out << "COVID-19 SELF-ASSESSMENT\n";
+    term.out << "========================\n\n";
+    
+    // Ask screening questions
+    bool hasFever = co_await getValidatedInt(term, "Do you have a fever? (1=Yes, 0=No): ", 0, 1);
+    bool hasCough = co_await getValidatedInt(term, "Do you have a cough? (1=Yes, 0=No): ", 0, 1);
+    bool hasBreathingDifficulty = co_await getValidatedInt(term, "Do you have difficulty breathing? (1=Yes, 0=No): ", 0, 1);
+    bool hasTravelHistory = co_await getValidatedInt(term, "Have you traveled to a high-risk area in the past 14 days? (1=Yes, 0=No): ", 0, 1);
+    bool hasCloseContact = co_await getValidatedInt(term, "Have you been in close contact with a COVID-19 positive individual? (1=Yes, 0=No): ", 0, 1);
+    
+    // Registered users named here are traced if either side tests positive
+    vector<string> contacts;
+    if (hasCloseContact)
+    {
+        User self;
+        directory.get(id, self);
+        term.out << "Enter the username or IC number of each close contact, or 'done' when finished.\n";
+        while (contacts.size() < MAX_REPORTED_CONTACTS)
+        {
+            term.out << "Contact: ";
+            string entry;
+            co_await readWord(term, entry);
+            if (entry == "done")
+                break;
+            
+            string contact = directory.findContact(entry);
+            if (contact.empty())
+                term.out << "No registered user has that username or IC number.\n";
+            else if (contact == self.username)
+                term.out << "You cannot list yourself as a contact.\n";
+            else if (find(contacts.begin(), contacts.end(), contact) != contacts.end())
+                term.out << "That contact is already listed.\n";
+            else
+                contacts.push_back(contact);
+        }
+        co_await skipLine(term);
+    }
+    
+    int testResult = co_await getValidatedInt(term, "Enter test result (1=Positive, 0=Negative): ", 0, 1);
+    
+    unsigned answers = riskIndex(hasFever, hasCough, hasBreathingDifficulty, hasTravelHistory, hasCloseContact,
+                                 testResult == 1);
+    Category category = currentPolicy()->table[answers];
+    
+    // Get test date
+    int32_t testDay;
+    while (true)
+    {
+        term.out << "\nEnter test date (DD/MM/YYYY) or 'today' for current date: ";
+        string dateInput;
+        co_await readWord(term, dateInput);
+        
+        if (dateInput == "today")
+        {
+            testDay = currentDayNumber();
+            break;
+        }
+        else
+        {
+            if (parseDate(dateInput, testDay))
+            {
+                break;
+            }
+            else
+            {
+                term.out << "Invalid date format. Please use DD/MM/YYYY or D/M/YYYY.\n";
+            }
+        }
+    }
+    
+    if (!directory.recordTest(id, TestRecord{testDay, static_cast<uint8_t>(answers), category}, contacts))
+        co_return;
+    
+    term.out << "\nAssessment completed. Your health category has been updated.\n";
+}
+
+// Determines the category from the screening answers and the test result.
+// Shared by the assessment menu and --ingest so both apply the same rules.
+constexpr Category assessRisk(bool hasFever, bool hasCough, bool hasBreathingDifficulty, bool hasTravelHistory,
+                              bool hasCloseContact, bool testPositive)
+{
+    int symptomScore = (hasFever ? 1 : 0) + (hasCough ? 1 : 0) + (hasBreathingDifficulty ? 1 : 0);
+    
+    if (testPositive)
+    {
+        return POSITIVE;
+    }
+    else if (hasCloseContact)
+    {
+        return CLOSE_CONTACT;
+    }
+    else if (symptomScore >= 2 || (symptomScore >= 1 && hasTravelHistory))
+    {
+        return SUSPECTED;
+    }
+    else if (hasTravelHistory)
+    {
+        return TRAVEL_HISTORY;
+    }
+    return LOW_RISK;
+}
+
+// assessRisk for all 64 sets of answers. Bit 0 of the index is fever, then
+// cough, breathing difficulty, travel history, close contact and, in bit 5,
+// a positive test.
+constexpr array<Category, 64> RISK_TABLE = []() {
+    array<Category, 64> table{};
+    for (int index = 0; index < 64; index++)
+        table[index] = assessRisk(index & 1, index & 2, index & 4, index & 8, index & 16, index & 32);
+    return table;
+}();
+
+static_assert(RISK_TABLE[0b001000] == TRAVEL_HISTORY && RISK_TABLE[0b001001] == SUSPECTED &&
+              RISK_TABLE[0b011001] == CLOSE_CONTACT && RISK_TABLE[0b100000] == POSITIVE,
+              "RISK_TABLE bit order does not match assessRisk");
+
+// Categorises `count` rows of columnar answers under the current policy,
+// with AVX2 when the CPU has it
+void categoriseBatch(const ScreeningColumns& answers, size_t count, Category* categories)
+{
+    shared_ptr<const Policy> policy = currentPolicy();
+    const Category* table = policy->table.data();
+#ifdef HAVE_AVX2_KERNEL
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2)
+    {
+        categoriseBatchAvx2(answers, count, categories, table);
+        return;
+    }
+#endif
+    categoriseBatchScalar(answers, count, categories, table);
+}
+
+// Reference batch kernel: one lookup in the 64-entry table per row
+void categoriseBatchScalar(const ScreeningColumns& answers, size_t count, Category* categories, const Category* table)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        categories[i] = table[riskIndex(answers.fever[i], answers.cough[i], answers.breathingDifficulty[i],
+                                        answers.travelHistory[i], answers.closeContact[i], answers.testPositive[i])];
+    }
+}
+
+#ifdef HAVE_AVX2_KERNEL
+// Turns 32 answers into the given index bit for each nonzero byte
+__attribute__((target("avx2"))) static inline __m256i answerBits(const uint8_t* column, __m256i bit)
+{
+    __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(column));
+    return _mm256_andnot_si256(_mm256_cmpeq_epi8(values, _mm256_setzero_si256()), bit);
+}
+
+// 32 rows per step. vpshufb looks up 16 entries by the low four index bits,
+// so the table is split into four rows of 16 and bits 4 and 5 pick the row.
+// The last count % 32 rows go through the scalar kernel.
+__attribute__((target("avx2"))) void categoriseBatchAvx2(const ScreeningColumns& answers, size_t count,
+                                                        Category* categories, const Category* table)
+{
+    __m256i tableRows[4];
+    for (int row = 0; row < 4; row++)
+    {
+        __m128i entries = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + row * 16));
+        tableRows[row] = _mm256_broadcastsi128_si256(entries);
+    }
+    const __m256i bit4 = _mm256_set1_epi8(16);
+    const __m256i bit5 = _mm256_set1_epi8(32);
+    
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i index = _mm256_or_si256(
+            _mm256_or_si256(answerBits(answers.fever + i, _mm256_set1_epi8(1)),
+                            answerBits(answers.cough + i, _mm256_set1_epi8(2))),
+            _mm256_or_si256(answerBits(answers.breathingDifficulty + i, _mm256_set1_epi8(4)),
+                            answerBits(answers.travelHistory + i, _mm256_set1_epi8(8))));
+        __m256i contact = answerBits(answers.closeContact + i, bit4);
+        __m256i positive = answerBits(answers.testPositive + i, bit5);
+        
+        // Look up all four rows by the low bits, then keep the right one
+        __m256i low = _mm256_blendv_epi8(_mm256_shuffle_epi8(tableRows[0], index),
+                                         _mm256_shuffle_epi8(tableRows[1], index), _mm256_cmpeq_epi8(contact, bit4));
+        __m256i high = _mm256_blendv_epi8(_mm256_shuffle_epi8(tableRows[2], index),
+                                          _mm256_shuffle_epi8(tableRows[3], index), _mm256_cmpeq_epi8(contact, bit4));
+        __m256i result = _mm256_blendv_epi8(low, high, _mm256_cmpeq_epi8(positive, bit5));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(categories + i), result);
+    }
+    
+    ScreeningColumns rest = {answers.fever + i, answers.cough + i, answers.breathingDifficulty + i,
+                             answers.travelHistory + i, answers.closeContact + i, answers.testPositive + i};
+    categoriseBatchScalar(rest, count - i, categories + i, table);
+}
+#endif
+
+// The rules built into the program, in policy file form. Used until a
+// policy file is loaded, and as the starting point for writing one.
+const char* const DEFAULT_POLICY =
+    "# Durations in days\n"
+    "quarantine_days = 7\n"
+    "test_reminder_days = 3\n"
+    "\n"
+    "# Contact tracing: a POSITIVE result marks users this many contacts away,\n"
+    "# through contacts made this many days before the test, as close contacts\n"
+    "contact_window_days = 14\n"
+    "trace_hops = 2\n"
+    "\n"
+    "# Rules, tried in order; the first one whose conditions all hold decides\n"
+    "positive: positive\n"
+    "close_contact: contact\n"
+    "suspected: symptoms>=2\n"
+    "suspected: symptoms>=1 travel\n"
+    "travel_history: travel\n"
+    "low_risk:\n";
+
+// Published policy; null while the built-in one applies. A session holds
+// the policy it read, so a replaced policy is freed when the last session
+// that read it lets go.
+atomic<shared_ptr<const Policy>> activePolicy;
+
+shared_ptr<const Policy> currentPolicy()
+{
+    shared_ptr<const Policy> policy = activePolicy.load(memory_order_acquire);
+    if (policy)
+        return policy;
+    
+    static const shared_ptr<const Policy> builtIn = []() {
+        auto policy = make_shared<Policy>();
+        string error;
+        compilePolicy(DEFAULT_POLICY, *policy, error);
+        return policy;
+    }();
+    return builtIn;
+}
+
+// Parses a policy and evaluates its rules for all 64 sets of answers, so
+// using it is one table lookup however many rules it has. Lines are either
+// "name = days" for quarantine_days and test_reminder_days, or
+// "category: conditions". A condition is an answer (fever, cough, breathing,
+// travel, contact, positive), "!" and an answer for its negation, or
+// symptoms>=N, symptoms<=N or symptoms=N on the number of fever, cough and
+// breathing answers. A rule with no conditions always holds. Every set of
+// answers must reach some rule.
+bool compilePolicy(string_view text, Policy& policy, string& error)
+{
+    const char* const categoryNames[] = {"low_risk", "travel_history", "suspected", "close_contact", "positive"};
+    const char* const answerNames[] = {"fever", "cough", "breathing", "travel", "contact", "positive"};
+    struct Rule
+    {
+        Category category;
+        unsigned mask = 0;          // Answers the rule looks at
+        unsigned values = 0;        // and the value each must have
+        int minSymptoms = 0;
+        int maxSymptoms = 3;
+    };
+    
+    vector<Rule> rules;
+    policy.quarantineDays = QUARANTINE_DAYS;
+    policy.testReminderDays = TEST_REMINDER_DAYS;
+    policy.contactWindowDays = CONTACT_WINDOW_DAYS;
+    policy.traceHops = TRACE_HOPS;
+    int lineNumber = 0;
+    auto fail = [&](const string& message) {
+        error = "line " + to_string(lineNumber) + ": " + message;
+        return false;
+    };
+    auto trim = [](string_view field) {
+        size_t first = field.find_first_not_of(" \t\r");
+        if (first == string_view::npos)
+            return string_view();
+        return field.substr(first, field.find_last_not_of(" \t\r") - first + 1);
+    };
+    
+    while (!text.empty())
+    {
+        size_t newline = text.find('\n');
+        string_view line = text.substr(0, newline);
+        text.remove_prefix(newline == string_view::npos ? text.size() : newline + 1);
+        lineNumber++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+        
+        size_t equals = line.find('=');
+        size_t colon = line.find(':');
+        if (colon == string_view::npos && equals != string_view::npos)
+        {
+            string_view name = trim(line.substr(0, equals));
+            int value;
+            bool parsed = parseLeadingInt(trim(line.substr(equals + 1)), value);
+            if (name == "trace_hops")
+            {
+                if (!parsed || value < 0 || value > MAX_TRACE_HOPS)
+                    return fail("'trace_hops' needs a number from 0 to " + to_string(MAX_TRACE_HOPS));
+                policy.traceHops = value;
+                continue;
+            }
+            
+            int* days = name == "quarantine_days"       ? &policy.quarantineDays
+                        : name == "test_reminder_days"  ? &policy.testReminderDays
+                        : name == "contact_window_days" ? &policy.contactWindowDays
+                                                        : nullptr;
+            if (!days)
+                return fail("unknown setting '" + string(name) + "'");
+            if (!parsed || value < 1 || value > 3650)
+                return fail("'" + string(name) + "' needs a number of days from 1 to 3650");
+            *days = value;
+            continue;
+        }
+        if (colon == string_view::npos)
+            return fail("expected 'category: conditions' or 'setting = days'");
+        
+        Rule rule;
+        string_view name = trim(line.substr(0, colon));
+        auto category = find(begin(categoryNames), end(categoryNames), name);
+        if (category == end(categoryNames))
+            return fail("unknown category '" + string(name) + "'");
+        rule.category = static_cast<Category>(category - begin(categoryNames));
+        
+        string_view conditions = line.substr(colon + 1);
+        while (!(conditions = trim(conditions)).empty())
+        {
+            size_t space = conditions.find_first_of(" \t");
+            string_view condition = conditions.substr(0, space);
+            conditions.remove_prefix(space == string_view::npos ? conditions.size() : space);
+            
+            if (condition.rfind("symptoms", 0) == 0)
+            {
+                string_view comparison = condition.substr(8);
+                int count;
+                size_t digits = comparison.find_first_of("0123456789");
+                if (digits == string_view::npos || !parseLeadingInt(comparison.substr(digits), count) ||
+                    count < 0 || count > 3)
+                    return fail("'" + string(condition) + "' needs a symptom count from 0 to 3");
+                string_view op = comparison.substr(0, digits);
+                if (op == ">=")
+                    rule.minSymptoms = max(rule.minSymptoms, count);
+                else if (op == "<=")
+                    rule.maxSymptoms = min(rule.maxSymptoms, count);
+                else if (op == "=")
+                {
+                    rule.minSymptoms = max(rule.minSymptoms, count);
+                    rule.maxSymptoms = min(rule.maxSymptoms, count);
+                }
+                else
+                    return fail("'" + string(condition) + "' should use >=, <= or =");
+                continue;
+            }
+            
+            bool negated = condition.front() == '!';
+            if (negated)
+                condition.remove_prefix(1);
+            auto answer = find(begin(answerNames), end(answerNames), condition);
+            if (answer == end(answerNames))
+                return fail("unknown condition '" + string(condition) + "'");
+            unsigned bit = 1u << (answer - begin(answerNames));
+            rule.mask |= bit;
+            if (!negated)
+                rule.values |= bit;
+        }
+        rules.push_back(rule);
+    }
+    
+    for (unsigned index = 0; index < 64; index++)
+    {
+        int symptoms = (index & 1) + (index >> 1 & 1) + (index >> 2 & 1);
+        auto rule = find_if(rules.begin(), rules.end(), [&](const Rule& r) {
+            return (index & r.mask) == r.values && symptoms >= r.minSymptoms && symptoms <= r.maxSymptoms;
+        });
+        if (rule == rules.end())
+        {
+            string answers;
+            for (int bit = 0; bit < 6; bit++)
+                answers += string(answers.empty() ? "" : " ") + (index >> bit & 1 ? "" : "!") + answerNames[bit];
+            error = "has no rule for '" + answers + "'; end with a rule that has no conditions";
+            return false;
+        }
+        policy.table[index] = rule->category;
+    }
+    return true;
+}
+
+// Publishes a compiled policy, or the built-in one for null, with one atomic
+// store; nothing waits for it
+void installPolicy(shared_ptr<const Policy> policy)
+{
+    activePolicy.store(move(policy), memory_order_release);
+}
+
+// Installs POLICY_FILE if it has changed since it was last read, checking
+// at most once a second. A file that does not compile is reported and the
+// current policy stays; a file that is deleted puts the built-in policy back.
+// Returns true if a new policy was installed, and sets `durationsChanged` if
+// timers set under the old one are now wrong.
+bool reloadPolicyIfChanged(bool& durationsChanged)
+{
+    static mutex reloadMutex;
+    static chrono::steady_clock::time_point lastCheck;
+    static filesystem::file_time_type loadedTime;  // Default while no file is in force
+    static bool checked = false;
+    durationsChanged = false;
+    
+    unique_lock<mutex> lock(reloadMutex, try_to_lock);
+    auto now = chrono::steady_clock::now();
+    if (!lock || (checked && now - lastCheck < chrono::seconds(1)))
+        return false;
+    lastCheck = now;
+    checked = true;
+    
+    error_code ec;
+    filesystem::file_time_type modified = filesystem::last_write_time(POLICY_FILE, ec);
+    if (ec == errc::no_such_file_or_directory && loadedTime != filesystem::file_time_type())
+    {
+        // Whatever the deleted file set is undone, not left in force unseen
+        loadedTime = filesystem::file_time_type();
+        shared_ptr<const Policy> previous = currentPolicy();
+        installPolicy(nullptr);
+        shared_ptr<const Policy> builtIn = currentPolicy();
+        durationsChanged = builtIn->quarantineDays != previous->quarantineDays ||
+                           builtIn->testReminderDays != previous->testReminderDays;
+        cout << POLICY_FILE << " was removed; using the built-in policy.\n";
+        return previous != builtIn;
+    }
+    if (ec || modified == loadedTime)
+        return false;
+    loadedTime = modified;
+    
+    ifstream file(POLICY_FILE, ios::binary);
+    stringstream text;
+    text << file.rdbuf();
+    auto policy = make_shared<Policy>();
+    string error;
+    if (!file || !compilePolicy(text.str(), *policy, error))
+    {
+        cerr << "Error: " << POLICY_FILE << " " << (error.empty() ? "could not be read" : error)
+             << "; keeping the current policy.\n";
+        return false;
+    }
+    
+    shared_ptr<const Policy> previous = currentPolicy();
+    durationsChanged = policy->quarantineDays != previous->quarantineDays ||
+                       policy->testReminderDays != previous->testReminderDays;
+    cout << "Loaded policy from " << POLICY_FILE << " (quarantine " << policy->quarantineDays
+         << " days, test reminder " << policy->testReminderDays << " days, contact window "
+         << policy->contactWindowDays << " days, trace " << policy->traceHops << " hop(s)).\n";
+    installPolicy(move(policy));
+    return true;
+}
+
+#ifdef HAVE_METRICS
+int LatencyHistogram::bucketOf(uint64_t ns)
+{
+    if (ns < static_cast<uint64_t>(SUB_BUCKETS))
+        return static_cast<int>(ns);
+    int shift = bit_width(ns) - LATENCY_SUB_BUCKET_BITS - 1;
+    int bucket = shift * SUB_BUCKETS + static_cast<int>(ns >> shift);
+    return min(bucket, BUCKETS - 1);
+}
+
+uint64_t LatencyHistogram::bucketLimit(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return static_cast<uint64_t>(bucket);
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t top = static_cast<uint64_t>(bucket - shift * SUB_BUCKETS);
+    return ((top + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+    bump(counts[bucketOf(ns)], 1);
+    bump(total, 1);
+    bump(totalNs, ns);
+    if (ns > maxNs.load(memory_order_relaxed))
+        maxNs.store(ns, memory_order_relaxed);
+}
+
+void LatencyHistogram::addTo(LatencyHistogram& sum) const
+{
+    for (int bucket = 0; bucket < BUCKETS; bucket++)
+    {
+        uint64_t count = counts[bucket].load(memory_order_relaxed);
+        if (count > 0)
+            bump(sum.counts[bucket], count);
+    }
+    bump(sum.total, total.load(memory_order_relaxed));
+    bump(sum.totalNs, totalNs.load(memory_order_relaxed));
+    sum.maxNs.store(max(sum.maxNs.load(memory_order_relaxed), maxNs.load(memory_order_relaxed)),
+                    memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    uint64_t samples = count();
+    if (samples == 0)
+        return 0;
+    uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * static_cast<double>(samples))));
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; bucket++)
+    {
+        seen += counts[bucket].load(memory_order_relaxed);
+        if (seen >= rank)
+            return min(bucketLimit(bucket), maximum());
+    }
+    return maximum();
+}
+
+double LatencyHistogram::mean() const
+{
+    uint64_t samples = count();
+    return samples ? static_cast<double>(totalNs.load(memory_order_relaxed)) / samples : 0;
+}
+
+void ThreadMetrics::addTo(ThreadMetrics& total) const
+{
+    for (int operation = 0; operation < METRIC_OPERATION_COUNT; operation++)
+    {
+        latency[operation].addTo(total.latency[operation]);
+        total.operations[operation] += operations[operation].load(memory_order_relaxed);
+    }
+    for (int counter = 0; counter < METRIC_COUNTER_COUNT; counter++)
+        total.counters[counter] += counters[counter].load(memory_order_relaxed);
+}
+
+// Every live thread's metrics, and the sum of those of threads that have
+// exited, so totals never go down
+mutex metricsRegistryMutex;
+vector<ThreadMetrics*> liveMetrics;
+ThreadMetrics retiredMetrics;
+
+// Owns a thread's metrics and folds them into retiredMetrics at thread exit.
+// Kept apart from the plain pointer the fast path reads, which needs no
+// thread-exit guard.
+struct ThreadMetricsOwner
+{
+    ~ThreadMetricsOwner()
+    {
+        if (!metrics)
+            return;
+        lock_guard<mutex> lock(metricsRegistryMutex);
+        metrics->addTo(retiredMetrics);
+        liveMetrics.erase(find(liveMetrics.begin(), liveMetrics.end(), metrics.get()));
+    }
+
+    unique_ptr<ThreadMetrics> metrics;
+};
+
+thread_local ThreadMetricsOwner localMetricsOwner;
+
+ThreadMetrics& registerThreadMetrics()
+{
+    localMetricsOwner.metrics = make_unique<ThreadMetrics>();
+    localMetrics = localMetricsOwner.metrics.get();
+    lock_guard<mutex> lock(metricsRegistryMutex);
+    liveMetrics.push_back(localMetrics);
+    return *localMetrics;
+}
+
+// Sums every thread's metrics into `total`
+void collectMetrics(ThreadMetrics& total)
+{
+    lock_guard<mutex> lock(metricsRegistryMutex);
+    retiredMetrics.addTo(total);
+    for (const ThreadMetrics* metrics : liveMetrics)
+        metrics->addTo(total);
+}
+
+void LatencyTimer::recordSample()
+{
+    auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+    metrics.latency[operation].record(static_cast<uint64_t>(elapsed.count()));
+}
+#endif
+
+// Prints calls, timed samples and latency percentiles in microseconds for
+// each operation, then the counters, summed over every thread
+void printMetrics(ostream& out)
+{
+#ifdef HAVE_METRICS
+    const char* const operationNames[] = {"load", "save", "login", "registration", "assessment", "profile_update"};
+    const char* const counterNames[] = {"load_warnings", "skipped_lines", "failed_logins"};
+    auto total = make_unique<ThreadMetrics>();
+    collectMetrics(*total);
+    
+    ios::fmtflags flags = out.flags();
+    streamsize precision = out.precision();
+    out << left << setw(16) << "operation" << right << setw(10) << "calls" << setw(10) << "timed" << setw(12)
+        << "p50_us" << setw(12) << "p99_us" << setw(12) << "p999_us" << setw(12) << "max_us" << setw(12)
+        << "mean_us" << "\n";
+    out << fixed << setprecision(1);
+    for (int operation = 0; operation < METRIC_OPERATION_COUNT; operation++)
+    {
+        const LatencyHistogram& latency = total->latency[operation];
+        out << left << setw(16) << operationNames[operation] << right << setw(10)
+            << total->operations[operation].load() << setw(10) << latency.count() << setw(12)
+            << latency.percentile(0.5) / 1e3 << setw(12) << latency.percentile(0.99) / 1e3 << setw(12)
+            << latency.percentile(0.999) / 1e3 << setw(12) << latency.maximum() / 1e3 << setw(12)
+            << latency.mean() / 1e3 << "\n";
+    }
+    for (int counter = 0; counter < METRIC_COUNTER_COUNT; counter++)
+        out << left << setw(16) << counterNames[counter] << right << setw(10) << total->counters[counter].load() << "\n";
+    out.flags(flags);
+    out.precision(precision);
+#else
+    out << "Metrics were left out of this build (NO_METRICS).\n";
+#endif
+}
+
+// Rewrites `filename` with printMetrics' report, through a temporary file
+bool writeStats(const string& filename)
+{
+    string tempName = filename + ".tmp";
+    ofstream outfile(tempName, ios::trunc);
+    printMetrics(outfile);
+    outfile.close();
+    if (!outfile)
+    {
+        cerr << "Error: Could not write statistics to " << filename << ".\n";
+        return false;
+    }
+    return replaceFile(tempName, filename, false);
+}
+
+// Writes the statistics file at most once every STATS_INTERVAL_SECONDS
+void writeStatsIfDue(const string& filename)
+{
+    static mutex writeMutex;
+    static chrono::steady_clock::time_point lastWrite;
+    if (filename.empty())
+        return;
+    
+    unique_lock<mutex> lock(writeMutex, try_to_lock);
+    auto now = chrono::steady_clock::now();
+    if (!lock || (lastWrite.time_since_epoch().count() != 0 && now - lastWrite < chrono::seconds(STATS_INTERVAL_SECONDS)))
+        return;
+    lastWrite = now;
+    writeStats(filename);
+}
+
+void viewCategory(Terminal& term, const UserDirectory& directory, UserId id)
+{
+    User user;
+    if (!directory.get(id, user))
+        return;
+    
+    term.out << "HEALTH CATEGORY & RECOMMENDATIONS\n";
+    term.out << "==================================\n\n";
+    
+    string categoryNames[] = {"Low Risk", "Travel History", "Suspected Case", "Close Contact", "Positive Case"};
+    term.out << "Your Category: " << categoryNames[user.category] << "\n\n";
+    
+    switch (user.category)
+    {
+        case POSITIVE:
+            term.out << "RECOMMENDED ACTIONS:\n";
+            term.out << "1. Isolate immediately for " << currentPolicy()->quarantineDays << " days\n";
+            term.out << "2. Notify your supervisor/lecturer\n";
+            term.out << "3. Follow local health authority guidelines\n";
+            term.out << "4. Monitor symptoms closely\n";
+            term.out << "5. Seek medical attention if symptoms worsen\n";
+            break;
+            
+        case CLOSE_CONTACT:
+            term.out << "RECOMMENDED ACTIONS:\n";
+            term.out << "1. Self-quarantine for " << currentPolicy()->testReminderDays << " days\n";
+            term.out << "2. Get tested immediately\n";
+            term.out << "3. Monitor for symptoms\n";
+            term.out << "4. Wear a mask around others\n";
+            break;
+            
+        case SUSPECTED:
+            term.out << "RECOMMENDED ACTIONS:\n";
+            term.out << "1. Self-isolate immediately\n";
+            term.out << "2. Get tested as soon as possible\n";
+            term.out << "3. Rest and monitor symptoms\n";
+            term.out << "4. Avoid contact with others\n";
+            break;
+            
+        case TRAVEL_HISTORY:
+            term.out << "RECOMMENDED ACTIONS:\n";
+            term.out << "1. Monitor for symptoms for 14 days\n";
+            term.out << "2. Consider getting tested\n";
+            term.out << "3. Follow local quarantine requirements\n";
+            break;
+            
+        case LOW_RISK:
+            term.out << "RECOMMENDED ACTIONS:\n";
+            term.out << "1. Continue practicing preventive measures\n";
+            term.out << "2. Wash hands regularly\n";
+            term.out << "3. Wear mask in crowded places\n";
+            term.out << "4. Get tested if you develop symptoms\n";
+            break;
+    }
+    
+    term.out << "\nLast Test Date: " << (user.testDay == NO_TEST_DAY ? "Not recorded" : dayNumberToDate(user.testDay)) << endl;
+}
+
+void showReminder(Terminal& term, const UserDirectory& directory, UserId id)
+{
+    User user;
+    if (!directory.get(id, user))
+        return;
+    
+    if (user.testDay == NO_TEST_DAY)
+    {
+        term.out << "\nREMINDER: Please complete your COVID-19 test assessment.\n";
+        return;
+    }
+    
+    int daysSinceTest = currentDayNumber() - user.testDay;
+    shared_ptr<const Policy> policy = currentPolicy();
+    
+    if (daysSinceTest >= policy->testReminderDays && daysSinceTest < policy->quarantineDays)
+    {
+        term.out << "\nREMINDER: It has been " << daysSinceTest << " days since your last test. ";
+        term.out << "Consider getting tested again.\n";
+    }
+}
+
+int categoryToInt(Category category)
+{
+    return static_cast<int>(category);
+}
+
+Category intToCategory(int value)
+{
+    if (value >= 0 && value <= 4)
+        return static_cast<Category>(value);
+    return LOW_RISK;
+}
+
+// Original regex validator and stringstream normaliser. Together they
+// define which dates the loader and the date prompt accept; they are kept as
+// the reference for the getline loader and --bench-dates.
+bool isValidDateRegex(const string& dateStr)
+{
+    // Check for default date
+    if (dateStr == DEFAULT_DATE) return true;
+    
+    // Remove any trailing whitespace
+    string trimmed = dateStr;
+    trimmed.erase(trimmed.find_last_not_of(" \t\n\r\f\v") + 1);
+    
+    // Accept various date formats
+    regex datePattern1("^(0[1-9]|[12][0-9]|3[01])/(0[1-9]|1[0-2])/([0-9]{4})$");  // DD/MM/YYYY
+    regex datePattern2("^([1-9]|[12][0-9]|3[01])/([1-9]|1[0-2])/([0-9]{4})$");     // D/M/YYYY
+    regex datePattern3("^(0[1-9]|[12][0-9]|3[01])/([1-9]|1[0-2])/([0-9]{4})$");    // DD/M/YYYY
+    regex datePattern4("^([1-9]|[12][0-9]|3[01])/(0[1-9]|1[0-2])/([0-9]{4})$");    // D/MM/YYYY
+    
+    if (!regex_match(trimmed, datePattern1) && 
+        !regex_match(trimmed, datePattern2) &&
+        !regex_match(trimmed, datePattern3) &&
+        !regex_match(trimmed, datePattern4)) {
+        return false;
+    }
+    
+    // Parse the date
+    stringstream ss(trimmed);
+    int day, month, year;
+    char slash;
+    
+    if (!(ss >> day >> slash >> month >> slash >> year)) {
+        return false;
+    }
+    
+    // Basic validation
+    if (year < 1900 || year > 2100) return false;
+    if (month < 1 || month > 12) return false;
+    if (day < 1 || day > 31) return false;
+    
+    // Check specific month-day combinations
+    if (month == 2) {
+        bool isLeap = (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
+        if (day > (isLeap ? 29 : 28))
+            return false;
+    }
+    else if (month == 4 || month == 6 || month == 9 || month == 11) {
+        if (day > 30)
+            return false;
+    }
+    
+    return true;
+}
+
+string normalizeDateStream(const string& dateStr)
+{
+    if (dateStr.empty() || dateStr == DEFAULT_DATE) {
+        return DEFAULT_DATE;
+    }
+    
+    string trimmed = dateStr;
+    // Remove any trailing whitespace
+    trimmed.erase(trimmed.find_last_not_of(" \t\n\r\f\v") + 1);
+    
+    // Try to parse the date
+    stringstream ss(trimmed);
+    int day, month, year;
+    char slash;
+    
+    if (!(ss >> day >> slash >> month >> slash >> year)) {
+        return DEFAULT_DATE;
+    }
+    
+    // Format to DD/MM/YYYY
+    stringstream normalized;
+    normalized << setfill('0') << setw(2) << day << "/"
+               << setfill('0') << setw(2) << month << "/"
+               << setfill('0') << setw(4) << year;
+    
+    return normalized.str();
+}
+
+// Days since 01/01/1970 for a proleptic Gregorian date
+constexpr int32_t daysFromCivil(int year, int month, int day)
+{
+    year -= (month <= 2) ? 1 : 0;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+void civilFromDays(int32_t dayNumber, int& year, int& month, int& day)
+{
+    int z = dayNumber + 719468;
+    int era = (z >= 0 ? z : z - 146096) / 146097;
+    int dayOfEra = z - era * 146097;
+    int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int mp = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * mp + 2) / 5 + 1;
+    month = mp + (mp < 10 ? 3 : -9);
+    year = yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+}
+
+// Parses a test date exactly as normalizeDateStream followed by
+// isValidDateRegex always has: day, month and year read like `>> int`
+// (leading blanks, an optional sign, leading zeros), each pair separated by
+// any one non-blank character, and anything after the year ignored. Text
+// that does not have that shape, an empty string and DEFAULT_DATE all mean
+// "never tested" and give NO_TEST_DAY. Returns false only for a date that
+// does not exist or falls outside 1900-2100. Allocates nothing and can run at
+// compile time.
+constexpr bool parseDate(string_view text, int32_t& dayNumber)
+{
+    size_t pos = 0;
+    auto skipBlanks = [&]() {
+        while (pos < text.size() && (text[pos] == ' ' || (text[pos] >= '\t' && text[pos] <= '\r')))
+            pos++;
+    };
+    auto readInt = [&](int& value) {
+        skipBlanks();
+        bool negative = false;
+        if (pos < text.size() && (text[pos] == '+' || text[pos] == '-'))
+        {
+            negative = (text[pos] == '-');
+            pos++;
+        }
+        size_t digitsStart = pos;
+        long long result = 0;
+        while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9')
+        {
+            result = result * 10 + (text[pos] - '0');
+            if (result > static_cast<long long>(INT_MAX) + 1)
+                return false;
+            pos++;
+        }
+        if (pos == digitsStart || (!negative && result > INT_MAX))
+            return false;
+        value = static_cast<int>(negative ? -result : result);
+        return true;
+    };
+    auto readSeparator = [&]() {
+        skipBlanks();
+        if (pos == text.size())
+            return false;
+        pos++;
+        return true;
+    };
+    
+    int day = 0, month = 0, year = 0;
+    if (!readInt(day) || !readSeparator() || !readInt(month) || !readSeparator() || !readInt(year) ||
+        (day == 0 && month == 0 && year == 0))
+    {
+        dayNumber = NO_TEST_DAY;
+        return true;
+    }
+    
+    if (year < 1900 || year > 2100 || month < 1 || month > 12 || day < 1)
+        return false;
+    bool isLeap = (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
+    int monthDays = (month == 2) ? (isLeap ? 29 : 28) :
+                    (month == 4 || month == 6 || month == 9 || month == 11) ? 30 : 31;
+    if (day > monthDays)
+        return false;
+    
+    dayNumber = daysFromCivil(year, month, day);
+    return true;
+}
+
+static_assert([] { int32_t day = 1; return parseDate("01/01/1970", day) && day == 0; }(),
+              "parseDate must count days from 01/01/1970");
+static_assert([] { int32_t day = 0; return parseDate("29/2/2024", day) && !parseDate("29/02/2023", day); }(),
+              "parseDate must handle leap years");
+static_assert([] { int32_t day = 0; return parseDate("00/00/0000", day) && day == NO_TEST_DAY; }(),
+              "DEFAULT_DATE must parse as never tested");
+
+// Writes the DD/MM/YYYY form of a day number, or DEFAULT_DATE for
+// NO_TEST_DAY, into the 10 characters at `out`
+void formatDate(int32_t dayNumber, char* out)
+{
+    if (dayNumber == NO_TEST_DAY)
+    {
+        memcpy(out, DEFAULT_DATE.data(), 10);
+        return;
+    }
+    
+    int year, month, day;
+    civilFromDays(dayNumber, year, month, day);
+    out[0] = static_cast<char>('0' + day / 10);
+    out[1] = static_cast<char>('0' + day % 10);
+    out[2] = '/';
+    out[3] = static_cast<char>('0' + month / 10);
+    out[4] = static_cast<char>('0' + month % 10);
+    out[5] = '/';
+    out[6] = static_cast<char>('0' + year / 1000 % 10);
+    out[7] = static_cast<char>('0' + year / 100 % 10);
+    out[8] = static_cast<char>('0' + year / 10 % 10);
+    out[9] = static_cast<char>('0' + year % 10);
+}
+
+string dayNumberToDate(int32_t dayNumber)
+{
+    char date[10];
+    formatDate(dayNumber, date);
+    return string(date, sizeof(date));
+}
+
+bool needsTesting(const User* user)
+{
+    if (user->testDay == NO_TEST_DAY)
+        return true;
+    
+    int daysSinceTest = currentDayNumber() - user->testDay;
+    return (daysSinceTest >= currentPolicy()->testReminderDays);
+}
+
+// Returns true if the user's quarantine has just ended
+bool updateCategoryBasedOnTime(User* user)
+{
+    if (user->category != POSITIVE || user->testDay == NO_TEST_DAY)
+        return false;
+    
+    // Calculate days since positive test
+    int daysSinceTest = currentDayNumber() - user->testDay;
+    
+    if (daysSinceTest >= currentPolicy()->quarantineDays)
+    {
+        user->category = LOW_RISK;
+        return true;
+    }
+    return false;
+}
+
+bool sameUser(const User& a, const User& b)
+{
+    return a.username == b.username && a.password == b.password && a.name == b.name && a.age == b.age &&
+           a.address == b.address && a.phone == b.phone && a.IC == b.IC && a.category == b.category &&
+           a.testDay == b.testDay;
+}
+
+void displayQuote(Terminal& term)
+{
+    string quotes[] = {
+        "\"Health is a state of complete harmony of the body, mind and spirit.\" - B.K.S. Iyengar",
+        "\"To ensure good health: eat lightly, breathe deeply, live moderately, cultivate cheerfulness.\" - William Londen",
+        "\"It is health that is the real wealth, and not pieces of gold and silver.\" - Mahatma Gandhi",
+        "\"The first wealth is health.\" - Ralph Waldo Emerson",
+        "\"He who has health has hope, and he who has hope has everything.\" - Thomas Carlyle",
+        "\"A good laugh and a long sleep are the best cures in the doctor's book.\" - Irish Proverb",
+        "\"Keeping your body healthy is an expression of gratitude to the whole cosmos.\" - Thich Nhat Hanh",
+        "\"The doctor of the future will give no medicine, but will instruct his patients in care of the human frame.\" - Thomas Edison",
+        "\"The cheerful mind perseveres, and the strong mind hews its way through a thousand difficulties.\" - Swami Vivekananda",
+        "\"Good health is not something we can buy. However, it can be an extremely valuable savings account.\" - Anne Wilson Schaef"
+    };
+    
+    srand(static_cast<unsigned>(time(nullptr)));
+    int index = rand() % 10;
+    
+    term.out << "Daily Inspiration: " << quotes[index] << "\n";
+}
+
+Task<int> getValidatedInt(Terminal& term, string prompt, int minVal, int maxVal)
+{
+    int value;
+    while (true)
+    {
+        term.out << prompt;
+        string input;
+        co_await readLine(term, input);
+        
+        // Check if input is empty
+        if (input.empty()) {
+            term.out << "Input cannot be empty. Please enter a number.\n";
+            continue;
+        }
+        
+        // Check if all characters are digits (or negative sign at start)
+        bool isNumeric = true;
+        for (size_t i = 0; i < input.length(); i++) {
+            if (i == 0 && input[i] == '-') {
+                continue;  // Allow negative sign at beginning
+            }
+            if (!isdigit(input[i])) {
+                isNumeric = false;
+                break;
+            }
+        }
+        
+        if (!isNumeric) {
+            term.out << "Invalid input. Please enter a valid number.\n";
+            continue;
+        }
+        
+        try {
+            value = stoi(input);
+        } catch (const invalid_argument& e) {
+            term.out << "Invalid input. Please enter a valid number.\n";
+            continue;
+        } catch (const out_of_range& e) {
+            term.out << "Number is too large or too small. Please enter a value between " 
+                 << minVal << " and " << maxVal << ".\n";
+            continue;
+        }
+        
+        if (value < minVal || value > maxVal)
+        {
+            term.out << "Please enter a value between " << minVal << " and " << maxVal << ".\n";
+        }
+        else
+        {
+            co_return value;
+        }
+    }
+}
+
+Task<string> getValidatedString(Terminal& term, string prompt, bool allowSpaces)
+{
+    string input;
+    term.out << prompt;
+    
+    if (allowSpaces)
+    {
+        co_await readLine(term, input);
+    }
+    else
+    {
+        co_await readWord(term, input);
+        co_await skipLine(term);
+    }
+    
+    co_return input;
+}
+
+// Today's date in local time as a day number
+int32_t currentDayNumber()
+{
+    // Sessions call this concurrently, so use the reentrant localtime
+    time_t now = time(nullptr);
+    tm localTime;
+#ifdef _WIN32
+    localtime_s(&localTime, &now);
+#else
+    localtime_r(&now, &localTime);
+#endif
+    return daysFromCivil(localTime.tm_year + 1900, localTime.tm_mon + 1, localTime.tm_mday);
+}
+
+// Reads an integer prefix the same way stoi does (leading whitespace, optional
+// sign, trailing characters ignored) without building a temporary string.
+bool parseLeadingInt(string_view text, int& value)
+{
+    size_t i = 0;
+    while (i < text.size() && isspace(static_cast<unsigned char>(text[i])))
+        i++;
+    
+    bool negative = false;
+    if (i < text.size() && (text[i] == '+' || text[i] == '-'))
+    {
+        negative = (text[i] == '-');
+        i++;
+    }
+    
+    size_t digitsStart = i;
+    long long result = 0;
+    while (i < text.size() && isdigit(static_cast<unsigned char>(text[i])))
+    {
+        result = result * 10 + (text[i] - '0');
+        if (result > static_cast<long long>(INT_MAX) + 1)
+            return false;
+        i++;
+    }
+    
+    if (i == digitsStart)
+        return false;
+    if (negative)
+        result = -result;
+    if (result < INT_MIN || result > INT_MAX)
+        return false;
+    
+    value = static_cast<int>(result);
+    return true;
+}
+
+// Splits argv into settings (which also apply to the interactive program)
+// and an optional tool command with its positional arguments.
+bool parseCommandLine(int argc, char* argv[], ProgramOptions& options)
+{
+    const vector<string> commands = {"--generate", "--bench-load", "--bench-login", "--bench-memory", "--bench-dates",
+                                     "--bench-scheduler", "--bench-contention", "--due-report", "--serve", "--load-test", "--replay",
+                                     "--import-text", "--export-text", "--ingest", "--bench-categorise",
+                                     "--bench-policy", "--dashboard", "--history", "--tests-between",
+                                     "--bench-history", "--trace", "--bench-contacts", "--lookup", "--query",
+                                     "--bench-query", "--bench-suite", "--bench-metrics", "--route",
+                                     "--split-partition", "--bench-partitions", "--promote", "--bench-writer"};
+    
+    try {
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--load-threads" && i + 1 < argc)
+            {
+                options.loadThreads = static_cast<unsigned>(stoul(argv[++i]));
+            }
+            else if (arg == "--server-threads" && i + 1 < argc)
+            {
+                options.serverThreads = max(1u, static_cast<unsigned>(stoul(argv[++i])));
+            }
+            else if (arg == "--journal")
+            {
+                options.persistence = PERSIST_JOURNAL;
+            }
+            else if (arg == "--unique-ic")
+            {
+                options.uniqueIC = true;
+            }
+            else if (arg == "--stats-file" && i + 1 < argc)
+            {
+                options.statsFile = argv[++i];
+            }
+            else if (arg == "--headless")
+            {
+                options.headless = true;
+            }
+            else if (arg == "--replica")
+            {
+                options.replica = true;
+            }
+            else if (arg == "--max-staleness" && i + 1 < argc)
+            {
+                options.maxStalenessMs = max(0, stoi(argv[++i]));
+            }
+            else if (arg == "--record" && i + 1 < argc)
+            {
+                options.recordFile = argv[++i];
+            }
+            else if (arg == "--partition" && i + 1 < argc)
+            {
+                if (!parsePartition(argv[++i], options.partition))
+                {
+                    cerr << "Error: --partition takes <index>/<count>, the count a power of two up to "
+                         << MAX_PARTITIONS << ".\n";
+                    return false;
+                }
+                options.partitionGiven = true;
+            }
+            else if (arg == "--fsync" && i + 1 < argc)
+            {
+                string policy = argv[++i];
+                if (policy == "none")
+                    options.fsyncPolicy = FSYNC_NONE;
+                else if (policy == "commit")
+                    options.fsyncPolicy = FSYNC_COMMIT;
+                else
+                {
+                    size_t used = 0;
+                    int intervalMs = stoi(policy, &used);
+                    if (used != policy.size() || intervalMs <= 0)
+                    {
+                        cerr << "Error: --fsync takes none, commit or a positive number of milliseconds.\n";
+                        return false;
+                    }
+                    options.fsyncPolicy = FSYNC_INTERVAL;
+                    options.fsyncIntervalMs = intervalMs;
+                }
+            }
+            else if (options.command.empty() && find(commands.begin(), commands.end(), arg) != commands.end())
+            {
+                options.command = arg;
+            }
+            else if (!options.command.empty() && arg.rfind("--", 0) != 0)
+            {
+                options.commandArgs.push_back(arg);
+            }
+            else
+            {
+                cerr << "Error: Unrecognised argument '" << arg << "'.\n";
+                return false;
+            }
+        }
+    } catch (const exception& e) {
+        cerr << "Error: Invalid argument (" << e.what() << ").\n";
+        return false;
+    }
+    
+    return true;
+}
+
+int runCommand(const ProgramOptions& options)
+{
+    const vector<string>& args = options.commandArgs;
+    auto dayArgument = [](const string& text) {
+        int32_t day;
+        if (text == "today")
+            return currentDayNumber();
+        if (!parseDate(text, day) || day == NO_TEST_DAY)
+            throw invalid_argument("not a date: " + text);
+        return day;
+    };
+    
+    try {
+        if (options.command == "--generate" && (args.size() == 2 || args.size() == 3))
+        {
+            return generateUserFile(args[1], stoll(args[0]), args.size() == 3 ? stoi(args[2]) : 0) ? 0 : 1;
+        }
+        if (options.command == "--bench-suite" && args.size() <= 2)
+        {
+            return runBenchmarkSuite(args.empty() ? 1000000 : stoll(args[0]), args.size() == 2 ? args[1] : "-") ? 0 : 1;
+        }
+        if (options.command == "--bench-load" && (args.size() == 1 || args.size() == 2))
+        {
+            benchmarkLoad(args[0], args.size() == 2 ? stoi(args[1]) : 3);
+            return 0;
+        }
+        if (options.command == "--bench-login" && args.size() <= 1)
+        {
+            benchmarkLogin(args.empty() ? 10000000 : stoll(args[0]));
+            return 0;
+        }
+        if (options.command == "--bench-scheduler" && args.size() <= 1)
+        {
+            return benchmarkScheduler(args.empty() ? 1000000 : stoll(args[0])) ? 0 : 1;
+        }
+        if (options.command == "--bench-contention" && args.size() <= 2)
+        {
+            unsigned maxThreads = args.size() == 2 ? static_cast<unsigned>(stoul(args[1]))
+                                                   : max(8u, thread::hardware_concurrency());
+            return benchmarkContention(args.empty() ? 1000000 : stoll(args[0]), max(1u, maxThreads)) ? 0 : 1;
+        }
+        if (options.command == "--dashboard" && args.empty())
+        {
+            return showDashboard(options) ? 0 : 1;
+        }
+        if (options.command == "--history" && args.size() >= 1 && args.size() <= 3)
+        {
+            int32_t fromDay = args.size() >= 2 ? dayArgument(args[1]) : INT32_MIN;
+            int32_t toDay = args.size() == 3 ? dayArgument(args[2]) : INT32_MAX;
+            return showHistory(options, args[0], fromDay, toDay) ? 0 : 1;
+        }
+        if (options.command == "--tests-between" && (args.size() == 1 || args.size() == 2))
+        {
+            int32_t fromDay = dayArgument(args[0]);
+            return showTestsBetween(options, fromDay, args.size() == 2 ? dayArgument(args[1]) : fromDay) ? 0 : 1;
+        }
+        if (options.command == "--trace" && (args.size() == 1 || args.size() == 2))
+        {
+            return showContacts(options, args[0], args.size() == 2 ? stoi(args[1]) : -1) ? 0 : 1;
+        }
+        if (options.command == "--lookup" && args.size() == 1)
+        {
+            return showLookup(options, args[0]) ? 0 : 1;
+        }
+        if (options.command == "--query")
+        {
+            return showQuery(options, args) ? 0 : 1;
+        }
+        if (options.command == "--due-report" && args.empty())
+        {
+            printDueReport(options);
+            return 0;
+        }
+        if (options.command == "--bench-dates" && args.empty())
+        {
+            return benchmarkDates() ? 0 : 1;
+        }
+        if (options.command == "--bench-categorise" && args.size() <= 1)
+        {
+            return benchmarkCategorise(args.empty() ? 10000000 : stoll(args[0])) ? 0 : 1;
+        }
+        if (options.command == "--bench-policy" && args.size() <= 1)
+        {
+            return benchmarkPolicy(args.empty() ? 10000000 : stoll(args[0])) ? 0 : 1;
+        }
+        if (options.command == "--bench-history" && args.size() <= 2)
+        {
+            long long users = args.empty() ? 100000 : stoll(args[0]);
+            return benchmarkHistory(users, args.size() == 2 ? stoi(args[1]) : 365) ? 0 : 1;
+        }
+        if (options.command == "--bench-contacts" && args.size() <= 2)
+        {
+            long long users = args.empty() ? 1000000 : stoll(args[0]);
+            return benchmarkContacts(users, args.size() == 2 ? stoi(args[1]) : 10) ? 0 : 1;
+        }
+        if (options.command == "--bench-metrics" && args.size() <= 1)
+        {
+            return benchmarkMetrics(args.empty() ? 1000000 : stoll(args[0])) ? 0 : 1;
+        }
+        if (options.command == "--bench-partitions" && args.size() <= 1)
+        {
+            return benchmarkPartitions(args.empty() ? 1000000 : stoll(args[0])) ? 0 : 1;
+        }
+        if (options.command == "--bench-writer" && args.size() <= 1)
+        {
+            return benchmarkWriter(args.empty() ? 20000 : stoll(args[0])) ? 0 : 1;
+        }
+        if (options.command == "--bench-query" && args.size() <= 1)
+        {
+            return benchmarkQuery(args.empty() ? 10000000 : stoll(args[0])) ? 0 : 1;
+        }
+        if (options.command == "--bench-memory" && args.size() <= 1)
+        {
+            return benchmarkMemory(args.empty() ? 10000000 : stoll(args[0])) ? 0 : 1;
+        }
+        if (options.command == "--ingest" && (args.size() == 1 || args.size() == 2))
+        {
+            size_t batchRows = args.size() == 2 ? stoull(args[1]) : INGEST_BATCH_ROWS;
+            return ingestResults(options, args[0], max<size_t>(1, batchRows)) ? 0 : 1;
+        }
+        if (options.command == "--serve" && args.size() == 1)
+        {
+            return runServer(options, args[0]);
+        }
+        if (options.command == "--route" && args.size() == 2)
+        {
+            return runRouter(args[0], args[1]);
+        }
+        if (options.command == "--split-partition" && args.size() == 3)
+        {
+            return splitMappedPartition(args[0], args[1], args[2]) ? 0 : 1;
+        }
+        if (options.command == "--promote" && args.size() == 1)
+        {
+            return promoteReplica(args[0]) ? 0 : 1;
+        }
+        if (options.command == "--load-test" && args.size() >= 1 && args.size() <= 4)
+        {
+            long long sessions = args.size() >= 2 ? stoll(args[1]) : 1000;
+            unsigned concurrency = args.size() >= 3 ? static_cast<unsigned>(stoul(args[2])) : 32;
+            long long idle = args.size() == 4 ? stoll(args[3]) : 0;
+            return runLoadTest(args[0], sessions, max(1u, concurrency), idle) ? 0 : 1;
+        }
+        if (options.command == "--replay" && args.size() >= 2 && args.size() <= 4)
+        {
+            vector<string> scripts;
+            stringstream names(args[1]);
+            string name;
+            while (getline(names, name, ','))
+            {
+                ifstream file(name, ios::binary);
+                stringstream text;
+                text << file.rdbuf();
+                if (!file || text.str().empty())
+                {
+                    cerr << "Error: Could not read the script " << name << ".\n";
+                    return 1;
+                }
+                scripts.push_back(text.str());
+            }
+            long long sessions = args.size() >= 3 ? stoll(args[2]) : 1000;
+            unsigned concurrency = args.size() == 4 ? static_cast<unsigned>(stoul(args[3])) : 32;
+            return runLoadTest(args[0], sessions, max(1u, concurrency), 0, scripts) ? 0 : 1;
+        }
+        if (options.command == "--import-text" && args.size() == 2)
+        {
+            vector<User> users;
+            loadUsersFromFile(args[0], users, options.loadThreads);
+            UserStore store;
+            store.assign(move(users));
+            return saveSnapshot(args[1], store) ? 0 : 1;
+        }
+        if (options.command == "--export-text" && args.size() == 2)
+        {
+            vector<User> users;
+            if (!loadSnapshot(args[0], users, options.loadThreads))
+                return 1;
+            UserStore store;
+            store.assign(move(users));
+            saveUsersToFile(args[1], store);
+            return 0;
+        }
+    } catch (const exception& e) {
+        cerr << "Error: Invalid argument (" << e.what() << ").\n";
+        return 1;
+    }
+    
+    cerr << "Error: Wrong arguments for " << options.command << ".\n";
+    return 1;
+}
+
+void printUsage(const char* program)
+{
+    cerr << "Usage:\n";
+    cerr << "  " << program << " [--load-threads N] [--journal] [--fsync none|commit|<ms>] [--unique-ic]\n";
+    cerr << "          [--stats-file <file>] [--headless] [--record <script>] [--partition <index/count>]\n";
+    cerr << "          [--replica] [--max-staleness <ms>]\n";
+    cerr << "                                                  Run the interactive program\n";
+    cerr << "  " << program << " --generate <count> <file> [malformed %]\n";
+    cerr << "                                                  Write <count> synthetic users, some lines damaged\n";
+    cerr << "  " << program << " --bench-suite [users] [json]   Time loading, saving, login, dates and categorising as JSON\n";
+    cerr << "  " << program << " --bench-load <file> [runs]     Compare the text loaders and the snapshot loader\n";
+    cerr << "  " << program << " --bench-login [max users]      Time username lookups from 1k users up\n";
+    cerr << "  " << program << " --bench-memory [max users]     Report store memory from 1M users up\n";
+    cerr << "  " << program << " --bench-dates                  Check parseDate against the regex validator and time both\n";
+    cerr << "  " << program << " --bench-categorise [rows]      Check the batch category kernels and time them\n";
+    cerr << "  " << program << " --bench-policy [rows]          Check policy compilation and time it against the built-in rules\n";
+    cerr << "  " << program << " --bench-scheduler [users]      Compare scheduler ticks with a daily full scan\n";
+    cerr << "  " << program << " --bench-contention [users] [threads]\n";
+    cerr << "                                                  Compare directory locking under concurrent sessions\n";
+    cerr << "  " << program << " --dashboard                    Show user counts by category, age band and positive test day\n";
+    cerr << "  " << program << " --due-report                   List users whose quarantine has ended or who are due a test\n";
+    cerr << "  " << program << " --lookup <IC|phone>            Show the users with an IC/passport or phone number\n";
+    cerr << "  " << program << " --query [category=a,b] [age=min-max] [tested=from-to] [days-since-test=min-max] [limit=N]\n";
+    cerr << "                                                  List the users matching every filter given\n";
+    cerr << "  " << program << " --bench-query [users]          Check roster queries and IC/phone lookups against scans and time them\n";
+    cerr << "  " << program << " --bench-metrics [users]        Check the latency histograms and time their cost against login\n";
+    cerr << "  " << program << " --history <username> [from] [to]\n";
+    cerr << "                                                  List a user's tests, optionally between two dates\n";
+    cerr << "  " << program << " --tests-between <from> [to]    Count and list the tests taken between two dates\n";
+    cerr << "  " << program << " --bench-history [users] [days] Check the test history against plain records and time queries\n";
+    cerr << "  " << program << " --trace <username> [hops]      List who a positive test today would mark as close contacts\n";
+    cerr << "  " << program << " --bench-contacts [users] [contacts per user]\n";
+    cerr << "                                                  Check contact tracing against a plain search and time it\n";
+    cerr << "  " << program << " --ingest <file|-> [batch rows] Apply lab results from a CSV or JSON Lines feed\n";
+    cerr << "  " << program << " --serve <socket|port> [--server-threads N] [--stats-file <file>] [--headless] [--replica]\n";
+    cerr << "                                                  Serve the menus to many sessions at once\n";
+    cerr << "  " << program << " --route <socket|port> <map>    Forward sessions to the partition that owns each user\n";
+    cerr << "  " << program << " --split-partition <map> <index/count> <socket|port>\n";
+    cerr << "                                                  Move half of a partition's users to a new partition\n";
+    cerr << "  " << program << " --bench-partitions [users]     Check partition splits and the hash spread and time them\n";
+    cerr << "  " << program << " --bench-writer [changes]       Check the journal writer survives failed writes and time it\n";
+    cerr << "  " << program << " --promote <socket|port>        Make the replica serving there the primary\n";
+    cerr << "  " << program << " --load-test <socket|port> [sessions] [concurrency] [idle]\n";
+    cerr << "                                                  Run scripted sessions against a server\n";
+    cerr << "  " << program << " --replay <socket|port> <script[,script...]> [sessions] [concurrency]\n";
+    cerr << "                                                  Replay recorded scripts as concurrent sessions\n";
+    cerr << "  " << program << " --import-text <text> <snap>    Convert a text data file to a binary snapshot\n";
+    cerr << "  " << program << " --export-text <snap> <text>    Convert a binary snapshot to a text data file\n";
+}
+
+// Builds a plausible user with the given id. Usernames are "user" plus the
+// zero-padded id, so benchmarks can look users up without storing them.
+User makeSyntheticUser(long long id, mt19937& rng)
+{
+    static const char* firstNames[] = {"Aisyah", "Wei Ming", "Priya", "John", "Nur", "Kumar", "Mei Ling", "Ahmad", "Sarah", "Raj"};
+    static const char* lastNames[] = {"Tan", "Lim", "Abdullah", "Wong", "Singh", "Lee", "Rahman", "Chong", "Fernandez", "Ng"};
+    static const char* streets[] = {"Jalan Ampang", "Jalan Bukit Bintang", "Lorong Maarof", "Jalan Tun Razak", "Persiaran Surian"};
+    static const char* cities[] = {"Kuala Lumpur", "Petaling Jaya", "Shah Alam", "Subang Jaya", "Cyberjaya"};
+    
+    char username[32];
+    snprintf(username, sizeof(username), "user%08lld", id);
+    
+    User user;
+    user.username = username;
+    user.password = "pw" + to_string(rng() % 1000000);
+    user.name = string(firstNames[rng() % 10]) + " " + lastNames[rng() % 10];
+    user.age = static_cast<int>(1 + rng() % 90);
+    user.address = to_string(1 + rng() % 200) + " " + streets[rng() % 5] + ", " + cities[rng() % 5];
+    user.phone = "01" + to_string(10000000 + rng() % 90000000);
+    user.IC = to_string(100000 + rng() % 900000) + to_string(100000 + rng() % 900000);
+    user.category = intToCategory(static_cast<int>(rng() % 5));
+    
+    // A quarter of the users have never been tested
+    if (rng() % 4 == 0)
+    {
+        user.testDay = NO_TEST_DAY;
+    }
+    else
+    {
+        int day = static_cast<int>(1 + rng() % 28);
+        int month = static_cast<int>(1 + rng() % 12);
+        int year = static_cast<int>(2020 + rng() % 4);
+        user.testDay = daysFromCivil(year, month, day);
+    }
+    return user;
+}
+
+// Writes `count` users in the same pipe-delimited format as saveUsersToFile.
+// About `malformedPercent` percent of the lines are damaged the ways the
+// loader guards against: a field missing or extra, which the loader skips
+// (counted in `skippedLines`), or a bad age, category or date, which it
+// replaces with the default. The seeds are fixed so repeated runs produce
+// identical files, and the users are the same whatever the share.
+bool generateUserFile(const string& filename, long long count, int malformedPercent, long long* skippedLines)
+{
+    ofstream outfile(filename, ios::binary);
+    if (!outfile.is_open())
+    {
+        cerr << "Error: Could not create " << filename << ".\n";
+        return false;
+    }
+    
+    mt19937 rng(20200311);
+    mt19937 damage(20200125);
+    long long skipped = 0;
+    for (long long i = 0; i < count; i++)
+    {
+        User user = makeSyntheticUser(i, rng);
+        int kind = malformedPercent > 0 && static_cast<int>(damage() % 100) < malformedPercent
+                       ? static_cast<int>(damage() % 5) : -1;
+        outfile << user.username << "|"
+                << user.password << "|"
+                << user.name << "|";
+        if (kind == 2)
+            outfile << "twenty|";
+        else
+            outfile << user.age << "|";
+        outfile << user.address << "|"
+                << user.phone << "|";
+        if (kind != 0)
+            outfile << user.IC << "|";
+        if (kind == 3)
+            outfile << "9|";
+        else
+            outfile << categoryToInt(user.category) << "|";
+        if (kind == 4)
+            outfile << "31/02/2023";
+        else
+            outfile << dayNumberToDate(user.testDay);
+        if (kind == 1)
+            outfile << "|extra";
+        outfile << '\n';
+        skipped += kind == 0 || kind == 1;
+    }
+    
+    outfile.close();
+    if (!outfile)
+    {
+        cerr << "Error: Could not write " << filename << ".\n";
+        return false;
+    }
+    if (skippedLines)
+        *skippedLines = skipped;
+    cout << "Generated " << count << " user(s) in " << filename << ".\n";
+    return true;
+}
+
+// Measures username lookups as the store grows from 1k to `maxUsers` users.
+// The linear scan that login used before the index is timed up to 100k users.
+void benchmarkLogin(long long maxUsers)
+{
+    const int lookups = 200000;
+    mt19937 rng(20200311);
+    UserStore store;
+    vector<UserId> ids;
+    
+    cout << setw(10) << "users" << setw(16) << "index ns/login" << setw(16) << "miss ns" << setw(16) << "scan ns/login" << "\n";
+    for (long long size = 1000; size <= maxUsers; size *= 10)
+    {
+        // Grow the store to `size` users through the same path registration uses
+        for (long long id = static_cast<long long>(store.size()); id < size; id++)
+            ids.push_back(store.add(makeSyntheticUser(id, rng)));
+        
+        vector<string> names(lookups);
+        for (auto& name : names)
+        {
+            char username[32];
+            snprintf(username, sizeof(username), "user%08lld", static_cast<long long>(rng() % size));
+            name = username;
+        }
+        
+        size_t found = 0;
+        auto start = chrono::steady_clock::now();
+        for (const auto& name : names)
+            found += store.contains(name);
+        auto middle = chrono::steady_clock::now();
+        for (auto& name : names)
+            name[0] = 'x';
+        auto missStart = chrono::steady_clock::now();
+        for (const auto& name : names)
+            found += store.contains(name);
+        auto end = chrono::steady_clock::now();
+        
+        double hitNs = chrono::duration<double, nano>(middle - start).count() / lookups;
+        double missNs = chrono::duration<double, nano>(end - missStart).count() / lookups;
+        cout << fixed << setprecision(1) << setw(10) << size << setw(16) << hitNs << setw(16) << missNs;
+        
+        if (size <= 100000)
+        {
+            const int scans = 1000;
+            auto scanStart = chrono::steady_clock::now();
+            for (int i = 0; i < scans; i++)
+            {
+                string_view wanted = store.view(ids[rng() % size]).username;
+                for (UserId id : ids)
+                {
+                    if (store.view(id).username == wanted)
+                    {
+                        found++;
+                        break;
+                    }
+                }
+            }
+            auto scanEnd = chrono::steady_clock::now();
+            cout << setw(16) << chrono::duration<double, nano>(scanEnd - scanStart).count() / scans;
+        }
+        cout << "\n";
+        
+        if (found < static_cast<size_t>(lookups))
+            cout << "Error: Index lost users (" << found << " found).\n";
+    }
+}
+
+// Reports the memory the store holds at 1M users and each tenfold step up to
+// `maxUsers`, next to what the previous layout (a vector<User> of std::string
+// fields, plus the same username index) needed for the same users. Then
+// renames and edits a smaller store over and over and returns false if its
+// string pool keeps growing or a user's details come back wrong.
+bool benchmarkMemory(long long maxUsers)
+{
+    // The User layout the store replaced
+    struct PreviousUser
+    {
+        string username, password, name;
+        int age;
+        string address, phone, IC;
+        int category;
+        string testdate;
+    };
+    
+    // Heap block glibc malloc returns for a std::string of `length`
+    // characters; up to 15 fit inside the string itself
+    auto stringHeapBytes = [](size_t length) -> size_t {
+        if (length <= 15)
+            return 0;
+        return max<size_t>(32, (length + 1 + 8 + 15) / 16 * 16);
+    };
+    
+    mt19937 rng(20200311);
+    UserStore store;
+    size_t previousStrings = 0;
+    size_t residentBefore = residentBytes();
+    
+    cout << setw(10) << "users" << setw(14) << "previous MB" << setw(10) << "B/user"
+         << setw(14) << "compact MB" << setw(10) << "B/user" << setw(14) << "resident MB" << "\n";
+    for (long long size = 1000000; size <= maxUsers; size *= 10)
+    {
+        for (long long id = static_cast<long long>(store.size()); id < size; id++)
+        {
+            User user = makeSyntheticUser(id, rng);
+            for (const string* field : {&user.username, &user.password, &user.name, &user.address,
+                                        &user.phone, &user.IC})
+                previousStrings += stringHeapBytes(field->size());
+            store.add(user);
+        }
+        
+        // push_back doubles the vector's capacity as it grows
+        size_t vectorCapacity = 1;
+        while (vectorCapacity < static_cast<size_t>(size))
+            vectorCapacity *= 2;
+        
+        StoreMemoryUsage usage = store.memoryUsage();
+        double previous = static_cast<double>(vectorCapacity * sizeof(PreviousUser) + previousStrings + usage.usernameIndex);
+        double compact = static_cast<double>(usage.total());
+        size_t resident = residentBytes();
+        
+        cout << fixed << setprecision(1) << setw(10) << size
+             << setw(14) << previous / 1e6 << setw(10) << previous / size
+             << setw(14) << compact / 1e6 << setw(10) << compact / size;
+        if (resident > residentBefore)
+            cout << setw(14) << (resident - residentBefore) / 1e6;
+        else
+            cout << setw(14) << "-";
+        cout << "\n";
+    }
+    
+    StoreMemoryUsage usage = store.memoryUsage();
+    cout << "\nCompact store at " << store.size() << " users:\n";
+    cout << "  hot records:    " << setw(10) << usage.hotRecords / 1e6 << " MB\n";
+    cout << "  cold records:   " << setw(10) << usage.coldRecords / 1e6 << " MB\n";
+    cout << "  string pool:    " << setw(10) << usage.strings / 1e6 << " MB ("
+         << usage.deadStrings / 1e6 << " MB dead)\n";
+    cout << "  username index: " << setw(10) << usage.usernameIndex / 1e6 << " MB\n";
+    cout << "  IC and phone:   " << setw(10) << usage.identityIndexes / 1e6 << " MB\n";
+    cout << "  roster bitmaps: " << setw(10) << usage.rosterIndex / 1e6 << " MB\n";
+    cout << "Previous layout: sizeof(User) = " << sizeof(PreviousUser) << " bytes plus a heap block per long string.\n";
+    
+    // Every round gives each user a new username, phone number and address,
+    // leaving the old strings dead
+    const long long churnUsers = 100000;
+    const int churnRounds = 20;
+    UserStore churned;
+    vector<UserId> ids;
+    for (long long id = 0; id < churnUsers; id++)
+        ids.push_back(churned.add(makeSyntheticUser(id, rng)));
+    size_t initialStrings = churned.memoryUsage().strings;
+    size_t peakStrings = initialStrings;
+    
+    User user;
+    for (int round = 1; round <= churnRounds; round++)
+    {
+        for (long long id = 0; id < churnUsers; id++)
+        {
+            churned.get(ids[id], user);
+            user.username = "user" + to_string(id) + "r" + to_string(round);
+            user.phone = to_string(60000000 + round * churnUsers + id);
+            user.address = "Block " + to_string(round) + " Churn Street";
+            if (!churned.update(ids[id], user))
+            {
+                cout << "Error: Update failed in round " << round << ".\n";
+                return false;
+            }
+        }
+        peakStrings = max(peakStrings, churned.memoryUsage().strings);
+    }
+    
+    for (long long id = 0; id < churnUsers; id++)
+    {
+        UserId found = churned.find("user" + to_string(id) + "r" + to_string(churnRounds));
+        if (found.slot != ids[id].slot || !churned.get(found, user) ||
+            user.phone != to_string(60000000 + churnRounds * churnUsers + id) ||
+            user.address != "Block " + to_string(churnRounds) + " Churn Street")
+        {
+            cout << "Error: User " << id << " came back wrong after " << churnRounds << " rounds of edits.\n";
+            return false;
+        }
+    }
+    
+    StoreMemoryUsage churnUsage = churned.memoryUsage();
+    cout << "\nString pool over " << churnRounds << " rounds of renames and edits at " << churnUsers << " users: "
+         << initialStrings / 1e6 << " MB at first, " << peakStrings / 1e6 << " MB at most, "
+         << churnUsage.deadStrings / 1e6 << " MB dead at the end.\n";
+    if (peakStrings > initialStrings * 3)
+    {
+        cout << "Error: The string pool grew without bound.\n";
+        return false;
+    }
+    cout << "(all checks passed)\n";
+    return true;
+}
+
+// Checks parseDate against the original normalise-and-regex pipeline on a
+// grid of dates around every range edge, hand-picked malformed inputs and
+// randomly mangled dates, then times both. Returns false on any disagreement.
+bool benchmarkDates()
+{
+    vector<string> inputs = {"", " ", DEFAULT_DATE, "0/0/0", "-0/+0/00", "today", "abc", "5/3", "5/3/", "//",
+                             "5/3/2024abc", "5/3/20245", " 5 / 3 / 2024 ", "5-3-2024", "5.3.2024", "5 3 2024",
+                             "5//3/2024", "+5/+3/+2024", "-5/3/2024", "5/-3/2024", "05/03/-2024", "+-5/3/2024",
+                             "\t05/03/2024\r\n", "05\v/03/2024", "005/0003/02024", "29/02/2000", "29/02/1900",
+                             "99999999999/01/2024", "01/99999999999/2024", "01/01/99999999999",
+                             "2147483647/1/2024", "-2147483648/1/2024", "2147483648/1/2024", "0/0/0000junk"};
+    
+    // Every day and month from 0 up past the end, in both spellings the
+    // prompt suggests, across the year range edges and leap years
+    const int years[] = {0, 1899, 1900, 1901, 2000, 2023, 2024, 2100, 2101, 9999};
+    for (int year : years)
+    {
+        for (int month = 0; month <= 13; month++)
+        {
+            for (int day = 0; day <= 32; day++)
+            {
+                char date[32];
+                snprintf(date, sizeof(date), "%02d/%02d/%04d", day, month, year);
+                inputs.push_back(date);
+                snprintf(date, sizeof(date), "%d/%d/%d", day, month, year);
+                inputs.push_back(date);
+            }
+        }
+    }
+    
+    // Valid dates with one or two characters replaced, inserted or deleted
+    const string alphabet = "0123456789/ -+x\t";
+    mt19937 rng(20200311);
+    for (int i = 0; i < 3000; i++)
+    {
+        string date = dayNumberToDate(daysFromCivil(2020, 1, 1) + static_cast<int32_t>(rng() % 1500));
+        for (int edits = 1 + rng() % 2; edits > 0; edits--)
+        {
+            size_t pos = rng() % (date.size() + 1);
+            char c = alphabet[rng() % alphabet.size()];
+            switch (rng() % 3)
+            {
+                case 0: if (pos < date.size()) date[pos] = c; break;
+                case 1: date.insert(date.begin() + pos, c); break;
+                case 2: if (pos < date.size()) date.erase(pos, 1); break;
+            }
+        }
+        inputs.push_back(date);
+    }
+    
+    vector<string> normalized(inputs.size());
+    vector<char> expected(inputs.size());
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        normalized[i] = normalizeDateStream(inputs[i]);
+        expected[i] = isValidDateRegex(normalized[i]);
+    }
+    auto middle = chrono::steady_clock::now();
+    
+    const int repeats = 200;
+    vector<int32_t> dayNumbers(inputs.size());
+    vector<char> accepted(inputs.size());
+    for (int r = 0; r < repeats; r++)
+    {
+        for (size_t i = 0; i < inputs.size(); i++)
+            accepted[i] = parseDate(inputs[i], dayNumbers[i]);
+    }
+    auto end = chrono::steady_clock::now();
+    
+    size_t mismatches = 0;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (accepted[i] == expected[i] && (!accepted[i] || dayNumberToDate(dayNumbers[i]) == normalized[i]))
+            continue;
+        if (++mismatches <= 10)
+        {
+            cout << "Mismatch for '" << inputs[i] << "': regex " << (expected[i] ? "accepts " + normalized[i] : "rejects")
+                 << ", parseDate " << (accepted[i] ? "accepts " + dayNumberToDate(dayNumbers[i]) : "rejects") << "\n";
+        }
+    }
+    
+    double regexNs = chrono::duration<double, nano>(middle - start).count() / inputs.size();
+    double parseNs = chrono::duration<double, nano>(end - middle).count() / (static_cast<double>(inputs.size()) * repeats);
+    cout << "Inputs checked:   " << inputs.size() << (mismatches == 0 ? " (all agree)" : "") << "\n";
+    cout << fixed << setprecision(1);
+    cout << "regex validator:  " << regexNs << " ns/date\n";
+    cout << "parseDate:        " << parseNs << " ns/date, " << setprecision(0) << regexNs / parseNs << "x\n";
+    if (mismatches > 0)
+    {
+        cout << "Error: parseDate disagrees with the regex validator on " << mismatches << " input(s).\n";
+        return false;
+    }
+    return true;
+}
+
+// Checks every batch kernel against assessRisk on all 64 sets of answers, in
+// every lane and at every start offset and tail length a 32-row step can
+// see, then times the branchy rule against the kernels on `rows` random rows.
+bool benchmarkCategorise(long long rows)
+{
+    struct Kernel
+    {
+        const char* name;
+        void (*run)(const ScreeningColumns&, size_t, Category*, const Category*);
+    };
+    vector<Kernel> kernels = {{"scalar table", categoriseBatchScalar}};
+#ifdef HAVE_AVX2_KERNEL
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({"AVX2", categoriseBatchAvx2});
+    else
+        cout << "AVX2 is not available on this CPU; timing the scalar kernels only.\n";
+#endif
+    
+    auto makeColumns = [](vector<uint8_t> (&columns)[6]) {
+        return ScreeningColumns{columns[0].data(), columns[1].data(), columns[2].data(),
+                                columns[3].data(), columns[4].data(), columns[5].data()};
+    };
+    auto expectedFor = [](vector<uint8_t> (&columns)[6], size_t row) {
+        return assessRisk(columns[0][row], columns[1][row], columns[2][row], columns[3][row], columns[4][row],
+                          columns[5][row]);
+    };
+    
+    // Answer set k fills lanes 0-31 of block k; "yes" is any nonzero byte
+    const size_t checkRows = 64 * 32;
+    vector<uint8_t> check[6];
+    for (auto& column : check)
+        column.resize(checkRows);
+    for (size_t row = 0; row < checkRows; row++)
+    {
+        for (int question = 0; question < 6; question++)
+            check[question][row] = ((row / 32) >> question & 1) ? static_cast<uint8_t>(1 + row % 255) : 0;
+    }
+    
+    size_t mismatches = 0;
+    vector<Category> categories(checkRows + 1);
+    for (const Kernel& kernel : kernels)
+    {
+        for (size_t offset = 0; offset < 32; offset++)
+        {
+            for (size_t count : {checkRows - offset, checkRows - offset - 31, size_t(31)})
+            {
+                ScreeningColumns columns = makeColumns(check);
+                ScreeningColumns shifted = {columns.fever + offset, columns.cough + offset,
+                                            columns.breathingDifficulty + offset, columns.travelHistory + offset,
+                                            columns.closeContact + offset, columns.testPositive + offset};
+                fill(categories.begin(), categories.end(), static_cast<Category>(0xFF));
+                kernel.run(shifted, count, categories.data(), RISK_TABLE.data());
+                for (size_t i = 0; i < count; i++)
+                {
+                    if (categories[i] == expectedFor(check, offset + i))
+                        continue;
+                    if (++mismatches <= 10)
+                    {
+                        cout << "Mismatch in " << kernel.name << " for answers " << (offset + i) / 32
+                             << " (row " << offset + i << "): got " << int(categories[i]) << ", expected "
+                             << int(expectedFor(check, offset + i)) << "\n";
+                    }
+                }
+                if (categories[count] != static_cast<Category>(0xFF))
+                {
+                    mismatches++;
+                    cout << "Error: " << kernel.name << " wrote past the end of a " << count << "-row batch.\n";
+                }
+            }
+        }
+    }
+    
+    // Timing on random answers, about a third of them yes
+    size_t count = static_cast<size_t>(max(1LL, rows));
+    vector<uint8_t> random[6];
+    mt19937 rng(20200311);
+    for (auto& column : random)
+    {
+        column.resize(count);
+        for (auto& answer : column)
+            answer = rng() % 3 == 0;
+    }
+    ScreeningColumns columns = makeColumns(random);
+    vector<Category> expected(count), results(count + 1);
+    
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+        expected[i] = expectedFor(random, i);
+    double branchyNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / count;
+    
+    cout << "Answer sets checked: 64 in every lane, offset and tail" << (mismatches == 0 ? " (all agree)" : "") << "\n";
+    cout << fixed << setprecision(2);
+    cout << "assessRisk:          " << branchyNs << " ns/row\n";
+    for (const Kernel& kernel : kernels)
+    {
+        start = chrono::steady_clock::now();
+        kernel.run(columns, count, results.data(), RISK_TABLE.data());
+        double kernelNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / count;
+        if (!equal(expected.begin(), expected.end(), results.begin()))
+        {
+            mismatches++;
+            cout << "Error: " << kernel.name << " disagrees with assessRisk on random rows.\n";
+        }
+        cout << left << setw(21) << string(kernel.name) + ":" << right << kernelNs << " ns/row, "
+             << setprecision(1) << branchyNs / kernelNs << "x" << setprecision(2) << "\n";
+    }
+    
+    if (mismatches > 0)
+    {
+        cout << "Error: The batch kernels disagree with assessRisk on " << mismatches << " row(s).\n";
+        return false;
+    }
+    return true;
+}
+
+// Checks that the built-in policy compiles to exactly the hard-coded rules
+// and that broken policies are refused, then times single assessments
+// through the current policy against assessRisk, alone and while another
+// thread keeps publishing new policies, and checks the replaced ones are freed.
+bool benchmarkPolicy(long long rows)
+{
+    bool agree = true;
+    Policy builtIn, reordered;
+    string error;
+    auto start = chrono::steady_clock::now();
+    bool compiled = compilePolicy(DEFAULT_POLICY, builtIn, error);
+    double compileUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    if (!compiled || builtIn.table != RISK_TABLE || builtIn.quarantineDays != QUARANTINE_DAYS ||
+        builtIn.testReminderDays != TEST_REMINDER_DAYS || builtIn.contactWindowDays != CONTACT_WINDOW_DAYS ||
+        builtIn.traceHops != TRACE_HOPS)
+    {
+        cout << "Error: The built-in policy does not match the hard-coded rules" << (compiled ? "" : " (" + error + ")")
+             << ".\n";
+        agree = false;
+    }
+    
+    // The same rules written differently, which must compile to the same table
+    const char* sameRules = "low_risk: !fever !cough !breathing !travel !contact !positive\n"
+                            "positive: positive\n"
+                            "close_contact: contact\n"
+                            "travel_history: travel symptoms=0\n"
+                            "suspected: symptoms>=1 travel\n"
+                            "suspected: symptoms>=2 !travel\n"
+                            "low_risk: symptoms<=1\n";
+    if (!compilePolicy(sameRules, reordered, error) || reordered.table != RISK_TABLE)
+    {
+        cout << "Error: An equivalent policy compiled to different categories.\n";
+        agree = false;
+    }
+    
+    const char* broken[] = {"positive: positive\n", "quarantine_days = 0\nlow_risk:\n", "low_risk\n",
+                            "unknown: fever\nlow_risk:\n", "low_risk: feverish\n", "low_risk: symptoms>2\n",
+                            "low_risk: symptoms>=4\n", "isolation_days = 5\nlow_risk:\n",
+                            "trace_hops = 9\nlow_risk:\n", "contact_window_days = 0\nlow_risk:\n"};
+    for (const char* text : broken)
+    {
+        Policy policy;
+        if (compilePolicy(text, policy, error))
+        {
+            cout << "Error: Accepted a broken policy: " << text;
+            agree = false;
+        }
+    }
+    
+    // Random answers, about a third of them yes, packed as table indexes
+    size_t count = static_cast<size_t>(max(1LL, rows));
+    vector<uint8_t> answers(count);
+    mt19937 rng(20200311);
+    for (auto& answer : answers)
+    {
+        for (int bit = 0; bit < 6; bit++)
+            answer |= (rng() % 3 == 0) << bit;
+    }
+    vector<Category> expected(count), results(count);
+    
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t a = answers[i];
+        expected[i] = assessRisk(a & 1, a & 2, a & 4, a & 8, a & 16, a & 32);
+    }
+    double hardCodedNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / count;
+    
+    // The policy is read once per block of rows, as the batch paths read it
+    // once per batch; a read takes a reference, which costs more than a row
+    const size_t block = 64;
+    auto timePolicy = [&]() {
+        auto started = chrono::steady_clock::now();
+        for (size_t first = 0; first < count; first += block)
+        {
+            shared_ptr<const Policy> policy = currentPolicy();
+            for (size_t i = first; i < min(count, first + block); i++)
+            {
+                uint8_t a = answers[i];
+                results[i] = policy->assess(a & 1, a & 2, a & 4, a & 8, a & 16, a & 32);
+            }
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count() / count;
+        if (results != expected)
+            agree = false;
+        return ns;
+    };
+    double policyNs = timePolicy();
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < count / block; i++)
+        agree = currentPolicy() && agree;
+    double readNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / max<size_t>(1, count / block);
+    
+    // Publish the two equivalent policies in turn while assessing
+    shared_ptr<const Policy> original = currentPolicy();
+    weak_ptr<const Policy> firstPublished;
+    atomic<bool> done(false);
+    atomic<long long> published(0);
+    thread publisher([&]() {
+        while (!done)
+        {
+            auto policy = make_shared<const Policy>(published % 2 ? builtIn : reordered);
+            if (published == 0)
+                firstPublished = policy;
+            installPolicy(move(policy));
+            published++;
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+    });
+    // Timing starts once a published policy is in force, not the original
+    while (published == 0)
+        this_thread::yield();
+    double reloadingNs = timePolicy();
+    done = true;
+    publisher.join();
+    
+    // Every policy published meanwhile is freed once it is replaced
+    weak_ptr<const Policy> lastPublished = currentPolicy();
+    installPolicy(original);
+    bool freed = firstPublished.expired() && lastPublished.expired();
+    
+    cout << "Policies checked:    built-in, reordered and " << size(broken) << " broken"
+         << (agree ? " (all as expected)" : "") << "\n";
+    cout << fixed << setprecision(1);
+    cout << "Policy compile:      " << compileUs << " us\n";
+    cout << setprecision(2);
+    cout << "assessRisk:          " << hardCodedNs << " ns/row\n";
+    cout << "Policy table:        " << policyNs << " ns/row, " << setprecision(1) << hardCodedNs / policyNs << "x\n";
+    cout << setprecision(2);
+    cout << "Policy read:         " << readNs << " ns, once per " << block << " rows\n";
+    cout << setprecision(2);
+    cout << "While reloading:     " << reloadingNs << " ns/row (" << published << " policies published)\n";
+    if (!freed)
+        cout << "Error: A replaced policy was never freed.\n";
+    if (!agree)
+        cout << "Error: Policy evaluation disagrees with the hard-coded rules.\n";
+    return agree && freed;
+}
+
+// Records `days` days of tests for `userCount` users, most testing daily and a
+// few with backdated tests, and checks the compact history against plain
+// per-user vectors: whole histories, date-range queries through the index
+// (timed against a full scan) and histories after users leave and their
+// slots are reused. Then checks that a history file with renames, a reused
+// name and a torn last record loads the tests onto the right users.
+bool benchmarkHistory(long long userCount, int days)
+{
+    bool agree = true;
+    uint32_t users = static_cast<uint32_t>(clamp(userCount, 1LL, 1LL << 24));
+    days = max(1, days);
+    int32_t firstDay = currentDayNumber() - days;
+    mt19937 rng(20200311);
+    auto randomTest = [&](int32_t day) {
+        uint8_t answers = static_cast<uint8_t>(rng() & 63);
+        return TestRecord{day, answers, RISK_TABLE[answers]};
+    };
+    
+    TestHistory history;
+    vector<vector<TestRecord>> expected(users);
+    size_t tests = 0;
+    auto start = chrono::steady_clock::now();
+    for (int day = 0; day < days; day++)
+    {
+        for (uint32_t slot = 0; slot < users; slot++)
+        {
+            if (rng() % 10 >= 7)
+                continue;
+            // One user in a thousand also reports older tests, halfway through
+            // one from before the first
+            int32_t testDay = firstDay + day;
+            if (slot % 1000 == 999 && rng() % 4 == 0)
+                testDay -= static_cast<int32_t>(rng() % 30) + (day == days / 2 ? day + 1 : 0);
+            TestRecord test = randomTest(testDay);
+            history.append(slot, test);
+            expected[slot].push_back(test);
+            tests++;
+        }
+    }
+    double appendNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / max<size_t>(1, tests);
+    
+    auto checkUsers = [&]() {
+        vector<TestRecord> found;
+        for (uint32_t slot = 0; slot < users; slot++)
+        {
+            found.clear();
+            history.forEach(slot, INT32_MIN, INT32_MAX, [&](const TestRecord& test) { found.push_back(test); });
+            if (found != expected[slot] || history.count(slot) != expected[slot].size())
+                return false;
+        }
+        return true;
+    };
+    if (!checkUsers())
+    {
+        cout << "Error: A user's history did not decode to the tests recorded.\n";
+        agree = false;
+    }
+    
+    // Single days and ranges of up to two months, indexed against a scan of
+    // every user; the totals are kept apart for the two kinds
+    double indexedMs[2] = {}, scannedMs[2] = {};
+    size_t matched[2] = {};
+    const int queries = 40;
+    auto checkRanges = [&](int count) {
+        bool same = true;
+        vector<pair<uint32_t, TestRecord>> indexed, scanned;
+        for (int i = 0; i < count; i++)
+        {
+            int32_t from = firstDay - 30 + static_cast<int32_t>(rng() % (days + 30));
+            int32_t to = from + static_cast<int32_t>(rng() % (i % 2 ? 60 : 1));
+            indexed.clear();
+            scanned.clear();
+            auto started = chrono::steady_clock::now();
+            history.forEachBetween(from, to, [&](uint32_t slot, const TestRecord& test) {
+                indexed.emplace_back(slot, test);
+            });
+            indexedMs[i % 2] += chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+            
+            started = chrono::steady_clock::now();
+            for (uint32_t slot = 0; slot < users; slot++)
+            {
+                for (const TestRecord& test : expected[slot])
+                {
+                    if (test.day >= from && test.day <= to)
+                        scanned.emplace_back(slot, test);
+                }
+            }
+            scannedMs[i % 2] += chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+            matched[i % 2] += scanned.size();
+            same = same && (indexed == scanned);
+        }
+        return same;
+    };
+    if (!checkRanges(queries))
+    {
+        cout << "Error: A date-range query disagreed with a full scan.\n";
+        agree = false;
+    }
+    size_t memory = history.memoryBytes();
+    size_t encoded = history.encodedBytes();
+    
+    // Users leave, as on a rename to another shard, and others take their slots
+    for (uint32_t slot = 0; slot < users; slot += 97)
+    {
+        history.remove(slot);
+        expected[slot].clear();
+        for (int i = 0; i < 5; i++)
+        {
+            TestRecord test = randomTest(firstDay + static_cast<int32_t>(rng() % days));
+            history.append(slot, test);
+            expected[slot].push_back(test);
+        }
+    }
+    double queryMs[2] = {indexedMs[0], indexedMs[1]}, scanMs[2] = {scannedMs[0], scannedMs[1]};
+    size_t queryMatches[2] = {matched[0], matched[1]};
+    if (!checkUsers() || !checkRanges(10))
+    {
+        cout << "Error: Histories were wrong after slots were reused.\n";
+        agree = false;
+    }
+    
+    // A history file as the writer leaves it: tests, a move to a new name, a
+    // new user taking the old name, more tests for both and a torn record
+    string filename = (filesystem::temp_directory_path() / "covid-history-bench.tmp").string();
+    error_code ec;
+    filesystem::remove(filename, ec);
+    const long long fileUsers = 1000;
+    vector<User> finalUsers;
+    map<string, vector<TestRecord>> fileExpected;
+    {
+        Journal file;
+        if (!file.open(filename, 0))
+            return false;
+        for (long long id = 0; id < fileUsers; id++)
+        {
+            User user = makeSyntheticUser(id, rng);
+            vector<TestRecord> first = {randomTest(firstDay), randomTest(firstDay + 1)};
+            file.stageTests(user.username, first);
+            if (id % 10 == 0)
+            {
+                string movedName = "moved" + user.username;
+                file.stageRename(user.username, movedName);
+                TestRecord later = randomTest(firstDay + 2), reused = randomTest(firstDay + 3);
+                file.stageTests(movedName, span<const TestRecord>(&later, 1));
+                file.stageTests(user.username, span<const TestRecord>(&reused, 1));
+                first.push_back(later);
+                fileExpected[movedName] = first;
+                fileExpected[user.username] = {reused};
+                User moved = user;
+                moved.username = movedName;
+                finalUsers.push_back(moved);
+            }
+            else
+                fileExpected[user.username] = first;
+            finalUsers.push_back(user);
+        }
+        file.writeStaged();
+    }
+    {
+        ofstream torn(filename, ios::binary | ios::app);
+        torn.write("\x30\0\0\0torn", 8);
+    }
+    
+    UserStore store;
+    store.assign(move(finalUsers));
+    UserDirectory directory(store, nullptr);
+    directory.loadHistory(filename, false);
+    filesystem::remove(filename, ec);
+    size_t fileMismatches = 0;
+    for (const auto& [username, recorded] : fileExpected)
+    {
+        vector<TestRecord> loaded;
+        if (!directory.testHistory(username, INT32_MIN, INT32_MAX, loaded) || loaded != recorded)
+            fileMismatches++;
+    }
+    if (fileMismatches > 0)
+    {
+        cout << "Error: " << fileMismatches << " user(s) loaded the wrong tests from a history file.\n";
+        agree = false;
+    }
+    
+    cout << "Tests recorded:      " << tests << " for " << users << " users over " << days << " days"
+         << (agree ? " (all checks passed)" : "") << "\n";
+    cout << fixed << setprecision(2);
+    cout << "Append:              " << appendNs << " ns/test\n";
+    cout << "Encoded entries:     " << double(encoded) / max<size_t>(1, tests) << " bytes/test\n";
+    cout << "History in memory:   " << double(memory) / max<size_t>(1, tests) << " bytes/test ("
+         << sizeof(TestRecord) << " as plain records), " << setprecision(1) << memory / 1048576.0 << " MB\n";
+    const char* const kinds[] = {"Single-day queries:  ", "Up to two months:    "};
+    for (int kind = 0; kind < 2; kind++)
+    {
+        cout << kinds[kind] << setprecision(2) << queryMs[kind] / (queries / 2) << " ms indexed, "
+             << scanMs[kind] / (queries / 2) << " ms full scan (" << queryMatches[kind] / (queries / 2)
+             << " tests each on average)\n";
+    }
+    cout << "History file:        " << fileExpected.size() << " users with renames and a torn record"
+         << (fileMismatches == 0 ? ", loaded correctly" : "") << "\n";
+    if (!agree)
+    {
+        cout << "Error: The test history disagrees with the tests recorded.\n";
+        return false;
+    }
+    return true;
+}
+
+// Lists the users a POSITIVE test today would mark: those within `hops`
+// contacts (the policy's number if negative) through the policy's window
+bool showContacts(const ProgramOptions& options, const string& username, int hops)
+{
+    const size_t listed = 50;
+    UserStore store;
+    loadUserData(store, options);
+    UserDirectory directory(store, nullptr);
+    store = UserStore();
+    directory.loadHistory(HISTORY_FILE, false);
+    if (!directory.contains(username))
+    {
+        cerr << "Error: No user named '" << username << "'.\n";
+        return false;
+    }
+    
+    shared_ptr<const Policy> policy = currentPolicy();
+    hops = clamp(hops < 0 ? policy->traceHops : hops, 0, MAX_TRACE_HOPS);
+    int32_t sinceDay = currentDayNumber() - policy->contactWindowDays;
+    auto start = chrono::steady_clock::now();
+    vector<string> reached = directory.contactsWithin(username, hops, sinceDay);
+    double traceMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    cout << "Contacts of " << username << " within " << hops << " hop(s) since " << dayNumberToDate(sinceDay) << ": "
+         << reached.size() << "\n";
+    for (size_t i = 0; i < reached.size() && i < listed; i++)
+        cout << "  " << reached[i] << "\n";
+    if (reached.size() > listed)
+        cout << "  ... and " << reached.size() - listed << " more\n";
+    cout << fixed << setprecision(2);
+    cout << "Trace took " << traceMs << " ms over " << directory.contactCount() << " contacts.\n";
+    return true;
+}
+
+// Builds a synthetic contact graph of `userCount` users, each meeting about
+// `contactsPerUser` others over the last 30 days, mostly within a group of
+// 50 (a household, class or workplace) and otherwise anywhere. Checks traces
+// from random users, with and without the thread pool and with unmerged
+// contacts pending, against a plain breadth-first search, and times them.
+// Then checks that a POSITIVE test in a directory marks the right users.
+bool benchmarkContacts(long long userCount, int contactsPerUser)
+{
+    const uint32_t groupSize = 50;
+    const int window = 30;
+    const int sources = 20;
+    bool agree = true;
+    uint32_t users = static_cast<uint32_t>(clamp(userCount, 2LL, 1LL << 24));
+    contactsPerUser = clamp(contactsPerUser, 1, 1000);
+    int32_t today = currentDayNumber();
+    mt19937 rng(20200311);
+    
+    ContactGraph graph;
+    auto start = chrono::steady_clock::now();
+    for (uint32_t user = 0; user < users; user++)
+        graph.vertex("user" + to_string(user));
+    double vertexNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / users;
+    
+    // Contacts are drawn up front so only the inserts are timed
+    vector<vector<ContactGraph::Contact>> expected(users);
+    auto addContacts = [&](size_t count) {
+        struct Meeting
+        {
+            uint32_t a, b;
+            int32_t day;
+        };
+        vector<Meeting> meetings(count);
+        for (Meeting& meeting : meetings)
+        {
+            meeting.a = rng() % users;
+            meeting.b = rng() % 5 ? min(users - 1, meeting.a / groupSize * groupSize + static_cast<uint32_t>(rng() % groupSize))
+                                  : static_cast<uint32_t>(rng() % users);
+            meeting.day = today - static_cast<int32_t>(rng() % window);
+        }
+        auto started = chrono::steady_clock::now();
+        for (const Meeting& meeting : meetings)
+            graph.addContact(meeting.a, meeting.b, meeting.day);
+        double elapsed = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+        for (const Meeting& meeting : meetings)
+        {
+            if (meeting.a == meeting.b)
+                continue;
+            expected[meeting.a].push_back({meeting.b, meeting.day});
+            expected[meeting.b].push_back({meeting.a, meeting.day});
+        }
+        return elapsed / max<size_t>(1, count);
+    };
+    double insertNs = addContacts(size_t(users) * contactsPerUser / 2);
+    start = chrono::steady_clock::now();
+    graph.merge();
+    double mergeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    size_t memory = graph.memoryBytes();
+    size_t contacts = graph.contactCount();
+    
+    // The users at each distance from the source, sorted
+    auto reference = [&](uint32_t source, int hops, int32_t sinceDay) {
+        vector<vector<uint32_t>> levels;
+        vector<bool> seen(users);
+        seen[source] = true;
+        vector<uint32_t> frontier = {source};
+        for (int hop = 0; hop < hops && !frontier.empty(); hop++)
+        {
+            vector<uint32_t> next;
+            for (uint32_t user : frontier)
+            {
+                for (const ContactGraph::Contact& contact : expected[user])
+                {
+                    if (contact.day >= sinceDay && !seen[contact.user])
+                    {
+                        seen[contact.user] = true;
+                        next.push_back(contact.user);
+                    }
+                }
+            }
+            sort(next.begin(), next.end());
+            levels.push_back(next);
+            frontier.swap(next);
+        }
+        return levels;
+    };
+    // A trace matches if it lists the same users, nearest first; the order
+    // within a level depends on the threads
+    auto matches = [](vector<uint32_t> reached, const vector<vector<uint32_t>>& levels) {
+        auto begin = reached.begin();
+        for (const vector<uint32_t>& level : levels)
+        {
+            if (size_t(reached.end() - begin) < level.size())
+                return false;
+            sort(begin, begin + level.size());
+            if (!equal(level.begin(), level.end(), begin))
+                return false;
+            begin += level.size();
+        }
+        return begin == reached.end();
+    };
+    
+    ThreadPool pool(max(1u, thread::hardware_concurrency()));
+    double sequentialMs[3] = {}, pooledMs[3] = {};
+    size_t reachedTotal[3] = {};
+    auto checkTraces = [&](bool timed) {
+        bool same = true;
+        for (int i = 0; i < sources; i++)
+        {
+            uint32_t source = rng() % users;
+            int hops = 1 + i % 3;
+            int32_t sinceDay = today - CONTACT_WINDOW_DAYS;
+            auto started = chrono::steady_clock::now();
+            vector<uint32_t> sequential = graph.trace(source, hops, sinceDay, nullptr);
+            double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+            started = chrono::steady_clock::now();
+            vector<uint32_t> pooled = graph.trace(source, hops, sinceDay, &pool);
+            double pooledElapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+            if (timed)
+            {
+                sequentialMs[hops - 1] += elapsed;
+                pooledMs[hops - 1] += pooledElapsed;
+                reachedTotal[hops - 1] += sequential.size();
+            }
+            vector<vector<uint32_t>> levels = reference(source, hops, sinceDay);
+            same = same && matches(sequential, levels) && matches(pooled, levels);
+        }
+        return same;
+    };
+    if (!checkTraces(true))
+    {
+        cout << "Error: A trace disagreed with a plain breadth-first search.\n";
+        agree = false;
+    }
+    
+    // New contacts sit in the log until the next merge
+    addContacts(users / 100 + 1);
+    if (!checkTraces(false))
+    {
+        cout << "Error: A trace missed contacts that were not merged yet.\n";
+        agree = false;
+    }
+    
+    // A chain of contacts in a directory: user i names user i + 1, an old
+    // contact hangs off the first user, and the first user then tests positive
+    const int chain = 10;
+    shared_ptr<const Policy> policy = currentPolicy();
+    vector<User> people;
+    for (long long id = 0; id <= chain + 1; id++)
+    {
+        User user = makeSyntheticUser(id, rng);
+        user.category = LOW_RISK;
+        user.testDay = NO_TEST_DAY;
+        people.push_back(user);
+    }
+    UserStore store;
+    store.assign(people);
+    UserDirectory directory(store, nullptr);
+    auto idOf = [&](const User& user) {
+        bool ended;
+        User found;
+        return directory.login(user.username, user.password, found, ended);
+    };
+    if (directory.findContact(people[3].IC) != people[3].username || !directory.findContact("no such user").empty())
+    {
+        cout << "Error: Contacts were not found by IC number.\n";
+        agree = false;
+    }
+    for (int i = 0; i < chain; i++)
+    {
+        string next = people[i + 1].username;
+        directory.recordTest(idOf(people[i]), TestRecord{today, 0, LOW_RISK}, span<const string>(&next, 1));
+    }
+    directory.recordTest(idOf(people[chain + 1]), TestRecord{today - policy->contactWindowDays - 1, 0, LOW_RISK},
+                         span<const string>(&people[0].username, 1));
+    directory.recordTest(idOf(people[0]), TestRecord{today, 32, POSITIVE});
+    int wrong = 0;
+    for (int i = 1; i <= chain + 1; i++)
+    {
+        User user;
+        directory.get(idOf(people[i]), user);
+        bool shouldMark = i <= policy->traceHops && i <= chain;
+        if ((user.category == CLOSE_CONTACT) != shouldMark)
+            wrong++;
+    }
+    if (wrong > 0 || !directory.checkStatistics())
+    {
+        cout << "Error: A positive test marked the wrong users as close contacts.\n";
+        agree = false;
+    }
+    
+    // The contacts survive a compacted history file
+    string filename = (filesystem::temp_directory_path() / "covid-contacts-bench.tmp").string();
+    UserDirectory reloaded(store, nullptr);
+    bool saved = directory.saveHistory(filename, false);
+    reloaded.loadHistory(filename, false);
+    error_code ec;
+    filesystem::remove(filename, ec);
+    for (int i = 0; i <= chain + 1; i++)
+    {
+        // Vertices are numbered differently after a reload, so compare sets
+        vector<string> before = directory.contactsWithin(people[i].username, MAX_TRACE_HOPS, INT32_MIN);
+        vector<string> after = reloaded.contactsWithin(people[i].username, MAX_TRACE_HOPS, INT32_MIN);
+        sort(before.begin(), before.end());
+        sort(after.begin(), after.end());
+        if (!saved || before != after || before.empty())
+        {
+            cout << "Error: Contacts were lost or changed in a history file.\n";
+            agree = false;
+            break;
+        }
+    }
+    
+    cout << "Contacts:            " << contacts << " between " << users << " users"
+         << (agree ? " (all checks passed)" : "") << "\n";
+    cout << fixed << setprecision(2);
+    cout << "Insert:              " << vertexNs << " ns/user, " << insertNs << " ns/contact, final merge "
+         << setprecision(1) << mergeMs << " ms\n";
+    cout << "Graph in memory:     " << setprecision(2) << double(memory) / max<size_t>(1, contacts)
+         << " bytes/contact, " << setprecision(1) << memory / 1048576.0 << " MB\n";
+    for (int hops = 1; hops <= 3; hops++)
+    {
+        int traces = (sources + 3 - hops) / 3;
+        cout << "Trace, " << hops << " hop(s):      " << setprecision(3) << sequentialMs[hops - 1] / traces
+             << " ms, " << pooledMs[hops - 1] / traces << " ms with " << pool.size() << " threads ("
+             << reachedTotal[hops - 1] / traces << " users reached on average)\n";
+    }
+    cout << "Directory:           " << chain << " reported contacts, " << policy->traceHops
+         << " hop(s) marked on a positive test" << (wrong == 0 ? "" : ", WRONG") << ", saved and reloaded\n";
+    if (!agree)
+    {
+        cout << "Error: Contact tracing disagrees with a plain search.\n";
+        return false;
+    }
+    return true;
+}
+
+// Shows the users with the IC/passport number or, failing that, the phone
+// number, found through the shards' indexes
+bool showLookup(const ProgramOptions& options, const string& key)
+{
+    const char* const names[] = {"Low Risk", "Travel History", "Suspected", "Close Contact", "Positive"};
+    UserStore store;
+    loadUserData(store, options);
+    UserDirectory directory(store, nullptr);
+    store = UserStore();
+    
+    auto start = chrono::steady_clock::now();
+    vector<User> users;
+    User user;
+    const char* field = "IC/passport";
+    if (directory.findByIC(key, user))
+        users.push_back(user);
+    else
+    {
+        users = directory.findByPhone(key);
+        field = "phone";
+    }
+    double lookupUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    if (users.empty())
+    {
+        cerr << "Error: No user has the IC/passport or phone number '" << key << "'.\n";
+        return false;
+    }
+    
+    cout << "Users with " << field << " number " << key << ": " << users.size() << "\n";
+    for (const User& found : users)
+    {
+        cout << "  " << found.username << ": " << found.name << ", age " << found.age << ", phone " << found.phone
+             << ", IC/passport " << found.IC << ", " << names[found.category] << ", "
+             << (found.testDay == NO_TEST_DAY ? string("never tested") : "tested " + dayNumberToDate(found.testDay))
+             << "\n";
+    }
+    cout << fixed << setprecision(1);
+    cout << "Lookup took " << lookupUs << " us.\n";
+    return true;
+}
+
+// Lists the first users matching the filters in `args` and counts them all.
+// Each filter is name=value: category takes a comma-separated list of policy
+// category names; age, tested (dates) and days-since-test take a range
+// "min-max" where either end may be left out.
+bool showQuery(const ProgramOptions& options, const vector<string>& args)
+{
+    const char* const categoryNames[] = {"low_risk", "travel_history", "suspected", "close_contact", "positive"};
+    const char* const names[] = {"Low Risk", "Travel History", "Suspected", "Close Contact", "Positive"};
+    int32_t today = currentDayNumber();
+    RosterFilter filter;
+    size_t limit = 20;
+    
+    // "min-max", "min-", "-max" or a single value for both
+    auto range = [](const string& text) {
+        size_t dash = text.find('-');
+        if (dash == string::npos)
+            return pair<string, string>(text, text);
+        return pair<string, string>(text.substr(0, dash), text.substr(dash + 1));
+    };
+    auto day = [today](const string& text) {
+        int32_t parsed;
+        if (text == "today")
+            return today;
+        if (!parseDate(text, parsed) || parsed == NO_TEST_DAY)
+            throw invalid_argument("not a date: " + text);
+        return parsed;
+    };
+    for (const string& arg : args)
+    {
+        size_t equals = arg.find('=');
+        if (equals == string::npos || equals + 1 == arg.size())
+            throw invalid_argument("expected name=value: " + arg);
+        string name = arg.substr(0, equals), value = arg.substr(equals + 1);
+        auto [low, high] = range(value);
+        if (name == "category")
+        {
+            filter.categories = 0;
+            stringstream list(value);
+            string item;
+            while (getline(list, item, ','))
+            {
+                auto category = find(begin(categoryNames), end(categoryNames), item);
+                if (category == end(categoryNames))
+                    throw invalid_argument("unknown category: " + item);
+                filter.categories |= 1u << (category - begin(categoryNames));
+            }
+        }
+        else if (name == "age")
+        {
+            filter.minAge = low.empty() ? 0 : stoi(low);
+            filter.maxAge = high.empty() ? INT_MAX : stoi(high);
+        }
+        else if (name == "tested")
+        {
+            filter.fromDay = low.empty() ? INT32_MIN : day(low);
+            filter.toDay = high.empty() ? INT32_MAX : day(high);
+        }
+        else if (name == "days-since-test")
+        {
+            filter.toDay = low.empty() ? INT32_MAX : today - stoi(low);
+            filter.fromDay = high.empty() ? INT32_MIN : today - stoi(high);
+        }
+        else if (name == "limit")
+            limit = stoull(value);
+        else
+            throw invalid_argument("unknown filter: " + name);
+    }
+    
+    UserStore store;
+    loadUserData(store, options);
+    UserDirectory directory(store, nullptr);
+    store = UserStore();
+    
+    size_t matched = 0;
+    double firstMs = 0;
+    auto start = chrono::steady_clock::now();
+    directory.query(filter, [&](const UserView& user) {
+        if (matched == 0)
+        {
+            firstMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            cout << "  Username        Name                     Age  Category        Last test\n";
+        }
+        if (matched++ < limit)
+        {
+            cout << "  " << left << setw(16) << user.username << setw(24) << user.name << right << setw(4)
+                 << user.age << "  " << left << setw(16) << names[user.category] << right
+                 << (user.testDay == NO_TEST_DAY ? string("never") : dayNumberToDate(user.testDay)) << "\n";
+        }
+        return true;
+    });
+    double queryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    if (matched > limit)
+        cout << "  ... and " << matched - limit << " more\n";
+    cout << fixed << setprecision(2);
+    cout << "Matched " << matched << " of " << directory.size() << " users in " << queryMs << " ms";
+    if (matched > 0)
+        cout << " (first after " << firstMs << " ms)";
+    cout << ".\n";
+    return true;
+}
+
+// Fills a store with `userCount` synthetic users and checks roster queries
+// against a scan of every user, timing both and the time to the first match.
+// Then changes, removes and replaces 1% of the users and checks the queries
+// and the IC and phone indexes again, and checks that a directory requiring
+// unique IC numbers refuses a taken one.
+bool benchmarkQuery(long long userCount)
+{
+    bool agree = true;
+    mt19937 rng(20200311);
+    int32_t today = currentDayNumber();
+    
+    UserStore store;
+    vector<UserId> ids;
+    auto start = chrono::steady_clock::now();
+    for (long long id = 0; id < userCount; id++)
+        ids.push_back(store.add(makeSyntheticUser(id, rng)));
+    double addNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / max(1LL, userCount);
+    StoreMemoryUsage usage = store.memoryUsage();
+    
+    struct Case
+    {
+        const char* description;
+        RosterFilter filter;
+    };
+    const Case cases[] = {
+        {"Suspected, aged 60+, tested more than 3 days ago",
+         RosterFilter{.categories = 1u << SUSPECTED, .minAge = 60, .toDay = today - 4}},
+        {"Positive, tested in January 2023",
+         RosterFilter{.categories = 1u << POSITIVE, .fromDay = daysFromCivil(2023, 1, 1),
+                      .toDay = daysFromCivil(2023, 1, 31)}},
+        {"Close contact or positive, aged 0-17, tested in 2021",
+         RosterFilter{.categories = 1u << CLOSE_CONTACT | 1u << POSITIVE, .maxAge = 17,
+                      .fromDay = daysFromCivil(2021, 1, 1), .toDay = daysFromCivil(2021, 12, 31)}},
+        {"Tested on 14/02/2022", RosterFilter{.fromDay = daysFromCivil(2022, 2, 14), .toDay = daysFromCivil(2022, 2, 14)}},
+        {"Aged 18-29", RosterFilter{.minAge = 18, .maxAge = 29}},
+        {"Low risk", RosterFilter{.categories = 1u << LOW_RISK}},
+    };
+    
+    // Returns the matching slots, with the best of three times for each way
+    struct Timing
+    {
+        double queryMs = 1e300, scanMs = 1e300, firstMs = 1e300;
+        size_t matched = 0;
+    };
+    vector<Timing> timings(size(cases));
+    auto checkCases = [&](bool timed) {
+        bool same = true;
+        for (size_t i = 0; i < size(cases); i++)
+        {
+            const RosterFilter& filter = cases[i].filter;
+            vector<uint32_t> queried, scanned;
+            for (int run = 0; run < (timed ? 3 : 1); run++)
+            {
+                queried.clear();
+                scanned.clear();
+                auto started = chrono::steady_clock::now();
+                store.query(filter, [&](UserId id, const UserView&) {
+                    queried.push_back(id.slot);
+                    return true;
+                });
+                double queryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+                
+                started = chrono::steady_clock::now();
+                store.forEach([&](UserId id, const UserView& user) {
+                    if (filter.matches(user.category, user.age, user.testDay))
+                        scanned.push_back(id.slot);
+                });
+                double scanMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+                
+                started = chrono::steady_clock::now();
+                store.query(filter, [](UserId, const UserView&) { return false; });
+                double firstMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+                if (timed)
+                {
+                    timings[i].queryMs = min(timings[i].queryMs, queryMs);
+                    timings[i].scanMs = min(timings[i].scanMs, scanMs);
+                    timings[i].firstMs = min(timings[i].firstMs, firstMs);
+                    timings[i].matched = scanned.size();
+                }
+            }
+            same = same && queried == scanned;
+        }
+        return same;
+    };
+    if (!checkCases(true))
+    {
+        cout << "Error: A roster query disagreed with a full scan.\n";
+        agree = false;
+    }
+    
+    // Each number must find every user that has it and no one else
+    auto checkIdentity = [&](size_t samples) {
+        for (size_t i = 0; i < samples && !ids.empty(); i++)
+        {
+            UserId id = ids[rng() % ids.size()];
+            if (!store.valid(id))
+                continue;
+            UserView user = store.view(id);
+            bool foundIC = false, foundPhone = false, wrong = false;
+            store.forEachWithIC(user.IC, [&](UserId other, const UserView& view) {
+                foundIC = foundIC || other == id;
+                wrong = wrong || view.IC != user.IC;
+            });
+            store.forEachWithPhone(user.phone, [&](UserId other, const UserView& view) {
+                foundPhone = foundPhone || other == id;
+                wrong = wrong || view.phone != user.phone;
+            });
+            if (!foundIC || !foundPhone || wrong)
+                return false;
+        }
+        return true;
+    };
+    vector<string> removedICs;
+    
+    // Profiles change, users leave and new users take their slots
+    for (long long i = 0; i < userCount / 100; i++)
+    {
+        size_t pick = rng() % ids.size();
+        User user;
+        if (!store.get(ids[pick], user))
+            continue;
+        switch (i % 4)
+        {
+            case 0:
+                store.setCategory(ids[pick], intToCategory(static_cast<int>(rng() % 5)));
+                break;
+            case 1:
+                user.age = static_cast<int>(1 + rng() % 90);
+                user.testDay = rng() % 4 ? daysFromCivil(2020 + static_cast<int>(rng() % 4), 1, 1) +
+                                               static_cast<int32_t>(rng() % 365)
+                                         : NO_TEST_DAY;
+                store.update(ids[pick], user);
+                break;
+            case 2:
+                user.IC = "M" + to_string(rng());
+                user.phone = "03" + to_string(rng() % 100000000);
+                store.update(ids[pick], user);
+                break;
+            case 3:
+                removedICs.push_back(user.IC);
+                store.remove(ids[pick]);
+                ids[pick] = store.add(makeSyntheticUser(userCount + i, rng));
+                break;
+        }
+    }
+    size_t leftBehind = 0;
+    for (const string& IC : removedICs)
+    {
+        store.forEachWithIC(IC, [&](UserId id, const UserView&) { leftBehind += !store.valid(id); });
+    }
+    if (!checkCases(false) || !checkIdentity(100000) || leftBehind > 0)
+    {
+        cout << "Error: The indexes were wrong after users changed.\n";
+        agree = false;
+    }
+    
+    // Lookups by IC against a scan for the same number
+    const int lookups = 100000;
+    vector<string> keys;
+    for (int i = 0; i < lookups; i++)
+        keys.emplace_back(store.view(ids[rng() % ids.size()]).IC);
+    size_t hits = 0;
+    start = chrono::steady_clock::now();
+    for (const string& key : keys)
+        store.forEachWithIC(key, [&](UserId, const UserView&) { hits++; });
+    double lookupNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / lookups;
+    start = chrono::steady_clock::now();
+    size_t scanHits = 0;
+    store.forEach([&](UserId, const UserView& user) { scanHits += user.IC == keys[0]; });
+    double scanMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    if (hits < static_cast<size_t>(lookups) || scanHits == 0)
+    {
+        cout << "Error: An IC lookup missed a user.\n";
+        agree = false;
+    }
+    
+    // A directory that requires unique IC numbers
+    vector<User> people;
+    for (long long id = 0; id < 100; id++)
+        people.push_back(makeSyntheticUser(id, rng));
+    people[1].phone = people[0].phone;
+    UserStore small;
+    small.assign(people);
+    UserDirectory directory(small, nullptr);
+    directory.requireUniqueIC(true);
+    User newcomer = makeSyntheticUser(100, rng), found;
+    User copycat = newcomer;
+    copycat.username = "copycat";
+    UserId newcomerId = directory.registerUser(newcomer);
+    bool joined = directory.valid(newcomerId);
+    bool refused = !directory.valid(directory.registerUser(copycat));
+    User changed = newcomer;
+    changed.IC = people[5].IC;
+    bool updateRefused = !directory.update(newcomerId, changed);
+    changed = newcomer;
+    changed.address = "Elsewhere";
+    bool updateAllowed = directory.update(newcomerId, changed);
+    bool foundIC = directory.findByIC(people[5].IC, found) && found.username == people[5].username;
+    bool household = directory.findByPhone(people[0].phone).size() == 2;
+    if (!joined || !refused || !updateRefused || !updateAllowed || !foundIC || !household)
+    {
+        cout << "Error: The directory did not keep IC numbers unique.\n";
+        agree = false;
+    }
+    
+    cout << "Users:               " << store.size() << (agree ? " (all checks passed)" : "") << "\n";
+    cout << fixed << setprecision(1);
+    cout << "Add:                 " << addNs << " ns/user with every index\n";
+    cout << "Roster bitmaps:      " << usage.rosterIndex / 1e6 << " MB, " << setprecision(2)
+         << double(usage.rosterIndex) / max(1LL, userCount) << " bytes/user\n";
+    cout << "IC and phone index:  " << setprecision(1) << usage.identityIndexes / 1e6 << " MB\n";
+    for (size_t i = 0; i < size(cases); i++)
+    {
+        cout << "  " << cases[i].description << ": " << timings[i].matched << " users\n";
+        cout << "    " << setprecision(2) << timings[i].queryMs << " ms indexed (first after " << timings[i].firstMs
+             << " ms), " << timings[i].scanMs << " ms full scan\n";
+    }
+    cout << "IC lookup:           " << setprecision(1) << lookupNs << " ns, " << setprecision(2) << scanMs
+         << " ms by full scan\n";
+    cout << "Unique IC directory: " << (refused && updateRefused ? "refused a taken number" : "WRONG") << "\n";
+    if (!agree)
+    {
+        cout << "Error: The roster indexes disagree with the users.\n";
+        return false;
+    }
+    return true;
+}
+
+// Checks the latency histogram's buckets and percentiles against exact
+// values and that counts from several threads add up, then measures what a
+// timed operation costs next to a login among `userCount` users.
+bool benchmarkMetrics(long long userCount)
+{
+#ifdef HAVE_METRICS
+    bool agree = true;
+    
+    // Each bucket's limit maps back to it, and the next value to the next bucket
+    for (int bucket = 0; bucket + 1 < LatencyHistogram::BUCKETS; bucket++)
+    {
+        uint64_t limit = LatencyHistogram::bucketLimit(bucket);
+        if (LatencyHistogram::bucketOf(limit) != bucket || LatencyHistogram::bucketOf(limit + 1) != bucket + 1)
+        {
+            cout << "Error: Histogram bucket " << bucket << " does not hold the values it should.\n";
+            agree = false;
+            break;
+        }
+    }
+    
+    // Percentiles of latencies spread evenly in log scale from 100 ns to 10 s
+    const size_t samples = 1000000;
+    mt19937_64 rng(20200311);
+    uniform_real_distribution<double> exponent(0, 8);
+    vector<uint64_t> values(samples);
+    auto histogram = make_unique<LatencyHistogram>();
+    for (uint64_t& value : values)
+    {
+        value = static_cast<uint64_t>(100 * pow(10.0, exponent(rng)));
+        histogram->record(value);
+    }
+    sort(values.begin(), values.end());
+    double worstError = 0;
+    for (double fraction : {0.5, 0.9, 0.99, 0.999, 1.0})
+    {
+        uint64_t exact = values[max<size_t>(1, static_cast<size_t>(ceil(fraction * samples))) - 1];
+        uint64_t estimate = histogram->percentile(fraction);
+        double error = (static_cast<double>(estimate) - exact) / exact;
+        worstError = max(worstError, error);
+        if (estimate < exact || error > 1.0 / LatencyHistogram::SUB_BUCKETS)
+        {
+            cout << "Error: Percentile " << fraction << " is " << estimate << " ns, the exact value is " << exact
+                 << " ns.\n";
+            agree = false;
+        }
+    }
+    
+    // Threads that record and exit while another keeps collecting
+    const int threads = 4;
+    const uint64_t callsPerThread = 100000;
+    auto before = make_unique<ThreadMetrics>();
+    collectMetrics(*before);
+    atomic<bool> recording(true);
+    thread collector([&]() {
+        while (recording)
+        {
+            auto during = make_unique<ThreadMetrics>();
+            collectMetrics(*during);
+        }
+    });
+    vector<thread> recorders;
+    for (int i = 0; i < threads; i++)
+    {
+        recorders.emplace_back([&]() {
+            for (uint64_t call = 0; call < callsPerThread; call++)
+            {
+                LatencyTimer timer(METRIC_REGISTRATION);
+                countEvent(COUNTER_FAILED_LOGINS);
+            }
+        });
+    }
+    for (thread& recorder : recorders)
+        recorder.join();
+    recording = false;
+    collector.join();
+    auto after = make_unique<ThreadMetrics>();
+    collectMetrics(*after);
+    uint64_t calls = after->operations[METRIC_REGISTRATION] - before->operations[METRIC_REGISTRATION];
+    uint64_t timed = after->latency[METRIC_REGISTRATION].count() - before->latency[METRIC_REGISTRATION].count();
+    uint64_t counted = after->counters[COUNTER_FAILED_LOGINS] - before->counters[COUNTER_FAILED_LOGINS];
+    uint64_t expectedTimed = threads * ((callsPerThread + LATENCY_SAMPLE_INTERVAL - 1) / LATENCY_SAMPLE_INTERVAL);
+    if (calls != threads * callsPerThread || counted != calls || timed != expectedTimed)
+    {
+        cout << "Error: Threads recorded " << calls << " calls, " << timed << " timed and " << counted
+             << " counted; expected " << threads * callsPerThread << ", " << expectedTimed << " and "
+             << threads * callsPerThread << ".\n";
+        agree = false;
+    }
+    
+    // Cost of the timers alone, always timed and timed one call in 16
+    const int loops = 10000000;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < loops / 10; i++)
+        LatencyTimer timer(METRIC_SAVE);
+    double timedNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (loops / 10);
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < loops; i++)
+        LatencyTimer timer(METRIC_PROFILE_UPDATE);
+    double sampledNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / loops;
+    
+    // Against the cheapest operation that carries a timer
+    mt19937 userRng(20200311);
+    vector<User> users;
+    for (long long id = 0; id < max(1LL, userCount); id++)
+        users.push_back(makeSyntheticUser(id, userRng));
+    UserStore store;
+    store.assign(users);
+    UserDirectory directory(store, nullptr);
+    store = UserStore();
+    const int logins = 1000000;
+    vector<uint32_t> picks(logins);
+    for (uint32_t& pick : picks)
+        pick = static_cast<uint32_t>(rng() % users.size());
+    size_t found = 0;
+    start = chrono::steady_clock::now();
+    for (uint32_t pick : picks)
+    {
+        User user;
+        bool quarantineEnded;
+        found += directory.valid(directory.login(users[pick].username, users[pick].password, user, quarantineEnded));
+    }
+    double loginNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / logins;
+    if (found != static_cast<size_t>(logins))
+    {
+        cout << "Error: Logins failed.\n";
+        agree = false;
+    }
+    
+    cout << "Histogram:           " << LatencyHistogram::BUCKETS << " buckets, " << sizeof(ThreadMetrics) / 1024
+         << " KiB per thread" << (agree ? " (all checks passed)" : "") << "\n";
+    cout << fixed << setprecision(2);
+    cout << "Percentile error:    at most " << worstError * 100 << "% high\n";
+    cout << setprecision(1);
+    cout << "Timed call:          " << timedNs << " ns for every call timed, " << sampledNs << " ns at one in "
+         << LATENCY_SAMPLE_INTERVAL << "\n";
+    cout << "Login:               " << loginNs << " ns among " << users.size() << " users, so metrics add "
+         << setprecision(2) << sampledNs / loginNs * 100 << "%\n";
+    if (!agree)
+    {
+        cout << "Error: The metrics are wrong.\n";
+        return false;
+    }
+    return true;
+#else
+    (void)userCount;
+    cout << "Error: Metrics were left out of this build (NO_METRICS).\n";
+    return false;
+#endif
+}
+
+// Gives `userCount` synthetic users three tests each and contacts with the
+// users 1 and 7 after them, splits them into halves and one half again into
+// quarters, and checks that every user ends up in exactly the partition that
+// owns it with its record and tests intact, and that the moved partitions
+// hold every contact between their own users. Also checks how evenly the
+// hash spreads users, and times the splits and the imports.
+bool benchmarkPartitions(long long userCount)
+{
+    bool agree = true;
+    uint32_t users = static_cast<uint32_t>(clamp(userCount, 16LL, 1LL << 24));
+    int32_t today = currentDayNumber();
+    mt19937 rng(20200311);
+    vector<User> expected;
+    for (uint32_t id = 0; id < users; id++)
+        expected.push_back(makeSyntheticUser(id, rng));
+    
+    // Over as many partitions as hold a thousand users each; binomial counts
+    // stay within six standard deviations of the mean
+    uint32_t spreadCount = 2;
+    while (spreadCount < MAX_PARTITIONS && users / (spreadCount * 2) >= 1000)
+        spreadCount *= 2;
+    vector<size_t> sizes(spreadCount);
+    for (const User& user : expected)
+        sizes[partitionHash(user.username) & (spreadCount - 1)]++;
+    double mean = static_cast<double>(users) / spreadCount;
+    double worst = 0;
+    for (size_t size : sizes)
+        worst = max(worst, abs(static_cast<double>(size) - mean));
+    if (worst > 6 * sqrt(mean) + 1)
+    {
+        cout << "Error: A partition is " << worst << " users off the mean of " << mean << ".\n";
+        agree = false;
+    }
+    
+    auto testsOf = [&](uint32_t id) {
+        vector<TestRecord> tests;
+        for (int32_t k = 0; k < 3; k++)
+            tests.push_back(TestRecord{today - 20 + 7 * k + static_cast<int32_t>(id % 5),
+                                       static_cast<uint8_t>((id * 7 + k) % 64), (id + k) % 2 ? SUSPECTED : LOW_RISK});
+        return tests;
+    };
+    const uint32_t neighbours[] = {1, 7};
+    UserStore store;
+    store.assign(expected);
+    UserDirectory whole(store, nullptr);
+    store = UserStore();
+    for (uint32_t id = 0; id < users; id++)
+    {
+        User user;
+        bool quarantineEnded;
+        UserId handle = whole.login(expected[id].username, expected[id].password, user, quarantineEnded);
+        vector<TestRecord> tests = testsOf(id);
+        vector<string> contacts;
+        for (uint32_t step : neighbours)
+        {
+            if (id + step < users)
+                contacts.push_back(expected[id + step].username);
+        }
+        whole.recordTest(handle, tests[0]);
+        whole.recordTest(handle, tests[1]);
+        whole.recordTest(handle, tests[2], contacts);
+        expected[id].category = tests[2].category;
+        expected[id].testDay = tests[2].day;
+    }
+    
+    // 0/1 into 0/2 and 1/2, then 1/2 into 1/4 and 3/4
+    struct Split
+    {
+        size_t moved = 0, bytes = 0, users = 0, tests = 0, contacts = 0;
+        double splitMs = 0, importMs = 0;
+    };
+    auto split = [&](UserDirectory& from, UserDirectory& to, Split& result) {
+        Partition kept = from.partition();
+        to.setPartition(Partition{kept.index + kept.count, kept.count * 2});
+        string records;
+        auto start = chrono::steady_clock::now();
+        bool done = from.splitPartition(records, result.moved);
+        result.splitMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+        done = to.importRecords(records, result.users, result.tests, result.contacts) && done;
+        result.importMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        result.bytes = records.size();
+        if (!done || result.users != result.moved || result.tests != 3 * result.moved)
+        {
+            cout << "Error: Splitting " << partitionName(kept) << " moved " << result.moved << " user(s) but "
+                 << result.users << " user(s) and " << result.tests << " test(s) arrived.\n";
+            agree = false;
+        }
+    };
+    UserDirectory half(UserStore(), nullptr), quarter(UserStore(), nullptr);
+    Split halves, quarters;
+    split(whole, half, halves);
+    split(half, quarter, quarters);
+    
+    UserDirectory* holders[] = {&whole, &half, &quarter};
+    size_t misplaced = 0, wrongRecords = 0, wrongTests = 0, wrongContacts = 0, expectedContacts = 0;
+    vector<TestRecord> tests;
+    for (uint32_t id = 0; id < users; id++)
+    {
+        const string& name = expected[id].username;
+        UserDirectory* owner = nullptr;
+        int holding = 0;
+        for (UserDirectory* holder : holders)
+        {
+            if (holder->partition().owns(name))
+                owner = holder;
+            holding += holder->contains(name);
+        }
+        if (holding != 1 || !owner || !owner->contains(name))
+        {
+            misplaced++;
+            continue;
+        }
+        User user;
+        bool quarantineEnded;
+        owner->login(name, expected[id].password, user, quarantineEnded);
+        wrongRecords += !sameUser(user, expected[id]);
+        wrongTests += !owner->testHistory(name, INT32_MIN, INT32_MAX, tests) || tests != testsOf(id);
+        
+        // A partition that kept its users still has the moved users' contacts
+        // in its graph, so there the wanted contacts need only be among them
+        vector<string> wanted;
+        for (uint32_t step : neighbours)
+        {
+            if (id >= step && owner->partition().owns(expected[id - step].username))
+                wanted.push_back(expected[id - step].username);
+            if (id + step < users && owner->partition().owns(expected[id + step].username))
+                wanted.push_back(expected[id + step].username);
+        }
+        expectedContacts += wanted.size();
+        vector<string> found = owner->contactsWithin(name, 1, INT32_MIN);
+        sort(wanted.begin(), wanted.end());
+        sort(found.begin(), found.end());
+        if (owner == &quarter)
+            wrongContacts += found != wanted;
+        else
+            wrongContacts += !includes(found.begin(), found.end(), wanted.begin(), wanted.end());
+    }
+    if (misplaced + wrongRecords + wrongTests + wrongContacts > 0 || expectedContacts == 0)
+    {
+        cout << "Error: " << misplaced << " user(s) misplaced, " << wrongRecords << " record(s), " << wrongTests
+             << " test histories and " << wrongContacts << " contact lists wrong.\n";
+        agree = false;
+    }
+    if (whole.size() + half.size() + quarter.size() != users)
+    {
+        cout << "Error: The partitions hold " << whole.size() + half.size() + quarter.size() << " users, not "
+             << users << ".\n";
+        agree = false;
+    }
+    
+    cout << fixed << setprecision(2);
+    cout << "Spread:              " << users << " users over " << spreadCount << " partitions, at most "
+         << worst / mean * 100 << "% off the mean" << (agree ? " (all checks passed)" : "") << "\n";
+    for (const auto& [name, result] : {pair<const char*, const Split&>("0/1 into 0/2 + 1/2", halves),
+                                       pair<const char*, const Split&>("1/2 into 1/4 + 3/4", quarters)})
+    {
+        cout << "Split " << name << ": " << result.moved << " users, " << result.tests << " tests and "
+             << result.contacts << " contacts (" << result.bytes / 1048576.0 << " MB) out in "
+             << result.splitMs << " ms, in again in " << result.importMs << " ms ("
+             << result.moved / max(result.splitMs + result.importMs, 0.001) / 1000 << " M users/s)\n";
+    }
+    if (!agree)
+    {
+        cout << "Error: Partition splits are wrong.\n";
+        return false;
+    }
+    return true;
+}
+
+// Journals `changeCount` registrations, then makes writes fail part way by
+// capping the file size: first until the cap is lifted again, then for good.
+// Every change flush() acknowledged must replay afterwards, and the journal
+// must end on a whole record. Runs in a scratch directory.
+bool benchmarkWriter(long long changeCount)
+{
+#ifdef _WIN32
+    (void)changeCount;
+    cerr << "Error: --bench-writer caps file sizes with POSIX calls and is not available on Windows.\n";
+    return false;
+#else
+    using namespace chrono;
+    const long long failingChanges = 200;
+    const rlim_t capSlack = 1000;       // Bytes the journal may still grow by; a batch needs more
+    changeCount = max(1LL, changeCount);
+    
+    error_code ec;
+    filesystem::path home = filesystem::current_path();
+    filesystem::path scratch = filesystem::temp_directory_path() / ("covid-writer-bench-" + to_string(getpid()));
+    filesystem::remove_all(scratch, ec);
+    if (!filesystem::create_directory(scratch, ec))
+    {
+        cerr << "Error: Could not create " << scratch.string() << ".\n";
+        return false;
+    }
+    filesystem::current_path(scratch);
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit original;
+    getrlimit(RLIMIT_FSIZE, &original);
+    auto capAt = [&](uintmax_t bytes) {
+        rlimit capped = original;
+        capped.rlim_cur = min<rlim_t>(static_cast<rlim_t>(bytes), original.rlim_max);
+        setrlimit(RLIMIT_FSIZE, &capped);
+    };
+    
+    bool passed = true;
+    auto check = [&](bool ok, const string& what) {
+        if (!ok)
+        {
+            cout << "Error: " << what << ".\n";
+            passed = false;
+        }
+    };
+    // The journal ends on a whole record, so nothing after it would be lost
+    auto wholeRecords = [&]() {
+        MappedFile file(JOURNAL_FILE);
+        string_view contents = file.contents();
+        size_t pos = 0;
+        JournalRecordHeader header;
+        string_view payload;
+        while (readJournalRecord(contents, pos, header, payload))
+        {
+        }
+        return file.isOpen() && pos == contents.size();
+    };
+    auto replayedUsers = [&]() {
+        UserStore store;
+        replayJournal(JOURNAL_FILE, store, 0);
+        return static_cast<long long>(store.size());
+    };
+    
+    mt19937 rng(20200311);
+    long long nextId = 0;
+    auto queueChanges = [&](PersistenceWriter& writer, long long count) {
+        for (long long i = 0; i < count; i++)
+        {
+            User user = makeSyntheticUser(nextId++, rng);
+            writer.userChanged(user, user.username);
         }
+    };
+    
+    ProgramOptions options;
+    options.persistence = PERSIST_JOURNAL;
+    options.fsyncPolicy = FSYNC_NONE;
+    double commitUs = 0, recoverMs = 0;
+    {
+        PersistenceWriter writer(options, UserStore(), 0);
+        check(writer.start(), "The writer did not start");
+        auto start = steady_clock::now();
+        queueChanges(writer, changeCount);
+        check(writer.flush(), "The first changes were not committed");
+        commitUs = duration<double, micro>(steady_clock::now() - start).count() / changeCount;
         
-        // Check if we got exactly 9 fields
-        if (fields.size() != 9) {
-            cerr << "Warning: Line " << lineNumber << " has " << fields.size() 
-                 << " fields (expected 9). Skipping.\n";
-            continue;
+        // Writes fail for a while, then the disk has room again
+        capAt(filesystem::file_size(JOURNAL_FILE, ec) + capSlack);
+        queueChanges(writer, failingChanges);
+        this_thread::sleep_for(milliseconds(WRITE_RETRY_MS * 2));
+        check(wholeRecords(), "A failed write left a torn record in the journal");
+        capAt(original.rlim_cur);
+        start = steady_clock::now();
+        check(writer.flush(), "Changes staged during failed writes were not written once they could be");
+        recoverMs = duration<double, milli>(steady_clock::now() - start).count();
+        writer.close();
+    }
+    long long acknowledged = changeCount + failingChanges;
+    check(wholeRecords(), "The journal does not end on a whole record");
+    check(replayedUsers() == acknowledged, "Acknowledged changes are missing from the journal");
+    
+    // Writes keep failing, so the writer gives up without acknowledging
+    bool gaveUp = false;
+    {
+        UserStore store;
+        uint64_t sequence = replayJournal(JOURNAL_FILE, store, 0);
+        PersistenceWriter writer(options, store, sequence);
+        check(writer.start(), "The writer did not restart");
+        capAt(filesystem::file_size(JOURNAL_FILE, ec) + capSlack);
+        queueChanges(writer, failingChanges);
+        gaveUp = !writer.flush();
+        check(gaveUp, "Changes were acknowledged although they could not be written");
+        queueChanges(writer, 1);
+        check(!writer.flush(), "The writer acknowledged changes after giving up");
+        capAt(original.rlim_cur);
+        writer.close();
+    }
+    check(wholeRecords(), "The journal does not end on a whole record after the writer gave up");
+    check(replayedUsers() == acknowledged, "The journal lost changes acknowledged before the failures");
+    
+    filesystem::current_path(home);
+    filesystem::remove_all(scratch, ec);
+    signal(SIGXFSZ, SIG_DFL);
+    
+    cout << fixed << setprecision(2);
+    cout << "Commit:              " << commitUs << " us/change over " << changeCount << " changes"
+         << (passed ? " (all checks passed)" : "") << "\n";
+    cout << "Failing writes:      " << failingChanges << " changes written " << recoverMs
+         << " ms after the disk had room again, no torn records\n";
+    cout << "Failing for good:    " << (gaveUp ? "gave up after " + to_string(WRITE_ATTEMPTS) + " attempts" : "did not give up")
+         << ", " << acknowledged << " acknowledged changes kept\n";
+    if (!passed)
+    {
+        cout << "Error: The writer lost or acknowledged changes it should not have.\n";
+        return false;
+    }
+    return true;
+#endif
+}
+
+// Simulates 60 days over `userCount` synthetic users whose tests fall around
+// the start day, with some retests every day, and checks that the scheduler
+// releases and reminds exactly the users a daily full scan finds.
+bool benchmarkScheduler(long long userCount)
+{
+    const int days = 60;
+    const long long retestsPerDay = max(1LL, userCount / 1000);
+    int32_t startDay = currentDayNumber();
+    mt19937 rng(20200311);
+    
+    UserStore store;
+    for (long long id = 0; id < userCount; id++)
+    {
+        User user = makeSyntheticUser(id, rng);
+        if (user.testDay != NO_TEST_DAY)
+            user.testDay = startDay - 45 + static_cast<int32_t>(rng() % 150);
+        store.add(user);
+    }
+    UserStore scanned = store;      // The full scan works on its own copy
+    
+    auto rebuildStart = chrono::steady_clock::now();
+    HealthScheduler scheduler(startDay);
+    scheduler.rebuild(store);
+    auto rebuildEnd = chrono::steady_clock::now();
+    size_t timers = scheduler.pending();
+    
+    double tickNs = 0, scanNs = 0;
+    size_t events = 0;
+    int mismatchedDays = 0;
+    for (int d = 0; d < days; d++)
+    {
+        int32_t today = startDay + d;
+        for (long long r = 0; r < retestsPerDay; r++)
+        {
+            UserId id{static_cast<uint32_t>(rng() % userCount), 0};
+            User user;
+            store.get(id, user);
+            user.testDay = today;
+            user.category = intToCategory(static_cast<int>(rng() % 5));
+            store.update(id, user);
+            scanned.update(id, user);
+            scheduler.userChanged(id, store.view(id));
         }
         
-        try {
+        vector<uint32_t> released, reminded, scanReleased, scanReminded;
+        auto tickStart = chrono::steady_clock::now();
+        scheduler.advanceTo(today, store, [&](UserId id) { released.push_back(id.slot); },
+                            [&](UserId id) { reminded.push_back(id.slot); });
+        auto scanStart = chrono::steady_clock::now();
+        scanned.forEach([&](UserId id, const UserView& user) {
+            if (user.testDay == NO_TEST_DAY)
+                return;
+            if (user.category == POSITIVE && today - user.testDay >= currentPolicy()->quarantineDays)
+                scanReleased.push_back(id.slot);
+            int32_t reminderDay = user.testDay + currentPolicy()->testReminderDays;
+            if (d == 0 ? reminderDay <= today : reminderDay == today)
+                scanReminded.push_back(id.slot);
+        });
+        for (uint32_t slot : scanReleased)
+            scanned.setCategory(UserId{slot, 0}, LOW_RISK);
+        auto scanEnd = chrono::steady_clock::now();
+        
+        // The first day includes every reminder that came due before the start
+        if (d > 0)
+        {
+            tickNs += chrono::duration<double, nano>(scanStart - tickStart).count();
+            scanNs += chrono::duration<double, nano>(scanEnd - scanStart).count();
+            events += released.size() + reminded.size();
+        }
+        
+        sort(released.begin(), released.end());
+        sort(reminded.begin(), reminded.end());
+        if (released != scanReleased || reminded != scanReminded)
+        {
+            if (++mismatchedDays <= 5)
+            {
+                cout << "Day " << d << ": scheduler released " << released.size() << " and reminded " << reminded.size()
+                     << ", full scan found " << scanReleased.size() << " and " << scanReminded.size() << "\n";
+            }
+        }
+    }
+    
+    cout << fixed << setprecision(1);
+    cout << "Users:              " << userCount << " (" << retestsPerDay << " retests a day for " << days << " days)\n";
+    cout << "Scheduler rebuild:  " << chrono::duration<double, milli>(rebuildEnd - rebuildStart).count()
+         << " ms, " << timers << " timers\n";
+    cout << "Scheduler tick:     " << tickNs / (days - 1) / 1000 << " us/day, "
+         << static_cast<double>(events) / (days - 1) << " events/day\n";
+    cout << "Full scan:          " << scanNs / (days - 1) / 1e6 << " ms/day\n";
+    if (mismatchedDays > 0)
+    {
+        cout << "Error: The scheduler disagreed with the full scan on " << mismatchedDays << " day(s).\n";
+        return false;
+    }
+    cout << "Scheduler and full scan agree on every day.\n";
+    return true;
+}
+
+// Runs a read-mostly session mix on 1..maxThreads threads against one
+// exclusive mutex (the directory before sharding), a single reader-writer
+// lock, and the sharded directory. Every operation logs in; one in five also
+// views the profile and one in twenty records a test. Then checks that
+// concurrent renames, most of them across shards, lose or duplicate no one.
+bool benchmarkContention(long long userCount, unsigned maxThreads)
+{
+    const long long opsPerThread = 200000;
+    int32_t today = currentDayNumber();
+    mt19937 rng(20200311);
+    
+    UserStore loaded;
+    vector<string> passwords(userCount);
+    for (long long id = 0; id < userCount; id++)
+    {
+        User user = makeSyntheticUser(id, rng);
+        passwords[id] = user.password;
+        loaded.add(user);
+    }
+    
+    // One store behind one exclusive mutex, the way the server started out
+    class GlobalLockDirectory
+    {
+    public:
+        explicit GlobalLockDirectory(const UserStore& loaded) : store(loaded) {}
+        
+        UserId login(const string& username, const string& password, User& user, bool&)
+        {
+            lock_guard<mutex> guard(lock);
+            UserId id = store.find(username);
+            if (!store.valid(id) || store.view(id).password != password)
+                return UserId();
+            store.get(id, user);
+            return id;
+        }
+        bool get(UserId id, User& user) const
+        {
+            lock_guard<mutex> guard(lock);
+            return store.get(id, user);
+        }
+        bool update(UserId id, const User& user)
+        {
+            lock_guard<mutex> guard(lock);
+            return store.update(id, user);
+        }
+        
+    private:
+        mutable mutex lock;
+        UserStore store;
+    };
+    
+    atomic<long long> failures(0);
+    bool statisticsWrong = false;
+    auto run = [&](auto& directory, unsigned threadCount) {
+        auto start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (unsigned t = 0; t < threadCount; t++)
+        {
+            threads.emplace_back([&, t]() {
+                mt19937 local(t + 1);
+                char username[32];
+                User user;
+                bool quarantineEnded;
+                for (long long op = 0; op < opsPerThread; op++)
+                {
+                    long long id = static_cast<long long>(local() % userCount);
+                    snprintf(username, sizeof(username), "user%08lld", id);
+                    UserId handle = directory.login(username, passwords[id], user, quarantineEnded);
+                    unsigned roll = local() % 20;
+                    if (roll < 4)
+                    {
+                        directory.get(handle, user);
+                    }
+                    else if (roll == 4)
+                    {
+                        user.testDay = today - static_cast<int32_t>(local() % 10);
+                        user.category = intToCategory(static_cast<int>(local() % 5));
+                        directory.update(handle, user);
+                    }
+                    if (user.username != username)
+                        failures++;
+                }
+            });
+        }
+        for (thread& worker : threads)
+            worker.join();
+        return opsPerThread * threadCount / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    
+    cout << fixed << setprecision(2);
+    cout << "Users: " << userCount << ", " << opsPerThread << " operations per thread, "
+         << thread::hardware_concurrency() << " hardware thread(s)\n";
+    cout << "Threads   one mutex (Mops/s)   one rw lock (Mops/s)   " << (1u << USER_SHARD_BITS)
+         << " shards (Mops/s)\n";
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        GlobalLockDirectory global(loaded);
+        UserDirectory single(loaded, nullptr, 0);
+        UserDirectory sharded(loaded, nullptr);
+        double globalRate = run(global, threads);
+        double singleRate = run(single, threads);
+        double shardedRate = run(sharded, threads);
+        if (!single.checkStatistics() || !sharded.checkStatistics())
+            statisticsWrong = true;
+        cout << setw(7) << threads << setw(21) << globalRate / 1e6 << setw(23) << singleRate / 1e6
+             << setw(22) << shardedRate / 1e6 << "\n";
+    }
+    
+    // Each thread renames its own users back and forth between two names
+    const long long renamed = min(userCount, 20000LL);
+    const int rounds = 4;
+    unsigned threadCount = max(2u, maxThreads);
+    UserDirectory directory(loaded, nullptr);
+    vector<thread> threads;
+    for (unsigned t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&, t]() {
+            char from[32], to[32];
             User user;
-            user.username = fields[0];
-            user.password = fields[1];
-            user.name = fields[2];
+            bool quarantineEnded;
+            for (int round = 0; round < rounds; round++)
+            {
+                for (long long id = t; id < renamed; id += threadCount)
+                {
+                    snprintf(from, sizeof(from), round % 2 == 0 ? "user%08lld" : "moved%08lld", id);
+                    snprintf(to, sizeof(to), round % 2 == 0 ? "moved%08lld" : "user%08lld", id);
+                    UserId handle = directory.login(from, passwords[id], user, quarantineEnded);
+                    if (!directory.rename(handle, to) || !directory.get(handle, user) || user.username != to ||
+                        directory.contains(from))
+                        failures++;
+                }
+            }
+        });
+    }
+    
+    // Every snapshot of the counters taken meanwhile must still add up
+    atomic<bool> renaming(true);
+    thread reader([&]() {
+        while (renaming)
+        {
+            CategoryStats stats = directory.statistics();
+            int64_t total = 0;
+            for (int64_t users : stats.byCategory)
+                total += users;
+            if (total != userCount)
+                statisticsWrong = true;
+        }
+    });
+    for (thread& worker : threads)
+        worker.join();
+    renaming = false;
+    reader.join();
+    if (!directory.checkStatistics())
+        statisticsWrong = true;
+    
+    char username[32];
+    for (long long id = 0; id < userCount; id++)
+    {
+        snprintf(username, sizeof(username), "user%08lld", id);
+        if (!directory.contains(username))
+            failures++;
+    }
+    if (directory.size() != static_cast<size_t>(userCount))
+        failures++;
+    
+    cout << "Renamed " << renamed << " users " << rounds << " times on " << threadCount << " threads\n";
+    if (statisticsWrong)
+    {
+        cout << "Error: The category counters drifted from a full scan under concurrent updates.\n";
+        return false;
+    }
+    if (failures > 0)
+    {
+        cout << "Error: " << failures << " lookup(s) or rename(s) returned the wrong user.\n";
+        return false;
+    }
+    cout << "Every lookup and rename returned the right user.\n";
+    
+    // A data file with a duplicate username goes through the directory and
+    // is saved again; both records must survive and the first still log in
+    string filename = (filesystem::temp_directory_path() / "covid-duplicates-bench.tmp").string();
+    vector<User> written;
+    for (long long id = 0; id < 3; id++)
+        written.push_back(makeSyntheticUser(id, rng));
+    written.push_back(written[1]);
+    written.back().password = "duplicate";
+    UserStore withDuplicate;
+    withDuplicate.assign(written, false);
+    vector<User> reloaded;
+    bool kept = saveUsersToFile(filename, withDuplicate);
+    if (kept)
+    {
+        loadUsersFromFile(filename, reloaded);
+        withDuplicate.assign(move(reloaded), false);
+        UserDirectory fromFile(withDuplicate, nullptr);
+        User user;
+        bool quarantineEnded;
+        kept = fromFile.size() == written.size() &&
+               fromFile.valid(fromFile.login(written[1].username, written[1].password, user, quarantineEnded)) &&
+               saveUsersToFile(filename, fromFile.copyUsers());
+    }
+    reloaded.clear();
+    if (kept)
+        loadUsersFromFile(filename, reloaded);
+    remove(filename.c_str());
+    auto savedOnce = [&](const User& user) {
+        return count_if(reloaded.begin(), reloaded.end(), [&](const User& other) {
+            return other.username == user.username && other.password == user.password;
+        }) == 1;
+    };
+    if (reloaded.size() != written.size() || !all_of(written.begin(), written.end(), savedOnce))
+    {
+        cout << "Error: A user with a duplicate username was lost between loading and saving.\n";
+        return false;
+    }
+    cout << "Both users with a duplicate username were saved again.\n";
+    return true;
+}
+
+// Loads the data files and lists the users the scheduler would act on today
+void printDueReport(const ProgramOptions& options)
+{
+    const size_t listed = 20;
+    UserStore store;
+    loadUserData(store, options);
+    
+    int32_t today = currentDayNumber();
+    HealthScheduler scheduler(today);
+    scheduler.rebuild(store);
+    vector<UserId> released, due;
+    scheduler.advanceTo(today, store, [&](UserId id) { released.push_back(id); },
+                        [&](UserId id) { due.push_back(id); });
+    
+    auto printUsers = [&](const vector<UserId>& ids) {
+        for (size_t i = 0; i < ids.size() && i < listed; i++)
+        {
+            UserView user = store.view(ids[i]);
+            cout << "  " << user.username << " (tested " << dayNumberToDate(user.testDay) << ")\n";
+        }
+        if (ids.size() > listed)
+            cout << "  ... and " << ids.size() - listed << " more\n";
+    };
+    
+    cout << "Quarantine over but still marked positive: " << released.size() << "\n";
+    printUsers(released);
+    cout << "Due for a test (last test " << currentPolicy()->testReminderDays << " or more days ago): " << due.size() << "\n";
+    printUsers(due);
+}
+
+// Prints the maintained counters: users per category, per age band and
+// category, and POSITIVE users by test day over the last DASHBOARD_DAYS days
+void printDashboard(ostream& out, const CategoryStats& stats, int32_t today)
+{
+    const char* const names[] = {"Low Risk", "Travel History", "Suspected", "Close Contact", "Positive"};
+    int64_t total = 0;
+    for (int64_t users : stats.byCategory)
+        total += users;
+    
+    out << "Users by category (" << total << " in total):\n";
+    for (int category = 0; category < 5; category++)
+        out << "  " << left << setw(16) << names[category] << right << setw(10) << stats.byCategory[category] << "\n";
+    
+    out << "\nUsers by age band:\n  Age   ";
+    for (const char* name : names)
+        out << setw(16) << name;
+    out << "\n";
+    for (int band = 0; band < AGE_BANDS; band++)
+    {
+        string label = to_string(AGE_BAND_STARTS[band]) +
+                       (band + 1 < AGE_BANDS ? "-" + to_string(AGE_BAND_STARTS[band + 1] - 1) : "+");
+        out << "  " << left << setw(6) << label << right;
+        for (int category = 0; category < 5; category++)
+            out << setw(16) << stats.byAgeBand[band][category];
+        out << "\n";
+    }
+    
+    out << "\nPositive users by test day (last " << DASHBOARD_DAYS << " days):\n";
+    int64_t listed = 0;
+    for (int32_t day = today; day > today - DASHBOARD_DAYS; day--)
+    {
+        auto found = stats.positivesByDay.find(day);
+        int64_t positives = found == stats.positivesByDay.end() ? 0 : found->second;
+        listed += positives;
+        out << "  " << dayNumberToDate(day) << setw(10) << positives << "\n";
+    }
+    if (stats.byCategory[POSITIVE] > listed)
+        out << "  Earlier   " << setw(10) << stats.byCategory[POSITIVE] - listed << "\n";
+}
+
+// Loads the data files, prints the dashboard and checks its counters
+// against a full scan
+bool showDashboard(const ProgramOptions& options)
+{
+    UserStore store;
+    loadUserData(store, options);
+    UserDirectory directory(store, nullptr);
+    store = UserStore();
+    
+    auto start = chrono::steady_clock::now();
+    CategoryStats stats = directory.statistics();
+    double readUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    printDashboard(cout, stats, currentDayNumber());
+    
+    start = chrono::steady_clock::now();
+    bool consistent = directory.checkStatistics();
+    double scanMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << fixed << setprecision(1);
+    cout << "\nCounters read in " << readUs << " us; full-scan check took " << scanMs << " ms";
+    cout << (consistent ? " and matches.\n" : ".\n");
+    if (!consistent)
+    {
+        cout << "Error: The maintained counters do not match a full scan.\n";
+        return false;
+    }
+    return true;
+}
+
+// Column order of a CSV results row, and the keys of a JSON one
+const char* const RESULT_FIELDS[] = {"username", "fever", "cough", "breathing", "travel", "contact", "result", "date"};
+const int RESULT_FIELD_COUNT = 8;
+
+// Parses one CSV or JSON Lines results row. A line starting with '{' is a
+// flat JSON object with the RESULT_FIELDS keys; anything else is CSV in
+// RESULT_FIELDS order. Answers are 0/1 or true/false and the date is
+// DD/MM/YYYY or "today".
+bool parseResultRow(string_view line, int32_t today, TestResultRow& row, string& error)
+{
+    auto trim = [](string_view text) {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+            text.remove_prefix(1);
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r'))
+            text.remove_suffix(1);
+        return text;
+    };
+    
+    line = trim(line);
+    string_view fields[RESULT_FIELD_COUNT];
+    bool present[RESULT_FIELD_COUNT] = {};
+    string unquoted[RESULT_FIELD_COUNT];    // Quoted CSV fields, which `fields` may point into
+    
+    if (!line.empty() && line.front() == '{')
+    {
+        // Flat object of string, number and boolean values
+        size_t pos = 1;
+        auto skipSpace = [&]() {
+            while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t'))
+                pos++;
+        };
+        auto readString = [&](string_view& text) {
+            size_t end = line.find('"', ++pos);
+            if (end == string_view::npos)
+                return false;
+            text = line.substr(pos, end - pos);
+            pos = end + 1;
+            return text.find('\\') == string_view::npos;
+        };
+        
+        while (true)
+        {
+            skipSpace();
+            if (pos < line.size() && line[pos] == '}')
+                break;
+            string_view key, value;
+            if (pos >= line.size() || line[pos] != '"' || !readString(key))
+            {
+                error = "malformed JSON key";
+                return false;
+            }
+            skipSpace();
+            if (pos >= line.size() || line[pos] != ':')
+            {
+                error = "missing ':' after \"" + string(key) + "\"";
+                return false;
+            }
+            pos++;
+            skipSpace();
+            if (pos < line.size() && line[pos] == '"')
+            {
+                if (!readString(value))
+                {
+                    error = "malformed JSON string";
+                    return false;
+                }
+            }
+            else
+            {
+                size_t end = line.find_first_of(",}", pos);
+                if (end == string_view::npos)
+                    end = line.size();
+                value = trim(line.substr(pos, end - pos));
+                pos = end;
+            }
             
-            // Parse age
-            try {
-                user.age = stoi(fields[3]);
-                if (user.age < 1 || user.age > 120) {
-                    throw out_of_range("Age out of range");
+            for (int i = 0; i < RESULT_FIELD_COUNT; i++)
+            {
+                if (key == RESULT_FIELDS[i])
+                {
+                    fields[i] = value;
+                    present[i] = true;
                 }
-            } catch (const exception& e) {
-                cerr << "Warning: Invalid age on line " << lineNumber 
-                     << ": '" << fields[3] << "'. Using default age 25.\n";
-                user.age = 25;
             }
             
-            user.address = fields[4];
-            user.phone = fields[5];
-            user.IC = fields[6];
+            skipSpace();
+            if (pos < line.size() && line[pos] == ',')
+                pos++;
+            else if (pos >= line.size() || line[pos] != '}')
+            {
+                error = "expected ',' or '}'";
+                return false;
+            }
+        }
+        for (int i = 0; i < RESULT_FIELD_COUNT; i++)
+        {
+            if (!present[i])
+            {
+                error = string("missing \"") + RESULT_FIELDS[i] + "\"";
+                return false;
+            }
+        }
+    }
+    else
+    {
+        // A field may be quoted as in RFC 4180: commas inside the quotes are
+        // part of it and "" stands for one quote
+        int count = 0;
+        size_t start = 0;
+        while (true)
+        {
+            if (count == RESULT_FIELD_COUNT)
+            {
+                count++;
+                break;
+            }
+            size_t comma;
+            string_view field = trim(line.substr(start));
+            if (!field.empty() && field.front() == '"')
+            {
+                size_t pos = line.find('"', start) + 1;
+                string& text = unquoted[count];
+                while (true)
+                {
+                    size_t quote = line.find('"', pos);
+                    if (quote == string_view::npos)
+                    {
+                        error = "unterminated quoted field";
+                        return false;
+                    }
+                    text.append(line.substr(pos, quote - pos));
+                    pos = quote + 1;
+                    if (pos >= line.size() || line[pos] != '"')
+                        break;
+                    text.push_back('"');
+                    pos++;
+                }
+                comma = line.find(',', pos);
+                if (!trim(line.substr(pos, comma == string_view::npos ? string_view::npos : comma - pos)).empty())
+                {
+                    error = "text after a quoted field";
+                    return false;
+                }
+                fields[count++] = text;
+            }
+            else
+            {
+                comma = line.find(',', start);
+                fields[count++] = trim(line.substr(start, comma == string_view::npos ? string_view::npos : comma - start));
+            }
+            if (comma == string_view::npos)
+                break;
+            start = comma + 1;
+        }
+        if (count != RESULT_FIELD_COUNT)
+        {
+            error = "expected " + to_string(RESULT_FIELD_COUNT) + " fields";
+            return false;
+        }
+    }
+    
+    bool answers[6];
+    for (int i = 1; i <= 6; i++)
+    {
+        if (fields[i] == "1" || fields[i] == "true")
+            answers[i - 1] = true;
+        else if (fields[i] == "0" || fields[i] == "false")
+            answers[i - 1] = false;
+        else
+        {
+            error = string("\"") + RESULT_FIELDS[i] + "\" must be 0 or 1";
+            return false;
+        }
+    }
+    
+    if (fields[7] == "today")
+        row.testDay = today;
+    else if (!parseDate(fields[7], row.testDay))
+    {
+        error = "invalid date '" + string(fields[7]) + "'";
+        return false;
+    }
+    if (fields[0].empty())
+    {
+        error = "empty username";
+        return false;
+    }
+    
+    row.username.assign(fields[0]);
+    row.hasFever = answers[0];
+    row.hasCough = answers[1];
+    row.hasBreathingDifficulty = answers[2];
+    row.hasTravelHistory = answers[3];
+    row.hasCloseContact = answers[4];
+    row.testPositive = answers[5];
+    return true;
+}
+
+// Applies a feed of lab results without the menus. The input is read a chunk
+// at a time and applied INGEST_BATCH_ROWS (or `batchRows`) rows at a time,
+// waiting for the writer to commit each batch before reading more, so memory
+// stays bounded however long the feed is. Returns false if the input could
+// not be read or the results could not be saved.
+bool ingestResults(const ProgramOptions& options, const string& filename, size_t batchRows)
+{
+    const int listedWarnings = 10;
+    ifstream file;
+    istream* in = &cin;
+    if (filename != "-")
+    {
+        file.open(filename, ios::binary);
+        if (!file)
+        {
+            cerr << "Error: Could not open " << filename << ".\n";
+            return false;
+        }
+        in = &file;
+    }
+    
+    UserStore store;
+    uint64_t journalSequence = loadUserData(store, options);
+    PersistenceWriter writer(options, store, journalSequence);
+    UserDirectory directory(store, &writer);
+    store = UserStore();
+    directory.loadHistory(HISTORY_FILE, options.fsyncPolicy != FSYNC_NONE);
+    if (!writer.start())
+        return false;
+    
+    int32_t today = currentDayNumber();
+    long long lineNumber = 0, rows = 0, applied = 0, unknown = 0, invalid = 0, batches = 0;
+    auto warn = [&](long long line, const string& message) {
+        if (unknown + invalid <= listedWarnings)
+            cerr << "Warning: Line " << line << ": " << message << ".\n";
+    };
+    
+    vector<TestResultRow> batch(batchRows);
+    vector<long long> batchLines(batchRows);
+    size_t batchSize = 0;
+    string pending;
+    vector<char> chunk(INGEST_READ_BYTES);
+    bool skippingLine = false;
+    bool saved = true;
+    
+    auto applyBatch = [&]() {
+        if (batchSize == 0)
+            return;
+        shared_ptr<const Policy> policy = currentPolicy();
+        for (size_t i = 0; i < batchSize; i++)
+        {
+            const TestResultRow& row = batch[i];
+            unsigned answers = riskIndex(row.hasFever, row.hasCough, row.hasBreathingDifficulty,
+                                         row.hasTravelHistory, row.hasCloseContact, row.testPositive);
+            TestRecord test{row.testDay, static_cast<uint8_t>(answers), policy->table[answers]};
+            if (directory.recordTest(row.username, test))
+            {
+                applied++;
+                continue;
+            }
+            unknown++;
+            warn(batchLines[i], "no user named '" + row.username + "'");
+        }
+        batches++;
+        batchSize = 0;
+        saved = writer.flush();
+    };
+    
+    auto started = chrono::steady_clock::now();
+    while (*in && saved)
+    {
+        in->read(chunk.data(), static_cast<streamsize>(chunk.size()));
+        size_t received = static_cast<size_t>(in->gcount());
+        bool finished = !*in;
+        if (received == 0 && !finished)
+            continue;
+        
+        // Keep the incomplete last line for the next read
+        pending.append(chunk.data(), received);
+        size_t lineStart = 0;
+        while (saved)
+        {
+            size_t newline = pending.find('\n', lineStart);
+            if (newline == string::npos && !(finished && lineStart < pending.size()))
+                break;
+            size_t lineEnd = (newline == string::npos) ? pending.size() : newline;
+            string_view line(pending.data() + lineStart, lineEnd - lineStart);
+            lineStart = lineEnd + 1;
+            lineNumber++;
+            if (skippingLine)
+            {
+                skippingLine = false;
+                continue;
+            }
+            
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == string_view::npos || line[first] == '#')
+                continue;
+            if (line.substr(first).rfind("username,", 0) == 0 || line.substr(first).rfind("\"username\",", 0) == 0)
+                continue;       // CSV header
             
-            // Parse category
-            try {
-                int catVal = stoi(fields[7]);
-                if (catVal < 0 || catVal > 4) {
-                    throw out_of_range("Category out of range");
+            rows++;
+            string error;
+            if (!parseResultRow(line, today, batch[batchSize], error))
+            {
+                invalid++;
+                warn(lineNumber, error);
+                continue;
+            }
+            batchLines[batchSize++] = lineNumber;
+            if (batchSize == batchRows)
+                applyBatch();
+        }
+        
+        pending.erase(0, min(lineStart, pending.size()));
+        if (pending.size() > INGEST_READ_BYTES)
+        {
+            // Dropped here; the rest of the line is skipped when its end arrives
+            if (!skippingLine)
+            {
+                rows++;
+                invalid++;
+                warn(lineNumber + 1, "line is longer than " + to_string(INGEST_READ_BYTES) + " bytes");
+            }
+            pending.clear();
+            skippingLine = true;
+        }
+    }
+    if (saved)
+        applyBatch();
+    writer.close();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    if (!saved)
+    {
+        cerr << "Error: Stopped after line " << lineNumber << " because the results could not be saved.\n";
+        return false;
+    }
+    
+    if (unknown + invalid > listedWarnings)
+        cerr << "Warning: " << unknown + invalid - listedWarnings << " more row(s) were skipped.\n";
+    cout << "Rows:          " << rows << " (" << applied << " applied, " << unknown << " unknown user(s), "
+         << invalid << " invalid)\n";
+    cout << "Batches:       " << batches << "\n";
+    cout << fixed << setprecision(2);
+    cout << "Throughput:    " << (seconds > 0 ? rows / seconds : 0.0) << " rows/s (" << seconds << " s)\n";
+    return true;
+}
+
+// Answers of a test as listed by the history tools, e.g. "fever travel"
+string describeAnswers(uint8_t answers)
+{
+    string text;
+    for (int bit = 0; bit < 5; bit++)
+    {
+        if (answers & (1 << bit))
+            text += (text.empty() ? "" : " ") + string(RESULT_FIELDS[bit + 1]);
+    }
+    return text.empty() ? "none" : text;
+}
+
+// Lists one user's tests dated fromDay..toDay
+bool showHistory(const ProgramOptions& options, const string& username, int32_t fromDay, int32_t toDay)
+{
+    const char* const names[] = {"Low Risk", "Travel History", "Suspected", "Close Contact", "Positive"};
+    UserStore store;
+    loadUserData(store, options);
+    UserDirectory directory(store, nullptr);
+    store = UserStore();
+    directory.loadHistory(HISTORY_FILE, false);
+    
+    vector<TestRecord> tests;
+    if (!directory.testHistory(username, fromDay, toDay, tests))
+    {
+        cerr << "Error: No user named '" << username << "'.\n";
+        return false;
+    }
+    
+    cout << "Tests of " << username << ": " << tests.size() << "\n";
+    if (!tests.empty())
+        cout << "  Date        Result    Category        Answers\n";
+    for (const TestRecord& test : tests)
+    {
+        cout << "  " << dayNumberToDate(test.day) << "  " << left << setw(10)
+             << ((test.answers & 32) ? "Positive" : "Negative") << setw(16) << names[test.category] << right
+             << describeAnswers(test.answers) << "\n";
+    }
+    return true;
+}
+
+// Counts the tests dated fromDay..toDay by category and lists the first few,
+// and times the query
+bool showTestsBetween(const ProgramOptions& options, int32_t fromDay, int32_t toDay)
+{
+    const size_t listed = 20;
+    const char* const names[] = {"Low Risk", "Travel History", "Suspected", "Close Contact", "Positive"};
+    UserStore store;
+    loadUserData(store, options);
+    UserDirectory directory(store, nullptr);
+    store = UserStore();
+    directory.loadHistory(HISTORY_FILE, false);
+    
+    array<int64_t, 5> byCategory{};
+    vector<pair<TestRecord, string>> first;
+    auto start = chrono::steady_clock::now();
+    directory.testsBetween(fromDay, toDay, [&](string_view username, const TestRecord& test) {
+        byCategory[test.category]++;
+        first.emplace_back(test, string(username));
+        // Keep only the earliest few, by date and then username
+        if (first.size() >= 2 * listed)
+        {
+            nth_element(first.begin(), first.begin() + listed, first.end(), [](const auto& a, const auto& b) {
+                return tie(a.first.day, a.second) < tie(b.first.day, b.second);
+            });
+            first.resize(listed);
+        }
+    });
+    double queryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    sort(first.begin(), first.end(), [](const auto& a, const auto& b) {
+        return tie(a.first.day, a.second) < tie(b.first.day, b.second);
+    });
+    
+    int64_t total = 0;
+    for (int64_t tests : byCategory)
+        total += tests;
+    cout << "Tests from " << dayNumberToDate(fromDay) << " to " << dayNumberToDate(toDay) << ": " << total << "\n";
+    for (int category = 0; category < 5; category++)
+        cout << "  " << left << setw(16) << names[category] << right << setw(10) << byCategory[category] << "\n";
+    for (size_t i = 0; i < first.size() && i < listed; i++)
+    {
+        cout << "  " << dayNumberToDate(first[i].first.day) << "  " << left << setw(24) << first[i].second << right
+             << names[first[i].first.category] << "\n";
+    }
+    if (total > static_cast<int64_t>(listed))
+        cout << "  ... and " << total - static_cast<int64_t>(listed) << " more\n";
+    cout << fixed << setprecision(1);
+    cout << "Query took " << queryMs << " ms; the history uses " << directory.historyBytes() / 1048576.0
+         << " MB of memory.\n";
+    return true;
+}
+
+// Resident set size of this process, or 0 where it cannot be read
+size_t residentBytes()
+{
+#ifdef __linux__
+    ifstream statm("/proc/self/statm");
+    size_t totalPages = 0, residentPages = 0;
+    if (statm >> totalPages >> residentPages)
+        return residentPages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    return 0;
+}
+
+// Discards what is written to it, so loader messages and per-line warnings
+// do not dominate a timing
+struct NullBuffer : streambuf
+{
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+// Times the original getline loader against the mmap loader, single-threaded
+// and at increasing thread counts, and checks that all of them agree.
+void benchmarkLoad(const string& filename, int iterations)
+{
+    NullBuffer nullBuffer;
+    iterations = max(iterations, 1);
+    
+    // Returns the best time in milliseconds and leaves the last result in `users`
+    auto timeLoader = [&](const function<void(vector<User>&)>& loader, vector<User>& users) {
+        double best = numeric_limits<double>::max();
+        for (int run = 0; run < iterations; run++)
+        {
+            users.clear();
+            streambuf* savedOut = cout.rdbuf(&nullBuffer);
+            streambuf* savedErr = cerr.rdbuf(&nullBuffer);
+            auto start = chrono::steady_clock::now();
+            loader(users);
+            auto end = chrono::steady_clock::now();
+            cout.rdbuf(savedOut);
+            cerr.rdbuf(savedErr);
+            best = min(best, chrono::duration<double, milli>(end - start).count());
+        }
+        return best;
+    };
+    
+    auto sameUsers = [](const vector<User>& left, const vector<User>& right) {
+        if (left.size() != right.size())
+            return false;
+        for (size_t i = 0; i < left.size(); i++)
+        {
+            if (!sameUser(left[i], right[i]))
+                return false;
+        }
+        return true;
+    };
+    
+    vector<User> reference, users;
+    double baseline = timeLoader([&](vector<User>& out) { loadUsersFromFileGetline(filename, out); }, reference);
+    
+    cout << fixed << setprecision(1);
+    cout << "Records loaded:            " << reference.size() << "\n";
+    cout << "getline loader:            " << baseline << " ms (best of " << iterations << ")\n";
+    
+    vector<unsigned> threadCounts = {1};
+    unsigned hardwareThreads = max(1u, thread::hardware_concurrency());
+    for (unsigned threads = 2; threads < hardwareThreads; threads *= 2)
+        threadCounts.push_back(threads);
+    if (hardwareThreads > 1)
+        threadCounts.push_back(hardwareThreads);
+    
+    for (unsigned threads : threadCounts)
+    {
+        double elapsed = timeLoader([&](vector<User>& out) { loadUsersFromFile(filename, out, threads); }, users);
+        cout << "mmap loader, " << setw(3) << threads << " thread(s): " << setprecision(1) << elapsed << " ms, "
+             << setprecision(2) << baseline / elapsed << "x"
+             << (sameUsers(reference, users) ? "" : " (RESULTS DIFFER FROM GETLINE LOADER)") << "\n";
+    }
+    
+    string snapshotName = filename + ".bench.snap";
+    UserStore referenceStore;
+    referenceStore.assign(reference);
+    if (saveSnapshot(snapshotName, referenceStore))
+    {
+        double elapsed = timeLoader([&](vector<User>& out) { loadSnapshot(snapshotName, out); }, users);
+        cout << "snapshot loader:           " << setprecision(1) << elapsed << " ms, "
+             << setprecision(2) << baseline / elapsed << "x"
+             << (sameUsers(reference, users) ? "" : " (RESULTS DIFFER FROM GETLINE LOADER)") << "\n";
+        remove(snapshotName.c_str());
+    }
+}
+
+// Generates `userCount` users with 1% of the lines damaged, then times the
+// text loaders, saving and reloading, login, date parsing and formatting,
+// and categorisation, checking each against a reference as it goes. The
+// results go to `output` ("-" for standard output) as one JSON object with a
+// flat "results" object, so two runs can be compared key by key.
+bool runBenchmarkSuite(long long userCount, const string& output)
+{
+    const int malformedPercent = 1;
+    const int runs = 3;
+    const string dataName = "bench-suite.users.txt";
+    const string savedName = "bench-suite.saved.txt";
+    const string snapshotName = "bench-suite.snap";
+    userCount = max(1LL, userCount);
+    
+    NullBuffer nullBuffer;
+    vector<pair<string, double>> results;
+    vector<string> failures;
+    
+    // Best of `runs` in milliseconds, with the program's messages silenced
+    auto best = [&](const function<void()>& work) {
+        double fastest = numeric_limits<double>::max();
+        for (int run = 0; run < runs; run++)
+        {
+            streambuf* savedOut = cout.rdbuf(&nullBuffer);
+            streambuf* savedErr = cerr.rdbuf(&nullBuffer);
+            auto start = chrono::steady_clock::now();
+            work();
+            auto end = chrono::steady_clock::now();
+            cout.rdbuf(savedOut);
+            cerr.rdbuf(savedErr);
+            fastest = min(fastest, chrono::duration<double, milli>(end - start).count());
+        }
+        return fastest;
+    };
+    auto sameUsers = [](const vector<User>& left, const vector<User>& right) {
+        return left.size() == right.size() && equal(left.begin(), left.end(), right.begin(), sameUser);
+    };
+    
+    // Data file
+    long long skipped = 0;
+    bool generated = false;
+    double generateMs = best([&] { generated = generateUserFile(dataName, userCount, malformedPercent, &skipped); });
+    if (!generated)
+        return false;
+    results.emplace_back("generate_ms", generateMs);
+    
+    // Loading on one thread and on every core. The original getline loader
+    // is left to --bench-load; it takes minutes at a million users.
+    vector<User> reference, users;
+    double singleMs = best([&] {
+        reference.clear();
+        loadUsersFromFile(dataName, reference, 1);
+    });
+    double loadMs = best([&] {
+        users.clear();
+        loadUsersFromFile(dataName, users);
+    });
+    if (!sameUsers(reference, users))
+        failures.push_back("the parallel loader disagrees with the single-threaded one");
+    if (static_cast<long long>(users.size()) != userCount - skipped)
+        failures.push_back("the loader kept " + to_string(users.size()) + " users, expected " +
+                           to_string(userCount - skipped));
+    results.emplace_back("load_text_one_thread_ms", singleMs);
+    results.emplace_back("load_text_ms", loadMs);
+    results.emplace_back("load_text_users_per_second", users.size() / (loadMs / 1000));
+    results.emplace_back("skipped_lines", static_cast<double>(skipped));
+    
+    // Saving, and reading back what was saved
+    UserStore store;
+    store.assign(users);
+    bool saved = false;
+    uint64_t savedStamp = 0;
+    double saveMs = best([&] { saved = saveUsersToFile(savedName, store, false, &savedStamp); });
+    double snapshotSaveMs = best([&] { saved = saveSnapshot(snapshotName, store) && saved; });
+    vector<User> reloaded;
+    double snapshotLoadMs = best([&] {
+        reloaded.clear();
+        loadSnapshot(snapshotName, reloaded);
+    });
+    if (!saved || !sameUsers(users, reloaded))
+        failures.push_back("the snapshot did not reload the saved users");
+    reloaded.clear();
+    {
+        streambuf* savedOut = cout.rdbuf(&nullBuffer);
+        loadUsersFromFile(savedName, reloaded);
+        cout.rdbuf(savedOut);
+    }
+    if (!sameUsers(users, reloaded))
+        failures.push_back("the saved text file did not reload the same users");
+    if (savedStamp != textFileStamp(savedName))
+        failures.push_back("the stamp taken while saving does not match the saved text file");
+    results.emplace_back("save_text_ms", saveMs);
+    results.emplace_back("save_snapshot_ms", snapshotSaveMs);
+    results.emplace_back("load_snapshot_ms", snapshotLoadMs);
+    remove(dataName.c_str());
+    remove(savedName.c_str());
+    remove(snapshotName.c_str());
+    
+    // Login through the directory, for known users and unknown names
+    const size_t logins = 200000;
+    mt19937 rng(20200311);
+    vector<size_t> picks(logins);
+    for (size_t& pick : picks)
+        pick = rng() % users.size();
+    UserDirectory directory(store, nullptr);
+    store = UserStore();
+    size_t found = 0;
+    double loginMs = best([&] {
+        User user;
+        bool quarantineEnded;
+        found = 0;
+        for (size_t pick : picks)
+            found += directory.valid(directory.login(users[pick].username, users[pick].password, user, quarantineEnded));
+    });
+    size_t strangers = 0;
+    double missMs = best([&] {
+        User user;
+        bool quarantineEnded;
+        strangers = 0;
+        for (size_t pick : picks)
+            strangers += !directory.valid(directory.login("x" + users[pick].username, users[pick].password, user,
+                                                          quarantineEnded));
+    });
+    if (found != logins || strangers != logins)
+        failures.push_back("login did not find exactly the known users");
+    results.emplace_back("login_ns", loginMs * 1e6 / logins);
+    results.emplace_back("login_miss_ns", missMs * 1e6 / logins);
+    
+    // Dates as users type them, some of them invalid
+    vector<string> dates;
+    for (size_t i = 0; i < logins; i++)
+    {
+        int32_t testDay = users[picks[i]].testDay;
+        int year, month, day;
+        civilFromDays(testDay, year, month, day);
+        if (i % 10 == 0)
+            dates.push_back("31/02/2023");
+        else if (i % 2 == 0 && testDay != NO_TEST_DAY)
+            dates.push_back(to_string(day) + "/" + to_string(month) + "/" + to_string(year));
+        else
+            dates.push_back(dayNumberToDate(testDay));
+    }
+    vector<int32_t> parsed(dates.size());
+    size_t accepted = 0;
+    double parseMs = best([&] {
+        accepted = 0;
+        for (size_t i = 0; i < dates.size(); i++)
+            accepted += parseDate(dates[i], parsed[i]);
+    });
+    if (accepted != dates.size() - (dates.size() + 9) / 10)
+        failures.push_back("parseDate accepted " + to_string(accepted) + " of the dates");
+    vector<char> formatted(dates.size() * 10);
+    double formatMs = best([&] {
+        for (size_t i = 0; i < dates.size(); i++)
+            formatDate(parsed[i], &formatted[i * 10]);
+    });
+    results.emplace_back("parse_date_ns", parseMs * 1e6 / dates.size());
+    results.emplace_back("format_date_ns", formatMs * 1e6 / dates.size());
+    
+    // Categorisation, one assessment at a time and in batches
+    const size_t rows = 10000000;
+    vector<uint8_t> columns[6];
+    vector<uint8_t> answerSets(rows);
+    for (auto& column : columns)
+        column.resize(rows);
+    for (size_t row = 0; row < rows; row++)
+    {
+        for (int question = 0; question < 6; question++)
+        {
+            columns[question][row] = rng() % 3 == 0;
+            answerSets[row] |= columns[question][row] << question;
+        }
+    }
+    vector<Category> single(rows), batch(rows);
+    double assessMs = best([&] {
+        shared_ptr<const Policy> policy = currentPolicy();
+        for (size_t row = 0; row < rows; row++)
+            single[row] = policy->table[answerSets[row]];
+    });
+    ScreeningColumns screening{columns[0].data(), columns[1].data(), columns[2].data(),
+                               columns[3].data(), columns[4].data(), columns[5].data()};
+    double batchMs = best([&] { categoriseBatch(screening, rows, batch.data()); });
+    for (size_t row = 0; row < rows; row += 997)
+    {
+        const auto& a = answerSets[row];
+        if (single[row] != assessRisk(a & 1, a & 2, a & 4, a & 8, a & 16, a & 32) || batch[row] != single[row])
+        {
+            failures.push_back("categorisation disagrees with assessRisk");
+            break;
+        }
+    }
+    results.emplace_back("assess_ns", assessMs * 1e6 / rows);
+    results.emplace_back("categorise_batch_ns", batchMs * 1e6 / rows);
+    
+    // Strings in the report are fixed names or the compiler's version
+    auto quoted = [](const string& text) {
+        string escaped = "\"";
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            if (static_cast<unsigned char>(c) >= 0x20)
+                escaped += c;
+        }
+        return escaped + "\"";
+    };
+    ostringstream json;
+    json << setprecision(6);
+    json << "{\n";
+    json << "  \"suite\": \"health_manager\",\n";
+    json << "  \"schema\": 1,\n";
+    json << "  \"date\": " << quoted(dayNumberToDate(currentDayNumber())) << ",\n";
+#ifdef __VERSION__
+    json << "  \"compiler\": " << quoted(__VERSION__) << ",\n";
+#endif
+    json << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n";
+    json << "  \"users\": " << userCount << ",\n";
+    json << "  \"malformed_percent\": " << malformedPercent << ",\n";
+    json << "  \"runs\": " << runs << ",\n";
+    json << "  \"checks_passed\": " << (failures.empty() ? "true" : "false") << ",\n";
+    json << "  \"failures\": [";
+    for (size_t i = 0; i < failures.size(); i++)
+        json << (i ? ", " : "") << quoted(failures[i]);
+    json << "],\n";
+    json << "  \"results\": {\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        json << "    " << quoted(results[i].first) << ": " << results[i].second
+             << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  }\n";
+    json << "}\n";
+    
+    if (output == "-")
+    {
+        cout << json.str();
+    }
+    else
+    {
+        ofstream outfile(output);
+        if (!(outfile << json.str()))
+        {
+            cerr << "Error: Could not write " << output << ".\n";
+            return false;
+        }
+        cout << "Wrote " << results.size() << " results to " << output << ".\n";
+    }
+    for (const string& failure : failures)
+        cerr << "Error: Check failed: " << failure << ".\n";
+    return failures.empty();
+}
+
+#ifndef _WIN32
+// Set from the signal handler to stop the accept loop
+atomic<bool> serverStopping(false);
+
+void stopServer(int)
+{
+    serverStopping = true;
+}
+
+// Set by SIGUSR1 to have the accept loop print the dashboard
+atomic<bool> dashboardRequested(false);
+
+void requestDashboard(int)
+{
+    dashboardRequested = true;
+}
+
+// Set by SIGUSR2 to have the accept loop print the latency statistics
+atomic<bool> metricsRequested(false);
+
+void requestMetrics(int)
+{
+    metricsRequested = true;
+}
+
+// Lets the process open as many sockets as the hard limit allows
+void raiseFileLimit()
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// An address made only of digits is a TCP port on 127.0.0.1; anything else
+// is the path of a Unix domain socket
+bool makeSocketAddress(const string& address, sockaddr_storage& storage, socklen_t& length)
+{
+    memset(&storage, 0, sizeof(storage));
+    if (!address.empty() && all_of(address.begin(), address.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)); }))
+    {
+        unsigned long port = stoul(address);
+        if (port == 0 || port > 65535)
+        {
+            cerr << "Error: Invalid port " << address << ".\n";
+            return false;
+        }
+        sockaddr_in* inet = reinterpret_cast<sockaddr_in*>(&storage);
+        inet->sin_family = AF_INET;
+        inet->sin_port = htons(static_cast<uint16_t>(port));
+        inet->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        length = sizeof(sockaddr_in);
+        return true;
+    }
+    
+    sockaddr_un* local = reinterpret_cast<sockaddr_un*>(&storage);
+    if (address.empty() || address.size() >= sizeof(local->sun_path))
+    {
+        cerr << "Error: Socket path '" << address << "' is empty or too long.\n";
+        return false;
+    }
+    local->sun_family = AF_UNIX;
+    memcpy(local->sun_path, address.c_str(), address.size() + 1);
+    length = sizeof(sockaddr_un);
+    return true;
+}
+
+int openListener(const string& address)
+{
+    sockaddr_storage storage;
+    socklen_t length;
+    if (!makeSocketAddress(address, storage, length))
+        return -1;
+    
+    int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        cerr << "Error: Could not create a socket (" << strerror(errno) << ").\n";
+        return -1;
+    }
+    if (storage.ss_family == AF_UNIX)
+    {
+        unlink(address.c_str());
+    }
+    else
+    {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&storage), length) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        cerr << "Error: Could not listen on " << address << " (" << strerror(errno) << ").\n";
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connectTo(const string& address)
+{
+    sockaddr_storage storage;
+    socklen_t length;
+    if (!makeSocketAddress(address, storage, length))
+        return -1;
+    
+    int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&storage), length) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+#ifdef __linux__
+ServerSession::ServerSession(int fd, UserDirectory& directory)
+    : fd(fd), out(&output), term(nullptr, out), task(serveSession(term, directory))
+{
+}
+
+bool SessionLoop::open()
+{
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 || wakeFd < 0)
+    {
+        cerr << "Error: Could not create an event loop (" << strerror(errno) << ").\n";
+        return false;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == 0;
+}
+
+SessionLoop::~SessionLoop()
+{
+    if (epollFd >= 0)
+        close(epollFd);
+    if (wakeFd >= 0)
+        close(wakeFd);
+}
+
+// Hands a new connection to the loop; called from the accepting thread
+void SessionLoop::adopt(int fd)
+{
+    {
+        lock_guard<mutex> lock(inboxMutex);
+        inbox.push_back(fd);
+    }
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        cerr << "Warning: Could not wake an event loop (" << strerror(errno) << ").\n";
+}
+
+void SessionLoop::run()
+{
+    epoll_event events[64];
+    while (!serverStopping)
+    {
+        int count = epoll_wait(epollFd, events, 64, 200);
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.fd == wakeFd)
+            {
+                uint64_t wakeups;
+                while (read(wakeFd, &wakeups, sizeof(wakeups)) > 0)
+                {
                 }
-                user.category = intToCategory(catVal);
-            } catch (const exception& e) {
-                cerr << "Warning: Invalid category on line " << lineNumber 
-                     << ": '" << fields[7] << "'. Using default LOW_RISK.\n";
-                user.category = LOW_RISK;
+                vector<int> adopted;
+                {
+                    lock_guard<mutex> lock(inboxMutex);
+                    adopted.swap(inbox);
+                }
+                for (int fd : adopted)
+                    startSession(fd);
+            }
+            else
+            {
+                service(events[i].data.fd, events[i].events);
+            }
+        }
+    }
+    
+    // End every session as if its client had gone, so each unwinds normally
+    for (auto& entry : sessions)
+    {
+        ServerSession& session = *entry.second;
+        session.term.closeInput();
+        session.term.resumeIfReady();
+        flush(session);
+        shutdown(session.fd, SHUT_RDWR);
+        close(session.fd);
+    }
+    sessions.clear();
+    openCount = 0;
+}
+
+void SessionLoop::startSession(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+        close(fd);
+        return;
+    }
+    
+    auto created = make_unique<ServerSession>(fd, directory);
+    ServerSession& session = *created;
+    session.term.setHeadless(headless);
+    sessions.emplace(fd, move(created));
+    openCount = sessions.size();
+    
+    // Runs the menus up to the first prompt
+    session.task.start();
+    settle(session);
+}
+
+// Reads whatever the client has sent, a chunk at a time, letting the session
+// consume each chunk before the next so its buffer stays small. Stops reading
+// while output is backed up, so a client that does not read is not fed.
+void SessionLoop::service(int fd, uint32_t events)
+{
+    auto found = sessions.find(fd);
+    if (found == sessions.end())
+        return;
+    ServerSession& session = *found->second;
+    
+    if (events & EPOLLOUT)
+    {
+        settle(session);
+        return;
+    }
+    
+    char chunk[4096];
+    while (session.output.pending().empty() && !session.task.done() && !session.answered)
+    {
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (received <= 0)
+        {
+            session.term.closeInput();
+            session.term.resumeIfReady();
+            break;
+        }
+        
+        // A control request is answered here once it has all arrived; the
+        // menus it interrupted are dropped with the session
+        if (!session.inputSeen)
+        {
+            session.inputSeen = true;
+            session.control = chunk[0] == CONTROL_MARK;
+        }
+        if (session.control)
+        {
+            session.request.append(chunk, static_cast<size_t>(received));
+            size_t size = controlRequestSize(session.request);
+            if (size == 0 && session.request.size() > MAX_SESSION_INPUT)
+            {
+                endSession(fd);
+                return;
             }
-            
-            user.testdate = normalizeDate(fields[8]);
-            
-            // Validate date
-            if (user.testdate != DEFAULT_DATE && !isValidDate(user.testdate)) {
-                cerr << "Warning: Invalid date format on line " << lineNumber 
-                     << ": '" << fields[8] << "'. Using default date.\n";
-                user.testdate = DEFAULT_DATE;
+            if (size > 0 && session.request.size() >= size)
+            {
+                session.output.pending() += answerControl(directory, follower, session.request);
+                session.answered = true;
             }
-            
-            users.push_back(user);
-            loadedCount++;
-            
-        } catch (const exception& e) {
-            cerr << "Error processing line " << lineNumber << ": " << e.what() << endl;
-            cerr << "Line: " << line << endl;
             continue;
         }
+        
+        session.term.receive(chunk, static_cast<size_t>(received));
+        session.term.resumeIfReady();
+        if (session.term.buffered() > MAX_SESSION_INPUT)
+        {
+            endSession(fd);
+            return;
+        }
+        flush(session);
     }
-    
-    infile.close();
-    
-    if (loadedCount > 0) {
-        cout << "Successfully loaded " << loadedCount << " user(s) from file." << endl;
-    } else if (lineNumber > 0) {
-        cout << "No valid user data found in file." << endl;
-    }
+    settle(session);
 }
 
-void saveUsersToFile(const string& filename, const vector<User>& users)
+// Sends pending output, then either ends a finished session or waits for
+// whichever of input or output room it needs next
+void SessionLoop::settle(ServerSession& session)
 {
-    ofstream outfile(filename);
-    if (!outfile.is_open())
+    if (!flush(session))
     {
-        cerr << "Error: Could not save user data to file.\n";
+        endSession(session.fd);
         return;
     }
-    
-    for (const auto& user : users)
+    bool backedUp = !session.output.pending().empty();
+    if (!backedUp && (session.task.done() || session.answered))
     {
-        outfile << user.username << "|"
-                << user.password << "|"
-                << user.name << "|"
-                << user.age << "|"
-                << user.address << "|"
-                << user.phone << "|"
-                << user.IC << "|"
-                << categoryToInt(user.category) << "|"
-                << user.testdate << endl;
+        endSession(session.fd);
+        return;
+    }
+    if (backedUp != session.writing)
+    {
+        epoll_event event{};
+        event.events = backedUp ? EPOLLOUT : EPOLLIN;
+        event.data.fd = session.fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, session.fd, &event);
+        session.writing = backedUp;
     }
-    
-    outfile.close();
 }
 
-void clearScreen()
+// Writes as much pending output as the socket takes. Returns false if the
+// client has gone.
+bool SessionLoop::flush(ServerSession& session)
 {
-#ifdef _WIN32
-    system("cls");
-#else
-    system("clear");
-#endif
+    string& pending = session.output.pending();
+    size_t sent = 0;
+    while (sent < pending.size())
+    {
+        ssize_t written = send(session.fd, pending.data() + sent, pending.size() - sent, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written <= 0)
+            return false;
+        sent += static_cast<size_t>(written);
+    }
+    pending.erase(0, sent);
+    return true;
 }
 
-void waitForUser()
+void SessionLoop::endSession(int fd)
 {
-    cout << "\nPress Enter to continue...";
-    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-    cin.get();
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    sessions.erase(fd);
+    close(fd);
+    openCount = sessions.size();
 }
 
-void registration(vector<User>& users)
+// Runs one menu session and says goodbye if the user chose Exit
+Task<> serveSession(Terminal& term, UserDirectory& directory)
 {
-    cout << "REGISTRATION\n";
-    cout << "============\n\n";
-    
-    User newUser;
-    
-    // Username
-    while (true)
+    bool exited = co_await runSession(term, directory);
+    if (exited)
     {
-        cout << "Username: ";
-        cin >> newUser.username;
-        
-        bool usernameExists = false;
-        for (const auto& user : users)
-        {
-            if (user.username == newUser.username)
-            {
-                cout << "Username already exists. Please choose another.\n";
-                usernameExists = true;
-                break;
-            }
-        }
-        
-        if (!usernameExists) break;
+        term.out << "Thank you for using the COVID-19 Health Management System!\n";
     }
-    
-    // Password
-    cout << "Password: ";
-    cin >> newUser.password;
-    
-    // Name
-    cin.ignore();
-    cout << "Full Name: ";
-    getline(cin, newUser.name);
-    
-    // Age
-    newUser.age = getValidatedInt("Age: ", 1, 120);
-    
-    // Address
-    cout << "Address: ";
-    getline(cin, newUser.address);
-    
-    // Phone
-    cout << "Phone Number: ";
-    getline(cin, newUser.phone);
-    
-    // IC/Passport
-    cout << "IC/Passport Number: ";
-    getline(cin, newUser.IC);
-    
-    // Default values
-    newUser.category = LOW_RISK;
-    newUser.testdate = DEFAULT_DATE;
-    
-    users.push_back(newUser);
-    cout << "\nRegistration successful!\n";
 }
 
-bool login(vector<User>& users, User*& currentUser)
+// A control request is a line, "<CONTROL_MARK><verb> [bytes]", then that many
+// bytes. Returns the size of the whole request, or 0 while the line is still
+// incomplete.
+size_t controlRequestSize(string_view request)
 {
-    cout << "LOGIN\n";
-    cout << "=====\n\n";
+    size_t end = request.find('\n');
+    if (end == string_view::npos)
+        return 0;
+    istringstream line(string(request.substr(1, end - 1)));
+    string verb;
+    size_t bytes = 0;
+    line >> verb >> bytes;
+    return end + 1 + bytes;
+}
+
+// Answers the requests --split-partition and --promote make. "info" names
+// the partition and counts its users; "split" halves the partition and
+// replies with the records of the users who leave; "import" adds records from
+// a split; "promote" makes a replica the primary. The reply is one line,
+// starting with CONTROL_MARK, then any records.
+string answerControl(UserDirectory& directory, ReplicaFollower* follower, string_view request)
+{
+    size_t end = request.find('\n');
+    istringstream line(string(request.substr(1, end - 1)));
+    string verb;
+    line >> verb;
+    string_view body = request.substr(end + 1);
     
-    string username, password;
+    string reply(1, CONTROL_MARK);
+    if (directory.replica() && (verb == "split" || verb == "import"))
+    {
+        reply += "error this server is a read-only replica\n";
+    }
+    else if (verb == "promote")
+    {
+        string error;
+        if (!follower || !follower->promote(error))
+            return reply + "error " + (follower ? error : "this server is not a replica") + "\n";
+        reply += "promoted " + to_string(follower->sequence()) + "\n";
+    }
+    else if (verb == "info")
+    {
+        reply += "partition " + partitionName(directory.partition()) + " " + to_string(directory.size()) + "\n";
+    }
+    else if (verb == "split")
+    {
+        // The new partition is recorded first: a restart after the users
+        // have gone must not take them back
+        Partition kept = directory.partition();
+        kept.count *= 2;
+        string records;
+        size_t moved = 0;
+        if (kept.count > MAX_PARTITIONS || !savePartition(kept) || !directory.splitPartition(records, moved))
+            return reply + "error the partition cannot be split\n";
+        reply += "split " + partitionName(kept) + " " + to_string(moved) + " " + to_string(records.size()) + "\n";
+        reply += records;
+    }
+    else if (verb == "import")
+    {
+        size_t users, tests, contacts;
+        if (!directory.importRecords(body, users, tests, contacts))
+            return reply + "error the records are damaged\n";
+        reply += "imported " + to_string(users) + " " + to_string(tests) + " " + to_string(contacts) + "\n";
+    }
+    else
+    {
+        reply += "error unknown request " + verb + "\n";
+    }
+    return reply;
+}
+
+// Serves the menus to every client that connects. Sessions are coroutines
+// spread over a few epoll loops, one per thread, so an idle session costs
+// only its buffers and suspended frames rather than a thread. Runs until
+// SIGINT or SIGTERM, then ends open sessions and commits pending changes.
+int runServer(const ProgramOptions& options, const string& address)
+{
+    raiseFileLimit();
+    UserStore store;
+    uint64_t journalSequence = loadUserData(store, options);
+    PersistenceWriter writer(options, store, journalSequence);
+    UserDirectory directory(store, options.replica ? nullptr : &writer);
+    store = UserStore();
+    directory.setPartition(options.partition);
+    directory.requireUniqueIC(options.uniqueIC && !options.replica);
+    directory.writeStatsTo(options.statsFile);
+    ReplicaFollower follower(directory, options);
+    if (options.replica)
+    {
+        directory.setReplica(chrono::milliseconds(options.maxStalenessMs));
+        if (!follower.start(journalSequence))
+            return 1;
+    }
+    else
+    {
+        directory.loadHistory(HISTORY_FILE, options.fsyncPolicy != FSYNC_NONE);
+        if (!writer.start())
+            return 1;
+    }
     
-    cout << "Username: ";
-    cin >> username;
+    int listener = openListener(address);
+    if (listener < 0)
+    {
+        writer.close();
+        follower.close();
+        return 1;
+    }
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    signal(SIGUSR1, requestDashboard);
+    signal(SIGUSR2, requestMetrics);
     
-    cout << "Password: ";
-    cin >> password;
+    unsigned loopCount = options.serverThreads ? options.serverThreads : max(1u, thread::hardware_concurrency());
+    vector<unique_ptr<SessionLoop>> loops;
+    vector<thread> loopThreads;
+    for (unsigned i = 0; i < loopCount; i++)
+    {
+        loops.push_back(make_unique<SessionLoop>(directory, options.headless, &follower));
+        if (!loops.back()->open())
+        {
+            close(listener);
+            writer.close();
+            follower.close();
+            return 1;
+        }
+    }
+    for (auto& loop : loops)
+        loopThreads.emplace_back([&loop]() { loop->run(); });
+    cout << (options.replica ? "Serving a read-only replica " : "Serving ");
+    if (options.partition.count > 1)
+        cout << "partition " << partitionName(options.partition) << " ";
+    cout << "on " << address << " with " << loopCount << " event loop(s).\n";
     
-    for (auto& user : users)
+    long long sessionCount = 0;
+    size_t peakOpen = 0;
+    while (!serverStopping)
     {
-        if (user.username == username && user.password == password)
+        // Poll rather than block in accept so a signal can end the loop
+        pollfd listening{listener, POLLIN, 0};
+        int ready = poll(&listening, 1, 200);
+        directory.tick();
+        if (dashboardRequested.exchange(false))
         {
-            currentUser = &user;
-            updateCategoryBasedOnTime(currentUser);
-            cout << "\nLogin successful! Welcome, " << user.name << "!\n";
-            return true;
+            printDashboard(cout, directory.statistics(), currentDayNumber());
+            cout << flush;
+        }
+        if (metricsRequested.exchange(false))
+        {
+            printMetrics(cout);
+            cout << flush;
+        }
+        if (ready <= 0)
+            continue;
+        
+        int client;
+        while ((client = accept(listener, nullptr, nullptr)) >= 0)
+        {
+            loops[sessionCount++ % loopCount]->adopt(client);
         }
+        size_t open = 0;
+        for (auto& loop : loops)
+            open += loop->openSessions();
+        peakOpen = max(peakOpen, open);
     }
     
-    cout << "\nInvalid username or password.\n";
-    waitForUser();
-    return false;
+    for (thread& loopThread : loopThreads)
+        loopThread.join();
+    close(listener);
+    if (address.find_first_not_of("0123456789") != string::npos)
+        unlink(address.c_str());
+    bool saved = writer.close();
+    saved = follower.close() && saved;
+    
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cout << "Served " << sessionCount << " session(s), at most " << peakOpen << " open at once; peak RSS "
+         << fixed << setprecision(1) << usage.ru_maxrss / 1024.0 << " MB.\n";
+    if (options.replica)
+        cout << "Applied " << follower.records() << " journal record(s) from the primary, up to sequence "
+             << follower.sequence() << ".\n";
+    if (!options.statsFile.empty())
+        writeStats(options.statsFile);
+    if (!saved)
+    {
+        cerr << "Error: Some changes could not be saved.\n";
+        return 1;
+    }
+    if (directory.modified() && !directory.replica())
+    {
+        cout << "User data has been saved.\n";
+    }
+    return 0;
 }
 
-void logout(User*& currentUser)
+PartitionRouter::~PartitionRouter()
 {
-    currentUser = nullptr;
-    cout << "You have been logged out.\n";
-    waitForUser();
+    for (auto& entry : byFd)
+        close(entry.first);
+    if (listener >= 0)
+        close(listener);
+    if (epollFd >= 0)
+        close(epollFd);
 }
 
-void viewProfile(const User* user)
+// Runs until SIGINT or SIGTERM. Redirects the map could not follow yet are
+// retried between waits.
+bool PartitionRouter::run(const string& address)
 {
-    cout << "PROFILE INFORMATION\n";
-    cout << "===================\n\n";
+    using namespace chrono;
+    string error;
+    if (!loadPartitionMap(mapFile, map, error))
+    {
+        cerr << "Error: " << error << ".\n";
+        return false;
+    }
+    error_code ec;
+    mapTime = filesystem::last_write_time(mapFile, ec);
     
-    cout << "Name: " << user->name << endl;
-    cout << "Age: " << user->age << endl;
-    cout << "Address: " << user->address << endl;
-    cout << "Phone: " << user->phone << endl;
-    cout << "IC/Passport: " << user->IC << endl;
-    cout << "Last Test Date: " << (user->testdate == DEFAULT_DATE ? "Not recorded" : user->testdate) << endl;
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+    {
+        cerr << "Error: Could not create an event loop (" << strerror(errno) << ").\n";
+        return false;
+    }
+    listener = openListener(address);
+    if (listener < 0)
+        return false;
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = listener;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listener, &event);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    cout << "Routing " << address << " to " << map.entries.size() << " partition(s).\n" << flush;
     
-    string categoryNames[] = {"Low Risk", "Travel History", "Suspected Case", "Close Contact", "Positive Case"};
-    cout << "Health Category: " << categoryNames[user->category] << endl;
-}
-
-void updateProfile(User* user, vector<User>& users)
-{
-    while (true)
+    epoll_event events[64];
+    auto lastReload = steady_clock::now();
+    while (!serverStopping)
     {
-        clearScreen();
-        cout << "UPDATE PROFILE\n";
-        cout << "==============\n\n";
-        
-        cout << "Current Information:\n";
-        cout << "1. Name: " << user->name << endl;
-        cout << "2. Age: " << user->age << endl;
-        cout << "3. Address: " << user->address << endl;
-        cout << "4. Phone: " << user->phone << endl;
-        cout << "5. IC/Passport: " << user->IC << endl;
-        cout << "6. Password: " << string(user->password.length(), '*') << endl;
-        cout << "7. Username: " << user->username << endl;
-        cout << "8. Return to Menu\n\n";
-        
-        int choice = getValidatedInt("Select field to update (1-8): ", 1, 8);
-        
-        if (choice == 8) return;
-        
-        cin.ignore();
-        switch (choice)
+        int count = epoll_wait(epollFd, events, 64, ROUTER_RETRY_MS / 2);
+        for (int i = 0; i < count; i++)
         {
-            case 1:
-                cout << "Enter new name: ";
-                getline(cin, user->name);
-                cout << "Name updated.\n";
-                break;
-                
-            case 2:
-                user->age = getValidatedInt("Enter new age: ", 1, 120);
-                cout << "Age updated.\n";
-                break;
-                
-            case 3:
-                cout << "Enter new address: ";
-                getline(cin, user->address);
-                cout << "Address updated.\n";
-                break;
-                
-            case 4:
-                cout << "Enter new phone number: ";
-                getline(cin, user->phone);
-                cout << "Phone number updated.\n";
-                break;
-                
-            case 5:
-                cout << "Enter new IC/Passport number: ";
-                getline(cin, user->IC);
-                cout << "IC/Passport updated.\n";
-                break;
-                
-            case 6:
-            {
-                cout << "Enter old password: ";
-                string oldPass;
-                getline(cin, oldPass);
-                
-                if (oldPass == user->password)
-                {
-                    cout << "Enter new password: ";
-                    getline(cin, user->password);
-                    cout << "Password updated.\n";
-                }
-                else
-                {
-                    cout << "Incorrect password.\n";
-                }
-                break;
-            }
-                
-            case 7:
+            int fd = events[i].data.fd;
+            if (fd == listener)
             {
-                cout << "Enter new username: ";
-                string newUsername;
-                getline(cin, newUsername);
-                
-                bool usernameExists = false;
-                for (const auto& otherUser : users)
-                {
-                    if (otherUser.username == newUsername && &otherUser != user)
-                    {
-                        usernameExists = true;
-                        break;
-                    }
-                }
-                
-                if (!usernameExists)
-                {
-                    user->username = newUsername;
-                    cout << "Username updated.\n";
-                }
-                else
-                {
-                    cout << "Username already exists.\n";
-                }
-                break;
+                acceptClients();
+                continue;
             }
+            auto found = byFd.find(fd);
+            if (found == byFd.end())
+                continue;
+            shared_ptr<RoutedSession> session = found->second;
+            service(session, fd, events[i].events);
         }
         
-        waitForUser();
+        auto now = steady_clock::now();
+        if (now - lastReload >= seconds(1))
+        {
+            reloadMap();
+            lastReload = now;
+        }
+        vector<shared_ptr<RoutedSession>> due;
+        erase_if(retrying, [&](const shared_ptr<RoutedSession>& session) {
+            if (session->client >= 0 && session->retryAt > now)
+                return false;
+            if (session->client >= 0)
+                due.push_back(session);
+            return true;
+        });
+        for (const shared_ptr<RoutedSession>& session : due)
+        {
+            follow(session);
+            settle(*session);
+        }
     }
+    
+    if (address.find_first_not_of("0123456789") != string::npos)
+        unlink(address.c_str());
+    cout << "Routed " << routedCount << " session(s) with " << redirectCount << " redirect(s); "
+         << failedCount << " could not be placed.\n";
+    return true;
 }
 
-void takeTest(vector<User>& users, User* user)
+// Picks up a changed map file. A map that does not load is reported once and
+// the previous one kept.
+bool PartitionRouter::reloadMap()
 {
-    cout << "COVID-19 SELF-ASSESSMENT\n";
-    cout << "========================\n\n";
-    
-    // Ask screening questions
-    bool hasFever = getValidatedInt("Do you have a fever? (1=Yes, 0=No): ", 0, 1);
-    bool hasCough = getValidatedInt("Do you have a cough? (1=Yes, 0=No): ", 0, 1);
-    bool hasBreathingDifficulty = getValidatedInt("Do you have difficulty breathing? (1=Yes, 0=No): ", 0, 1);
-    bool hasTravelHistory = getValidatedInt("Have you traveled to a high-risk area in the past 14 days? (1=Yes, 0=No): ", 0, 1);
-    bool hasCloseContact = getValidatedInt("Have you been in close contact with a COVID-19 positive individual? (1=Yes, 0=No): ", 0, 1);
-    
-    int testResult = getValidatedInt("Enter test result (1=Positive, 0=Negative): ", 0, 1);
-    
-    // Determine category based on responses
-    int symptomScore = (hasFever ? 1 : 0) + (hasCough ? 1 : 0) + (hasBreathingDifficulty ? 1 : 0);
+    error_code ec;
+    filesystem::file_time_type modified = filesystem::last_write_time(mapFile, ec);
+    if (ec || modified == mapTime)
+        return false;
+    mapTime = modified;
     
-    if (testResult == 1)
-    {
-        user->category = POSITIVE;
-    }
-    else if (hasCloseContact)
+    PartitionMap loaded;
+    string error;
+    if (!loadPartitionMap(mapFile, loaded, error))
     {
-        user->category = CLOSE_CONTACT;
+        cerr << "Warning: Keeping the previous partition map; " << error << ".\n";
+        return false;
     }
-    else if (symptomScore >= 2 || (symptomScore >= 1 && hasTravelHistory))
+    map = move(loaded);
+    cout << "Loaded " << map.entries.size() << " partition(s) from " << mapFile << ".\n" << flush;
+    return true;
+}
+
+// New sessions start on the partitions in turn, skipping any that is down
+void PartitionRouter::acceptClients()
+{
+    int client;
+    while ((client = accept(listener, nullptr, nullptr)) >= 0)
     {
-        user->category = SUSPECTED;
+        auto session = make_shared<RoutedSession>();
+        session->client = client;
+        for (size_t tried = 0; tried < map.entries.size() && session->partition < 0; tried++)
+        {
+            session->address = map.entries[nextPartition++ % map.entries.size()].second;
+            session->partition = connectTo(session->address);
+        }
+        if (session->partition < 0)
+        {
+            const string message = "No partition is available. Please try again later.\n";
+            send(client, message.data(), message.size(), MSG_NOSIGNAL);
+            close(client);
+            failedCount++;
+            continue;
+        }
+        track(client, session);
+        track(session->partition, session);
+        routedCount++;
     }
-    else if (hasTravelHistory)
+}
+
+void PartitionRouter::track(int fd, const shared_ptr<RoutedSession>& session)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    byFd[fd] = session;
+}
+
+// Reads one chunk from whichever side is ready, then sends what is queued
+void PartitionRouter::service(const shared_ptr<RoutedSession>& session, int fd, uint32_t events)
+{
+    RoutedSession& routed = *session;
+    if (fd == routed.client && (events & (EPOLLHUP | EPOLLERR)))
     {
-        user->category = TRAVEL_HISTORY;
+        end(routed);
+        return;
     }
-    else
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
     {
-        user->category = LOW_RISK;
+        char chunk[4096];
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        bool again = received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        if (fd == routed.client && received > 0)
+            routed.sent.append(chunk, static_cast<size_t>(received));
+        else if (fd == routed.client && !again)
+            routed.clientDone = true;
+        else if (received > 0 && fromPartition(routed, string_view(chunk, static_cast<size_t>(received))))
+            follow(session);
+        else if (received <= 0 && !again)
+            closePartition(routed);
     }
-    
-    // Get test date
-    while (true)
+    settle(routed);
+}
+
+// Passes the partition's output on, less a replay's repeat of what the
+// client has already seen, until a redirect line starts. Returns true once a
+// whole redirect line has arrived.
+bool PartitionRouter::fromPartition(RoutedSession& session, string_view data)
+{
+    if (!session.redirected)
     {
-        cout << "\nEnter test date (DD/MM/YYYY) or 'today' for current date: ";
-        string dateInput;
-        cin >> dateInput;
-        
-        if (dateInput == "today")
-        {
-            user->testdate = getCurrentDate();
-            break;
-        }
-        else
+        size_t mark = data.find(CONTROL_MARK);
+        string_view text = data.substr(0, mark);
+        if (session.skipping)
         {
-            string normalizedDate = normalizeDate(dateInput);
-            if (isValidDate(normalizedDate))
+            const string prompt = "Username: ";
+            session.skipped.append(text);
+            size_t found = session.skipped.find(prompt);
+            if (found != string::npos)
             {
-                user->testdate = normalizedDate;
-                break;
+                session.toClient.append(session.skipped, found + prompt.size());
+                session.skipping = false;
+                session.skipped.clear();
             }
-            else
+            else if (session.skipped.size() > prompt.size())
             {
-                cout << "Invalid date format. Please use DD/MM/YYYY or D/M/YYYY.\n";
+                session.skipped.erase(0, session.skipped.size() - prompt.size());
             }
         }
+        else
+        {
+            session.toClient.append(text);
+        }
+        if (mark == string_view::npos)
+            return false;
+        session.redirected = true;
+        data = data.substr(mark + 1);
     }
     
-    cout << "\nAssessment completed. Your health category has been updated.\n";
+    session.redirect.append(data);
+    size_t end = session.redirect.find('\n');
+    if (end == string::npos)
+        return false;
+    istringstream line(session.redirect.substr(0, end));
+    string verb, username;
+    size_t from = 0;
+    line >> verb >> from >> username;
+    session.redirected = false;
+    session.redirect.clear();
+    if (!username.empty() && username.back() == ':')
+        username.pop_back();
+    if (verb != "redirect" || username.empty())
+        return false;
+    session.redirectUser = username;
+    session.replayFrom = from;
+    return true;
 }
 
-void viewCategory(const User* user)
+// Replays a redirected session on the partition the map says owns its
+// username. While the map still names the partition that sent it away, as it
+// does part way through a split, the redirect is retried a little later.
+void PartitionRouter::follow(const shared_ptr<RoutedSession>& session)
 {
-    cout << "HEALTH CATEGORY & RECOMMENDATIONS\n";
-    cout << "==================================\n\n";
-    
-    string categoryNames[] = {"Low Risk", "Travel History", "Suspected Case", "Close Contact", "Positive Case"};
-    cout << "Your Category: " << categoryNames[user->category] << "\n\n";
-    
-    switch (user->category)
+    RoutedSession& routed = *session;
+    closePartition(routed);
+    reloadMap();
+    const string* owner = map.addressOf(routed.redirectUser);
+    int fd = (owner && *owner != routed.address) ? connectTo(*owner) : -1;
+    if (fd < 0)
     {
-        case POSITIVE:
-            cout << "RECOMMENDED ACTIONS:\n";
-            cout << "1. Isolate immediately for " << QUARANTINE_DAYS << " days\n";
-            cout << "2. Notify your supervisor/lecturer\n";
-            cout << "3. Follow local health authority guidelines\n";
-            cout << "4. Monitor symptoms closely\n";
-            cout << "5. Seek medical attention if symptoms worsen\n";
-            break;
-            
-        case CLOSE_CONTACT:
-            cout << "RECOMMENDED ACTIONS:\n";
-            cout << "1. Self-quarantine for " << TEST_REMINDER_DAYS << " days\n";
-            cout << "2. Get tested immediately\n";
-            cout << "3. Monitor for symptoms\n";
-            cout << "4. Wear a mask around others\n";
-            break;
-            
-        case SUSPECTED:
-            cout << "RECOMMENDED ACTIONS:\n";
-            cout << "1. Self-isolate immediately\n";
-            cout << "2. Get tested as soon as possible\n";
-            cout << "3. Rest and monitor symptoms\n";
-            cout << "4. Avoid contact with others\n";
-            break;
-            
-        case TRAVEL_HISTORY:
-            cout << "RECOMMENDED ACTIONS:\n";
-            cout << "1. Monitor for symptoms for 14 days\n";
-            cout << "2. Consider getting tested\n";
-            cout << "3. Follow local quarantine requirements\n";
-            break;
-            
-        case LOW_RISK:
-            cout << "RECOMMENDED ACTIONS:\n";
-            cout << "1. Continue practicing preventive measures\n";
-            cout << "2. Wash hands regularly\n";
-            cout << "3. Wear mask in crowded places\n";
-            cout << "4. Get tested if you develop symptoms\n";
-            break;
+        if (++routed.retries <= ROUTER_RETRIES)
+        {
+            routed.retryAt = chrono::steady_clock::now() + chrono::milliseconds(ROUTER_RETRY_MS);
+            retrying.push_back(session);
+            return;
+        }
+        routed.toClient += "\nThis account is not available right now. Please try again later.\n";
+        routed.redirectUser.clear();
+        failedCount++;
+        return;
     }
     
-    cout << "\nLast Test Date: " << (user->testdate == DEFAULT_DATE ? "Not recorded" : user->testdate) << endl;
+    track(fd, session);
+    routed.partition = fd;
+    routed.address = *owner;
+    routed.sent.erase(0, min(routed.replayFrom, routed.sent.size()));
+    routed.forwarded = 0;
+    routed.partitionShut = false;
+    routed.skipping = true;
+    routed.skipped.clear();
+    routed.redirectUser.clear();
+    routed.retries = 0;
+    redirectCount++;
 }
 
-void showReminder(const User* user)
+// Sends what each side has queued and passes on the client's close once the
+// partition has everything. Returns false if the client has gone.
+bool PartitionRouter::forward(RoutedSession& session)
 {
-    if (user->testdate == DEFAULT_DATE)
+    while (session.partition >= 0 && !session.partitionShut && session.forwarded < session.sent.size())
     {
-        cout << "\nREMINDER: Please complete your COVID-19 test assessment.\n";
-        return;
+        ssize_t written = send(session.partition, session.sent.data() + session.forwarded,
+                               session.sent.size() - session.forwarded, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written <= 0)
+        {
+            // The partition has ended the session; its last output, maybe a
+            // redirect, is still read
+            session.partitionShut = true;
+            break;
+        }
+        session.forwarded += static_cast<size_t>(written);
+    }
+    if (session.partition >= 0 && !session.partitionShut && session.clientDone &&
+        session.forwarded == session.sent.size())
+    {
+        shutdown(session.partition, SHUT_WR);
+        session.partitionShut = true;
     }
     
-    // Parse test date
-    stringstream ss(user->testdate);
-    int day, month, year;
-    char slash;
-    ss >> day >> slash >> month >> slash >> year;
-    
-    // Calculate days since test
-    tm testDate = {0};
-    testDate.tm_mday = day;
-    testDate.tm_mon = month - 1;
-    testDate.tm_year = year - 1900;
-    
-    time_t testTime = mktime(&testDate);
-    time_t currentTime = time(nullptr);
-    
-    double diffSeconds = difftime(currentTime, testTime);
-    int daysSinceTest = static_cast<int>(diffSeconds / (24 * 3600));
-    
-    if (daysSinceTest >= TEST_REMINDER_DAYS && daysSinceTest < QUARANTINE_DAYS)
+    size_t sent = 0;
+    while (sent < session.toClient.size())
     {
-        cout << "\nREMINDER: It has been " << daysSinceTest << " days since your last test. ";
-        cout << "Consider getting tested again.\n";
+        ssize_t written = send(session.client, session.toClient.data() + sent, session.toClient.size() - sent,
+                               MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written <= 0)
+            return false;
+        sent += static_cast<size_t>(written);
     }
+    session.toClient.erase(0, sent);
+    return true;
 }
 
-int categoryToInt(Category category)
+// Ends a session once its partition is done and the client has all of its
+// output, and otherwise waits on whatever it needs next
+void PartitionRouter::settle(RoutedSession& session)
 {
-    return static_cast<int>(category);
+    if (session.client < 0)
+        return;
+    bool clientGone = !forward(session);
+    if (clientGone || (session.partition < 0 && session.redirectUser.empty() && session.toClient.empty()))
+    {
+        end(session);
+        return;
+    }
+    watch(session);
 }
 
-Category intToCategory(int value)
+// Reads from each side only while the other keeps up with it
+void PartitionRouter::watch(RoutedSession& session)
 {
-    if (value >= 0 && value <= 4)
-        return static_cast<Category>(value);
-    return LOW_RISK;
+    bool inputBackedUp = session.sent.size() - session.forwarded > ROUTER_QUEUE_BYTES;
+    epoll_event event{};
+    event.events = (session.clientDone || inputBackedUp ? 0u : EPOLLIN) | (session.toClient.empty() ? 0u : EPOLLOUT);
+    event.data.fd = session.client;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, session.client, &event);
+    if (session.partition < 0)
+        return;
+    bool unsent = !session.partitionShut && session.forwarded < session.sent.size();
+    event.events = (session.toClient.size() > ROUTER_QUEUE_BYTES ? 0u : EPOLLIN) | (unsent ? EPOLLOUT : 0u);
+    event.data.fd = session.partition;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, session.partition, &event);
 }
 
-bool isValidDate(const string& dateStr)
+void PartitionRouter::closePartition(RoutedSession& session)
 {
-    // Check for default date
-    if (dateStr == DEFAULT_DATE) return true;
-    
-    // Remove any trailing whitespace
-    string trimmed = dateStr;
-    trimmed.erase(trimmed.find_last_not_of(" \t\n\r\f\v") + 1);
-    
-    // Accept various date formats
-    regex datePattern1("^(0[1-9]|[12][0-9]|3[01])/(0[1-9]|1[0-2])/([0-9]{4})$");  // DD/MM/YYYY
-    regex datePattern2("^([1-9]|[12][0-9]|3[01])/([1-9]|1[0-2])/([0-9]{4})$");     // D/M/YYYY
-    regex datePattern3("^(0[1-9]|[12][0-9]|3[01])/([1-9]|1[0-2])/([0-9]{4})$");    // DD/M/YYYY
-    regex datePattern4("^([1-9]|[12][0-9]|3[01])/(0[1-9]|1[0-2])/([0-9]{4})$");    // D/MM/YYYY
-    
-    if (!regex_match(trimmed, datePattern1) && 
-        !regex_match(trimmed, datePattern2) &&
-        !regex_match(trimmed, datePattern3) &&
-        !regex_match(trimmed, datePattern4)) {
-        return false;
-    }
-    
-    // Parse the date
-    stringstream ss(trimmed);
-    int day, month, year;
-    char slash;
-    
-    if (!(ss >> day >> slash >> month >> slash >> year)) {
+    if (session.partition < 0)
+        return;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, session.partition, nullptr);
+    byFd.erase(session.partition);
+    close(session.partition);
+    session.partition = -1;
+}
+
+void PartitionRouter::end(RoutedSession& session)
+{
+    closePartition(session);
+    if (session.client < 0)
+        return;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, session.client, nullptr);
+    byFd.erase(session.client);
+    close(session.client);
+    session.client = -1;
+}
+
+// Forwards sessions on `address` to the partitions in `mapFile`
+int runRouter(const string& address, const string& mapFile)
+{
+    raiseFileLimit();
+    PartitionRouter router(mapFile);
+    return router.run(address) ? 0 : 1;
+}
+#else
+int runServer(const ProgramOptions&, const string&)
+{
+    cerr << "Error: Server mode needs epoll and is only available on Linux.\n";
+    return 1;
+}
+
+int runRouter(const string&, const string&)
+{
+    cerr << "Error: Routing needs epoll and is only available on Linux.\n";
+    return 1;
+}
+#endif
+
+// Sends `script` to a new session in one go, then collects everything the
+// server writes until it closes the connection. Returns false if the
+// connection failed.
+bool runScriptedSession(const string& address, const string& script, string& output)
+{
+    int fd = connectTo(address);
+    if (fd < 0)
         return false;
-    }
-    
-    // Basic validation
-    if (year < 1900 || year > 2100) return false;
-    if (month < 1 || month > 12) return false;
-    if (day < 1 || day > 31) return false;
     
-    // Check specific month-day combinations
-    if (month == 2) {
-        bool isLeap = (year % 4 == 0 && year % 100 != 0) || (year % 400 == 0);
-        if (day > (isLeap ? 29 : 28))
-            return false;
-    }
-    else if (month == 4 || month == 6 || month == 9 || month == 11) {
-        if (day > 30)
+    const char* data = script.data();
+    size_t remaining = script.size();
+    while (remaining > 0)
+    {
+        ssize_t sent = send(fd, data, remaining, 0);
+        if (sent <= 0)
+        {
+            close(fd);
             return false;
+        }
+        data += sent;
+        remaining -= static_cast<size_t>(sent);
     }
+    shutdown(fd, SHUT_WR);
     
+    output.clear();
+    char buffer[4096];
+    ssize_t received;
+    while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        output.append(buffer, static_cast<size_t>(received));
+    close(fd);
     return true;
 }
 
-string normalizeDate(const string& dateStr)
+// Runs `sessions` scripted sessions against a server, `concurrency` at a
+// time, and reports throughput and the latency of whole sessions. The
+// scripted sessions run alongside `idleSessions` connections that sit at the
+// main menu, like kiosks nobody is using. Without `scripts` each session
+// registers, logs in, takes the self-assessment, views its category, logs
+// out and exits. Otherwise session i replays scripts[i % size] with every
+// "{session}" replaced by a name unique to the session, and succeeds if it
+// reaches Exit.
+bool runLoadTest(const string& address, long long sessions, unsigned concurrency, long long idleSessions,
+                 const vector<string>& scripts)
 {
-    if (dateStr.empty() || dateStr == DEFAULT_DATE) {
-        return DEFAULT_DATE;
+    using namespace chrono;
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit();
+    
+    vector<int> idle;
+    const string menuPrompt = "Enter your choice (1-3): ";
+    for (long long i = 0; i < idleSessions; i++)
+    {
+        // Wait for each menu so the server really is holding the session
+        int fd = connectTo(address);
+        string received;
+        char buffer[1024];
+        ssize_t length;
+        while (fd >= 0 && received.find(menuPrompt) == string::npos &&
+               (length = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+            received.append(buffer, static_cast<size_t>(length));
+        if (fd < 0 || received.find(menuPrompt) == string::npos)
+        {
+            cerr << "Error: Only " << idle.size() << " idle session(s) could be opened.\n";
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        idle.push_back(fd);
     }
     
-    string trimmed = dateStr;
-    // Remove any trailing whitespace
-    trimmed.erase(trimmed.find_last_not_of(" \t\n\r\f\v") + 1);
+    // Usernames are unique per run so repeated runs against one server never collide
+    string prefix = "load" + to_string(duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count()) + "_";
     
-    // Try to parse the date
-    stringstream ss(trimmed);
-    int day, month, year;
-    char slash;
+    auto makeScript = [&](long long session) {
+        string name = prefix + to_string(session);
+        if (scripts.empty())
+        {
+            return "1\n" + name + "\npw\nLoad Test\n30\nJalan Ampang\n0123456789\nA1234567\n\n\n"
+                   "2\n" + name + "\npw\n\n"
+                   "3\n0\n0\n0\n0\n0\n0\ntoday\n\n"
+                   "4\n\n\n"
+                   "5\n\n\n"
+                   "3\n";
+        }
+        string script = scripts[static_cast<size_t>(session) % scripts.size()];
+        for (size_t at = script.find("{session}"); at != string::npos; at = script.find("{session}", at + name.size()))
+            script.replace(at, 9, name);
+        return script;
+    };
+    auto succeeded = [&](const string& output) {
+        bool exited = output.find("Thank you for using") != string::npos;
+        if (!scripts.empty())
+            return exited;
+        return exited && output.find("Registration successful!") != string::npos &&
+               output.find("Assessment completed") != string::npos;
+    };
     
-    if (!(ss >> day >> slash >> month >> slash >> year)) {
-        return DEFAULT_DATE;
+    atomic<long long> nextSession(0);
+    atomic<long long> failures(0);
+    atomic<long long> steps(0);
+    vector<vector<double>> latencies(concurrency);
+    
+    auto start = steady_clock::now();
+    vector<thread> workers;
+    for (unsigned w = 0; w < concurrency; w++)
+    {
+        workers.emplace_back([&, w]() {
+            string output;
+            for (long long i = nextSession++; i < sessions; i = nextSession++)
+            {
+                string script = makeScript(i);
+                auto began = steady_clock::now();
+                if (runScriptedSession(address, script, output) && succeeded(output))
+                {
+                    latencies[w].push_back(duration<double, milli>(steady_clock::now() - began).count());
+                    steps += count(script.begin(), script.end(), '\n');
+                }
+                else
+                {
+                    failures++;
+                }
+            }
+        });
     }
+    for (thread& worker : workers)
+        worker.join();
+    double elapsed = duration<double>(steady_clock::now() - start).count();
     
-    // Format to DD/MM/YYYY
-    stringstream normalized;
-    normalized << setfill('0') << setw(2) << day << "/"
-               << setfill('0') << setw(2) << month << "/"
-               << setfill('0') << setw(4) << year;
+    vector<double> all;
+    for (const vector<double>& samples : latencies)
+        all.insert(all.end(), samples.begin(), samples.end());
+    sort(all.begin(), all.end());
+    auto percentile = [&](double p) {
+        return all.empty() ? 0.0 : all[min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+    };
     
-    return normalized.str();
+    for (int fd : idle)
+        close(fd);
+    
+    cout << fixed << setprecision(2);
+    cout << "Sessions:      " << sessions << " (" << concurrency << " concurrent, " << idle.size() << " idle)\n";
+    cout << "Completed:     " << all.size() << ", failed: " << failures << "\n";
+    cout << "Throughput:    " << all.size() / elapsed << " sessions/s, " << steps / elapsed << " input lines/s\n";
+    cout << "Latency (ms):  p50 " << percentile(0.50) << ", p99 " << percentile(0.99)
+         << ", p99.9 " << percentile(0.999) << ", max " << (all.empty() ? 0.0 : all.back()) << "\n";
+    return failures == 0 && static_cast<long long>(idle.size()) == idleSessions;
 }
 
-bool needsTesting(const User* user)
+// Sends a control request to the partition at `address`. `reply` gets the
+// reply line and anything after it, without the menu the session showed
+// first. Returns false if the partition could not be reached or gave no reply.
+bool sendControl(const string& address, const string& request, string& reply)
 {
-    if (user->testdate == DEFAULT_DATE)
-        return true;
-        
-    // Similar date calculation as showReminder
-    stringstream ss(user->testdate);
-    int day, month, year;
-    char slash;
-    ss >> day >> slash >> month >> slash >> year;
-    
-    tm testDate = {0};
-    testDate.tm_mday = day;
-    testDate.tm_mon = month - 1;
-    testDate.tm_year = year - 1900;
-    
-    time_t testTime = mktime(&testDate);
-    time_t currentTime = time(nullptr);
-    
-    double diffSeconds = difftime(currentTime, testTime);
-    int daysSinceTest = static_cast<int>(diffSeconds / (24 * 3600));
-    
-    return (daysSinceTest >= TEST_REMINDER_DAYS);
+    string output;
+    reply.clear();
+    if (!runScriptedSession(address, string(1, CONTROL_MARK) + request, output))
+        return false;
+    size_t mark = output.find(CONTROL_MARK);
+    if (mark == string::npos)
+        return false;
+    reply = output.substr(mark + 1);
+    return true;
 }
 
-void updateCategoryBasedOnTime(User* user)
+// Splits partition `name` of the map in two while every partition keeps
+// serving. The partition keeps index/2count at its address; the users of
+// (index + count)/2count move to the empty partition already serving at
+// `newAddress`, and the map is rewritten last. The moved records wait in
+// <map>.moving until the new partition has them, so a run that fails part way
+// can be repeated to finish the move.
+bool splitMappedPartition(const string& mapFile, const string& name, const string& newAddress)
 {
-    if (user->category != POSITIVE || user->testdate == DEFAULT_DATE)
-        return;
-    
-    // Calculate days since positive test
-    stringstream ss(user->testdate);
-    int day, month, year;
-    char slash;
-    ss >> day >> slash >> month >> slash >> year;
-    
-    tm testDate = {0};
-    testDate.tm_mday = day;
-    testDate.tm_mon = month - 1;
-    testDate.tm_year = year - 1900;
-    
-    time_t testTime = mktime(&testDate);
-    time_t currentTime = time(nullptr);
-    
-    double diffSeconds = difftime(currentTime, testTime);
-    int daysSinceTest = static_cast<int>(diffSeconds / (24 * 3600));
-    
-    if (daysSinceTest >= QUARANTINE_DAYS)
+    using namespace chrono;
+    PartitionMap map;
+    string error;
+    if (!loadPartitionMap(mapFile, map, error))
     {
-        user->category = LOW_RISK;
-        cout << "\nNOTE: Your quarantine period has ended. Category updated to Low Risk.\n";
+        cerr << "Error: " << error << ".\n";
+        return false;
     }
-}
-
-void displayQuote()
-{
-    string quotes[] = {
-        "\"Health is a state of complete harmony of the body, mind and spirit.\" - B.K.S. Iyengar",
-        "\"To ensure good health: eat lightly, breathe deeply, live moderately, cultivate cheerfulness.\" - William Londen",
-        "\"It is health that is the real wealth, and not pieces of gold and silver.\" - Mahatma Gandhi",
-        "\"The first wealth is health.\" - Ralph Waldo Emerson",
-        "\"He who has health has hope, and he who has hope has everything.\" - Thomas Carlyle",
-        "\"A good laugh and a long sleep are the best cures in the doctor's book.\" - Irish Proverb",
-        "\"Keeping your body healthy is an expression of gratitude to the whole cosmos.\" - Thich Nhat Hanh",
-        "\"The doctor of the future will give no medicine, but will instruct his patients in care of the human frame.\" - Thomas Edison",
-        "\"The cheerful mind perseveres, and the strong mind hews its way through a thousand difficulties.\" - Swami Vivekananda",
-        "\"Good health is not something we can buy. However, it can be an extremely valuable savings account.\" - Anne Wilson Schaef"
-    };
+    Partition splitting;
+    if (!parsePartition(name, splitting) || splitting.count >= MAX_PARTITIONS)
+    {
+        cerr << "Error: " << name << " is not a partition that can be split.\n";
+        return false;
+    }
+    auto entry = find_if(map.entries.begin(), map.entries.end(),
+                         [&](const pair<Partition, string>& listed) { return listed.first == splitting; });
+    if (entry == map.entries.end())
+    {
+        cerr << "Error: " << mapFile << " has no partition " << name << ".\n";
+        return false;
+    }
+    string oldAddress = entry->second;
+    Partition kept{splitting.index, splitting.count * 2};
+    Partition added{splitting.index + splitting.count, splitting.count * 2};
+    auto firstLine = [](const string& text) { return text.substr(0, text.find('\n')); };
     
-    srand(static_cast<unsigned>(time(nullptr)));
-    int index = rand() % 10;
+    signal(SIGPIPE, SIG_IGN);
+    auto start = steady_clock::now();
+    string reply;
+    if (!sendControl(newAddress, "info\n", reply) || reply.rfind("partition " + partitionName(added) + " ", 0) != 0)
+    {
+        cerr << "Error: " << newAddress << " is not serving partition " << partitionName(added) << ".\n";
+        return false;
+    }
     
-    cout << "Daily Inspiration: " << quotes[index] << "\n";
-}
-
-int getValidatedInt(const string& prompt, int minVal, int maxVal)
-{
-    int value;
-    while (true)
+    string movingFile = mapFile + ".moving";
+    string records;
+    error_code ec;
+    if (filesystem::exists(movingFile, ec))
     {
-        cout << prompt;
-        string input;
-        getline(cin, input);
-        
-        // Check if input is empty
-        if (input.empty()) {
-            cout << "Input cannot be empty. Please enter a number.\n";
-            continue;
-        }
-        
-        // Check if all characters are digits (or negative sign at start)
-        bool isNumeric = true;
-        for (size_t i = 0; i < input.length(); i++) {
-            if (i == 0 && input[i] == '-') {
-                continue;  // Allow negative sign at beginning
-            }
-            if (!isdigit(input[i])) {
-                isNumeric = false;
-                break;
-            }
-        }
-        
-        if (!isNumeric) {
-            cout << "Invalid input. Please enter a valid number.\n";
-            continue;
-        }
-        
-        try {
-            value = stoi(input);
-        } catch (const invalid_argument& e) {
-            cout << "Invalid input. Please enter a valid number.\n";
-            continue;
-        } catch (const out_of_range& e) {
-            cout << "Number is too large or too small. Please enter a value between " 
-                 << minVal << " and " << maxVal << ".\n";
-            continue;
+        ifstream saved(movingFile, ios::binary);
+        stringstream contents;
+        contents << saved.rdbuf();
+        records = contents.str();
+        cout << "Resuming the move saved in " << movingFile << ".\n";
+    }
+    else
+    {
+        if (!sendControl(oldAddress, "split\n", reply) || reply.rfind("split ", 0) != 0)
+        {
+            cerr << "Error: " << oldAddress << " did not split (" << firstLine(reply) << ").\n";
+            return false;
         }
+        size_t lineEnd = reply.find('\n');
+        records = reply.substr(lineEnd == string::npos ? reply.size() : lineEnd + 1);
         
-        if (value < minVal || value > maxVal)
+        // Saved before anything is checked: the users have already left
+        string tempName = movingFile + ".tmp";
+        ofstream out(tempName, ios::binary | ios::trunc);
+        out.write(records.data(), static_cast<streamsize>(records.size()));
+        out.close();
+        if (!out || !replaceFile(tempName, movingFile, true))
         {
-            cout << "Please enter a value between " << minVal << " and " << maxVal << ".\n";
+            cerr << "Error: Could not save the moved users to " << movingFile << ".\n";
+            return false;
         }
-        else
+        istringstream line(firstLine(reply));
+        string verb, keptName;
+        size_t moved = 0, bytes = 0;
+        line >> verb >> keptName >> moved >> bytes;
+        if (keptName != partitionName(kept) || bytes != records.size())
         {
-            return value;
+            cerr << "Error: " << oldAddress << " split as " << keptName << " and sent " << records.size() << " of "
+                 << bytes << " bytes; the records are kept in " << movingFile << ".\n";
+            return false;
         }
     }
+    
+    if (!sendControl(newAddress, "import " + to_string(records.size()) + "\n" + records, reply) ||
+        reply.rfind("imported ", 0) != 0)
+    {
+        cerr << "Error: " << newAddress << " did not take the moved users (" << firstLine(reply)
+             << "); they are kept in " << movingFile << " and a second run retries.\n";
+        return false;
+    }
+    istringstream line(firstLine(reply));
+    string verb;
+    size_t users = 0, tests = 0, contacts = 0;
+    line >> verb >> users >> tests >> contacts;
+    size_t listed = 0, pos = 0;
+    JournalRecordHeader header;
+    string_view payload;
+    while (readJournalRecord(records, pos, header, payload))
+        listed += header.type == JOURNAL_PUT_USER;
+    
+    entry->first = kept;
+    map.entries.emplace_back(added, newAddress);
+    if (!savePartitionMap(mapFile, map))
+        return false;
+    if (users == listed)
+        filesystem::remove(movingFile, ec);
+    else
+        cerr << "Warning: " << listed - users << " user(s) were already on " << newAddress
+             << " or were refused; the records are kept in " << movingFile << ".\n";
+    
+    cout << "Moved " << users << " user(s), " << tests << " test(s) and " << contacts << " contact(s) from "
+         << partitionName(splitting) << " at " << oldAddress << " to " << partitionName(added) << " at "
+         << newAddress << " in " << duration_cast<milliseconds>(steady_clock::now() - start).count() << " ms.\n";
+    return true;
 }
 
-string getValidatedString(const string& prompt, bool allowSpaces)
+// Asks the replica serving at `address` to take over from its primary, which
+// must have stopped first
+bool promoteReplica(const string& address)
 {
-    string input;
-    cout << prompt;
-    
-    if (allowSpaces)
+    string reply;
+    if (!sendControl(address, "promote\n", reply))
     {
-        getline(cin, input);
+        cerr << "Error: Could not reach a server at " << address << ".\n";
+        return false;
     }
-    else
+    string answer = reply.substr(0, reply.find('\n'));
+    istringstream line(answer);
+    string verb;
+    uint64_t sequence = 0;
+    line >> verb >> sequence;
+    if (verb != "promoted")
     {
-        cin >> input;
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cerr << "Error: " << address << " was not promoted (" << answer << ").\n";
+        return false;
     }
-    
-    return input;
+    cout << "The replica at " << address << " is now the primary, from journal sequence " << sequence << ".\n";
+    return true;
+}
+#else
+int runServer(const ProgramOptions&, const string&)
+{
+    cerr << "Error: Server mode needs POSIX sockets and is not available on Windows.\n";
+    return 1;
 }
 
-string getCurrentDate()
+bool runLoadTest(const string&, long long, unsigned, long long, const vector<string>&)
 {
-    time_t now = time(nullptr);
-    tm* localTime = localtime(&now);
-    
-    stringstream ss;
-    ss << setfill('0') << setw(2) << localTime->tm_mday << "/"
-       << setfill('0') << setw(2) << (localTime->tm_mon + 1) << "/"
-       << (localTime->tm_year + 1900);
-    
-    return ss.str();
+    cerr << "Error: Server mode needs POSIX sockets and is not available on Windows.\n";
+    return false;
+}
+
+bool splitMappedPartition(const string&, const string&, const string&)
+{
+    cerr << "Error: Server mode needs POSIX sockets and is not available on Windows.\n";
+    return false;
+}
+
+bool promoteReplica(const string&)
+{
+    cerr << "Error: Server mode needs POSIX sockets and is not available on Windows.\n";
+    return false;
 }
+#endif